@@ -28,58 +28,40 @@
 #include "utils.h"
 
 int kill_guildcard(ship_client_t *c, uint32_t gc, const char *reason) {
-    block_t *b;
     ship_client_t *i;
-    int j;
 
     /* Make sure we don't have anyone trying to escalate their privileges. */
     if(!LOCAL_GM(c)) {
         return -1;
     }
 
-    /* Look through all the blocks for the requested user, and kick the first
-       instance we happen to find (there shouldn't be more than one). */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        b = ship->blocks[j];
-
-        if(b && b->run) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            /* Look for the requested user */
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                pthread_mutex_lock(&i->mutex);
-
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(c->privilege <= i->privilege) {
-                        pthread_mutex_unlock(&i->mutex);
-                        pthread_rwlock_unlock(&b->lock);
-                        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
-                    }
-
-                    if(reason) {
-                        send_message_box(i, "%s\n\n%s\n%s",
-                                         __(i, "\tEYou have been kicked by a "
-                                            "GM."),
-                                         __(i, "Reason:"), reason);
-                    }
-                    else {
-                        send_message_box(i, "%s",
-                                         __(i, "\tEYou have been kicked by a "
-                                            "GM."));
-                    }
+    /* Look up the requested user, and kick the first instance we happen to
+       find (there shouldn't be more than one). */
+    if((i = client_dir_get(gc, NULL))) {
+        pthread_mutex_lock(&i->mutex);
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                    pthread_mutex_unlock(&i->mutex);
-                    pthread_rwlock_unlock(&b->lock);
-                    return 0;
-                }
-
-                pthread_mutex_unlock(&i->mutex);
-            }
+        if(c->privilege <= i->privilege) {
+            pthread_mutex_unlock(&i->mutex);
+            client_dir_put(i);
+            return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+        }
 
-            pthread_rwlock_unlock(&b->lock);
+        if(reason) {
+            send_message_box(i, "%s\n\n%s\n%s",
+                             __(i, "\tEYou have been kicked by a "
+                                "GM."),
+                             __(i, "Reason:"), reason);
+        }
+        else {
+            send_message_box(i, "%s",
+                             __(i, "\tEYou have been kicked by a "
+                                "GM."));
         }
+
+        client_kick(i);
+        pthread_mutex_unlock(&i->mutex);
+        client_dir_put(i);
+        return 0;
     }
 
     /* If the requester is a global GM, forward the request to the shipgate,
@@ -338,9 +320,7 @@ int schedule_shutdown(ship_client_t *c, uint32_t when, int restart, msgfunc f) {
 
 int global_ban(ship_client_t *c, uint32_t gc, uint32_t l, const char *reason) {
     const char *len = NULL;
-    block_t *b;
     ship_client_t *i;
-    int j;
 
     /* Make sure we don't have anyone trying to escalate their privileges. */
     if(!GLOBAL_GM(c)) {
@@ -353,86 +333,71 @@ int global_ban(ship_client_t *c, uint32_t gc, uint32_t l, const char *reason) {
         return send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
     }
 
-    /* Look through all the blocks for the requested user, and kick the first
-       instance we happen to find, if any (there shouldn't be more than one). */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        b = ship->blocks[j];
-
-        if(b && b->run) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    pthread_mutex_lock(&i->mutex);
-
-                    /* Make sure we're not trying something dirty (the gate
-                       should also have blocked the ban if this happens, in
-                       most cases anyway) */
-                    if(c->privilege <= i->privilege) {
-                        pthread_mutex_unlock(&i->mutex);
-                        pthread_rwlock_unlock(&b->lock);
-                        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
-                    }
-
-                    /* Handle the common cases... */
-                    switch(l) {
-                        case 0xFFFFFFFF:
-                            len = __(i, "Forever");
-                            break;
-
-                        case 2592000:
-                            len = __(i, "30 days");
-                            break;
+    /* Look up the requested user, and kick the first instance we happen to
+       find, if any (there shouldn't be more than one). */
+    if((i = client_dir_get(gc, NULL))) {
+        pthread_mutex_lock(&i->mutex);
+
+        /* Make sure we're not trying something dirty (the gate
+           should also have blocked the ban if this happens, in
+           most cases anyway) */
+        if(c->privilege <= i->privilege) {
+            pthread_mutex_unlock(&i->mutex);
+            client_dir_put(i);
+            return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+        }
 
-                        case 604800:
-                            len = __(i, "1 week");
-                            break;
+        /* Handle the common cases... */
+        switch(l) {
+            case 0xFFFFFFFF:
+                len = __(i, "Forever");
+                break;
 
-                        case 86400:
-                            len = __(i, "1 day");
-                            break;
+            case 2592000:
+                len = __(i, "30 days");
+                break;
 
-                        /* Other cases just don't have a length on them... */
-                    }
+            case 604800:
+                len = __(i, "1 week");
+                break;
 
-                    /* Send the user a message telling them they're banned. */
-                    if(reason && len) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Ban Length:"),
-                                         len, __(i, "Reason:"), reason);
-                    }
-                    else if(len) {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Ban Length:"),
-                                         len);
-                    }
-                    else if(reason) {
-                        send_message_box(i, "%s\n%s\n%s",
-                                         __(i, "\tEYou have been banned by a "
-                                            "GM."), __(i, "Reason:"), reason);
-                    }
-                    else {
-                        send_message_box(i, "%s", __(i, "\tEYou have been "
-                                                     "banned by a GM."));
-                    }
+            case 86400:
+                len = __(i, "1 day");
+                break;
 
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
+            /* Other cases just don't have a length on them... */
+        }
 
-                    /* The ban setter will get a message telling them the ban has been
-                       set (or an error happened). */
-                    pthread_mutex_unlock(&i->mutex);
-                    pthread_rwlock_unlock(&b->lock);
-                    return 0;
-                }
+        /* Send the user a message telling them they're banned. */
+        if(reason && len) {
+            send_message_box(i, "%s\n%s %s\n%s\n%s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Ban Length:"),
+                             len, __(i, "Reason:"), reason);
+        }
+        else if(len) {
+            send_message_box(i, "%s\n%s %s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Ban Length:"),
+                             len);
+        }
+        else if(reason) {
+            send_message_box(i, "%s\n%s\n%s",
+                             __(i, "\tEYou have been banned by a "
+                                "GM."), __(i, "Reason:"), reason);
+        }
+        else {
+            send_message_box(i, "%s", __(i, "\tEYou have been "
+                                         "banned by a GM."));
+        }
 
-                pthread_mutex_unlock(&i->mutex);
-            }
+        client_kick(i);
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+        /* The ban setter will get a message telling them the ban has been
+           set (or an error happened). */
+        pthread_mutex_unlock(&i->mutex);
+        client_dir_put(i);
+        return 0;
     }
 
     /* Since the requester is a global GM, forward the kick request to the
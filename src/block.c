@@ -23,7 +23,6 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 
 #include <sylverant/debug.h>
@@ -46,267 +45,457 @@ extern int enable_ipv6;
 extern uint32_t ship_ip4;
 extern uint8_t ship_ip6[16];
 
-static void *block_thd(void *d) {
-    block_t *b = (block_t *)d;
-    ship_t *s = b->ship;
-    int nfds, i;
-    struct timeval timeout;
-    fd_set readfds, writefds;
-    ship_client_t *it, *tmp;
-    socklen_t len;
-    struct sockaddr_storage addr;
-    struct sockaddr *addr_p = (struct sockaddr *)&addr;
-    char ipstr[INET6_ADDRSTRLEN];
-    char nm[64];
-    int sock;
-    ssize_t sent;
-    time_t now;
-    int numsocks = 1;
+/* The most events we'll handle in one pass through the loop. */
+#define BLOCK_MAX_EVENTS    256
 
-#ifdef SYLVERANT_ENABLE_IPV6
-    if(enable_ipv6) {
-        numsocks = 2;
+static const char *version_names[CLIENT_VERSION_COUNT] = {
+    "DC", "DC", "PC", "GC", "Episode 3", "Blue Burst"
+};
+
+/* Per-block worker thread counts (from the command line). */
+extern int block_workers;
+extern int *block_workers_ovr;
+extern int block_workers_ovr_count;
+
+/* Output corking settings (from the command line). */
+extern int block_cork;
+extern int block_cork_max_ms;
+
+/* Key for finding the worker structure for the current thread. */
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+static void make_worker_key(void) {
+    pthread_key_create(&worker_key, NULL);
+}
+
+/* Something posted to a worker's mailbox for one of its clients. */
+typedef struct block_msg {
+    mailbox_node_t node;
+    ship_client_t *c;
+    int type;
+    int len;
+    uint8_t data[];
+} block_msg_t;
+
+/* How many worker threads the given block should run. */
+int block_worker_count(int b) {
+    int rv = block_workers;
+
+    if(b < block_workers_ovr_count && block_workers_ovr[b] > 0) {
+        rv = block_workers_ovr[b];
     }
-#endif
 
-    debug(DBG_LOG, "%s(%d): Up and running\n", s->cfg->name, b->b);
+    if(rv < 1) {
+        rv = 1;
+    }
+    else if(rv > BLOCK_MAX_WORKERS) {
+        rv = BLOCK_MAX_WORKERS;
+    }
 
-    /* While we're still supposed to run... do it. */
-    while(b->run) {
-        /* Clear the fd_sets so we can use them again. */
-        nfds = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        timeout.tv_sec = 30;
-        timeout.tv_usec = 0;
-        now = time(NULL);
-
-        /* Fill the sockets into the fd_sets so we can use select below. */
-        pthread_rwlock_rdlock(&b->lock);
+    return rv;
+}
 
-        TAILQ_FOREACH(it, b->clients, qentry) {
-            /* If we haven't heard from a client in 2 minutes, its dead.
-               Disconnect it. */
-            if(now > it->last_message + 120) {
-                if(it->bb_pl) {
-                    istrncpy16(ic_utf16_to_utf8, nm,
-                               &it->pl->bb.character.name[2], 64);
-                    debug(DBG_LOG, "Ping Timeout: %s(%d)\n", nm, it->guildcard);
-                }
-                else if(it->pl) {
-                    debug(DBG_LOG, "Ping Timeout: %s(%d)\n", it->pl->v1.name,
-                          it->guildcard);
-                }
+/* Grab the random number generator to use for the block from the current
+   thread. Each worker gets its own, since the generator state isn't safe to
+   share between threads. */
+struct mt19937_state *block_rng(block_t *b) {
+    block_worker_t *w = (block_worker_t *)pthread_getspecific(worker_key);
 
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
+    if(w && w->b == b) {
+        return &w->rng;
+    }
 
-                /* Make sure that we disconnect the client ASAP! */
-                timeout.tv_sec = 0;
+    return &b->rng;
+}
 
-                continue;
-            }
-            /* Otherwise, if we haven't heard from them in a minute, ping it. */
-            else if(now > it->last_message + 60 && now > it->last_sent + 10) {
-                if(send_simple(it, PING_TYPE, 0)) {
-                    it->flags |= CLIENT_FLAG_DISCONNECTED;
-                    timeout.tv_sec = 0;
-                    continue;
-                }
+block_worker_t *block_current_worker(void) {
+    return (block_worker_t *)pthread_getspecific(worker_key);
+}
 
-                it->last_sent = now;
-            }
+/* Send everything a client has corked up, taking it off the worker's list. */
+static int block_uncork(block_worker_t *w, ship_client_t *c) {
+    size_t len = c->sendbuf.len;
+    int rv;
 
-            /* Check if their timeout expired to login after getting a
-               protection message. */
-            if((it->flags & CLIENT_FLAG_GC_PROTECT) &&
-               it->join_time + 60 < now) {
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                timeout.tv_sec = 0;
-                continue;
+    TAILQ_REMOVE(&w->corked, c, cork_qentry);
+    c->corked = 0;
+
+    /* If the socket was already backed up, we're waiting to be told when we can
+       write again, so don't bother now. */
+    if(!len || c->write_armed) {
+        return 0;
+    }
+
+    rv = ringbuf_write(&c->sendbuf, c->sock);
+    ++w->sends;
+    ++w->flushes;
+    w->flush_bytes += len - c->sendbuf.len;
+
+    if(rv < 0) {
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        return -1;
+    }
+    else if(rv) {
+        client_want_write(c, 1);
+    }
+
+    return client_sendq_update(c);
+}
+
+int block_cork_send(block_worker_t *w, ship_client_t *c, const void *data,
+                    int len) {
+    if(ringbuf_append(&c->sendbuf, data, len)) {
+        return -1;
+    }
+
+    if(!c->corked) {
+        c->corked = 1;
+        c->cork_time = block_cork_max_ms ? timerwheel_time_ms() : 0;
+        TAILQ_INSERT_TAIL(&w->corked, c, cork_qentry);
+    }
+    else if(block_cork_max_ms &&
+            timerwheel_time_ms() - c->cork_time >= (uint64_t)block_cork_max_ms) {
+        return block_uncork(w, c);
+    }
+
+    return 0;
+}
+
+/* Flush out every client the worker has corked. */
+static void block_flush_corked(block_worker_t *w) {
+    ship_client_t *c;
+
+    while((c = TAILQ_FIRST(&w->corked))) {
+        block_uncork(w, c);
+    }
+}
+
+/* Forget about a client's corked output (because it is going away). */
+void block_cork_drop(ship_client_t *c) {
+    if(c->corked && c->worker) {
+        TAILQ_REMOVE(&c->worker->corked, c, cork_qentry);
+        c->corked = 0;
+    }
+}
+
+/* Give a client that's being disconnected one last shot at sending what it has
+   corked up, since that's often the message saying why it's being kicked. If
+   the socket's backed up, whatever doesn't fit is lost. */
+void block_cork_flush(ship_client_t *c) {
+    if(!c->corked || !c->worker) {
+        return;
+    }
+
+    TAILQ_REMOVE(&c->worker->corked, c, cork_qentry);
+    c->corked = 0;
+
+    if(c->sendbuf.len && !c->write_armed && c->sock >= 0) {
+        ringbuf_write(&c->sendbuf, c->sock);
+    }
+}
+
+static block_msg_t *block_msg_alloc(ship_client_t *c, int type, int len) {
+    block_msg_t *m;
+
+    /* Leave room on the end for the packet to be padded out before it gets
+       encrypted. */
+    if(!(m = (block_msg_t *)malloc(sizeof(block_msg_t) + len + 8))) {
+        perror("malloc");
+        return NULL;
+    }
+
+    m->c = c;
+    m->type = type;
+    m->len = len;
+
+    return m;
+}
+
+static void block_msg_post(block_worker_t *w, block_msg_t *m) {
+    mailbox_post(&w->mbox, &m->node);
+
+    /* If the worker hasn't been told there's mail since it last checked, wake
+       it up. */
+    if(!__atomic_exchange_n(&w->mbox_wake, 1, __ATOMIC_ACQ_REL)) {
+        write(w->pipes[1], "\x00", 1);
+    }
+}
+
+int block_post(block_worker_t *w, ship_client_t *c, int type, const void *data,
+               int len) {
+    block_msg_t *m;
+
+    if(!(m = block_msg_alloc(c, type, len))) {
+        return -1;
+    }
+
+    if(len) {
+        memcpy(m->data, data, len);
+    }
+
+    block_msg_post(w, m);
+    return 0;
+}
+
+int block_post_pkt(block_worker_t *w, ship_client_t *c, uint32_t lobby_id,
+                   const void *pkt, int len) {
+    block_msg_t *m;
+
+    /* The game's ID goes first, so the packet itself stays aligned. */
+    if(!(m = block_msg_alloc(c, BLOCK_MSG_PKT, len + 4))) {
+        return -1;
+    }
+
+    memcpy(m->data, &lobby_id, 4);
+    memcpy(m->data + 4, pkt, len);
+    block_msg_post(w, m);
+    return 0;
+}
+
+/* Do everything other threads have asked of the worker's clients. The caller
+   has to hold the block's client lock. */
+static void block_read_mail(block_worker_t *w) {
+    mailbox_node_t *n;
+    block_msg_t *m;
+    ship_client_t *c;
+    uint32_t id;
+
+    /* Clear the flag first, so that anyone posting from here on will wake us
+       up again (even if we happen to see what they post right now). */
+    __atomic_store_n(&w->mbox_wake, 0, __ATOMIC_SEQ_CST);
+
+    while((n = mailbox_take(&w->mbox))) {
+        m = (block_msg_t *)n;
+        c = m->c;
+        ++w->delivered;
+
+        if(!(c->flags & CLIENT_FLAG_DISCONNECTED)) {
+            switch(m->type) {
+                case BLOCK_MSG_SEND:
+                    if(crypt_send(c, m->len, m->data)) {
+                        c->flags |= CLIENT_FLAG_DISCONNECTED;
+                    }
+                    break;
+
+                case BLOCK_MSG_DISCONNECT:
+                    c->flags |= CLIENT_FLAG_DISCONNECTED;
+                    break;
+
+                case BLOCK_MSG_CHAR_DATA:
+                    client_set_char_data(c, m->data, m->len);
+                    break;
+
+                case BLOCK_MSG_GM_LOGIN:
+                    client_gm_login(c, m->len ? m->data[0] : 0, !!m->len);
+                    break;
+
+                case BLOCK_MSG_STFU:
+                    client_set_stfu(c, m->data[0]);
+                    break;
+
+                case BLOCK_MSG_PKT:
+                    memcpy(&id, m->data, 4);
+
+                    if(lobby_replay_pkt(c, id, (dc_pkt_hdr_t *)(m->data + 4))) {
+                        c->flags |= CLIENT_FLAG_DISCONNECTED;
+                    }
+                    break;
             }
+        }
 
-            FD_SET(it->sock, &readfds);
+        free(m);
+    }
+}
 
-            /* Only add to the write fd set if we have something to send out. */
-            if(it->sendbuf_cur) {
-                FD_SET(it->sock, &writefds);
+/* Figure out which version a listening socket is for, or -1 if the socket
+   isn't one of our listening sockets. */
+static int block_listen_version(block_worker_t *w, int fd) {
+    int i;
+
+    for(i = 0; i < 2; ++i) {
+        if(w->dcsock[i] == fd)
+            return CLIENT_VERSION_DCV1;
+        else if(w->pcsock[i] == fd)
+            return CLIENT_VERSION_PC;
+        else if(w->gcsock[i] == fd)
+            return CLIENT_VERSION_GC;
+        else if(w->ep3sock[i] == fd)
+            return CLIENT_VERSION_EP3;
+        else if(w->bbsock[i] == fd)
+            return CLIENT_VERSION_BB;
+    }
+
+    return -1;
+}
+
+/* Accept everything that's waiting on one of the listening sockets. */
+static void block_accept(block_worker_t *w, int lsock, int version) {
+    block_t *b = w->b;
+    ship_t *s = b->ship;
+    socklen_t len;
+    struct sockaddr_storage addr;
+    struct sockaddr *addr_p = (struct sockaddr *)&addr;
+    char ipstr[INET6_ADDRSTRLEN];
+    int sock;
+
+    for(;;) {
+        len = sizeof(struct sockaddr_storage);
+        if((sock = accept(lsock, addr_p, &len)) < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
             }
 
-            nfds = nfds > it->sock ? nfds : it->sock;
+            return;
         }
 
-        pthread_rwlock_unlock(&b->lock);
+        my_ntop(&addr, ipstr);
+        debug(DBG_LOG, "%s(%d/%d): Accepted %s block connection from %s\n",
+              s->cfg->name, b->b, w->id, version_names[version], ipstr);
 
-        /* Add the listening sockets to the read fd_set. */
-        for(i = 0; i < numsocks; ++i) {
-            FD_SET(b->dcsock[i], &readfds);
-            nfds = nfds > b->dcsock[i] ? nfds : b->dcsock[i];
-            FD_SET(b->pcsock[i], &readfds);
-            nfds = nfds > b->pcsock[i] ? nfds : b->pcsock[i];
-            FD_SET(b->gcsock[i], &readfds);
-            nfds = nfds > b->gcsock[i] ? nfds : b->gcsock[i];
-            FD_SET(b->ep3sock[i], &readfds);
-            nfds = nfds > b->ep3sock[i] ? nfds : b->ep3sock[i];
-            FD_SET(b->bbsock[i], &readfds);
-            nfds = nfds > b->bbsock[i] ? nfds : b->bbsock[i];
-        }
-
-        FD_SET(b->pipes[1], &readfds);
-        nfds = nfds > b->pipes[1] ? nfds : b->pipes[1];
-
-        /* Wait for some activity... */
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            if(FD_ISSET(b->pipes[1], &readfds)) {
-                read(b->pipes[1], &len, 1);
-            }
-
-            for(i = 0; i < numsocks; ++i) {
-                if(FD_ISSET(b->dcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->dcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+        if(!client_create_connection(sock, version, CLIENT_TYPE_BLOCK,
+                                     b->clients, s, b, w->evl, &w->tw,
+                                     addr_p, len)) {
+            close(sock);
+            continue;
+        }
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted DC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+        ++w->accepted;
+        ++w->num_clients;
+    }
+}
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_DCV1,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+/* Take the worker's dead clients out of the guildcard directory. The block's
+   client lock must be write locked. Returns how many were taken out. */
+static int worker_unlist_dead(block_worker_t *w) {
+    ship_client_t *it;
+    int rv = 0;
 
-                if(FD_ISSET(b->pcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->pcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    TAILQ_FOREACH(it, w->b->clients, qentry) {
+        if(it->worker == w && (it->flags & CLIENT_FLAG_DISCONNECTED) &&
+           it->dir_listed) {
+            client_dir_remove(it);
+            ++rv;
+        }
+    }
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted PC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+    return rv;
+}
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_PC,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+static void *block_thd(void *d) {
+    block_worker_t *w = (block_worker_t *)d;
+    block_t *b = w->b;
+    ship_t *s = b->ship;
+    int nev, i, rv, ver, timeout, fired;
+    evloop_event_t evs[BLOCK_MAX_EVENTS];
+    ship_client_t *it, *tmp;
+    char ipstr[INET6_ADDRSTRLEN];
+    char nm[64];
+    char junk[32];
 
-                if(FD_ISSET(b->gcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->gcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+    pthread_setspecific(worker_key, w);
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted GC block connection from "
-                          "%s\n", s->cfg->name, b->b, ipstr);
+    debug(DBG_LOG, "%s(%d/%d): Up and running (%s)\n", s->cfg->name, b->b,
+          w->id, evloop_backend_name(w->evl));
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_GC,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+    /* While we're still supposed to run... do it. */
+    while(b->run) {
+        /* Ping or time out anyone whose timer has gone off. */
+        pthread_rwlock_rdlock(&b->lock);
+        fired = timerwheel_run(&w->tw);
+        pthread_rwlock_unlock(&b->lock);
 
-                if(FD_ISSET(b->ep3sock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->ep3sock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+        /* If that kicked anyone, make sure they're cleaned up right away.
+           Otherwise, sleep until the next timer is due. */
+        timeout = fired ? 0 : timerwheel_next_timeout(&w->tw, 30000);
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted Episode 3 block "
-                          "connection from %s\n", s->cfg->name, b->b, ipstr);
+        /* Send out anything that got corked up since the last wait. */
+        block_flush_corked(w);
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_EP3,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+        /* Wait for some activity... Nothing we looked up before this is
+           still in use, so destroyed games don't need to wait on us. */
+        __atomic_store_n(&w->epoch, 0, __ATOMIC_SEQ_CST);
+        nev = evloop_wait(w->evl, evs, BLOCK_MAX_EVENTS, timeout);
+        __atomic_store_n(&w->epoch, __atomic_load_n(&b->lobby_epoch,
+                                                    __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+        timerwheel_update_clock(&w->tw);
+        ++w->wakeups;
 
-                if(FD_ISSET(b->bbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(b->bbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
+        if(nev > 0) {
+            w->events += nev;
+        }
 
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s(%d): Accepted Blue Burst block "
-                          "connection from %s\n", s->cfg->name, b->b, ipstr);
+        /* Deal with the pipe and listening sockets first. */
+        for(i = 0; i < nev; ++i) {
+            if(evs[i].data) {
+                continue;
+            }
 
-                    if(!client_create_connection(sock, CLIENT_VERSION_BB,
-                                                 CLIENT_TYPE_BLOCK, b->clients,
-                                                 s, b, addr_p, len)) {
-                        close(sock);
-                    }
-                }
+            if(evs[i].fd == w->pipes[0]) {
+                read(w->pipes[0], junk, sizeof(junk));
             }
+            else if((ver = block_listen_version(w, evs[i].fd)) >= 0) {
+                block_accept(w, evs[i].fd, ver);
+            }
+        }
 
-            pthread_rwlock_rdlock(&b->lock);
+        pthread_rwlock_rdlock(&b->lock);
 
-            /* Process client connections. */
-            TAILQ_FOREACH(it, b->clients, qentry) {
-                pthread_mutex_lock(&it->mutex);
+        /* Take care of anything other threads want done to our clients. */
+        block_read_mail(w);
 
-                /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(it->sock, &readfds)) {
-                    if(client_process_pkt(it)) {
-                        it->flags |= CLIENT_FLAG_DISCONNECTED;
-                        pthread_mutex_unlock(&it->mutex);
-                        continue;
-                    }
-                }
+        /* Process client connections. Nobody else touches these clients
+           directly, so there's nothing to lock here. */
+        for(i = 0; i < nev; ++i) {
+            if(!(it = (ship_client_t *)evs[i].data)) {
+                continue;
+            }
 
-                /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(it->sock, &writefds)) {
-                    if(it->sendbuf_cur) {
-                        sent = send(it->sock, it->sendbuf + it->sendbuf_start,
-                                    it->sendbuf_cur - it->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                                pthread_mutex_unlock(&it->mutex);
-                                continue;
-                            }
-                        }
-                        else {
-                            it->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(it->sendbuf_start == it->sendbuf_cur) {
-                                free(it->sendbuf);
-                                it->sendbuf = NULL;
-                                it->sendbuf_cur = 0;
-                                it->sendbuf_size = 0;
-                                it->sendbuf_start = 0;
-                            }
-                        }
-                    }
-                }
+            /* Check if this connection was trying to send us something. We get
+               edge-triggered notifications, so read until there's nothing
+               left (or until the client is on its way out). */
+            if(evs[i].events & EVLOOP_READ) {
+                do {
+                    rv = client_process_pkt(it);
+                } while(!rv && !(it->flags & CLIENT_FLAG_DISCONNECTED));
 
-                pthread_mutex_unlock(&it->mutex);
+                if(rv < 0) {
+                    it->flags |= CLIENT_FLAG_DISCONNECTED;
+                    continue;
+                }
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* If we have anything to write, check if we can right now. */
+            if((evs[i].events & EVLOOP_WRITE) && it->sendbuf.len) {
+                if(client_flush(it)) {
+                    it->flags |= CLIENT_FLAG_DISCONNECTED;
+                }
+            }
         }
 
+        pthread_rwlock_unlock(&b->lock);
+
         /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE
            in the middle of a TAILQ_FOREACH, and client_destroy_connection
            does indeed use TAILQ_REMOVE). */
         pthread_rwlock_wrlock(&b->lock);
+
+        /* With the lock held, nobody else can find our clients through the
+           block, so once the dead ones are out of the guildcard directory too
+           and the mailbox is empty, nothing refers to them anymore. Reading
+           the mail can kill off more clients, so go around until it doesn't. */
+        block_read_mail(w);
+
+        while(worker_unlist_dead(w)) {
+            block_read_mail(w);
+        }
+
         it = TAILQ_FIRST(b->clients);
         while(it) {
             tmp = TAILQ_NEXT(it, qentry);
 
-            if(it->flags & CLIENT_FLAG_DISCONNECTED) {
+            if(it->worker == w && (it->flags & CLIENT_FLAG_DISCONNECTED)) {
                 if(it->bb_pl) {
                     istrncpy16(ic_utf16_to_utf8, nm,
                                &it->pl->bb.character.name[2], 64);
@@ -327,6 +516,7 @@ static void *block_thd(void *d) {
                 lobby_remove_player(it);
                 client_destroy_connection(it, b->clients);
                 --b->num_clients;
+                --w->num_clients;
             }
 
             it = tmp;
@@ -338,94 +528,233 @@ static void *block_thd(void *d) {
     pthread_exit(NULL);
 }
 
-block_t *block_server_start(ship_t *s, int b, uint16_t port) {
-    block_t *rv;
-    int dcsock[2] = { -1, -1 }, pcsock[2] = { -1, -1 };
-    int gcsock[2] = { -1, -1 }, ep3sock[2] = { -1, -1 };
-    int bbsock[2] = { -1, -1 }, i;
-    lobby_t *l, *l2;
-    uint32_t rng_seed;
+/* Close any of a worker's listening sockets that are open. */
+static void worker_close_socks(block_worker_t *w) {
+    int i;
 
-    debug(DBG_LOG, "%s: Starting server for block %d...\n", s->cfg->name, b);
+    for(i = 0; i < 2; ++i) {
+        if(w->dcsock[i] >= 0)
+            close(w->dcsock[i]);
+        if(w->pcsock[i] >= 0)
+            close(w->pcsock[i]);
+        if(w->gcsock[i] >= 0)
+            close(w->gcsock[i]);
+        if(w->ep3sock[i] >= 0)
+            close(w->ep3sock[i]);
+        if(w->bbsock[i] >= 0)
+            close(w->bbsock[i]);
+
+        w->dcsock[i] = w->pcsock[i] = w->gcsock[i] = -1;
+        w->ep3sock[i] = w->bbsock[i] = -1;
+    }
+}
 
-    /* Create the sockets for listening for connections. */
-    dcsock[0] = open_sock(AF_INET, port);
-    if(dcsock[0] < 0) {
-        return NULL;
+/* Open up a worker's listening sockets on the block's ports. If the block has
+   more than one worker, the sockets are shared and the kernel spreads incoming
+   connections out between the workers. */
+static int worker_open_socks(block_worker_t *w, uint16_t port, int shared) {
+    int *socks[5] = { w->dcsock, w->pcsock, w->gcsock, w->ep3sock, w->bbsock };
+    int i;
+
+    for(i = 0; i < 5; ++i) {
+        socks[i][0] = socks[i][1] = -1;
     }
 
-    pcsock[0] = open_sock(AF_INET, port + 1);
-    if(pcsock[0] < 0) {
-        goto err_close_dc;
+    for(i = 0; i < 5; ++i) {
+        if((socks[i][0] = open_sock(AF_INET, port + i, shared)) < 0) {
+            goto err;
+        }
+
+#ifdef SYLVERANT_ENABLE_IPV6
+        if(enable_ipv6) {
+            if((socks[i][1] = open_sock(AF_INET6, port + i, shared)) < 0) {
+                goto err;
+            }
+        }
+#endif
     }
 
-    gcsock[0] = open_sock(AF_INET, port + 2);
-    if(gcsock[0] < 0) {
-        goto err_close_pc;
+    return 0;
+
+err:
+    worker_close_socks(w);
+    return -1;
+}
+
+/* Clean up everything a (stopped) worker owns. */
+static void worker_cleanup(block_worker_t *w) {
+    mailbox_node_t *n;
+
+    worker_close_socks(w);
+
+    /* Throw away anything that was posted too late to be looked at. */
+    while((n = mailbox_take(&w->mbox))) {
+        free(n);
     }
 
-    ep3sock[0] = open_sock(AF_INET, port + 3);
-    if(ep3sock[0] < 0) {
-        goto err_close_gc;
+    if(w->pipes[0] >= 0) {
+        close(w->pipes[0]);
+        close(w->pipes[1]);
+        w->pipes[0] = w->pipes[1] = -1;
     }
 
-    bbsock[0] = open_sock(AF_INET, port + 4);
-    if(bbsock[0] < 0) {
-        goto err_close_ep3;
+    evloop_destroy(w->evl);
+    w->evl = NULL;
+}
+
+/* Set up and start one of a block's workers. */
+static int worker_start(block_t *b, block_worker_t *w, int id, uint16_t port) {
+    ship_t *s = b->ship;
+    int i;
+
+    w->b = b;
+    w->id = id;
+    w->pipes[0] = w->pipes[1] = -1;
+    mailbox_init(&w->mbox);
+    w->mbox_wake = 0;
+
+    /* Create the sockets for listening for connections. */
+    if(worker_open_socks(w, port, b->num_workers > 1)) {
+        return -1;
     }
 
-#ifdef SYLVERANT_ENABLE_IPV6
-    if(enable_ipv6) {
-        dcsock[1] = open_sock(AF_INET6, port);
-        if(dcsock[1] < 0) {
-            goto err_close_bb;
-        }
+    /* Make our pipe */
+    if(pipe(w->pipes) == -1) {
+        debug(DBG_ERROR, "%s(%d/%d): Cannot create pipe!\n", s->cfg->name,
+              b->b, id);
+        w->pipes[0] = w->pipes[1] = -1;
+        goto err;
+    }
 
-        pcsock[1] = open_sock(AF_INET6, port + 1);
-        if(pcsock[1] < 0) {
-            goto err_close_dc_6;
-        }
+    /* Set up the event loop and put the pipe and listening sockets in it. */
+    if(!(w->evl = evloop_create(evloop_backend))) {
+        debug(DBG_ERROR, "%s(%d/%d): Cannot create event loop!\n",
+              s->cfg->name, b->b, id);
+        goto err;
+    }
 
-        gcsock[1] = open_sock(AF_INET6, port + 2);
-        if(gcsock[1] < 0) {
-            goto err_close_pc_6;
-        }
+    evloop_set_nonblock(w->pipes[0]);
+    evloop_set_nonblock(w->pipes[1]);
+
+    if(evloop_add(w->evl, w->pipes[0], EVLOOP_READ, NULL)) {
+        goto err;
+    }
 
-        ep3sock[1] = open_sock(AF_INET6, port + 3);
-        if(ep3sock[1] < 0) {
-            goto err_close_gc_6;
+    for(i = 0; i < 2; ++i) {
+        if(w->dcsock[i] < 0) {
+            continue;
         }
 
-        bbsock[1] = open_sock(AF_INET6, port + 4);
-        if(bbsock[1] < 0) {
-            goto err_close_ep3_6;
+        if(evloop_add(w->evl, w->dcsock[i], EVLOOP_READ, NULL) ||
+           evloop_add(w->evl, w->pcsock[i], EVLOOP_READ, NULL) ||
+           evloop_add(w->evl, w->gcsock[i], EVLOOP_READ, NULL) ||
+           evloop_add(w->evl, w->ep3sock[i], EVLOOP_READ, NULL) ||
+           evloop_add(w->evl, w->bbsock[i], EVLOOP_READ, NULL)) {
+            debug(DBG_ERROR, "%s(%d/%d): Cannot watch listening sockets!\n",
+                  s->cfg->name, b->b, id);
+            goto err;
         }
     }
-#endif
+
+    timerwheel_init(&w->tw);
+    TAILQ_INIT(&w->corked);
+
+    /* Give each worker a differently seeded random number generator. */
+    mt19937_init(&w->rng, mt19937_genrand_int32(&b->rng) ^ (uint32_t)id);
+
+    /* Start up the thread for this worker. */
+    if(pthread_create(&w->thd, NULL, &block_thd, w)) {
+        debug(DBG_ERROR, "%s(%d/%d): Cannot start block thread!\n",
+              s->cfg->name, b->b, id);
+        goto err;
+    }
+
+    return 0;
+
+err:
+    worker_cleanup(w);
+    return -1;
+}
+
+/* Tell a worker to stop, and wait for it to do so. */
+static void worker_stop(block_worker_t *w) {
+    /* Send a byte to the pipe so that we actually break out of the wait. */
+    write(w->pipes[1], "\xFF", 1);
+
+    /* Wait for it to die. */
+    pthread_join(w->thd, NULL);
+}
+
+/* Smallest lobby index we'll make. The 20 default lobbies and a handful of
+   games fit without growing it. */
+#define LOBBY_IDX_MIN   64
+
+static lobby_idx_t *lobby_idx_alloc(uint32_t size) {
+    lobby_idx_t *rv;
+
+    rv = (lobby_idx_t *)calloc(1, sizeof(lobby_idx_t) +
+                               size * sizeof(rv->ents[0]));
+
+    if(!rv) {
+        debug(DBG_ERROR, "Cannot allocate lobby index: %s\n",
+              strerror(errno));
+        return NULL;
+    }
+
+    rv->mask = size - 1;
+    return rv;
+}
+
+static void lobby_idx_free(lobby_idx_t *t) {
+    lobby_idx_t *tmp;
+
+    while(t) {
+        tmp = t->old;
+        free(t);
+        t = tmp;
+    }
+}
+
+block_t *block_server_start(ship_t *s, int b, uint16_t port) {
+    block_t *rv;
+    int i;
+    lobby_t *l, *l2;
+    uint32_t rng_seed;
+
+    debug(DBG_LOG, "%s: Starting server for block %d...\n", s->cfg->name, b);
+
+    pthread_once(&worker_key_once, &make_worker_key);
 
     /* Make space for the block structure. */
     rv = (block_t *)malloc(sizeof(block_t));
 
     if(!rv) {
         debug(DBG_ERROR, "%s(%d): Cannot allocate memory!\n", s->cfg->name, b);
-        goto err_close_all;
+        return NULL;
     }
 
     memset(rv, 0, sizeof(block_t));
 
-    /* Make our pipe */
-    if(pipe(rv->pipes) == -1) {
-        debug(DBG_ERROR, "%s(%d): Cannot create pipe!\n", s->cfg->name, b);
+    /* Make room for the workers. */
+    rv->num_workers = block_worker_count(b);
+    rv->workers = (block_worker_t *)malloc(sizeof(block_worker_t) *
+                                           rv->num_workers);
+
+    if(!rv->workers) {
+        debug(DBG_ERROR, "%s(%d): Cannot allocate memory for workers!\n",
+              s->cfg->name, b);
         goto err_free;
     }
 
+    memset(rv->workers, 0, sizeof(block_worker_t) * rv->num_workers);
+
     /* Make room for the client list. */
     rv->clients = (struct client_queue *)malloc(sizeof(struct client_queue));
 
     if(!rv->clients) {
         debug(DBG_ERROR, "%s(%d): Cannot allocate memory for clients!\n",
               s->cfg->name, b);
-        goto err_pipes;
+        goto err_workers;
     }
 
     /* Fill in the structure. */
@@ -437,19 +766,17 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
     rv->gc_port = port + 2;
     rv->ep3_port = port + 3;
     rv->bb_port = port + 4;
-    rv->dcsock[0] = dcsock[0];
-    rv->pcsock[0] = pcsock[0];
-    rv->gcsock[0] = gcsock[0];
-    rv->ep3sock[0] = ep3sock[0];
-    rv->bbsock[0] = bbsock[0];
-    rv->dcsock[1] = dcsock[1];
-    rv->pcsock[1] = pcsock[1];
-    rv->gcsock[1] = gcsock[1];
-    rv->ep3sock[1] = ep3sock[1];
-    rv->bbsock[1] = bbsock[1];
     rv->run = 1;
 
     TAILQ_INIT(&rv->lobbies);
+    TAILQ_INIT(&rv->lobby_pool);
+    TAILQ_INIT(&rv->lobby_retired);
+    pthread_mutex_init(&rv->lobby_pool_lock, NULL);
+    rv->lobby_epoch = 1;
+
+    if(!(rv->lobby_idx = lobby_idx_alloc(LOBBY_IDX_MIN))) {
+        goto err_clients;
+    }
 
     /* Create the first 20 lobbies (the default ones) */
     for(i = 1; i <= 20; ++i) {
@@ -458,11 +785,13 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
 
         /* Add it into our list of lobbies */
         TAILQ_INSERT_TAIL(&rv->lobbies, l, qentry);
+        block_add_lobby(rv, l);
     }
 
     /* Create the reader-writer locks */
     pthread_rwlock_init(&rv->lock, NULL);
     pthread_rwlock_init(&rv->lobby_lock, NULL);
+    pthread_rwlock_init(&rv->game_list_lock, NULL);
 
     /* Initialize the random number generator. The seed value is the current
        UNIX time, xored with the port (so that each block will use a different
@@ -470,16 +799,30 @@ block_t *block_server_start(ship_t *s, int b, uint16_t port) {
     rng_seed = (uint32_t)(time(NULL) ^ port);
     mt19937_init(&rv->rng, rng_seed);
 
-    /* Start up the thread for this block. */
-    if(pthread_create(&rv->thd, NULL, &block_thd, rv)) {
-        debug(DBG_ERROR, "%s(%d): Cannot start block thread!\n",
-              s->cfg->name, b);
-        goto err_lobbies;
+    /* Start up the threads for this block. */
+    for(i = 0; i < rv->num_workers; ++i) {
+        if(worker_start(rv, &rv->workers[i], i, port)) {
+            debug(DBG_ERROR, "%s(%d): Cannot start worker %d!\n",
+                  s->cfg->name, b, i);
+            goto err_stop;
+        }
+    }
+
+    if(rv->num_workers > 1) {
+        debug(DBG_LOG, "%s(%d): Running with %d workers\n", s->cfg->name, b,
+              rv->num_workers);
     }
 
     return rv;
 
-err_lobbies:
+err_stop:
+    rv->run = 0;
+
+    while(i--) {
+        worker_stop(&rv->workers[i]);
+        worker_cleanup(&rv->workers[i]);
+    }
+
     l2 = TAILQ_FIRST(&rv->lobbies);
     while(l2) {
         l = TAILQ_NEXT(l2, qentry);
@@ -489,36 +832,16 @@ err_lobbies:
 
     pthread_rwlock_destroy(&rv->lock);
     pthread_rwlock_destroy(&rv->lobby_lock);
+    pthread_rwlock_destroy(&rv->game_list_lock);
+    lobby_pool_drain(rv);
+    pthread_mutex_destroy(&rv->lobby_pool_lock);
+    lobby_idx_free(rv->lobby_idx);
+err_clients:
     free(rv->clients);
-err_pipes:
-    close(rv->pipes[0]);
-    close(rv->pipes[1]);
+err_workers:
+    free(rv->workers);
 err_free:
     free(rv);
-err_close_all:
-#ifdef SYLVERANT_ENABLE_IPV6
-    if(enable_ipv6) {
-        close(bbsock[1]);
-err_close_ep3_6:
-        close(ep3sock[1]);
-err_close_gc_6:
-        close(gcsock[1]);
-err_close_pc_6:
-        close(pcsock[1]);
-err_close_dc_6:
-        close(dcsock[1]);
-    }
-err_close_bb:
-#endif
-    close(bbsock[0]);
-err_close_ep3:
-    close(ep3sock[0]);
-err_close_gc:
-    close(gcsock[0]);
-err_close_pc:
-    close(pcsock[0]);
-err_close_dc:
-    close(dcsock[0]);
 
     return NULL;
 }
@@ -526,33 +849,17 @@ err_close_dc:
 void block_server_stop(block_t *b) {
     lobby_t *it2, *tmp2;
     ship_client_t *it, *tmp;
+    int i;
 
     /* Set the flag to kill the block. */
     b->run = 0;
 
-    /* Send a byte to the pipe so that we actually break out of the select. */
-    write(b->pipes[0], "\xFF", 1);
-
-    /* Wait for it to die. */
-    pthread_join(b->thd, NULL);
-
-    /* Close all the sockets so nobody can connect... */
-    close(b->pipes[0]);
-    close(b->pipes[1]);
-    close(b->dcsock[0]);
-    close(b->pcsock[0]);
-    close(b->gcsock[0]);
-    close(b->ep3sock[0]);
-    close(b->bbsock[0]);
-#ifdef SYLVERANT_ENABLE_IPV6
-    if(enable_ipv6) {
-        close(b->dcsock[1]);
-        close(b->pcsock[1]);
-        close(b->gcsock[1]);
-        close(b->ep3sock[1]);
-        close(b->bbsock[1]);
+    /* Wait for all the workers to die, and close all the sockets so nobody can
+       connect... */
+    for(i = 0; i < b->num_workers; ++i) {
+        worker_stop(&b->workers[i]);
+        worker_close_socks(&b->workers[i]);
     }
-#endif
 
     /* Disconnect any clients. */
     pthread_rwlock_wrlock(&b->lock);
@@ -581,7 +888,20 @@ void block_server_stop(block_t *b) {
     /* Finish with our cleanup... */
     pthread_rwlock_destroy(&b->lobby_lock);
     pthread_rwlock_destroy(&b->lock);
+    pthread_rwlock_destroy(&b->game_list_lock);
+    lobby_pool_drain(b);
+    pthread_mutex_destroy(&b->lobby_pool_lock);
+    lobby_idx_free(b->lobby_idx);
 
+    for(i = 0; i < GAME_LIST_KINDS; ++i) {
+        free(b->game_lists[i].pkt);
+    }
+
+    for(i = 0; i < b->num_workers; ++i) {
+        worker_cleanup(&b->workers[i]);
+    }
+
+    free(b->workers);
     free(b->clients);
     free(b);
 }
@@ -621,28 +941,165 @@ int block_info_reply(ship_client_t *c, uint32_t block) {
     return send_info_reply(c, string);
 }
 
-lobby_t *block_get_lobby(block_t *b, uint32_t lobby_id) {
-    lobby_t *rv = NULL, *l;
+/* Put a lobby in the first free slot at or after its home slot. */
+static void lobby_idx_put(lobby_idx_t *t, uint32_t id, lobby_t *l) {
+    uint32_t i = id & t->mask;
 
-    /* Look through all the lobbies in this block. */
-    TAILQ_FOREACH(l, &b->lobbies, qentry) {
-        pthread_mutex_lock(&l->mutex);
+    while(t->ents[i].l) {
+        i = (i + 1) & t->mask;
+    }
+
+    __atomic_store_n(&t->ents[i].id, id, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->ents[i].l, l, __ATOMIC_RELAXED);
+    ++t->count;
+}
+
+/* Mark the index as being changed. Lookups that see the sequence number
+   change from under them will start over. */
+static void lobby_idx_begin(block_t *b) {
+    __atomic_store_n(&b->lobby_seq, b->lobby_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-        if(l->lobby_id == lobby_id) {
-            rv = l;
+static void lobby_idx_end(block_t *b) {
+    __atomic_store_n(&b->lobby_seq, b->lobby_seq + 1, __ATOMIC_RELEASE);
+}
+
+int block_add_lobby(block_t *b, lobby_t *l) {
+    lobby_idx_t *t = b->lobby_idx, *nt;
+    uint32_t i;
+
+    /* Keep the table at most half full, so that runs stay short. */
+    if((t->count + 1) * 2 > t->mask + 1) {
+        if(!(nt = lobby_idx_alloc((t->mask + 1) << 1))) {
+            return -1;
         }
 
-        pthread_mutex_unlock(&l->mutex);
+        for(i = 0; i <= t->mask; ++i) {
+            if(t->ents[i].l) {
+                lobby_idx_put(nt, t->ents[i].id, t->ents[i].l);
+            }
+        }
 
-        if(rv) {
-            break;
+        /* Lookups might still be looking at the old table, so it has to stick
+           around until the block goes away. */
+        nt->old = t;
+        t = nt;
+    }
+
+    lobby_idx_begin(b);
+    lobby_idx_put(t, l->lobby_id, l);
+    __atomic_store_n(&b->lobby_idx, t, __ATOMIC_RELAXED);
+    lobby_idx_end(b);
+    block_game_list_changed(b);
+
+    return 0;
+}
+
+int block_add_game(block_t *b, lobby_t *l) {
+    uint32_t id = 0x20;
+
+    /* Select an unused ID. Since we're holding the lock for writing, nobody
+       else can grab the same one before it's in the index. */
+    do {
+        ++id;
+    } while(block_get_lobby(b, id));
+
+    l->lobby_id = id;
+
+    if(block_add_lobby(b, l)) {
+        l->lobby_id = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void block_remove_lobby(block_t *b, lobby_t *l) {
+    lobby_idx_t *t = b->lobby_idx;
+    uint32_t i = l->lobby_id & t->mask, j, k;
+
+    while(t->ents[i].l != l) {
+        if(!t->ents[i].l) {
+            return;
         }
+
+        i = (i + 1) & t->mask;
     }
 
-    return rv;
+    lobby_idx_begin(b);
+
+    /* Pull back anything after the removed entry in the same run that would
+       otherwise be cut off from its home slot by the gap. */
+    for(j = i;;) {
+        __atomic_store_n(&t->ents[i].l, NULL, __ATOMIC_RELAXED);
+
+        for(;;) {
+            j = (j + 1) & t->mask;
+
+            if(!t->ents[j].l) {
+                goto out;
+            }
+
+            k = t->ents[j].id & t->mask;
+
+            /* Leave it alone if its home slot is after the gap (cyclically). */
+            if(i <= j ? (i >= k || k > j) : (i >= k && k > j)) {
+                break;
+            }
+        }
+
+        __atomic_store_n(&t->ents[i].id, t->ents[j].id, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->ents[i].l, t->ents[j].l, __ATOMIC_RELAXED);
+        i = j;
+    }
+
+out:
+    --t->count;
+    lobby_idx_end(b);
+    block_game_list_changed(b);
 }
 
-static int join_game(ship_client_t *c, lobby_t *l) {
+lobby_t *block_get_lobby(block_t *b, uint32_t lobby_id) {
+    lobby_idx_t *t;
+    lobby_t *rv, *l;
+    uint32_t seq, i, n;
+
+    __atomic_add_fetch(&b->lobby_lookups, 1, __ATOMIC_RELAXED);
+
+    for(;;) {
+        seq = __atomic_load_n(&b->lobby_seq, __ATOMIC_ACQUIRE);
+
+        if(!(seq & 1)) {
+            t = __atomic_load_n(&b->lobby_idx, __ATOMIC_RELAXED);
+            rv = NULL;
+
+            for(i = lobby_id & t->mask, n = 0; n <= t->mask;
+                i = (i + 1) & t->mask, ++n) {
+                if(!(l = __atomic_load_n(&t->ents[i].l, __ATOMIC_RELAXED))) {
+                    break;
+                }
+
+                if(__atomic_load_n(&t->ents[i].id, __ATOMIC_RELAXED) ==
+                   lobby_id) {
+                    rv = l;
+                    break;
+                }
+            }
+
+            /* If nothing changed while we were looking, we're done. */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if(__atomic_load_n(&b->lobby_seq, __ATOMIC_RELAXED) == seq) {
+                return rv;
+            }
+        }
+
+        __atomic_add_fetch(&b->lobby_retries, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int join_game(ship_client_t *c, lobby_t *l, uint32_t lobby_id) {
     int rv;
     int i;
     uint32_t id;
@@ -655,7 +1112,7 @@ static int join_game(ship_client_t *c, lobby_t *l) {
     }
 
     /* See if they can change lobbies... */
-    rv = lobby_change_lobby(c, l);
+    rv = lobby_change_lobby(c, l, lobby_id);
     if(rv == -15) {
         /* HUcaseal, FOmar, or RAmarl trying to join a v1 game */
         send_message1(c, "%s\n\n%s", __(c, "\tE\tC4Can't join game!"),
@@ -786,6 +1243,7 @@ static int dcnte_process_login(ship_client_t *c, dcnte_login_8b_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    client_dir_add(c);
     c->language_code = CLIENT_LANG_JAPANESE;
     c->q_lang = CLIENT_LANG_JAPANESE;
     c->flags |= CLIENT_FLAG_IS_DCNTE;
@@ -821,6 +1279,7 @@ static int dc_process_login(ship_client_t *c, dc_login_93_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    client_dir_add(c);
     c->language_code = pkt->language_code;
     c->q_lang = pkt->language_code;
 
@@ -865,6 +1324,7 @@ static int dcv2_process_login(ship_client_t *c, dcv2_login_9d_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    client_dir_add(c);
     c->language_code = pkt->language_code;
     c->q_lang = pkt->language_code;
 
@@ -914,6 +1374,7 @@ static int gc_process_login(ship_client_t *c, gc_login_9e_pkt *pkt) {
 
     /* Save what we care about in here. */
     c->guildcard = LE32(pkt->guildcard);
+    client_dir_add(c);
     c->language_code = pkt->language_code;
     c->q_lang = pkt->language_code;
 
@@ -948,6 +1409,7 @@ static int bb_process_login(ship_client_t *c, bb_login_93_pkt *pkt) {
     }
 
     c->guildcard = LE32(pkt->guildcard);
+    client_dir_add(c);
     team_id = LE32(pkt->team_id);
 
     /* See if this person is a GM. */
@@ -1084,6 +1546,9 @@ static int dc_process_char(ship_client_t *c, dc_char_data_pkt *pkt) {
         c->blacklist = c->pl->v3.blacklist;
     }
 
+    /* Refile them in the player list, in case anything there changed. */
+    pllist_update(c);
+
     /* Copy out the inventory data */
     memcpy(c->items, c->pl->v1.inv.items, sizeof(item_t) * 30);
     c->item_count = (int)c->pl->v1.inv.item_count;
@@ -1128,7 +1593,8 @@ static int dc_process_char(ship_client_t *c, dc_char_data_pkt *pkt) {
             shipgate_send_block_login(&ship->sg, 1, c->guildcard,
                                       c->cur_block->b, c->pl->v1.name);
             shipgate_send_lobby_chg(&ship->sg, c->guildcard,
-                                    c->cur_lobby->lobby_id, c->cur_lobby->name);
+                                    c->cur_lobby->lobby_id, c->lobby_id,
+                                    c->cur_lobby->name);
 
             /* Set up to send the Message of the Day if we have one and the
                client hasn't already gotten it this session.
@@ -1144,7 +1610,8 @@ static int dc_process_char(ship_client_t *c, dc_char_data_pkt *pkt) {
         }
         else {
             shipgate_send_lobby_chg(&ship->sg, c->guildcard,
-                                    c->cur_lobby->lobby_id, c->cur_lobby->name);
+                                    c->cur_lobby->lobby_id, c->lobby_id,
+                                    c->cur_lobby->name);
         }
     }
 
@@ -1166,6 +1633,9 @@ static int bb_process_char(ship_client_t *c, bb_char_data_pkt *pkt) {
     c->c_rank = c->pl->bb.c_rank;
     c->blacklist = c->pl->bb.blacklist;
 
+    /* Refile them in the player list, in case anything there changed. */
+    pllist_update(c);
+
     /* Copy out the inventory data */
     memcpy(c->items, c->pl->bb.inv.items, sizeof(item_t) * 30);
     c->item_count = (int)c->pl->bb.inv.item_count;
@@ -1210,13 +1680,15 @@ static int bb_process_char(ship_client_t *c, bb_char_data_pkt *pkt) {
                                          c->cur_block->b,
                                          c->bb_pl->character.name);
             shipgate_send_lobby_chg(&ship->sg, c->guildcard,
-                                    c->cur_lobby->lobby_id, c->cur_lobby->name);
+                                    c->cur_lobby->lobby_id, c->lobby_id,
+                                    c->cur_lobby->name);
 
             c->flags |= CLIENT_FLAG_SENT_MOTD;
         }
         else {
             shipgate_send_lobby_chg(&ship->sg, c->guildcard,
-                                    c->cur_lobby->lobby_id, c->cur_lobby->name);
+                                    c->cur_lobby->lobby_id, c->lobby_id,
+                                    c->cur_lobby->name);
         }
     }
 
@@ -1253,7 +1725,7 @@ static int process_change_lobby(ship_client_t *c, uint32_t item_id) {
                              __(c, "\tC7The lobby is non-\nexistant."));
     }
 
-    rv = lobby_change_lobby(c, req);
+    rv = lobby_change_lobby(c, req, item_id);
 
     pthread_rwlock_unlock(&c->cur_block->lobby_lock);
 
@@ -1407,7 +1879,6 @@ static int bb_process_chat(ship_client_t *c, bb_chat_pkt *pkt) {
 
 /* Process a Guild Search request. */
 static int dc_process_guild_search(ship_client_t *c, dc_guild_search_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_target);
     int done = 0, rv = -1;
@@ -1420,44 +1891,28 @@ static int dc_process_guild_search(ship_client_t *c, dc_guild_search_pkt *pkt) {
     }
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
+    if((it = client_dir_get(gc, NULL))) {
+        /* If they're on but don't have data, we're not going to find them
+           anywhere else, return success. */
+        rv = 0;
+        done = 1;
+
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
 #ifdef SYLVERANT_ENABLE_IPV6
-                if((c->flags & CLIENT_FLAG_IPV6)) {
-                    rv = send_guild_reply6(c, it);
-                }
-                else {
-                    rv = send_guild_reply(c, it);
-                }
-#else
-                rv = send_guild_reply(c, it);
-#endif
-                done = 1;
-                pthread_mutex_unlock(&it->mutex);
+            if((c->flags & CLIENT_FLAG_IPV6)) {
+                rv = send_guild_reply6(c, it);
             }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
+            else {
+                rv = send_guild_reply(c, it);
             }
-
-            if(done)
-                break;
+#else
+            rv = send_guild_reply(c, it);
+#endif
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        client_dir_put(it);
     }
 
     /* If we get here, we didn't find it locally. Send to the shipgate to
@@ -1476,7 +1931,6 @@ static int dc_process_guild_search(ship_client_t *c, dc_guild_search_pkt *pkt) {
 }
 
 static int bb_process_guild_search(ship_client_t *c, bb_guild_search_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_target);
     int done = 0, rv = -1;
@@ -1489,44 +1943,28 @@ static int bb_process_guild_search(ship_client_t *c, bb_guild_search_pkt *pkt) {
     }
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
+    if((it = client_dir_get(gc, NULL))) {
+        /* If they're on but don't have data, we're not going to find them
+           anywhere else, return success. */
+        rv = 0;
+        done = 1;
+
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
 #ifdef SYLVERANT_ENABLE_IPV6
-                if((c->flags & CLIENT_FLAG_IPV6)) {
-                    rv = send_guild_reply6(c, it);
-                }
-                else {
-                    rv = send_guild_reply(c, it);
-                }
-#else
-                rv = send_guild_reply(c, it);
-#endif
-                done = 1;
-                pthread_mutex_unlock(&it->mutex);
+            if((c->flags & CLIENT_FLAG_IPV6)) {
+                rv = send_guild_reply6(c, it);
             }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
+            else {
+                rv = send_guild_reply(c, it);
             }
-
-            if(done)
-                break;
+#else
+            rv = send_guild_reply(c, it);
+#endif
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        client_dir_put(it);
     }
 
     /* If we get here, we didn't find it locally. Send to the shipgate to
@@ -1545,7 +1983,6 @@ static int bb_process_guild_search(ship_client_t *c, bb_guild_search_pkt *pkt) {
 }
 
 static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_dest);
     int done = 0, rv = -1;
@@ -1568,29 +2005,18 @@ static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
     }
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
-
-                /* Make sure the user hasn't blacklisted the sender. */
-                if(client_has_blacklisted(it, c->guildcard) ||
-                   client_has_ignored(it, c->guildcard)) {
-                    done = 1;
-                    pthread_mutex_unlock(&it->mutex);
-                    rv = 0;
-                    break;
-                }
-
+    if((it = client_dir_get(gc, NULL))) {
+        /* If they're on but don't have data, we're not going to find them
+           anywhere else, return success. */
+        rv = 0;
+        done = 1;
+
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
+
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(it, c->guildcard) &&
+               !client_has_ignored(it, c->guildcard)) {
                 /* Check if the user has an autoreply set. */
                 if(it->autoreply_on) {
                     send_mail_autoreply(c, it);
@@ -1598,20 +2024,12 @@ static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
 
                 /* Send the mail. */
                 rv = send_simple_mail(c->version, it, (dc_pkt_hdr_t *)pkt);
-                pthread_mutex_unlock(&it->mutex);
-                done = 1;
-                break;
-            }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
-                break;
             }
+
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        client_dir_put(it);
     }
 
     if(!done) {
@@ -1624,7 +2042,6 @@ static int dc_process_mail(ship_client_t *c, dc_simple_mail_pkt *pkt) {
 }
 
 static int pc_process_mail(ship_client_t *c, pc_simple_mail_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_dest);
     int done = 0, rv = -1;
@@ -1647,49 +2064,30 @@ static int pc_process_mail(ship_client_t *c, pc_simple_mail_pkt *pkt) {
     }
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
-
-                /* Make sure the user hasn't blacklisted the sender. */
-                if(client_has_blacklisted(it, c->guildcard) ||
-                   client_has_ignored(it, c->guildcard)) {
-                    done = 1;
-                    pthread_mutex_unlock(&it->mutex);
-                    rv = 0;
-                    break;
-                }
-
+    if((it = client_dir_get(gc, NULL))) {
+        /* If they're on but don't have data, we're not going to find them
+           anywhere else, return success. */
+        rv = 0;
+        done = 1;
+
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
+
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(it, c->guildcard) &&
+               !client_has_ignored(it, c->guildcard)) {
                 /* Check if the user has an autoreply set. */
                 if(it->autoreply_on) {
                     send_mail_autoreply(c, it);
                 }
 
                 rv = send_simple_mail(c->version, it, (dc_pkt_hdr_t *)pkt);
-                pthread_mutex_unlock(&it->mutex);
-                done = 1;
-                break;
-            }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
-                break;
             }
+
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        client_dir_put(it);
     }
 
     if(!done) {
@@ -1702,7 +2100,6 @@ static int pc_process_mail(ship_client_t *c, pc_simple_mail_pkt *pkt) {
 }
 
 static int bb_process_mail(ship_client_t *c, bb_simple_mail_pkt *pkt) {
-    int i;
     ship_client_t *it;
     uint32_t gc = LE32(pkt->gc_dest);
     int done = 0, rv = -1;
@@ -1725,49 +2122,30 @@ static int bb_process_mail(ship_client_t *c, bb_simple_mail_pkt *pkt) {
     }
 
     /* Search the local ship first. */
-    for(i = 0; i < ship->cfg->blocks && !done; ++i) {
-        if(!ship->blocks[i] || !ship->blocks[i]->run) {
-            continue;
-        }
-
-        pthread_rwlock_rdlock(&ship->blocks[i]->lock);
-
-        /* Look through all clients on that block. */
-        TAILQ_FOREACH(it, ship->blocks[i]->clients, qentry) {
-            /* Check if this is the target and the target has player
-               data. */
-            if(it->guildcard == gc && it->pl) {
-                pthread_mutex_lock(&it->mutex);
-
-                /* Make sure the user hasn't blacklisted the sender. */
-                if(client_has_blacklisted(it, c->guildcard) ||
-                   client_has_ignored(it, c->guildcard)) {
-                    done = 1;
-                    pthread_mutex_unlock(&it->mutex);
-                    rv = 0;
-                    break;
-                }
-
+    if((it = client_dir_get(gc, NULL))) {
+        /* If they're on but don't have data, we're not going to find them
+           anywhere else, return success. */
+        rv = 0;
+        done = 1;
+
+        if(it->pl) {
+            pthread_mutex_lock(&it->mutex);
+
+            /* Make sure the user hasn't blacklisted the sender. */
+            if(!client_has_blacklisted(it, c->guildcard) &&
+               !client_has_ignored(it, c->guildcard)) {
                 /* Check if the user has an autoreply set. */
                 if(it->autoreply_on) {
                     send_mail_autoreply(c, it);
                 }
 
                 rv = send_bb_simple_mail(it, pkt);
-                pthread_mutex_unlock(&it->mutex);
-                done = 1;
-                break;
-            }
-            else if(it->guildcard == gc) {
-                /* If they're on but don't have data, we're not going to
-                   find them anywhere else, return success. */
-                rv = 0;
-                done = 1;
-                break;
             }
+
+            pthread_mutex_unlock(&it->mutex);
         }
 
-        pthread_rwlock_unlock(&ship->blocks[i]->lock);
+        client_dir_put(it);
     }
 
     if(!done) {
@@ -1806,7 +2184,7 @@ static int dcnte_process_game_create(ship_client_t *c,
 
     /* We've got a new game, but nobody's in it yet... Lets put the requester
        in the game. */
-    if(join_game(c, l)) {
+    if(join_game(c, l, l->lobby_id)) {
         /* Something broke, destroy the created lobby before anyone tries to
            join it. */
         pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
@@ -1858,7 +2236,7 @@ static int dc_process_game_create(ship_client_t *c, dc_game_create_pkt *pkt) {
 
     /* We've got a new game, but nobody's in it yet... Lets put the requester
        in the game. */
-    if(join_game(c, l)) {
+    if(join_game(c, l, l->lobby_id)) {
         /* Something broke, destroy the created lobby before anyone tries to
            join it. */
         pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
@@ -1909,7 +2287,7 @@ static int pc_process_game_create(ship_client_t *c, pc_game_create_pkt *pkt) {
 
     /* We've got a new game, but nobody's in it yet... Lets put the requester
        in the game (as long as we're still here). */
-    if(join_game(c, l)) {
+    if(join_game(c, l, l->lobby_id)) {
         /* Something broke, destroy the created lobby before anyone tries to
            join it. */
         pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
@@ -1961,7 +2339,7 @@ static int gc_process_game_create(ship_client_t *c, gc_game_create_pkt *pkt) {
 
     /* We've got a new game, but nobody's in it yet... Lets put the requester
        in the game. */
-    if(join_game(c, l)) {
+    if(join_game(c, l, l->lobby_id)) {
         /* Something broke, destroy the created lobby before anyone tries to
            join it. */
         pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
@@ -2000,7 +2378,7 @@ static int ep3_process_game_create(ship_client_t *c, ep3_game_create_pkt *pkt) {
 
     /* We've got a new game, but nobody's in it yet... Lets put the requester
        in the game. */
-    if(join_game(c, l)) {
+    if(join_game(c, l, l->lobby_id)) {
         /* Something broke, destroy the created lobby before anyone tries to
            join it. */
         pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
@@ -2052,7 +2430,7 @@ static int bb_process_game_create(ship_client_t *c, bb_game_create_pkt *pkt) {
 
     /* We've got a new game, but nobody's in it yet... Lets put the requester
        in the game. */
-    if(join_game(c, l)) {
+    if(join_game(c, l, l->lobby_id)) {
         /* Something broke, destroy the created lobby before anyone tries to
            join it. */
         pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
@@ -2286,8 +2664,17 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
                 strncpy(passwd_cmp, tmp, 16);
             }
 
-            /* The client is selecting a game to join. */
-            l = block_get_lobby(c->cur_block, item_id);
+            /* The client is selecting a game to join. Games' lobbies get
+               reused once they're gone, so make sure it's still the game that
+               was asked for once it's locked. */
+            if((l = block_get_lobby(c->cur_block, item_id))) {
+                pthread_mutex_lock(&l->mutex);
+
+                if(l->lobby_id != item_id || l->type == LOBBY_TYPE_DEFAULT) {
+                    pthread_mutex_unlock(&l->mutex);
+                    l = NULL;
+                }
+            }
 
             if(!l) {
                 /* The lobby has disappeared. */
@@ -2299,6 +2686,7 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
             /* Check the provided password (if any). */
             if(!override) {
                 if(l->passwd[0] && strcmp(passwd_cmp, l->passwd)) {
+                    pthread_mutex_unlock(&l->mutex);
                     send_message1(c, "%s\n\n%s",
                                   __(c, "\tE\tC4Can't join game!"),
                                   __(c, "\tC7Wrong Password."));
@@ -2306,8 +2694,10 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
                 }
             }
 
+            pthread_mutex_unlock(&l->mutex);
+
             /* Attempt to change the player's lobby. */
-            join_game(c, l);
+            join_game(c, l, item_id);
 
             return 0;
         }
@@ -2373,7 +2763,14 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
 
                     /* Update the lobby's episode, just in case it doesn't
                        match up with what's already there. */
-                    l->episode = q->episode;
+                    pthread_mutex_lock(&l->mutex);
+
+                    if(l->episode != q->episode) {
+                        l->episode = q->episode;
+                        block_game_list_changed(l->block);
+                    }
+
+                    pthread_mutex_unlock(&l->mutex);
                 }
 
                 l->flags |= LOBBY_FLAG_QUESTING;
@@ -2473,14 +2870,22 @@ static int process_menu(ship_client_t *c, uint32_t menu_id, uint32_t item_id,
 
                 /* Add the lobby to the list of lobbies on the block. */
                 pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
+                c->create_lobby = NULL;
+
+                if(block_add_game(c->cur_block, l)) {
+                    pthread_rwlock_unlock(&c->cur_block->lobby_lock);
+                    lobby_destroy_noremove(l);
+                    return send_message1(c, "%s",
+                                         __(c, "\tE\tC4Can't create game!"));
+                }
+
                 TAILQ_INSERT_TAIL(&c->cur_block->lobbies, l, qentry);
                 ship_inc_games(ship);
                 ++c->cur_block->num_games;
                 pthread_rwlock_unlock(&c->cur_block->lobby_lock);
-                c->create_lobby = NULL;
 
                 /* Add the user to the lobby... */
-                if(join_game(c, l)) {
+                if(join_game(c, l, l->lobby_id)) {
                     /* Something broke, destroy the created lobby before anyone
                        tries to join it. */
                     pthread_rwlock_wrlock(&c->cur_block->lobby_lock);
@@ -2806,7 +3211,7 @@ static int process_qload_done(ship_client_t *c) {
     for(i = 0; i < l->max_clients; ++i) {
         if((c2 = l->clients[i])) {
             if(send_simple(c2, QUEST_LOAD_DONE_TYPE, 0))
-                c2->flags |= CLIENT_FLAG_DISCONNECTED;
+                client_kick(c2);
         }
     }
 
@@ -20,11 +20,16 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/queue.h>
 
 #include <sylverant/config.h>
 #include <sylverant/mtwist.h>
 
 #include "lobby.h"
+#include "evloop.h"
+#include "timerwheel.h"
+#include "mailbox.h"
+#include "rxbuf.h"
 
 /* Forward declarations. */
 struct ship;
@@ -41,10 +46,101 @@ typedef struct ship_client ship_client_t;
 typedef struct ship ship_t;
 #endif
 
-struct block {
-    ship_t *ship;
+/* Most worker threads a single block can be split across. */
+#define BLOCK_MAX_WORKERS   16
 
+/* One thread servicing a share of a block's connections. Each worker has its
+   own set of listening sockets (sharing the block's ports with SO_REUSEPORT)
+   and its own event loop, and owns every client accepted on those sockets. */
+typedef struct block_worker {
+    struct block *b;
     pthread_t thd;
+    int id;
+
+    int dcsock[2];
+    int pcsock[2];
+    int gcsock[2];
+    int ep3sock[2];
+    int bbsock[2];
+
+    int pipes[2];
+    evloop_t *evl;
+    timerwheel_t tw;
+
+    /* Random number generator state for anything done on this thread. */
+    struct mt19937_state rng;
+
+    /* Clients with corked output, to be flushed before the next wait. */
+    TAILQ_HEAD(cork_queue, ship_client) corked;
+
+    /* Requests from other threads for things to be done to this worker's
+       clients. The wake flag is set by whoever first posts something after the
+       worker last looked, and is their cue to poke the pipe. */
+    mailbox_t mbox;
+    int mbox_wake;
+
+    /* Load statistics. These are only written by the worker itself. */
+    int num_clients;
+    uint64_t accepted;
+    uint64_t wakeups;
+    uint64_t events;
+
+    /* Output statistics: send()/writev() calls made for the worker's clients,
+       and how many corked flushes happened with how many bytes in total. */
+    uint64_t sends;
+    uint64_t flushes;
+    uint64_t flush_bytes;
+
+    /* Requests taken out of the mailbox. */
+    uint64_t delivered;
+
+    /* The block's lobby epoch as of when the worker last woke up, or 0 while
+       it's waiting (and so can't be holding on to a lobby it looked up). */
+    uint64_t epoch;
+
+    /* Receive statistics for the worker's clients. */
+    rxbuf_stats_t rx;
+} block_worker_t;
+
+/* Open addressed table of a block's lobbies, keyed by lobby ID. Lobby IDs are
+   handed out sequentially, so the ID itself is a good enough hash. Tables are
+   only ever replaced by a bigger one, never freed while the block is up (so
+   that a lookup in progress never reads freed memory). */
+typedef struct lobby_idx {
+    struct lobby_idx *old;          /* The table this one replaced */
+    uint32_t mask;
+    uint32_t count;
+    struct {
+        uint32_t id;
+        lobby_t *l;                 /* NULL for an empty slot */
+    } ents[];
+} lobby_idx_t;
+
+/* Most destroyed game lobbies a block keeps around to reuse. */
+#define LOBBY_POOL_MAX          64
+
+/* The different game lists a client might be shown, depending on its version
+   (and, for Gamecube, whether it wants to see DC/PC games). */
+#define GAME_LIST_DCV1          0
+#define GAME_LIST_DCV2          1
+#define GAME_LIST_PC            2
+#define GAME_LIST_GC            3
+#define GAME_LIST_GC_DCPC       4
+#define GAME_LIST_EP3           5
+#define GAME_LIST_BB            6
+#define GAME_LIST_KINDS         7
+
+/* A rendered (but not encrypted) game list packet, good until the block's
+   game list generation moves past gen. */
+typedef struct game_list_cache {
+    uint32_t gen;
+    int len;                        /* 0 if nothing has been rendered yet */
+    int size;
+    uint8_t *pkt;
+} game_list_cache_t;
+
+struct block {
+    ship_t *ship;
 
     /* Reader-writer lock for the client tailqueue */
     pthread_rwlock_t lock;
@@ -53,13 +149,9 @@ struct block {
 
     int b;
     int run;
-    int dcsock[2];
-    int pcsock[2];
-    int gcsock[2];
-    int ep3sock[2];
-    int bbsock[2];
 
-    int pipes[2];
+    int num_workers;
+    block_worker_t *workers;
 
     uint16_t dc_port;
     uint16_t pc_port;
@@ -72,7 +164,43 @@ struct block {
     struct lobby_queue lobbies;
     int num_games;
 
-    /* Random number generator state */
+    /* Index of the lobbies by ID. This is only changed with lobby_lock held
+       for writing, but lookups don't lock anything: lobby_seq is odd while the
+       index is being changed, and a lookup that overlaps a change just tries
+       again (which is counted in lobby_retries). */
+    lobby_idx_t *lobby_idx;
+    uint32_t lobby_seq;
+    uint64_t lobby_lookups;
+    uint64_t lobby_retries;
+
+    /* Lobbies of games that have been destroyed, kept around to be reused for
+       new games (with their mutex still initialized and their enemy/object
+       buffers still allocated). The hit/miss counts are how many games were
+       created with a lobby from the pool and how many needed a new one. */
+    pthread_mutex_t lobby_pool_lock;
+    struct lobby_queue lobby_pool;
+    int lobby_pool_count;
+
+    /* Destroyed games that a lookup might still have in hand. Each one is
+       stamped with the lobby epoch it was retired in, and can't be reused or
+       freed until every worker has gone back to waiting or woken up in a later
+       epoch. This list is protected by lobby_pool_lock too. */
+    struct lobby_queue lobby_retired;
+    uint64_t lobby_epoch;
+    uint64_t lobby_pool_hits;
+    uint64_t lobby_pool_misses;
+
+    /* Game list packets for each kind of client. game_list_gen is bumped
+       whenever anything shown in the list changes (games being created or
+       destroyed, players coming and going, or a game's name, password or
+       flags changing), which makes everything in the cache stale. */
+    pthread_rwlock_t game_list_lock;
+    uint32_t game_list_gen;
+    game_list_cache_t game_lists[GAME_LIST_KINDS];
+    uint64_t game_list_reqs;
+    uint64_t game_list_builds;
+
+    /* Random number generator state (for threads other than the workers) */
     struct mt19937_state rng;
 };
 
@@ -83,9 +211,72 @@ typedef struct block block_t;
 
 block_t *block_server_start(ship_t *s, int b, uint16_t port);
 void block_server_stop(block_t *b);
+
+/* How many worker threads the given block should run. */
+int block_worker_count(int b);
+
+/* Grab the random number generator to use for the block from the current
+   thread. */
+struct mt19937_state *block_rng(block_t *b);
+
+/* The worker running on the current thread, or NULL if this thread isn't a
+   block worker. */
+block_worker_t *block_current_worker(void);
+
+/* Corked output. When enabled, packets sent to a client from the worker that
+   services it are queued up and sent all at once before the worker next waits
+   for activity (or sooner, if the oldest queued packet has been waiting longer
+   than the latency cap). */
+int block_cork_send(block_worker_t *w, ship_client_t *c, const void *data,
+                    int len);
+
+/* Things another thread can ask a client's worker to do to it. */
+#define BLOCK_MSG_SEND          0       /* Encrypt and send the given packet */
+#define BLOCK_MSG_DISCONNECT    1       /* Disconnect the client */
+#define BLOCK_MSG_CHAR_DATA     2       /* Replace the client's character */
+#define BLOCK_MSG_GM_LOGIN      3       /* Answer to a GM login (the data is
+                                           the privilege bits, or empty if the
+                                           login failed) */
+#define BLOCK_MSG_STFU          4       /* Set (data 1) or clear (data 0) the
+                                           client's STFU flag */
+#define BLOCK_MSG_PKT           5       /* Handle a game packet from the client
+                                           that was held back during a burst
+                                           (see block_post_pkt()) */
+
+/* Each block client belongs to exactly one worker, and only that worker reads
+   from it, writes to it, or touches its encryption state. Everyone else has to
+   hand things off through the worker's mailbox with this, which copies the data
+   (if any). The caller must be holding the block's client lock (reading is fine),
+   or have the client looked up with client_dir_get(), so that the client can't
+   go away before the worker gets to it. */
+int block_post(block_worker_t *w, ship_client_t *c, int type, const void *data,
+               int len);
+
+/* Post a packet the client sent in the given game while someone was bursting,
+   to be handled as if it had just come in (as long as the client is still in
+   that game by then). */
+int block_post_pkt(block_worker_t *w, ship_client_t *c, uint32_t lobby_id,
+                   const void *pkt, int len);
+void block_cork_drop(ship_client_t *c);
+void block_cork_flush(ship_client_t *c);
 int block_process_pkt(ship_client_t *c, uint8_t *pkt);
 
+/* Note that something shown in the block's game list has changed. Call this
+   after making the change, while still holding the lock that protects it. */
+#define block_game_list_changed(b) \
+    __atomic_add_fetch(&(b)->game_list_gen, 1, __ATOMIC_RELAXED)
+
+/* Look up a lobby by ID, without taking any locks. */
 lobby_t *block_get_lobby(block_t *b, uint32_t lobby_id);
+
+/* Add/remove a lobby to/from the block's index. The caller must hold the
+   block's lobby_lock for writing (if the block is running). */
+int block_add_lobby(block_t *b, lobby_t *l);
+void block_remove_lobby(block_t *b, lobby_t *l);
+
+/* Give a new game an unused ID and add it to the block's index. The caller must
+   hold the block's lobby_lock for writing. */
+int block_add_game(block_t *b, lobby_t *l);
 int block_info_reply(ship_client_t *c, uint32_t block);
 
 int send_motd(ship_client_t *c);
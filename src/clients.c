@@ -39,6 +39,7 @@
 #include "scripts.h"
 #include "subcmd.h"
 #include "mapdata.h"
+#include "savecache.h"
 
 #ifdef UNUSED
 #undef UNUSED
@@ -52,42 +53,255 @@ static PyObject *client_pyobj_create(ship_client_t *c);
 static void client_pyobj_invalidate(ship_client_t *c);
 #endif
 
-/* The key for accessing our thread-specific receive buffer. */
-pthread_key_t recvbuf_key;
-
 /* The key for accessing our thread-specific send buffer. */
 pthread_key_t sendbuf_key;
 
-/* Destructor for the thread-specific receive buffer */
+/* The key for accessing our thread-specific broadcast rendering buffer. */
+pthread_key_t bcastbuf_key;
+
+/* Most data we'll queue up for any one client, and the congestion settings
+   (from the command line). */
+extern size_t client_sendbuf_max;
+extern size_t client_sendbuf_high;
+extern size_t client_sendbuf_total;
+extern int client_sendbuf_stall;
+
+size_t client_sendq_total = 0;
+
+/* The guildcard directory. */
+typedef struct client_dir_shard {
+    pthread_rwlock_t lock;
+    ship_client_t *buckets[CLIENT_DIR_BUCKETS];
+} client_dir_shard_t;
+
+static client_dir_shard_t dir_shards[CLIENT_DIR_SHARDS];
+
+int client_dir_count = 0;
+uint64_t client_dir_lookups = 0;
+
+/* Destructor for the thread-specific buffers */
 static void buf_dtor(void *rb) {
     free(rb);
 }
 
 /* Initialize the clients system, allocating any thread specific keys */
 int client_init(sylverant_ship_t *cfg) {
-    if(pthread_key_create(&recvbuf_key, &buf_dtor)) {
+    int i;
+
+    if(pthread_key_create(&sendbuf_key, &buf_dtor)) {
         perror("pthread_key_create");
         return -1;
     }
 
-    if(pthread_key_create(&sendbuf_key, &buf_dtor)) {
+    if(pthread_key_create(&bcastbuf_key, &buf_dtor)) {
         perror("pthread_key_create");
         return -1;
     }
 
+    for(i = 0; i < CLIENT_DIR_SHARDS; ++i) {
+        pthread_rwlock_init(&dir_shards[i].lock, NULL);
+        memset(dir_shards[i].buckets, 0, sizeof(dir_shards[i].buckets));
+    }
+
     return 0;
 }
 
 /* Clean up the clients system. */
 void client_shutdown(void) {
-    pthread_key_delete(recvbuf_key);
+    int i;
+
     pthread_key_delete(sendbuf_key);
+    pthread_key_delete(bcastbuf_key);
+
+    for(i = 0; i < CLIENT_DIR_SHARDS; ++i) {
+        pthread_rwlock_destroy(&dir_shards[i].lock);
+    }
+}
+
+/* Spread guildcards (which are mostly handed out sequentially) over the shards
+   and buckets. The high bits of the product are the best mixed, so those pick
+   the shard, and some from the middle pick the bucket. */
+static inline uint32_t dir_hash(uint32_t gc) {
+    return gc * 2654435761U;
+}
+
+#define DIR_SHARD(h)    (&dir_shards[((h) >> 24) % CLIENT_DIR_SHARDS])
+#define DIR_BUCKET(h)   (((h) >> 8) % CLIENT_DIR_BUCKETS)
+
+/* Unlink the client from its bucket. The shard must be write locked. */
+static void dir_unlink(client_dir_shard_t *s, ship_client_t *c) {
+    ship_client_t **pp = &s->buckets[DIR_BUCKET(dir_hash(c->dir_gc))];
+
+    while(*pp) {
+        if(*pp == c) {
+            *pp = c->dir_next;
+            break;
+        }
+
+        pp = &(*pp)->dir_next;
+    }
+
+    c->dir_next = NULL;
+    c->dir_listed = 0;
+    __atomic_sub_fetch(&client_dir_count, 1, __ATOMIC_RELAXED);
+}
+
+void client_dir_add(ship_client_t *c) {
+    uint32_t h = dir_hash(c->guildcard);
+    client_dir_shard_t *s = DIR_SHARD(h), *old;
+
+    if(c->dir_listed) {
+        if(c->dir_gc == c->guildcard) {
+            return;
+        }
+
+        old = DIR_SHARD(dir_hash(c->dir_gc));
+        pthread_rwlock_wrlock(&old->lock);
+        dir_unlink(old, c);
+        pthread_rwlock_unlock(&old->lock);
+    }
+
+    pthread_rwlock_wrlock(&s->lock);
+    c->dir_gc = c->guildcard;
+    c->dir_next = s->buckets[DIR_BUCKET(h)];
+    s->buckets[DIR_BUCKET(h)] = c;
+    c->dir_listed = 1;
+    __atomic_add_fetch(&client_dir_count, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+void client_dir_remove(ship_client_t *c) {
+    client_dir_shard_t *s;
+
+    if(!c->dir_listed) {
+        return;
+    }
+
+    s = DIR_SHARD(dir_hash(c->dir_gc));
+    pthread_rwlock_wrlock(&s->lock);
+    dir_unlink(s, c);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+/* Walk a bucket chain from it onwards looking for a match. */
+static ship_client_t *dir_scan(ship_client_t *it, uint32_t gc, block_t *b) {
+    for(; it; it = it->dir_next) {
+        if(it->dir_gc == gc && (!b || it->cur_block == b)) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+ship_client_t *client_dir_get(uint32_t gc, block_t *b) {
+    uint32_t h = dir_hash(gc);
+    client_dir_shard_t *s = DIR_SHARD(h);
+    ship_client_t *it;
+
+    __atomic_add_fetch(&client_dir_lookups, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_rdlock(&s->lock);
+
+    if(!(it = dir_scan(s->buckets[DIR_BUCKET(h)], gc, b))) {
+        pthread_rwlock_unlock(&s->lock);
+    }
+
+    return it;
+}
+
+ship_client_t *client_dir_next(ship_client_t *c, block_t *b) {
+    return dir_scan(c->dir_next, c->dir_gc, b);
+}
+
+void client_dir_put(ship_client_t *c) {
+    pthread_rwlock_unlock(&DIR_SHARD(dir_hash(c->dir_gc))->lock);
+}
+
+/* Figure out when the client next needs attention (a ping, or a kick for being
+   quiet too long or not logging in after guildcard protection kicked in), and
+   set the timer for then. */
+static void client_timer_schedule(ship_client_t *c) {
+    timerwheel_t *tw = c->tw;
+    time_t next, tmp;
+
+    next = c->last_message + 121;
+    tmp = c->last_message + 61;
+
+    if(tmp < c->last_sent + 11) {
+        tmp = c->last_sent + 11;
+    }
+
+    if(tmp < next) {
+        next = tmp;
+    }
+
+    if((c->flags & CLIENT_FLAG_GC_PROTECT) && c->join_time + 61 < next) {
+        next = c->join_time + 61;
+    }
+
+    if(next < tw->now) {
+        next = tw->now;
+    }
+
+    timerwheel_schedule(tw, &c->timer, tw->now_ms + (next - tw->now) * 1000);
+}
+
+/* Timer callback for the client. Anything that has changed since the timer was
+   set (like hearing from the client) just pushes the timer back. */
+static void client_timer_fire(timerwheel_t *tw, tw_timer_t *t, void *d) {
+    ship_client_t *c = (ship_client_t *)d;
+    char nm[64];
+
+    /* Don't bother with anyone that's already on their way out. */
+    if(c->flags & CLIENT_FLAG_DISCONNECTED) {
+        return;
+    }
+
+    /* If we haven't heard from a client in 2 minutes, its dead. Disconnect
+       it. */
+    if(tw->now > c->last_message + 120) {
+        if(c->bb_pl) {
+            istrncpy16(ic_utf16_to_utf8, nm, &c->pl->bb.character.name[2], 64);
+            debug(DBG_LOG, "Ping Timeout: %s(%d)\n", nm, c->guildcard);
+        }
+        else if(c->pl) {
+            debug(DBG_LOG, "Ping Timeout: %s(%d)\n", c->pl->v1.name,
+                  c->guildcard);
+        }
+
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        return;
+    }
+    /* Otherwise, if we haven't heard from them in a minute, ping it. */
+    else if(tw->now > c->last_message + 60 && tw->now > c->last_sent + 10) {
+        if(send_simple(c, PING_TYPE, 0)) {
+            c->flags |= CLIENT_FLAG_DISCONNECTED;
+            return;
+        }
+
+        c->last_sent = tw->now;
+    }
+
+    /* If they've been backed up for too long, give up on them. */
+    if(client_sendq_update(c)) {
+        return;
+    }
+
+    /* Check if their timeout expired to login after getting a protection
+       message. */
+    if((c->flags & CLIENT_FLAG_GC_PROTECT) && c->join_time + 60 < tw->now) {
+        c->flags |= CLIENT_FLAG_DISCONNECTED;
+        return;
+    }
+
+    client_timer_schedule(c);
 }
 
 /* Create a new connection, storing it in the list of clients. */
 ship_client_t *client_create_connection(int sock, int version, int type,
                                         struct client_queue *clients,
                                         ship_t *ship, block_t *block,
+                                        evloop_t *evl, timerwheel_t *tw,
                                         struct sockaddr *ip, socklen_t size) {
     ship_client_t *rv = (ship_client_t *)malloc(sizeof(ship_client_t));
     uint32_t client_seed_dc, server_seed_dc;
@@ -159,6 +373,8 @@ ship_client_t *client_create_connection(int sock, int version, int type,
     rv->arrow = 1;
     rv->last_message = rv->login_time = time(NULL);
     rv->hdr_size = 4;
+    ringbuf_init(&rv->sendbuf, client_sendbuf_max);
+    ringbuf_account(&rv->sendbuf, &client_sendq_total);
 
     /* Create the mutex */
     pthread_mutexattr_init(&attr);
@@ -181,7 +397,23 @@ ship_client_t *client_create_connection(int sock, int version, int type,
         rng = &ship->rng;
     }
     else {
-        rng = &block->rng;
+        rng = block_rng(block);
+
+        /* Block clients are only ever accepted by the worker that will be
+           servicing them. */
+        rv->worker = block_current_worker();
+    }
+
+    rv->evl = evl;
+    rv->tw = tw;
+    rxbuf_init(&rv->recvbuf, rv->worker ? &rv->worker->rx : NULL);
+
+    /* Register the socket with the event loop once, right here, so that the
+       welcome packet can be queued if the socket isn't ready for it. */
+    if(evloop_set_nonblock(sock) ||
+       evloop_add(rv->evl, sock, EVLOOP_READ | EVLOOP_EDGE, rv)) {
+        rv->evl = NULL;
+        goto err;
     }
 
 #ifdef HAVE_PYTHON
@@ -261,6 +493,11 @@ ship_client_t *client_create_connection(int sock, int version, int type,
             break;
     }
 
+    /* Start keeping track of when we need to ping the client. */
+    timerwheel_timer_init(&rv->timer, &client_timer_fire, rv);
+    timerwheel_timer_init(&rv->pos_timer, &subcmd_pos_timer, rv);
+    client_timer_schedule(rv);
+
     /* Insert it at the end of our list, and we're done. */
     if(type == CLIENT_TYPE_BLOCK) {
         pthread_rwlock_wrlock(&block->lock);
@@ -277,6 +514,10 @@ ship_client_t *client_create_connection(int sock, int version, int type,
     return rv;
 
 err:
+    if(rv->evl) {
+        evloop_del(rv->evl, sock);
+    }
+
     close(sock);
 
     if(type == CLIENT_TYPE_BLOCK) {
@@ -290,6 +531,8 @@ err:
 #endif
 
     pthread_mutex_destroy(&rv->mutex);
+    block_cork_drop(rv);
+    ringbuf_destroy(&rv->sendbuf);
 
     free(rv);
     return NULL;
@@ -302,15 +545,17 @@ void client_destroy_connection(ship_client_t *c,
     time_t now = time(NULL);
     char tstr[26];
 
+    client_dir_remove(c);
+    pllist_remove(c);
     TAILQ_REMOVE(clients, c, qentry);
 
     /* If the client was on Blue Burst, update their db character */
     if(c->version == CLIENT_VERSION_BB &&
        !(c->flags & CLIENT_FLAG_TYPE_SHIP)) {
         c->bb_pl->character.play_time += now - c->login_time;
-        shipgate_send_cdata(&ship->sg, c->guildcard, c->sec_data.slot,
-                            c->bb_pl, sizeof(sylverant_bb_db_char_t),
-                            c->cur_block->b);
+        save_cache_put(&ship->sg, c->guildcard, c->sec_data.slot,
+                       c->bb_pl, sizeof(sylverant_bb_db_char_t),
+                       c->cur_block->b);
         shipgate_send_bb_opts(&ship->sg, c);
     }
 
@@ -350,17 +595,17 @@ void client_destroy_connection(ship_client_t *c,
         fclose(c->logfile);
     }
 
+    timerwheel_cancel(c->tw, &c->timer);
+    timerwheel_cancel(c->tw, &c->pos_timer);
+    block_cork_flush(c);
+
     if(c->sock >= 0) {
+        evloop_del(c->evl, c->sock);
         close(c->sock);
     }
 
-    if(c->recvbuf) {
-        free(c->recvbuf);
-    }
-
-    if(c->sendbuf) {
-        free(c->sendbuf);
-    }
+    rxbuf_destroy(&c->recvbuf);
+    ringbuf_destroy(&c->sendbuf);
 
     if(c->autoreply) {
         free(c->autoreply);
@@ -396,30 +641,65 @@ void client_destroy_connection(ship_client_t *c,
     free(c);
 }
 
+/* Figure out how long a packet is from its (decrypted) header, rounded up to
+   a multiple of 8 or 4 bytes (depending on the type of the client), since
+   that's how much will actually be sent. Returns 0 for unknown versions. */
+static size_t client_pkt_size(ship_client_t *c, const uint8_t *hdr) {
+    const pkt_header_t *pkt = (const pkt_header_t *)hdr;
+    size_t hsz = (size_t)c->hdr_size, sz;
+
+    switch(c->version) {
+        case CLIENT_VERSION_DCV1:
+        case CLIENT_VERSION_DCV2:
+        case CLIENT_VERSION_GC:
+        case CLIENT_VERSION_EP3:
+            sz = LE16(pkt->dc.pkt_len);
+            break;
+
+        case CLIENT_VERSION_PC:
+            sz = LE16(pkt->pc.pkt_len);
+            break;
+
+        case CLIENT_VERSION_BB:
+            sz = LE16(pkt->bb.pkt_len);
+            break;
+
+        default:
+            return 0;
+    }
+
+    return (sz + hsz - 1) & ~(hsz - 1);
+}
+
 /* Read data from a client that is connected to any port. */
 int client_process_pkt(ship_client_t *c) {
     ssize_t sz;
-    uint16_t pkt_sz;
+    size_t pkt_sz, need, avail;
     int rv = 0;
-    unsigned char *rbp;
-    void *tmp;
-    uint8_t *recvbuf = get_recvbuf();
+    uint8_t *rbp;
     int hsz = c->hdr_size;
 
-    /* Make sure we got the recvbuf, otherwise, bail. */
-    if(!recvbuf) {
-        return -1;
+    /* Make sure there's room for the rest of the packet we're in the middle of
+       (if we know how big it is yet). */
+    need = hsz;
+
+    if(c->flags & CLIENT_FLAG_HDR_READ) {
+        need = client_pkt_size(c, rxbuf_data(&c->recvbuf));
     }
 
-    /* If we've got anything buffered, copy it out to the main buffer to make
-       the rest of this a bit easier. */
-    if(c->recvbuf_cur) {
-        memcpy(recvbuf, c->recvbuf, c->recvbuf_cur);
+    if(!(rbp = rxbuf_space(&c->recvbuf, need, &avail))) {
+        perror("malloc");
+        return -1;
     }
 
     /* Attempt to read, and if we don't get anything, punt. */
-    if((sz = recv(c->sock, recvbuf + c->recvbuf_cur, 65536 - c->recvbuf_cur,
-                  0)) <= 0) {
+    if((sz = recv(c->sock, rbp, avail, 0)) <= 0) {
+        /* The socket is non-blocking, so this just means we've drained it. */
+        if(sz == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINTR)) {
+            return 1;
+        }
+
         if(sz == -1) {
             perror("recv");
         }
@@ -427,129 +707,226 @@ int client_process_pkt(ship_client_t *c) {
         return -1;
     }
 
-    sz += c->recvbuf_cur;
-    c->recvbuf_cur = 0;
-    rbp = recvbuf;
+    rxbuf_commit(&c->recvbuf, (size_t)sz);
+
+    /* As long as what we have is long enough, decrypt it. Everything is done
+       right in the client's buffer, without copying it anywhere else. */
+    while(c->recvbuf.len >= (size_t)hsz && rv == 0) {
+        rbp = rxbuf_data(&c->recvbuf);
 
-    /* As long as what we have is long enough, decrypt it. */
-    while(sz >= hsz && rv == 0) {
         /* Decrypt the packet header so we know what exactly we're looking
            for, in terms of packet length. */
         if(!(c->flags & CLIENT_FLAG_HDR_READ)) {
-            memcpy(&c->pkt, rbp, hsz);
-            CRYPT_CryptData(&c->ckey, &c->pkt, hsz, 0);
+            CRYPT_CryptData(&c->ckey, rbp, hsz, 0);
             c->flags |= CLIENT_FLAG_HDR_READ;
         }
 
         /* Read the packet size to see how much we're expecting. */
-        switch(c->version) {
-            case CLIENT_VERSION_DCV1:
-            case CLIENT_VERSION_DCV2:
-            case CLIENT_VERSION_GC:
-            case CLIENT_VERSION_EP3:
-                pkt_sz = LE16(c->pkt.dc.pkt_len);
-                break;
-
-            case CLIENT_VERSION_PC:
-                pkt_sz = LE16(c->pkt.pc.pkt_len);
-                break;
-
-            case CLIENT_VERSION_BB:
-                pkt_sz = LE16(c->pkt.bb.pkt_len);
-                break;
-
-            default:
-                return -1;
+        if((pkt_sz = client_pkt_size(c, rbp)) < (size_t)hsz) {
+            return -1;
         }
 
-        /* We'll always need a multiple of 8 or 4 (depending on the type of
-           the client) bytes. */
-        if(pkt_sz & (hsz - 1)) {
-            pkt_sz = (pkt_sz & (0x10000 - hsz)) + hsz;
+        /* Do we have the whole packet? If not, wait for the rest of it. */
+        if(c->recvbuf.len < pkt_sz) {
+            break;
+        }
+
+        /* Yes, we do, decrypt it. */
+        CRYPT_CryptData(&c->ckey, rbp + hsz, pkt_sz - hsz, 0);
+        c->last_message = c->tw->now;
+
+        if(c->recvbuf.stats) {
+            ++c->recvbuf.stats->pkts;
         }
 
-        /* Do we have the whole packet? */
-        if(sz >= (ssize_t)pkt_sz) {
-            /* Yes, we do, decrypt it. */
-            CRYPT_CryptData(&c->ckey, rbp + hsz, pkt_sz - hsz, 0);
-            memcpy(rbp, &c->pkt, hsz);
-            c->last_message = time(NULL);
+        /* If we're logging the client, write into the log. Logging gets
+           turned on and off from other threads, so check again with the lock
+           held. */
+        if(c->logfile) {
+            pthread_mutex_lock(&c->mutex);
 
-            /* If we're logging the client, write into the log */
             if(c->logfile) {
                 fprint_packet(c->logfile, rbp, pkt_sz, 1);
             }
 
-            /* Pass it onto the correct handler. */
-            if(c->flags & CLIENT_FLAG_TYPE_SHIP) {
-                rv = ship_process_pkt(c, rbp);
-            }
-            else {
-                rv = block_process_pkt(c, rbp);
-            }
-
-            rbp += pkt_sz;
-            sz -= pkt_sz;
+            pthread_mutex_unlock(&c->mutex);
+        }
 
-            c->flags &= ~CLIENT_FLAG_HDR_READ;
+        /* Pass it onto the correct handler. */
+        if(c->flags & CLIENT_FLAG_TYPE_SHIP) {
+            rv = ship_process_pkt(c, rbp);
         }
         else {
-            /* Nope, we're missing part, break out of the loop, and buffer
-               the remaining data. */
-            break;
+            rv = block_process_pkt(c, rbp);
         }
+
+        rxbuf_consume(&c->recvbuf, pkt_sz);
+        c->flags &= ~CLIENT_FLAG_HDR_READ;
     }
 
-    /* If we've still got something left here, buffer it for the next pass. */
-    if(sz && rv == 0) {
-        /* Reallocate the recvbuf for the client if its too small. */
-        if(c->recvbuf_size < sz) {
-            tmp = realloc(c->recvbuf, sz);
+    return rv ? -1 : 0;
+}
 
-            if(!tmp) {
-                perror("realloc");
-                return -1;
-            }
+/* Turn interest in writability on/off for the client's socket. */
+void client_want_write(ship_client_t *c, int on) {
+    uint32_t ev = EVLOOP_READ | EVLOOP_EDGE;
 
-            c->recvbuf = (unsigned char *)tmp;
-            c->recvbuf_size = sz;
-        }
+    if(on) {
+        ev |= EVLOOP_WRITE;
+    }
 
-        memcpy(c->recvbuf, rbp, sz);
-        c->recvbuf_cur = sz;
+    if(c->evl && c->sock >= 0) {
+        evloop_mod(c->evl, c->sock, ev);
     }
-    else if(c->recvbuf) {
-        /* Free the buffer, if we've got nothing in it. */
-        free(c->recvbuf);
-        c->recvbuf = NULL;
-        c->recvbuf_size = 0;
+
+    c->write_armed = on;
+}
+
+/* Send as much of the client's queued outbound data as the socket will take. */
+int client_flush(ship_client_t *c) {
+    block_worker_t *w = block_current_worker();
+    int rv = ringbuf_write(&c->sendbuf, c->sock);
+
+    if(w && w == c->worker) {
+        ++w->sends;
     }
 
-    return rv;
+    if(rv < 0) {
+        return -1;
+    }
+
+    /* If we've sent everything, stop waiting to be able to write. The buffer
+       itself stays around for next time. */
+    if(!rv) {
+        client_want_write(c, 0);
+    }
+
+    return client_sendq_update(c);
 }
 
-/* Retrieve the thread-specific recvbuf for the current thread. */
-uint8_t *get_recvbuf(void) {
-    uint8_t *recvbuf = (uint8_t *)pthread_getspecific(recvbuf_key);
+int client_sendq_update(ship_client_t *c) {
+    size_t len = c->sendbuf.len, low = client_sendbuf_high / 2, total;
+    char nm[64];
 
-    /* If we haven't initialized the recvbuf pointer yet for this thread, then
-       we need to do that now. */
-    if(!recvbuf) {
-        recvbuf = (uint8_t *)malloc(65536);
+    if(len > c->sendq_peak) {
+        c->sendq_peak = len;
+    }
 
-        if(!recvbuf) {
-            perror("malloc");
-            return NULL;
+    if(!c->sendq_congested) {
+        /* Past the high watermark, or past the low one while everyone put
+           together is over the global budget? */
+        total = __atomic_load_n(&client_sendq_total, __ATOMIC_RELAXED);
+
+        if(len > client_sendbuf_high ||
+           (client_sendbuf_total && total > client_sendbuf_total && len > low)) {
+            __atomic_store_n(&c->sendq_congested, 1, __ATOMIC_RELAXED);
+            c->sendq_since = c->tw->now;
+            ++c->sendq_congestions;
         }
 
-        if(pthread_setspecific(recvbuf_key, recvbuf)) {
-            perror("pthread_setspecific");
-            free(recvbuf);
-            return NULL;
+        return 0;
+    }
+
+    if(len <= low) {
+        __atomic_store_n(&c->sendq_congested, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if(c->tw->now - c->sendq_since <= client_sendbuf_stall) {
+        return 0;
+    }
+
+    if(c->bb_pl) {
+        istrncpy16(ic_utf16_to_utf8, nm, &c->pl->bb.character.name[2], 64);
+        debug(DBG_LOG, "Send queue stalled: %s(%d)\n", nm, c->guildcard);
+    }
+    else if(c->pl) {
+        debug(DBG_LOG, "Send queue stalled: %s(%d)\n", c->pl->v1.name,
+              c->guildcard);
+    }
+
+    c->flags |= CLIENT_FLAG_DISCONNECTED;
+    return -1;
+}
+
+/* Mark a client to be disconnected. */
+void client_kick(ship_client_t *c) {
+    block_worker_t *w = c->worker;
+
+    /* If someone other than the client's worker is doing the kicking, let the
+       worker do it, so that anything sent to the client from here (like a
+       message saying why they're being kicked) gets to go out first. */
+    if(w && w != block_current_worker() &&
+       !block_post(w, c, BLOCK_MSG_DISCONNECT, NULL, 0)) {
+        return;
+    }
+
+    c->flags |= CLIENT_FLAG_DISCONNECTED;
+}
+
+void client_set_char_data(ship_client_t *c, const void *data, int len) {
+    block_worker_t *w = c->worker;
+    int i;
+
+    /* Only the worker gets to touch the character while the client is in the
+       middle of playing. */
+    if(w && w != block_current_worker() &&
+       !block_post(w, c, BLOCK_MSG_CHAR_DATA, data, len)) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+
+    if(!c->bb_pl && c->pl) {
+        /* Overwrite their data, and send the refresh packet. */
+        memcpy(c->pl, data, len);
+        send_lobby_join(c, c->cur_lobby);
+    }
+    else if(c->bb_pl) {
+        memcpy(c->bb_pl, data, len);
+
+        /* Clear the item ids from the inventory. */
+        for(i = 0; i < 30; ++i) {
+            c->bb_pl->inv.items[i].item_id = 0xFFFFFFFF;
         }
     }
 
-    return recvbuf;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void client_gm_login(ship_client_t *c, uint8_t priv, int ok) {
+    block_worker_t *w = c->worker;
+
+    if(w && w != block_current_worker() &&
+       !block_post(w, c, BLOCK_MSG_GM_LOGIN, &priv, ok ? 1 : 0)) {
+        return;
+    }
+
+    if(ok) {
+        c->privilege |= priv;
+        c->flags |= CLIENT_FLAG_LOGGED_IN;
+        c->flags &= ~CLIENT_FLAG_GC_PROTECT;
+        send_txt(c, "%s", __(c, "\tE\tC7Login Successful."));
+    }
+    else {
+        /* XXXX: Maybe send specific error messages sometime later */
+        send_txt(c, "%s", __(c, "\tE\tC7Login failed."));
+    }
+}
+
+void client_set_stfu(ship_client_t *c, int on) {
+    block_worker_t *w = c->worker;
+    uint8_t v = (uint8_t)on;
+
+    if(w && w != block_current_worker() &&
+       !block_post(w, c, BLOCK_MSG_STFU, &v, 1)) {
+        return;
+    }
+
+    if(on)
+        c->flags |= CLIENT_FLAG_STFU;
+    else
+        c->flags &= ~CLIENT_FLAG_STFU;
 }
 
 /* Set up a simple mail autoreply. */
@@ -731,6 +1108,8 @@ int client_give_exp(ship_client_t *c, uint32_t exp) {
     /* If they got any level ups, send out the packet that says so. */
     if(need_lvlup) {
         c->bb_pl->character.level = LE32(level);
+        pllist_update(c);
+
         if(subcmd_send_bb_level(c))
             return -1;
     }
@@ -767,6 +1146,8 @@ int client_give_level(ship_client_t *c, uint32_t level_req) {
 
     /* Send the level-up packet. */
     c->bb_pl->character.level = LE32(level_req);
+    pllist_update(c);
+
     if(subcmd_send_bb_level(c))
         return -1;
 
@@ -42,6 +42,9 @@
 #include "ship.h"
 #include "block.h"
 #include "player.h"
+#include "timerwheel.h"
+#include "ringbuf.h"
+#include "rxbuf.h"
 
 /* Pull in the packet header types. */
 #define PACKETS_H_HEADERS_ONLY
@@ -80,8 +83,10 @@ typedef struct bb_security_data {
 struct ship_client {
     TAILQ_ENTRY(ship_client) qentry;
 
+    /* Only held while changing (or reading from another thread) the player
+       data and logging state. Everything else about a block client belongs to
+       the worker servicing it; see block_post(). */
     pthread_mutex_t mutex;
-    pkt_header_t pkt;
 
     CRYPT_SETUP ckey;
     CRYPT_SETUP skey;
@@ -93,12 +98,7 @@ struct ship_client {
 
     int language_code;
     int cur_area;
-    int recvbuf_cur;
-    int recvbuf_size;
 
-    int sendbuf_cur;
-    int sendbuf_size;
-    int sendbuf_start;
     int item_count;
 
     int autoreply_len;
@@ -135,10 +135,13 @@ struct ship_client {
 
     block_t *cur_block;
     lobby_t *cur_lobby;
+    evloop_t *evl;
+    timerwheel_t *tw;
+    block_worker_t *worker;             /* Owning worker (block clients) */
     player_t *pl;
 
-    unsigned char *recvbuf;
-    unsigned char *sendbuf;
+    rxbuf_t recvbuf;
+    ringbuf_t sendbuf;
     void *autoreply;
     FILE *logfile;
 
@@ -155,6 +158,44 @@ struct ship_client {
     time_t join_time;
     time_t login_time;
 
+    /* Corked output waiting for the end of the worker's pass. */
+    TAILQ_ENTRY(ship_client) cork_qentry;
+    int corked;
+    int write_armed;
+    uint64_t cork_time;
+
+    /* Send queue congestion, maintained by client_sendq_update(). Only the
+       thread that owns the client changes these, except for sendq_drops. */
+    int sendq_congested;
+    time_t sendq_since;
+    size_t sendq_peak;
+    uint32_t sendq_congestions;
+    uint32_t sendq_drops;
+
+    /* Fires when the client next needs a ping, or needs to be kicked. Belongs
+       to the timer wheel of the thread that services the client. */
+    tw_timer_t timer;
+
+    /* The client's latest movement subcommand, held back until the end of the
+       lobby tick (pos_pending is 1 for a DC header, 2 for a BB one). */
+    tw_timer_t pos_timer;
+    int pos_pending;
+    uint8_t pos_pkt[64];
+
+    /* Guildcard directory linkage; see client_dir_add(). dir_gc is the
+       guildcard the client is filed under, which only changes with the
+       directory's lock held. */
+    struct ship_client *dir_next;
+    uint32_t dir_gc;
+    int dir_listed;
+
+    /* Where the client is filed in the /list index, and the results of the
+       last search it did (for paging through them). See list.c. */
+    int pllist_listed;
+    int pllist_class;
+    int pllist_level;
+    struct pllist_snap *pllist_snap;
+
     bb_security_data_t sec_data;
     sylverant_bb_db_char_t *bb_pl;
     sylverant_bb_db_opts_t *bb_opts;
@@ -201,12 +242,12 @@ typedef struct ship_client ship_client_t;
 
 TAILQ_HEAD(client_queue, ship_client);
 
-/* The key for accessing our thread-specific receive buffer. */
-extern pthread_key_t recvbuf_key;
-
 /* The key used for the thread-specific send buffer. */
 extern pthread_key_t sendbuf_key;
 
+/* The key used for the thread-specific broadcast rendering buffer. */
+extern pthread_key_t bcastbuf_key;
+
 /* Possible values for the type field of ship_client_t */
 #define CLIENT_TYPE_SHIP        0
 #define CLIENT_TYPE_BLOCK       1
@@ -275,16 +316,86 @@ void client_shutdown(void);
 ship_client_t *client_create_connection(int sock, int version, int type,
                                         struct client_queue *clients,
                                         ship_t *ship, block_t *block,
+                                        evloop_t *evl, timerwheel_t *tw,
                                         struct sockaddr *ip, socklen_t size);
 
 /* Destroy a connection, closing the socket and removing it from the list. */
 void client_destroy_connection(ship_client_t *c, struct client_queue *clients);
 
-/* Read data from a client that is connected to any port. */
+/* Read data from a client that is connected to any port. Returns 0 if data was
+   read and processed, 1 if there was nothing to read right now, and a negative
+   value if the client should be disconnected. */
 int client_process_pkt(ship_client_t *c);
 
-/* Retrieve the thread-specific recvbuf for the current thread. */
-uint8_t *get_recvbuf(void);
+/* Send as much of the client's queued outbound data as the socket will take.
+   Returns -1 if the client should be disconnected. */
+int client_flush(ship_client_t *c);
+
+/* Turn interest in writability on/off for the client's socket. */
+void client_want_write(ship_client_t *c, int on);
+
+/* Recheck whether the client's send queue is congested, after it has grown or
+   shrunk. Must be called by the thread that owns the client. Returns -1 (and
+   marks the client to be disconnected) if it has been congested for too long. */
+int client_sendq_update(ship_client_t *c);
+
+/* Is the client backed up enough that low priority packets should be skipped?
+   Safe to call from any thread. */
+#define client_sendq_congested(c) \
+    __atomic_load_n(&(c)->sendq_congested, __ATOMIC_RELAXED)
+
+/* Total amount of data queued up to be sent to all clients. */
+extern size_t client_sendq_total;
+
+/* Mark a client to be disconnected. Safe to call from any thread (with the
+   same locking rules as block_post()). */
+void client_kick(ship_client_t *c);
+
+/* Replace a client's character with one from the shipgate, and show the
+   client the new one. Safe to call from any thread (same rules again), since
+   it's handed off to the client's worker if need be. */
+void client_set_char_data(ship_client_t *c, const void *data, int len);
+
+/* Finish off a GM login the shipgate has answered. Safe to call from any
+   thread, like the above. */
+void client_gm_login(ship_client_t *c, uint8_t priv, int ok);
+
+/* Turn a client's STFU flag on or off. Safe to call from any thread, again. */
+void client_set_stfu(ship_client_t *c, int on);
+
+/* The guildcard directory maps a guildcard to the block client logged in with
+   it, so that looking someone up doesn't mean walking every block's client list
+   with its lock held. It is split into shards, each with its own lock, so the
+   only thing a lookup ever contends with is a login or disconnect that happens
+   to land in the same shard. */
+#define CLIENT_DIR_SHARDS       64
+#define CLIENT_DIR_BUCKETS      256     /* Per shard */
+
+/* File the client under its current guildcard (moving it if it was filed
+   under a different one). Don't hold the client's mutex while calling this. */
+void client_dir_add(ship_client_t *c);
+
+/* Take the client out of the directory, waiting for anyone that has it looked
+   up to be done with it. Safe to call if it isn't listed. */
+void client_dir_remove(ship_client_t *c);
+
+/* Look up the block client logged in with the given guildcard (on block b, or
+   on any block if b is NULL). If one is found, its shard of the directory is
+   left read locked, so the client can't be destroyed until it is handed back
+   with client_dir_put(). While holding it, it is safe to use block_post() (and
+   so client_kick() and friends) on the client and to lock its mutex, but not to
+   take any block's client lock. */
+ship_client_t *client_dir_get(uint32_t gc, block_t *b);
+void client_dir_put(ship_client_t *c);
+
+/* Find the next client after c with the same guildcard (on block b, or any if
+   b is NULL), for the rare case of someone being logged in more than once. The
+   client returned by client_dir_get() must still be held. */
+ship_client_t *client_dir_next(ship_client_t *c, block_t *b);
+
+/* Directory statistics. */
+extern int client_dir_count;
+extern uint64_t client_dir_lookups;
 
 /* Set up a simple mail autoreply. */
 int client_set_autoreply(ship_client_t *c, void *buf, uint16_t len);
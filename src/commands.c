@@ -33,6 +33,7 @@
 #include "subcmd.h"
 #include "utils.h"
 #include "shipgate.h"
+#include "savecache.h"
 #include "items.h"
 #include "bans.h"
 #include "admin.h"
@@ -285,8 +286,8 @@ static int handle_save(ship_client_t *c, const char *params) {
     slot += 4;
 
     /* Send the character data to the shipgate */
-    if(shipgate_send_cdata(&ship->sg, c->guildcard, slot, c->pl, 1052,
-                           c->cur_block->b)) {
+    if(save_cache_put(&ship->sg, c->guildcard, slot, c->pl, 1052,
+                      c->cur_block->b)) {
         /* Send a message saying we couldn't save */
         return send_txt(c, "%s", __(c, "\tE\tC7Couldn't save character data."));
     }
@@ -342,7 +343,10 @@ static int handle_restore(ship_client_t *c, const char *params) {
 /* Usage: /bstat */
 static int handle_bstat(ship_client_t *c, const char *params) {
     block_t *b = c->cur_block;
-    int games, players;
+    block_worker_t *w;
+    int games, players, i, len;
+    uint64_t sent;
+    char str[2048];
 
     /* Grab the stats from the block structure */
     pthread_rwlock_rdlock(&b->lobby_lock);
@@ -353,9 +357,137 @@ static int handle_bstat(ship_client_t *c, const char *params) {
     players = b->num_clients;
     pthread_rwlock_unlock(&b->lock);
 
-    /* Fill in the string. */
-    return send_txt(c, "\tE\tC7BLOCK%02d:\n%d %s\n%d %s", b->b, players,
-                    __(c, "Users"), games, __(c, "Teams"));
+    /* Non-GMs just get the basics. */
+    if(!LOCAL_GM(c)) {
+        return send_txt(c, "\tE\tC7BLOCK%02d:\n%d %s\n%d %s", b->b, players,
+                        __(c, "Users"), games, __(c, "Teams"));
+    }
+
+    /* GMs get to see how the load is spread between the workers and how the
+       timers are doing too (clients/accepted/events, then timers fired and
+       average/max firing latency, then send calls and corked flushes with the
+       average bytes per flush, and requests delivered through the mailbox
+       from other threads, then packets received, partial packets moved with
+       the bytes moved, and receive buffer allocations). These counters are
+       only ever touched by their own worker, so a slightly stale read here is
+       fine. Last comes the total queued up to send to every client. Before
+       all that are the number of lobby lookups by ID, and how many of them
+       had to retry because the lobby index changed under them, then the
+       number of game list requests and how many of those had to render the
+       list again, then how many games were created with a recycled lobby, how
+       many needed a new one, and how many lobbies are in the pool now. The
+       GD line is ship-wide: clients in the guildcard directory and lookups
+       done on it. So is the QC line: quests kept ready to send and the KiB
+       they take up, then how many sends used one, how many had to read the
+       files in and how many of those couldn't be kept for lack of room. */
+    len = snprintf(str, sizeof(str), "\tE\tC7BLOCK%02d:\n%d %s\n%d %s\n"
+                   "L: %llu/%llu GL: %llu/%llu\nLP: %llu/%llu %d "
+                   "GD: %d/%llu\nQC: %d/%lluKiB %llu/%llu/%llu", b->b,
+                   players, __(c, "Users"),
+                   games, __(c, "Teams"),
+                   (unsigned long long)__atomic_load_n(&b->lobby_lookups,
+                                                       __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(&b->lobby_retries,
+                                                       __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(&b->game_list_reqs,
+                                                       __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(&b->game_list_builds,
+                                                       __ATOMIC_RELAXED),
+                   (unsigned long long)b->lobby_pool_hits,
+                   (unsigned long long)b->lobby_pool_misses,
+                   b->lobby_pool_count,
+                   __atomic_load_n(&client_dir_count, __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(&client_dir_lookups,
+                                                       __ATOMIC_RELAXED),
+                   __atomic_load_n(&quest_payload_stats.count,
+                                   __ATOMIC_RELAXED),
+                   (unsigned long long)(__atomic_load_n(
+                       &quest_payload_stats.bytes, __ATOMIC_RELAXED) >> 10),
+                   (unsigned long long)__atomic_load_n(
+                       &quest_payload_stats.hits, __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(
+                       &quest_payload_stats.misses, __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(
+                       &quest_payload_stats.uncached, __ATOMIC_RELAXED));
+
+    for(i = 0; i < b->num_workers && len < (int)sizeof(str); ++i) {
+        w = &b->workers[i];
+        len += snprintf(str + len, sizeof(str) - len,
+                        "\nW%d: %d/%llu/%llu T: %llu %llu/%llums", i,
+                        w->num_clients, (unsigned long long)w->accepted,
+                        (unsigned long long)w->events,
+                        (unsigned long long)w->tw.fired,
+                        (unsigned long long)(w->tw.fired ?
+                            w->tw.latency_total / w->tw.fired : 0),
+                        (unsigned long long)w->tw.latency_max);
+
+        if(len >= (int)sizeof(str)) {
+            break;
+        }
+
+        len += snprintf(str + len, sizeof(str) - len,
+                        "\n   S: %llu F: %llu %llub M: %llu",
+                        (unsigned long long)w->sends,
+                        (unsigned long long)w->flushes,
+                        (unsigned long long)(w->flushes ?
+                            w->flush_bytes / w->flushes : 0),
+                        (unsigned long long)w->delivered);
+
+        if(len >= (int)sizeof(str)) {
+            break;
+        }
+
+        len += snprintf(str + len, sizeof(str) - len,
+                        "\n   R: %llu C: %llu %llub A: %llu",
+                        (unsigned long long)w->rx.pkts,
+                        (unsigned long long)w->rx.copies,
+                        (unsigned long long)w->rx.copy_bytes,
+                        (unsigned long long)w->rx.allocs);
+    }
+
+    /* The shipgate connection has the same receive counters. */
+    if(len < (int)sizeof(str)) {
+        snprintf(str + len, sizeof(str) - len,
+                 "\nSG R: %llu C: %llu %llub A: %llu",
+                 (unsigned long long)ship->sg.rx.pkts,
+                 (unsigned long long)ship->sg.rx.copies,
+                 (unsigned long long)ship->sg.rx.copy_bytes,
+                 (unsigned long long)ship->sg.rx.allocs);
+        len += strlen(str + len);
+    }
+
+    /* Then what's waiting on the shipgate writer: packets and KiB queued,
+       packets sent and the TLS records they went out in, packets thrown away,
+       and the average/max time from being queued to being handed to the
+       socket. */
+    if(len < (int)sizeof(str)) {
+        sent = __atomic_load_n(&ship->sg.out_sent, __ATOMIC_RELAXED);
+        snprintf(str + len, sizeof(str) - len,
+                 "\nSG Q: %llu/%lluKiB S: %llu/%llu D: %llu %llu/%llums",
+                 (unsigned long long)__atomic_load_n(&ship->sg.out_pkts,
+                                                     __ATOMIC_RELAXED),
+                 (unsigned long long)(__atomic_load_n(&ship->sg.out_bytes,
+                                                      __ATOMIC_RELAXED) >> 10),
+                 (unsigned long long)sent,
+                 (unsigned long long)__atomic_load_n(&ship->sg.out_records,
+                                                     __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&ship->sg.out_drops,
+                                                     __ATOMIC_RELAXED),
+                 (unsigned long long)(sent ?
+                     __atomic_load_n(&ship->sg.out_lat_total,
+                                     __ATOMIC_RELAXED) / sent : 0),
+                 (unsigned long long)__atomic_load_n(&ship->sg.out_lat_max,
+                                                     __ATOMIC_RELAXED));
+        len += strlen(str + len);
+    }
+
+    if(len < (int)sizeof(str)) {
+        snprintf(str + len, sizeof(str) - len, "\nQ: %lluKiB",
+                 (unsigned long long)(__atomic_load_n(&client_sendq_total,
+                                                      __ATOMIC_RELAXED) >> 10));
+    }
+
+    return send_txt(c, "%s", str);
 }
 
 /* Usage /bcast message */
@@ -525,6 +657,7 @@ static int handle_passwd(ship_client_t *c, const char *params) {
 
     /* Copy the new password in. */
     strcpy(l->passwd, params);
+    block_game_list_changed(l->block);
 
     pthread_mutex_unlock(&l->mutex);
 
@@ -555,6 +688,7 @@ static int handle_lname(ship_client_t *c, const char *params) {
 
     /* Copy the new name in. */
     strcpy(l->name, params);
+    block_game_list_changed(l->block);
 
     pthread_mutex_unlock(&l->mutex);
 
@@ -615,11 +749,146 @@ static int handle_clinfo(ship_client_t *c, const char *params) {
         return send_txt(c, "%s", __(c, "\tE\tC7No such client."));
     }
 
-    /* Fill in the client's info. */
+    /* Fill in the client's info. The send queue is the current length, the
+       peak length, how many times it has been congested, and how many
+       position updates were skipped because of that. */
     my_ntop(&cl->ip_addr, ip);
-    return send_txt(c, "\tE\tC7Name: %s\nIP: %s\nGC: %u\n%s Lv.%d",
+    return send_txt(c, "\tE\tC7Name: %s\nIP: %s\nGC: %u\n%s Lv.%d\n"
+                    "Q: %lu/%luKiB C: %lu D: %lu",
                     cl->pl->v1.name, ip, cl->guildcard,
-                    classes[cl->pl->v1.ch_class], cl->pl->v1.level + 1);
+                    classes[cl->pl->v1.ch_class], cl->pl->v1.level + 1,
+                    (unsigned long)(cl->sendbuf.len >> 10),
+                    (unsigned long)(cl->sendq_peak >> 10),
+                    (unsigned long)cl->sendq_congestions,
+                    (unsigned long)cl->sendq_drops);
+}
+
+/* Usage /lstat */
+static int handle_lstat(ship_client_t *c, const char *params) {
+    lobby_t *l = c->cur_lobby;
+    uint32_t coalesced, queued, qbytes, bursts, max_pkts, max_bytes, sup, ovr;
+    uint64_t saved, ms_total, ms_max;
+    int players;
+
+    /* Make sure the requester is a GM. */
+    if(!LOCAL_GM(c)) {
+        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+    }
+
+    pthread_mutex_lock(&l->mutex);
+    players = l->num_clients;
+    coalesced = l->pos_coalesced;
+    saved = l->pos_saved;
+    queued = l->burst_pkts;
+    qbytes = l->burst_used;
+    bursts = l->bursts;
+    max_pkts = l->burst_max_pkts;
+    max_bytes = l->burst_max_bytes;
+    ms_total = l->burst_ms_total;
+    ms_max = l->burst_ms_max;
+    sup = l->burst_superseded;
+    ovr = l->burst_overflows;
+    pthread_mutex_unlock(&l->mutex);
+
+    /* Movement updates replaced by a later one in the same tick, and how many
+       packets that kept from being sent. Then the packets (and bytes) queued
+       for a burst right now, the number of bursts with the average/longest
+       time taken by one, the most packets (and bytes) queued in one, and the
+       movement packets replaced while queued and bursts cut short because the
+       queue filled up. */
+    return send_txt(c, "\tE\tC7%s:\n%d %s\nPos: %lu %s\n%llu %s\n"
+                    "BQ: %lu/%lub B: %lu %llu/%llums\nBM: %lu/%lub S: %lu "
+                    "O: %lu", l->name, players, __(c, "Users"),
+                    (unsigned long)coalesced, __(c, "coalesced"),
+                    (unsigned long long)saved, __(c, "packets saved"),
+                    (unsigned long)queued, (unsigned long)qbytes,
+                    (unsigned long)bursts,
+                    (unsigned long long)(bursts ? ms_total / bursts : 0),
+                    (unsigned long long)ms_max, (unsigned long)max_pkts,
+                    (unsigned long)max_bytes, (unsigned long)sup,
+                    (unsigned long)ovr);
+}
+
+/* Usage: /sgstat */
+static int handle_sgstat(ship_client_t *c, const char *params) {
+    shipgate_conn_t *sg = &ship->sg;
+    sg_req_stats_t st[SG_REQ_TYPES];
+    int i, j, len, pending, roster;
+    uint64_t answered;
+    char str[2048];
+
+    /* Make sure the requester is a GM. */
+    if(!LOCAL_GM(c)) {
+        return send_txt(c, "%s", __(c, "\tE\tC7Nice try."));
+    }
+
+    pthread_mutex_lock(&sg->req_lock);
+    pending = sg->req_count;
+    memcpy(st, sg->reqs, sizeof(st));
+    pthread_mutex_unlock(&sg->req_lock);
+
+    pthread_mutex_lock(&sg->roster_lock);
+    roster = sg->roster_count;
+    pthread_mutex_unlock(&sg->roster_lock);
+
+    /* First, how many times we've reconnected (and how many of those resumed
+       the old TLS session), how many attempts failed, how long the last and
+       longest reconnects took and how many packets were sent again on a new
+       connection. Then the number of clients in the roster, how many times the
+       client list has been sent from it and how many clients were in it last
+       time. Then the character saves waiting on the shipgate (and the KiB of
+       data in them), the size of the save journal, saves made, saves replaced
+       by a later one before they went out, saves confirmed, sent again and
+       given up on, and how long the oldest one has been waiting (and the
+       longest any has waited). Then, for each type of request: how many were
+       sent, answered, answered with a failure and timed out, how many answers
+       showed up after that, and the average/max time an answer took. Under
+       that is how many answers came in under 5, 10, 25, 50, 100, 250 and
+       1000ms, and then slower than that. */
+    len = snprintf(str, sizeof(str), "\tE\tC7C: %llu/%llu F: %llu %llu/%llums "
+                   "RP: %llu\nR: %d %llu/%d\nSV: %d/%lluKiB "
+                   "J: %lluKiB\n   %llu/%llu F: %llu R: %llu X: %llu "
+                   "%llu/%llums\n%s: %d",
+                   (unsigned long long)sg->reconnects,
+                   (unsigned long long)sg->resumed,
+                   (unsigned long long)sg->reconn_fails,
+                   (unsigned long long)sg->reconn_last,
+                   (unsigned long long)sg->reconn_max,
+                   (unsigned long long)sg->out_replayed, roster,
+                   (unsigned long long)sg->roster_syncs, sg->roster_last,
+                   save_cache_stats.count,
+                   (unsigned long long)(save_cache_stats.bytes >> 10),
+                   (unsigned long long)(save_cache_stats.journal_bytes >> 10),
+                   (unsigned long long)save_cache_stats.puts,
+                   (unsigned long long)save_cache_stats.coalesced,
+                   (unsigned long long)save_cache_stats.flushed,
+                   (unsigned long long)save_cache_stats.retries,
+                   (unsigned long long)save_cache_stats.dropped,
+                   (unsigned long long)save_cache_lag(),
+                   (unsigned long long)save_cache_stats.lag_max,
+                   __(c, "Pending"), pending);
+
+    for(i = 0; i < SG_REQ_TYPES && len < (int)sizeof(str); ++i) {
+        answered = st[i].done + st[i].failed;
+        len += snprintf(str + len, sizeof(str) - len,
+                        "\n%s: %llu/%llu/%llu T: %llu L: %llu %llu/%llums\n  ",
+                        shipgate_req_names[i],
+                        (unsigned long long)st[i].sent,
+                        (unsigned long long)st[i].done,
+                        (unsigned long long)st[i].failed,
+                        (unsigned long long)st[i].expired,
+                        (unsigned long long)st[i].late,
+                        (unsigned long long)(answered ?
+                            st[i].lat_total / answered : 0),
+                        (unsigned long long)st[i].lat_max);
+
+        for(j = 0; j < SG_REQ_HIST && len < (int)sizeof(str); ++j) {
+            len += snprintf(str + len, sizeof(str) - len, " %llu",
+                            (unsigned long long)st[i].hist[j]);
+        }
+    }
+
+    return send_txt(c, "%s", str);
 }
 
 /* Usage: /gban:d guildcard reason */
@@ -789,7 +1058,7 @@ static int handle_legit(ship_client_t *c, const char *params) {
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i]) {
             if(send_simple(l->clients[i], CHAR_DATA_REQUEST_TYPE, 0)) {
-                l->clients[i]->flags |= CLIENT_FLAG_DISCONNECTED;
+                client_kick(l->clients[i]);
             }
         }
     }
@@ -900,22 +1169,21 @@ static int handle_log(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and start the log */
-    TAILQ_FOREACH(i, b->clients, qentry) {
+    if((i = client_dir_get(gc, b))) {
         /* Start logging them if we find them */
-        if(i->guildcard == gc) {
-            rv = pkt_log_start(i);
+        rv = pkt_log_start(i);
+        client_dir_put(i);
 
-            if(!rv) {
-                return send_txt(c, "%s", __(c, "\tE\tC7Logging started."));
-            }
-            else if(rv == -1) {
-                return send_txt(c, "%s", __(c, "\tE\tC7The user is already\n"
-                                            "being logged."));
-            }
-            else if(rv == -2) {
-                return send_txt(c, "%s",
-                                __(c, "\tE\tC7Cannot create log file."));
-            }
+        if(!rv) {
+            return send_txt(c, "%s", __(c, "\tE\tC7Logging started."));
+        }
+        else if(rv == -1) {
+            return send_txt(c, "%s", __(c, "\tE\tC7The user is already\n"
+                                        "being logged."));
+        }
+        else if(rv == -2) {
+            return send_txt(c, "%s",
+                            __(c, "\tE\tC7Cannot create log file."));
         }
     }
 
@@ -945,18 +1213,17 @@ static int handle_endlog(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and end the log */
-    TAILQ_FOREACH(i, b->clients, qentry) {
+    if((i = client_dir_get(gc, b))) {
         /* Finish logging them if we find them */
-        if(i->guildcard == gc) {
-            rv = pkt_log_stop(i);
+        rv = pkt_log_stop(i);
+        client_dir_put(i);
 
-            if(!rv) {
-                return send_txt(c, "%s", __(c, "\tE\tC7Logging ended."));
-            }
-            else if(rv == -1) {
-                return send_txt(c, "%s", __(c,"\tE\tC7The user is not\n"
-                                            "being logged."));
-            }
+        if(!rv) {
+            return send_txt(c, "%s", __(c, "\tE\tC7Logging ended."));
+        }
+        else if(rv == -1) {
+            return send_txt(c, "%s", __(c,"\tE\tC7The user is not\n"
+                                        "being logged."));
         }
     }
 
@@ -1051,6 +1318,7 @@ static int handle_dconly(ship_client_t *c, const char *params) {
     /* See if we're turning the flag off. */
     if(!strcmp(params, "off")) {
         l->flags &= ~LOBBY_FLAG_DCONLY;
+        block_game_list_changed(l->block);
         pthread_mutex_unlock(&l->mutex);
         return send_txt(c, "%s", __(c, "\tE\tC7Dreamcast-only mode off."));
     }
@@ -1070,6 +1338,7 @@ static int handle_dconly(ship_client_t *c, const char *params) {
 
     /* We passed the check, set the flag and unlock the lobby. */
     l->flags |= LOBBY_FLAG_DCONLY;
+    block_game_list_changed(l->block);
     pthread_mutex_unlock(&l->mutex);
 
     /* Tell the leader that the command has been activated. */
@@ -1100,6 +1369,7 @@ static int handle_v1only(ship_client_t *c, const char *params) {
     /* See if we're turning the flag off. */
     if(!strcmp(params, "off")) {
         l->flags &= ~LOBBY_FLAG_V1ONLY;
+        block_game_list_changed(l->block);
         pthread_mutex_unlock(&l->mutex);
         return send_txt(c, "%s", __(c, "\tE\tC7V1-only mode off."));
     }
@@ -1118,6 +1388,7 @@ static int handle_v1only(ship_client_t *c, const char *params) {
 
     /* We passed the check, set the flag and unlock the lobby. */
     l->flags |= LOBBY_FLAG_V1ONLY;
+    block_game_list_changed(l->block);
     pthread_mutex_unlock(&l->mutex);
 
     /* Tell the leader that the command has been activated. */
@@ -1516,6 +1787,7 @@ static int handle_allowgc(ship_client_t *c, const char *params) {
     /* See if we're turning the flag off. */
     if(!strcmp(params, "off")) {
         l->flags &= ~LOBBY_FLAG_GC_ALLOWED;
+        block_game_list_changed(l->block);
         pthread_mutex_unlock(&l->mutex);
         return send_txt(c, "%s", __(c, "\tE\tC7Gamecube disallowed."));
     }
@@ -1529,6 +1801,7 @@ static int handle_allowgc(ship_client_t *c, const char *params) {
 
     /* We passed the check, set the flag and unlock the lobby. */
     l->flags |= LOBBY_FLAG_GC_ALLOWED;
+    block_game_list_changed(l->block);
     pthread_mutex_unlock(&l->mutex);
 
     /* Tell the leader that the command has been activated. */
@@ -1739,6 +2012,7 @@ static int handle_npc(ship_client_t *c, const char *params) {
 
     /* This command, for now anyway, locks us down to one player mode. */
     l->flags |= LOBBY_FLAG_SINGLEPLAYER;
+    block_game_list_changed(l->block);
 
     /* We're done with the lobby data now... */
     pthread_mutex_unlock(&l->mutex);
@@ -1782,11 +2056,14 @@ static int handle_stfu(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and STFU them (only on this block). */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc && i->privilege < c->privilege) {
-            i->flags |= CLIENT_FLAG_STFU;
+    if((i = client_dir_get(gc, b))) {
+        if(i->privilege < c->privilege) {
+            client_set_stfu(i, 1);
+            client_dir_put(i);
             return send_txt(c, "%s", __(c, "\tE\tC7Client STFUed."));
         }
+
+        client_dir_put(i);
     }
 
     /* The person isn't here... There's nothing left to do. */
@@ -1814,11 +2091,10 @@ static int handle_unstfu(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and un-STFU them (only on this block). */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            i->flags &= ~CLIENT_FLAG_STFU;
-            return send_txt(c, "%s", __(c, "\tE\tC7Client un-STFUed."));
-        }
+    if((i = client_dir_get(gc, b))) {
+        client_set_stfu(i, 0);
+        client_dir_put(i);
+        return send_txt(c, "%s", __(c, "\tE\tC7Client un-STFUed."));
     }
 
     /* The person isn't here... There's nothing left to do. */
@@ -1921,10 +2197,8 @@ static int handle_gameevent(ship_client_t *c, const char *params) {
 /* Usage: /ban:d guildcard reason */
 static int handle_ban_d(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
-    ship_client_t *i;
+    ship_client_t *i, *first;
     char *reason;
-    int j;
 
     /* Make sure the requester is a local GM. */
     if(!LOCAL_GM(c)) {
@@ -1946,33 +2220,26 @@ static int handle_ban_d(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 day"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 day"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+    if((first = client_dir_get(gc, NULL))) {
+        for(i = first; i; i = client_dir_next(i, NULL)) {
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 day"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 day"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            client_kick(i);
         }
+
+        client_dir_put(first);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -1981,10 +2248,8 @@ static int handle_ban_d(ship_client_t *c, const char *params) {
 /* Usage: /ban:w guildcard reason */
 static int handle_ban_w(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
-    ship_client_t *i;
+    ship_client_t *i, *first;
     char *reason;
-    int j;
 
     /* Make sure the requester is a local GM. */
     if(!LOCAL_GM(c)) {
@@ -2006,33 +2271,26 @@ static int handle_ban_w(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 week"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "1 week"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+    if((first = client_dir_get(gc, NULL))) {
+        for(i = first; i; i = client_dir_next(i, NULL)) {
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 week"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "1 week"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            client_kick(i);
         }
+
+        client_dir_put(first);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -2041,10 +2299,8 @@ static int handle_ban_w(ship_client_t *c, const char *params) {
 /* Usage: /ban:m guildcard reason */
 static int handle_ban_m(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
-    ship_client_t *i;
+    ship_client_t *i, *first;
     char *reason;
-    int j;
 
     /* Make sure the requester is a local GM. */
     if(!LOCAL_GM(c)) {
@@ -2067,33 +2323,26 @@ static int handle_ban_m(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "30 days"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "30 days"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+    if((first = client_dir_get(gc, NULL))) {
+        for(i = first; i; i = client_dir_next(i, NULL)) {
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "30 days"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "30 days"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            client_kick(i);
         }
+
+        client_dir_put(first);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -2102,9 +2351,7 @@ static int handle_ban_m(ship_client_t *c, const char *params) {
 /* Usage: /ban:p guildcard reason */
 static int handle_ban_p(ship_client_t *c, const char *params) {
     uint32_t gc;
-    block_t *b;
-    ship_client_t *i;
-    int j;
+    ship_client_t *i, *first;
     char *reason;
 
     /* Make sure the requester is a local GM. */
@@ -2127,33 +2374,26 @@ static int handle_ban_p(ship_client_t *c, const char *params) {
     }
 
     /* Look for the requested user and kick them if they're on the ship. */
-    for(j = 0; j < ship->cfg->blocks; ++j) {
-        if((b = ship->blocks[j])) {
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(i, b->clients, qentry) {
-                /* Disconnect them if we find them */
-                if(i->guildcard == gc) {
-                    if(strlen(reason) > 1) {
-                        send_message_box(i, "%s\n%s %s\n%s\n%s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "Forever"), __(i, "Reason:"),
-                                         reason + 1);
-                    }
-                    else {
-                        send_message_box(i, "%s\n%s %s",
-                                         __(i, "\tEYou have been banned from "
-                                            "this ship."), __(i, "Ban Length:"),
-                                         __(i, "Forever"));
-                    }
-
-                    i->flags |= CLIENT_FLAG_DISCONNECTED;
-                }
+    if((first = client_dir_get(gc, NULL))) {
+        for(i = first; i; i = client_dir_next(i, NULL)) {
+            if(strlen(reason) > 1) {
+                send_message_box(i, "%s\n%s %s\n%s\n%s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "Forever"), __(i, "Reason:"),
+                                 reason + 1);
+            }
+            else {
+                send_message_box(i, "%s\n%s %s",
+                                 __(i, "\tEYou have been banned from "
+                                    "this ship."), __(i, "Ban Length:"),
+                                 __(i, "Forever"));
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            client_kick(i);
         }
+
+        client_dir_put(first);
     }
 
     return send_txt(c, "%s", __(c, "\tE\tC7Successfully set ban."));
@@ -2790,6 +3030,8 @@ static command_t cmds[] = {
     { "warpall"  , handle_warpall   },
     { "bug"      , handle_bug       },
     { "clinfo"   , handle_clinfo    },
+    { "lstat"    , handle_lstat     },
+    { "sgstat"   , handle_sgstat    },
     { "gban:d"   , handle_gban_d    },
     { "gban:w"   , handle_gban_w    },
     { "gban:m"   , handle_gban_m    },
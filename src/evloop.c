@@ -0,0 +1,888 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Only defined by poll.h with _GNU_SOURCE. */
+#ifndef POLLRDHUP
+#define POLLRDHUP               0x2000
+#endif
+
+/* Size of the submission/completion queues. Each registered descriptor has at
+   most one poll and one poll removal in flight at once. */
+#define EVLOOP_URING_SQ_SIZE    256
+#define EVLOOP_URING_CQ_SIZE    4096
+
+/* user_data for completions we don't care about (poll removals). */
+#define EVLOOP_URING_IGNORE     0xFFFFFFFFFFFFFFFFULL
+#endif
+
+#include <sylverant/debug.h>
+
+#include "evloop.h"
+
+/* What's registered for each file descriptor. */
+typedef struct evloop_reg {
+    uint32_t events;
+    void *data;
+
+    /* For the io_uring backend: whether a poll is outstanding, and which one
+       (so completions for polls that have since been replaced get ignored). */
+    uint32_t gen;
+    int armed;
+} evloop_reg_t;
+
+struct evloop {
+    int backend;
+
+    /* Protects everything below. Registrations can come from any thread (for
+       instance, arming write interest on a client owned by another block). */
+    pthread_mutex_t mutex;
+    evloop_reg_t *regs;
+    int regs_size;
+    int max_fd;
+
+    /* For the select backend: a self-pipe to break out of select() when the
+       interest set changes under us. */
+    int wake[2];
+    int waiting;
+
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+    struct epoll_event *epevs;
+    int epevs_size;
+#endif
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+    /* For the io_uring backend. Polls are one-shot and get re-armed after they
+       fire. Anything queued up by the thread that waits on the loop is only
+       submitted when it next waits, so that it all goes in with the same
+       system call. Changes from other threads are submitted right away. */
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_sz;
+    void *cq_ring;
+    size_t cq_ring_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    pthread_t waiter;
+    int has_waiter;
+#endif
+};
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+static int evloop_uring_setup(evloop_t *el);
+static void evloop_uring_teardown(evloop_t *el);
+#endif
+
+/* Default to the best backend we were built with. */
+#ifdef HAVE_SYS_EPOLL_H
+int evloop_backend = EVLOOP_BACKEND_EPOLL;
+#else
+int evloop_backend = EVLOOP_BACKEND_SELECT;
+#endif
+
+int evloop_set_nonblock(int fd) {
+    int flags;
+
+    if((flags = fcntl(fd, F_GETFL, 0)) == -1) {
+        perror("fcntl(F_GETFL)");
+        return -1;
+    }
+
+    if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl(F_SETFL)");
+        return -1;
+    }
+
+    return 0;
+}
+
+evloop_t *evloop_create(int backend) {
+    evloop_t *rv;
+
+    if(!(rv = (evloop_t *)malloc(sizeof(evloop_t)))) {
+        debug(DBG_ERROR, "Cannot allocate event loop: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(evloop_t));
+    rv->max_fd = -1;
+    rv->wake[0] = rv->wake[1] = -1;
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+    rv->ring_fd = -1;
+
+    if(backend == EVLOOP_BACKEND_URING && evloop_uring_setup(rv)) {
+        backend = EVLOOP_BACKEND_EPOLL;
+    }
+#else
+    if(backend == EVLOOP_BACKEND_URING) {
+        debug(DBG_WARN, "Built without io_uring support, falling back\n");
+        backend = EVLOOP_BACKEND_EPOLL;
+    }
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+    rv->epfd = -1;
+
+    if(backend == EVLOOP_BACKEND_EPOLL) {
+        if((rv->epfd = epoll_create(64)) < 0) {
+            debug(DBG_WARN, "epoll_create: %s, falling back to select\n",
+                  strerror(errno));
+            backend = EVLOOP_BACKEND_SELECT;
+        }
+    }
+#else
+    if(backend == EVLOOP_BACKEND_EPOLL) {
+        backend = EVLOOP_BACKEND_SELECT;
+    }
+#endif
+
+    if(backend == EVLOOP_BACKEND_SELECT) {
+        if(pipe(rv->wake) == -1) {
+            debug(DBG_ERROR, "Cannot create event loop pipe: %s\n",
+                  strerror(errno));
+            free(rv);
+            return NULL;
+        }
+
+        evloop_set_nonblock(rv->wake[0]);
+        evloop_set_nonblock(rv->wake[1]);
+    }
+
+    rv->backend = backend;
+    pthread_mutex_init(&rv->mutex, NULL);
+
+    return rv;
+}
+
+void evloop_destroy(evloop_t *el) {
+    if(!el) {
+        return;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if(el->epfd >= 0) {
+        close(el->epfd);
+    }
+
+    free(el->epevs);
+#endif
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+    evloop_uring_teardown(el);
+#endif
+
+    if(el->wake[0] >= 0) {
+        close(el->wake[0]);
+        close(el->wake[1]);
+    }
+
+    pthread_mutex_destroy(&el->mutex);
+    free(el->regs);
+    free(el);
+}
+
+int evloop_get_backend(evloop_t *el) {
+    return el->backend;
+}
+
+const char *evloop_backend_name(evloop_t *el) {
+    switch(el->backend) {
+        case EVLOOP_BACKEND_EPOLL:
+            return "epoll";
+
+        case EVLOOP_BACKEND_SELECT:
+            return "select";
+
+        case EVLOOP_BACKEND_URING:
+            return "io_uring";
+    }
+
+    return "unknown";
+}
+
+/* Poke the thread sitting in select() so it picks up a changed interest set.
+   Must be called with the mutex held. */
+static void evloop_wakeup(evloop_t *el) {
+    if(el->backend == EVLOOP_BACKEND_SELECT && el->waiting) {
+        write(el->wake[1], "\xFF", 1);
+        el->waiting = 0;
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t evloop_to_epoll(uint32_t events) {
+    uint32_t rv = 0;
+
+    if(events & EVLOOP_READ)
+        rv |= EPOLLIN | EPOLLRDHUP;
+    if(events & EVLOOP_WRITE)
+        rv |= EPOLLOUT;
+    if(events & EVLOOP_EDGE)
+        rv |= EPOLLET;
+
+    return rv;
+}
+#endif
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+static int evloop_uring_setup(evloop_t *el) {
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = EVLOOP_URING_CQ_SIZE;
+
+    if((el->ring_fd = (int)syscall(__NR_io_uring_setup, EVLOOP_URING_SQ_SIZE,
+                                   &p)) < 0) {
+        debug(DBG_WARN, "io_uring_setup: %s\n", strerror(errno));
+        el->ring_fd = -1;
+        return -1;
+    }
+
+    /* We need to be able to wait with a timeout (5.11 or newer). */
+    if(!(p.features & IORING_FEAT_EXT_ARG)) {
+        debug(DBG_WARN, "io_uring: kernel is too old\n");
+        goto err;
+    }
+
+    el->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    el->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(el->cq_ring_sz > el->sq_ring_sz) {
+            el->sq_ring_sz = el->cq_ring_sz;
+        }
+
+        el->cq_ring_sz = 0;
+    }
+
+    el->sq_ring = mmap(NULL, el->sq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, el->ring_fd,
+                       IORING_OFF_SQ_RING);
+
+    if(el->sq_ring == MAP_FAILED) {
+        el->sq_ring = NULL;
+        goto err_map;
+    }
+
+    if(el->cq_ring_sz) {
+        el->cq_ring = mmap(NULL, el->cq_ring_sz, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, el->ring_fd,
+                           IORING_OFF_CQ_RING);
+
+        if(el->cq_ring == MAP_FAILED) {
+            el->cq_ring = NULL;
+            goto err_map;
+        }
+    }
+
+    el->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    el->sqes = (struct io_uring_sqe *)mmap(NULL, el->sqes_sz,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           el->ring_fd, IORING_OFF_SQES);
+
+    if(el->sqes == MAP_FAILED) {
+        el->sqes = NULL;
+        goto err_map;
+    }
+
+    sq = (uint8_t *)el->sq_ring;
+    cq = el->cq_ring ? (uint8_t *)el->cq_ring : sq;
+
+    el->sq_head = (unsigned *)(sq + p.sq_off.head);
+    el->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    el->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    el->sq_entries = p.sq_entries;
+    el->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    el->cq_head = (unsigned *)(cq + p.cq_off.head);
+    el->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    el->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    el->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+
+err_map:
+    debug(DBG_WARN, "io_uring mmap: %s\n", strerror(errno));
+
+err:
+    evloop_uring_teardown(el);
+    return -1;
+}
+
+static void evloop_uring_teardown(evloop_t *el) {
+    if(el->sqes) {
+        munmap(el->sqes, el->sqes_sz);
+        el->sqes = NULL;
+    }
+
+    if(el->cq_ring) {
+        munmap(el->cq_ring, el->cq_ring_sz);
+        el->cq_ring = NULL;
+    }
+
+    if(el->sq_ring) {
+        munmap(el->sq_ring, el->sq_ring_sz);
+        el->sq_ring = NULL;
+    }
+
+    if(el->ring_fd >= 0) {
+        close(el->ring_fd);
+        el->ring_fd = -1;
+    }
+}
+
+/* Hand everything queued up so far to the kernel, optionally waiting for at
+   least one completion (with a timeout in ms, or -1 for none). */
+static int evloop_uring_enter(evloop_t *el, int wait, int timeout) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_EXT_ARG, submit;
+
+    submit = __atomic_load_n(el->sq_tail, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(el->sq_head, __ATOMIC_ACQUIRE);
+    memset(&arg, 0, sizeof(arg));
+
+    if(wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+
+        if(timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    else if(!submit) {
+        return 0;
+    }
+
+    return (int)syscall(__NR_io_uring_enter, el->ring_fd, submit,
+                        wait ? 1 : 0, flags, &arg, sizeof(arg));
+}
+
+/* Grab the next free submission queue entry. Must be called with the mutex
+   held. */
+static struct io_uring_sqe *evloop_uring_sqe(evloop_t *el) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *el->sq_tail, idx;
+
+    /* If it's full, push it all to the kernel to make room. */
+    while(tail - __atomic_load_n(el->sq_head, __ATOMIC_ACQUIRE) >=
+          el->sq_entries) {
+        if(evloop_uring_enter(el, 0, 0) < 0 && errno != EINTR &&
+           errno != EAGAIN && errno != EBUSY) {
+            debug(DBG_ERROR, "io_uring_enter: %s\n", strerror(errno));
+            return NULL;
+        }
+    }
+
+    idx = tail & el->sq_mask;
+    sqe = &el->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    el->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+/* Make a queued entry visible to the kernel. */
+static void evloop_uring_push(evloop_t *el) {
+    __atomic_store_n(el->sq_tail, *el->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/* If the thread making a change isn't the one that waits on the loop, send it
+   to the kernel now, since the waiting thread might be asleep. */
+static void evloop_uring_flush(evloop_t *el) {
+    if(!el->has_waiter || !pthread_equal(el->waiter, pthread_self())) {
+        evloop_uring_enter(el, 0, 0);
+    }
+}
+
+static uint32_t evloop_to_poll(uint32_t events) {
+    uint32_t rv = 0;
+
+    if(events & EVLOOP_READ)
+        rv |= POLLIN | POLLRDHUP;
+    if(events & EVLOOP_WRITE)
+        rv |= POLLOUT;
+
+    return rv;
+}
+
+/* Start a (one-shot) poll on a descriptor with its current interest set. */
+static int evloop_uring_arm(evloop_t *el, int fd) {
+    struct io_uring_sqe *sqe;
+    evloop_reg_t *r = &el->regs[fd];
+
+    if(!(sqe = evloop_uring_sqe(el))) {
+        return -1;
+    }
+
+    ++r->gen;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = evloop_to_poll(r->events);
+    sqe->user_data = ((uint64_t)r->gen << 32) | (uint32_t)fd;
+    evloop_uring_push(el);
+    r->armed = 1;
+
+    return 0;
+}
+
+/* Cancel the outstanding poll on a descriptor, if there is one. */
+static void evloop_uring_disarm(evloop_t *el, int fd) {
+    struct io_uring_sqe *sqe;
+    evloop_reg_t *r = &el->regs[fd];
+
+    if(!r->armed || !(sqe = evloop_uring_sqe(el))) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = ((uint64_t)r->gen << 32) | (uint32_t)fd;
+    sqe->user_data = EVLOOP_URING_IGNORE;
+    evloop_uring_push(el);
+
+    /* Anything that comes back for the old poll is stale now. */
+    ++r->gen;
+    r->armed = 0;
+}
+#endif
+
+int evloop_add(evloop_t *el, int fd, uint32_t events, void *data) {
+    evloop_reg_t *tmp;
+    int sz;
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    /* select() can't deal with anything past FD_SETSIZE. */
+    if(el->backend == EVLOOP_BACKEND_SELECT && fd >= FD_SETSIZE) {
+        debug(DBG_WARN, "Socket %d exceeds FD_SETSIZE, rejecting\n", fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&el->mutex);
+
+    /* Make sure we have a slot for this descriptor. */
+    if(fd >= el->regs_size) {
+        sz = el->regs_size ? el->regs_size : 64;
+
+        while(sz <= fd) {
+            sz <<= 1;
+        }
+
+        if(!(tmp = (evloop_reg_t *)realloc(el->regs,
+                                           sz * sizeof(evloop_reg_t)))) {
+            debug(DBG_ERROR, "Cannot grow event loop: %s\n", strerror(errno));
+            pthread_mutex_unlock(&el->mutex);
+            return -1;
+        }
+
+        memset(tmp + el->regs_size, 0,
+               (sz - el->regs_size) * sizeof(evloop_reg_t));
+        el->regs = tmp;
+        el->regs_size = sz;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if(el->backend == EVLOOP_BACKEND_EPOLL) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = evloop_to_epoll(events);
+        ev.data.fd = fd;
+
+        if(epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            debug(DBG_WARN, "epoll_ctl(ADD, %d): %s\n", fd, strerror(errno));
+            pthread_mutex_unlock(&el->mutex);
+            return -1;
+        }
+    }
+#endif
+
+    el->regs[fd].events = events;
+    el->regs[fd].data = data;
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+    if(el->backend == EVLOOP_BACKEND_URING) {
+        el->regs[fd].armed = 0;
+
+        if(evloop_uring_arm(el, fd)) {
+            el->regs[fd].events = 0;
+            el->regs[fd].data = NULL;
+            pthread_mutex_unlock(&el->mutex);
+            return -1;
+        }
+
+        evloop_uring_flush(el);
+    }
+#endif
+
+    if(fd > el->max_fd) {
+        el->max_fd = fd;
+    }
+
+    evloop_wakeup(el);
+    pthread_mutex_unlock(&el->mutex);
+
+    return 0;
+}
+
+int evloop_mod(evloop_t *el, int fd, uint32_t events) {
+    pthread_mutex_lock(&el->mutex);
+
+    if(fd < 0 || fd >= el->regs_size || !el->regs[fd].events) {
+        pthread_mutex_unlock(&el->mutex);
+        return -1;
+    }
+
+    /* Don't bother the kernel if nothing actually changed. */
+    if(el->regs[fd].events == events) {
+        pthread_mutex_unlock(&el->mutex);
+        return 0;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if(el->backend == EVLOOP_BACKEND_EPOLL) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = evloop_to_epoll(events);
+        ev.data.fd = fd;
+
+        if(epoll_ctl(el->epfd, EPOLL_CTL_MOD, fd, &ev)) {
+            debug(DBG_WARN, "epoll_ctl(MOD, %d): %s\n", fd, strerror(errno));
+            pthread_mutex_unlock(&el->mutex);
+            return -1;
+        }
+    }
+#endif
+
+    el->regs[fd].events = events;
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+    if(el->backend == EVLOOP_BACKEND_URING) {
+        evloop_uring_disarm(el, fd);
+        evloop_uring_arm(el, fd);
+        evloop_uring_flush(el);
+    }
+#endif
+
+    evloop_wakeup(el);
+    pthread_mutex_unlock(&el->mutex);
+
+    return 0;
+}
+
+int evloop_del(evloop_t *el, int fd) {
+    pthread_mutex_lock(&el->mutex);
+
+    if(fd < 0 || fd >= el->regs_size || !el->regs[fd].events) {
+        pthread_mutex_unlock(&el->mutex);
+        return -1;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if(el->backend == EVLOOP_BACKEND_EPOLL) {
+        struct epoll_event ev;
+
+        /* Older kernels want a non-NULL event here, even though its
+           ignored. */
+        memset(&ev, 0, sizeof(ev));
+        epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#endif
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+    if(el->backend == EVLOOP_BACKEND_URING) {
+        evloop_uring_disarm(el, fd);
+        evloop_uring_flush(el);
+    }
+#endif
+
+    el->regs[fd].events = 0;
+    el->regs[fd].data = NULL;
+
+    /* Pull the high-water mark back down if we can. */
+    while(el->max_fd >= 0 && !el->regs[el->max_fd].events) {
+        --el->max_fd;
+    }
+
+    evloop_wakeup(el);
+    pthread_mutex_unlock(&el->mutex);
+
+    return 0;
+}
+
+static int evloop_wait_select(evloop_t *el, evloop_event_t *evs, int max,
+                              int timeout) {
+    fd_set readfds, writefds;
+    struct timeval tv, *tvp = NULL;
+    int i, nfds, rv, cnt = 0;
+    uint32_t ev;
+    char junk[32];
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+
+    FD_SET(el->wake[0], &readfds);
+    nfds = el->wake[0];
+
+    pthread_mutex_lock(&el->mutex);
+
+    for(i = 0; i <= el->max_fd; ++i) {
+        if(el->regs[i].events & EVLOOP_READ) {
+            FD_SET(i, &readfds);
+        }
+
+        if(el->regs[i].events & EVLOOP_WRITE) {
+            FD_SET(i, &writefds);
+        }
+    }
+
+    nfds = nfds > el->max_fd ? nfds : el->max_fd;
+    el->waiting = 1;
+    pthread_mutex_unlock(&el->mutex);
+
+    if(timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    rv = select(nfds + 1, &readfds, &writefds, NULL, tvp);
+
+    pthread_mutex_lock(&el->mutex);
+    el->waiting = 0;
+
+    if(rv <= 0) {
+        pthread_mutex_unlock(&el->mutex);
+        return (rv < 0 && errno == EINTR) ? 0 : rv;
+    }
+
+    if(FD_ISSET(el->wake[0], &readfds)) {
+        while(read(el->wake[0], junk, sizeof(junk)) > 0) {
+        }
+    }
+
+    for(i = 0; i <= el->max_fd && cnt < max; ++i) {
+        ev = 0;
+
+        if(FD_ISSET(i, &readfds))
+            ev |= EVLOOP_READ;
+        if(FD_ISSET(i, &writefds))
+            ev |= EVLOOP_WRITE;
+
+        /* Skip anything that got unregistered while we were waiting. */
+        if(ev && el->regs[i].events) {
+            evs[cnt].fd = i;
+            evs[cnt].events = ev;
+            evs[cnt].data = el->regs[i].data;
+            ++cnt;
+        }
+    }
+
+    pthread_mutex_unlock(&el->mutex);
+
+    return cnt;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int evloop_wait_epoll(evloop_t *el, evloop_event_t *evs, int max,
+                             int timeout) {
+    int i, rv, fd, cnt = 0;
+    uint32_t ev;
+    void *tmp;
+
+    if(el->epevs_size < max) {
+        if(!(tmp = realloc(el->epevs, max * sizeof(struct epoll_event)))) {
+            debug(DBG_ERROR, "Cannot allocate epoll events: %s\n",
+                  strerror(errno));
+            return -1;
+        }
+
+        el->epevs = (struct epoll_event *)tmp;
+        el->epevs_size = max;
+    }
+
+    rv = epoll_wait(el->epfd, el->epevs, max, timeout);
+
+    if(rv <= 0) {
+        return (rv < 0 && errno == EINTR) ? 0 : rv;
+    }
+
+    pthread_mutex_lock(&el->mutex);
+
+    for(i = 0; i < rv; ++i) {
+        fd = el->epevs[i].data.fd;
+        ev = 0;
+
+        if(fd >= el->regs_size || !el->regs[fd].events)
+            continue;
+
+        if(el->epevs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+            ev |= EVLOOP_READ;
+        if(el->epevs[i].events & EPOLLOUT)
+            ev |= EVLOOP_WRITE;
+
+        /* Report errors as readable too, so the next recv() picks it up. */
+        if(el->epevs[i].events & EPOLLERR)
+            ev |= EVLOOP_READ | EVLOOP_ERROR;
+
+        evs[cnt].fd = fd;
+        evs[cnt].events = ev;
+        evs[cnt].data = el->regs[fd].data;
+        ++cnt;
+    }
+
+    pthread_mutex_unlock(&el->mutex);
+
+    return cnt;
+}
+#endif
+
+#ifdef SYLVERANT_ENABLE_IO_URING
+static int evloop_wait_uring(evloop_t *el, evloop_event_t *evs, int max,
+                             int timeout) {
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    uint64_t ud;
+    uint32_t ev;
+    int rv, fd, cnt = 0;
+
+    /* Submit whatever we've queued up (including re-arming everything that
+       fired last time) and wait, all at once. */
+    pthread_mutex_lock(&el->mutex);
+    el->waiter = pthread_self();
+    el->has_waiter = 1;
+    pthread_mutex_unlock(&el->mutex);
+
+    rv = evloop_uring_enter(el, 1, timeout);
+
+    if(rv < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+        debug(DBG_ERROR, "io_uring_enter: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&el->mutex);
+
+    head = *el->cq_head;
+    tail = __atomic_load_n(el->cq_tail, __ATOMIC_ACQUIRE);
+
+    for(; head != tail && cnt < max; ++head) {
+        cqe = &el->cqes[head & el->cq_mask];
+        ud = cqe->user_data;
+
+        if(ud == EVLOOP_URING_IGNORE) {
+            continue;
+        }
+
+        fd = (int)(ud & 0xFFFFFFFF);
+
+        /* Skip anything that has been changed or unregistered since. */
+        if(fd >= el->regs_size || !el->regs[fd].events ||
+           el->regs[fd].gen != (uint32_t)(ud >> 32)) {
+            continue;
+        }
+
+        el->regs[fd].armed = 0;
+
+        if(cqe->res < 0) {
+            ev = EVLOOP_READ | EVLOOP_ERROR;
+        }
+        else {
+            ev = 0;
+
+            if(cqe->res & (POLLIN | POLLRDHUP | POLLHUP))
+                ev |= EVLOOP_READ;
+            if(cqe->res & POLLOUT)
+                ev |= EVLOOP_WRITE;
+
+            /* Report errors as readable too, so the next recv() picks it
+               up. */
+            if(cqe->res & POLLERR)
+                ev |= EVLOOP_READ | EVLOOP_ERROR;
+        }
+
+        evs[cnt].fd = fd;
+        evs[cnt].events = ev;
+        evs[cnt].data = el->regs[fd].data;
+        ++cnt;
+
+        /* Polls only fire once, so set it up again. This goes in with the
+           next wait. */
+        evloop_uring_arm(el, fd);
+    }
+
+    __atomic_store_n(el->cq_head, head, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&el->mutex);
+
+    return cnt;
+}
+#endif
+
+int evloop_wait(evloop_t *el, evloop_event_t *evs, int max, int timeout) {
+#ifdef SYLVERANT_ENABLE_IO_URING
+    if(el->backend == EVLOOP_BACKEND_URING) {
+        return evloop_wait_uring(el, evs, max, timeout);
+    }
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+    if(el->backend == EVLOOP_BACKEND_EPOLL) {
+        return evloop_wait_epoll(el, evs, max, timeout);
+    }
+#endif
+
+    return evloop_wait_select(el, evs, max, timeout);
+}
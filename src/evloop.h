@@ -0,0 +1,80 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stdint.h>
+
+/* Interest/readiness flags. */
+#define EVLOOP_READ             0x00000001
+#define EVLOOP_WRITE            0x00000002
+#define EVLOOP_ERROR            0x00000004
+
+/* Only report transitions to ready, not the ready state itself. The caller
+   must read/write until EAGAIN before waiting again. Ignored by the select and
+   io_uring backends, which are always level-triggered. */
+#define EVLOOP_EDGE             0x00000100
+
+/* Available readiness backends. The io_uring backend is only there if support
+   for it was turned on at configure time, and needs a 5.11 or newer kernel. */
+#define EVLOOP_BACKEND_SELECT   0
+#define EVLOOP_BACKEND_EPOLL    1
+#define EVLOOP_BACKEND_URING    2
+
+typedef struct evloop_event {
+    int fd;
+    uint32_t events;
+    void *data;
+} evloop_event_t;
+
+struct evloop;
+
+#ifndef EVLOOP_DEFINED
+#define EVLOOP_DEFINED
+typedef struct evloop evloop_t;
+#endif
+
+/* The backend new event loops should use (set from the command line). */
+extern int evloop_backend;
+
+/* Create an event loop using the given backend. If the backend isn't available
+   on this system, the next best one is used instead (io_uring falls back to
+   epoll, and epoll to select). */
+evloop_t *evloop_create(int backend);
+void evloop_destroy(evloop_t *el);
+
+/* Which backend did we actually end up with? */
+int evloop_get_backend(evloop_t *el);
+const char *evloop_backend_name(evloop_t *el);
+
+/* Register/update/unregister interest in a file descriptor. These are safe to
+   call from any thread, and will wake up a thread waiting in evloop_wait if the
+   change might make something ready. */
+int evloop_add(evloop_t *el, int fd, uint32_t events, void *data);
+int evloop_mod(evloop_t *el, int fd, uint32_t events);
+int evloop_del(evloop_t *el, int fd);
+
+/* Wait for up to timeout milliseconds (-1 for forever) for something to become
+   ready. Returns the number of events filled in, 0 on timeout, or -1 on
+   error. */
+int evloop_wait(evloop_t *el, evloop_event_t *evs, int max, int timeout);
+
+/* Put a file descriptor into non-blocking mode. */
+int evloop_set_nonblock(int fd);
+
+#endif /* !EVLOOP_H */
@@ -21,9 +21,12 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include <sylverant/debug.h>
+
 #include "clients.h"
 #include "lobby.h"
 #include "block.h"
@@ -36,181 +39,378 @@
 #define DOMAIN_BLOCK    1
 #define DOMAIN_LOBBY    2
 
-static int pllist_ship(ship_client_t *c, const char *name, int first,
-                       int minlvl, int maxlvl, int ch_class) {
+/* How many results fit on one page of the list. */
+#define PLLIST_PAGE         4
+
+/* Most results a search holds on to, and how long (in seconds) they're kept
+   for paging through before the search has to be done again. */
+#define PLLIST_SNAP_MAX     400
+#define PLLIST_SNAP_TIME    60
+
+#define PLLIST_CLASSES      12
+
+/* How a name filter gets applied. Plain text is matched against the lowercased
+   name (anywhere in it, or only at the start if it began with a ^), which
+   covers what people actually search for. Anything else is a regex. */
+#define PLLIST_MATCH_ANY        0
+#define PLLIST_MATCH_SUBSTR     1
+#define PLLIST_MATCH_PREFIX     2
+#define PLLIST_MATCH_REGEX      3
+
+typedef struct pllist_ent {
+    ship_client_t *c;
     block_t *b;
-    ship_client_t *c2;
-    int i, count = 0, len = 2;
-    char str[512];
+    uint32_t guildcard;
+    int level;
+    int ch_class;
+    char name[24];                      /* As displayed */
+    char norm[24];                      /* Lowercased, no language code */
+} pllist_ent_t;
+
+/* Each class gets an array of its players, sorted by level, so a search only
+   has to look at the players in the level range it asked for. */
+typedef struct pllist_idx {
+    pllist_ent_t *ents;
+    int count;
+    int size;
+} pllist_idx_t;
+
+static pllist_idx_t pl_idx[PLLIST_CLASSES];
+static pthread_rwlock_t pl_idx_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The results of a search, kept with the client that did it. The entries are
+   copies, so the client pointers in them must not be used. */
+struct pllist_snap {
+    char key[128];
+    time_t when;
+    int count;
+    pllist_ent_t ents[PLLIST_SNAP_MAX];
+};
+
+typedef struct pllist_query {
+    int dom;
+    block_t *b;
+    int minlvl;
+    int maxlvl;
+    int ch_class;
+    int mode;
+    char lit[24];
     regex_t re;
-    char ip[INET6_ADDRSTRLEN];
+} pllist_query_t;
+
+static void pllist_normalize(char *dst, const char *src, size_t len) {
+    size_t i;
+
+    if(!(src = skip_lang_code(src))) {
+        dst[0] = '\0';
+        return;
+    }
+
+    for(i = 0; i < len - 1 && src[i]; ++i) {
+        dst[i] = (char)tolower((unsigned char)src[i]);
+    }
+
+    dst[i] = '\0';
+}
+
+/* Fill in the searchable parts of an entry from the client's player data. */
+static void pllist_client_info(ship_client_t *c, pllist_ent_t *e) {
+    const char *nm;
+    uint16_t ch;
+    size_t i;
+
+    if(c->version == CLIENT_VERSION_BB && c->bb_pl) {
+        e->level = (int)LE32(c->bb_pl->character.level);
+        e->ch_class = c->bb_pl->character.ch_class;
+
+        /* The name is UTF-16 with a language code on the front. Anything that
+           isn't plain ASCII can't be typed into a search anyway. */
+        for(i = 0; i < sizeof(e->name) - 1 &&
+            i + 2 < sizeof(c->bb_pl->character.name) / 2; ++i) {
+            if(!(ch = LE16(c->bb_pl->character.name[i + 2]))) {
+                break;
+            }
 
-    /* Compile the regular expression if the user asked to search by name */
-    if(name) {
-        if(regcomp(&re, name, REG_EXTENDED | REG_ICASE | REG_NOSUB)) {
-            return send_txt(c, "%s", __(c, "\tE\tC7Invalid name given."));
+            e->name[i] = ch < 0x80 ? (char)ch : '?';
         }
+
+        e->name[i] = '\0';
     }
+    else {
+        e->level = c->pl->v1.level;
+        e->ch_class = c->pl->v1.ch_class;
 
-    strcpy(str, "\tE");
+        if(!(nm = skip_lang_code(c->pl->v1.name))) {
+            nm = "";
+        }
 
-    /* Look through all blocks on the ship. */
-    for(i = 0; i < ship->cfg->blocks && count < first + 4; ++i) {
-        if(!ship->blocks[i]) {
-            continue;
+        /* The name field isn't necessarily terminated. */
+        for(i = 0; i < sizeof(e->name) - 1 &&
+            nm + i < c->pl->v1.name + sizeof(c->pl->v1.name) && nm[i]; ++i) {
+            e->name[i] = nm[i];
         }
 
-        b = ship->blocks[i];
-        pthread_rwlock_rdlock(&b->lock);
+        e->name[i] = '\0';
+    }
 
-        /* Go through everyone in the block looking for any matches. */
-        TAILQ_FOREACH(c2, b->clients, qentry) {
-            pthread_mutex_lock(&c2->mutex);
+    pllist_normalize(e->norm, e->name, sizeof(e->norm));
+}
 
-            /* Make sure the level is in range */
-            if(c2->pl->v1.level < minlvl || c2->pl->v1.level > maxlvl) {
-                pthread_mutex_unlock(&c2->mutex);
-                continue;
-            }
+/* Find the first entry with a level of at least lvl. */
+static int pllist_lower(pllist_idx_t *idx, int lvl) {
+    int lo = 0, hi = idx->count, mid;
 
-            /* Next check if the class matches the request */
-            if(ch_class != -1 && c2->pl->v1.ch_class != ch_class) {
-                pthread_mutex_unlock(&c2->mutex);
-                continue;
-            }
+    while(lo < hi) {
+        mid = (lo + hi) >> 1;
 
-            /* Check the name filter, if given */
-            if(name && regexec(&re, c2->pl->v1.name, 0, NULL, 0)) {
-                pthread_mutex_unlock(&c2->mutex);
-                continue;
-            }
+        if(idx->ents[mid].level < lvl)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-            /* If we've gotten here, then the user matches */
-            ++count;
+    return lo;
+}
 
-            /* If we're on the right page, add the client to the message */
-            if(count >= first) {
-                my_ntop(&c2->ip_addr, ip);
+/* Take the client out of the index. The index must be write locked. */
+static void pllist_unfile(ship_client_t *c) {
+    pllist_idx_t *idx = &pl_idx[c->pllist_class];
+    int i;
+
+    for(i = pllist_lower(idx, c->pllist_level);
+        i < idx->count && idx->ents[i].level == c->pllist_level; ++i) {
+        if(idx->ents[i].c == c) {
+            memmove(&idx->ents[i], &idx->ents[i + 1],
+                    (idx->count - i - 1) * sizeof(pllist_ent_t));
+            --idx->count;
+            break;
+        }
+    }
 
-                if(c2->cur_lobby) {
-                    sprintf(&str[len], "%s  %s  Lv.%d  GC: %d\n"
-                            "B: %d  IP: %s  Lobby: %s\n", c2->pl->v1.name,
-                            classes[c2->pl->v1.ch_class], c2->pl->v1.level + 1,
-                            c2->guildcard, c2->cur_block->b, ip,
-                            skip_lang_code(c2->cur_lobby->name));
-                }
-                else {
-                    sprintf(&str[len], "%s  %s  Lv.%d  GC: %d\n"
-                            "B: %d  IP: %s  Lobby: ----\n", c2->pl->v1.name,
-                            classes[c2->pl->v1.ch_class], c2->pl->v1.level + 1,
-                            c2->guildcard, c2->cur_block->b, ip);
-                }
+    c->pllist_listed = 0;
+}
 
-                len = strlen(str);
-            }
+void pllist_update(ship_client_t *c) {
+    pllist_ent_t e;
+    pllist_idx_t *idx;
+    pllist_ent_t *tmp;
+    int pos, size;
 
-            pthread_mutex_unlock(&c2->mutex);
+    if(!c->pl || (c->flags & CLIENT_FLAG_TYPE_SHIP)) {
+        return;
+    }
 
-            if(count >= first + 4) {
-                break;
-            }
+    pllist_client_info(c, &e);
+    e.c = c;
+    e.b = c->cur_block;
+    e.guildcard = c->guildcard;
+
+    /* Don't bother with anyone with a class we don't know about. */
+    if(e.ch_class < 0 || e.ch_class >= PLLIST_CLASSES) {
+        pllist_remove(c);
+        return;
+    }
+
+    idx = &pl_idx[e.ch_class];
+    pthread_rwlock_wrlock(&pl_idx_lock);
+
+    if(c->pllist_listed) {
+        pllist_unfile(c);
+    }
+
+    if(idx->count == idx->size) {
+        size = idx->size ? idx->size << 1 : 16;
+
+        if(!(tmp = (pllist_ent_t *)realloc(idx->ents,
+                                           size * sizeof(pllist_ent_t)))) {
+            pthread_rwlock_unlock(&pl_idx_lock);
+            debug(DBG_WARN, "Couldn't grow player list index\n");
+            return;
         }
 
-        pthread_rwlock_unlock(&b->lock);
+        idx->ents = tmp;
+        idx->size = size;
     }
 
-    /* Clean up the regular expression */
-    if(name) {
-        regfree(&re);
+    /* Put them after everyone else at the same level. */
+    pos = pllist_lower(idx, e.level + 1);
+    memmove(&idx->ents[pos + 1], &idx->ents[pos],
+            (idx->count - pos) * sizeof(pllist_ent_t));
+    idx->ents[pos] = e;
+    ++idx->count;
+
+    c->pllist_listed = 1;
+    c->pllist_class = e.ch_class;
+    c->pllist_level = e.level;
+
+    pthread_rwlock_unlock(&pl_idx_lock);
+}
+
+void pllist_remove(ship_client_t *c) {
+    if(c->pllist_listed) {
+        pthread_rwlock_wrlock(&pl_idx_lock);
+        pllist_unfile(c);
+        pthread_rwlock_unlock(&pl_idx_lock);
     }
 
-    /* If we have no results, then tell the user that */
-    if(len == 2) {
-        strcpy(str, __(c, "\tENo matches found."));
+    free(c->pllist_snap);
+    c->pllist_snap = NULL;
+}
+
+static int pllist_query_init(pllist_query_t *q, const char *name) {
+    const char *lit = name;
+    int prefix = 0;
+
+    q->mode = PLLIST_MATCH_ANY;
+
+    if(!name) {
+        return 0;
     }
 
-    /* Send the message away */
-    return send_message_box(c, "%s", str);
+    if(*lit == '^') {
+        prefix = 1;
+        ++lit;
+    }
+
+    if(!strpbrk(lit, ".[]()*+?{}|\\^$") && strlen(lit) < sizeof(q->lit)) {
+        pllist_normalize(q->lit, lit, sizeof(q->lit));
+        q->mode = prefix ? PLLIST_MATCH_PREFIX : PLLIST_MATCH_SUBSTR;
+        return 0;
+    }
+
+    if(regcomp(&q->re, name, REG_EXTENDED | REG_ICASE | REG_NOSUB)) {
+        return -1;
+    }
+
+    q->mode = PLLIST_MATCH_REGEX;
+    return 0;
 }
 
-static int pllist_block(ship_client_t *c, const char *name, int first,
-                        int minlvl, int maxlvl, int ch_class) {
-    block_t *b = c->cur_block;
-    ship_client_t *c2;
-    int count = 0, len = 2;
-    char str[512];
-    regex_t re;
-    char ip[INET6_ADDRSTRLEN];
+static void pllist_query_free(pllist_query_t *q) {
+    if(q->mode == PLLIST_MATCH_REGEX) {
+        regfree(&q->re);
+    }
+}
 
-    /* Compile the regular expression if the user asked to search by name */
-    if(name) {
-        if(regcomp(&re, name, REG_EXTENDED | REG_ICASE | REG_NOSUB)) {
-            return send_txt(c, "%s", __(c, "\tE\tC7Invalid name given."));
-        }
+/* Does the entry match everything but the level and class? */
+static int pllist_match(pllist_query_t *q, pllist_ent_t *e) {
+    if(q->dom == DOMAIN_BLOCK && e->b != q->b) {
+        return 0;
     }
 
-    strcpy(str, "\tE");
+    switch(q->mode) {
+        case PLLIST_MATCH_SUBSTR:
+            return strstr(e->norm, q->lit) != NULL;
 
-    pthread_rwlock_rdlock(&b->lock);
+        case PLLIST_MATCH_PREFIX:
+            return !strncmp(e->norm, q->lit, strlen(q->lit));
 
-    /* Go through everyone in the block looking for any matches. */
-    TAILQ_FOREACH(c2, b->clients, qentry) {
-        pthread_mutex_lock(&c2->mutex);
+        case PLLIST_MATCH_REGEX:
+            return !regexec(&q->re, e->name, 0, NULL, 0);
+    }
 
-        /* Make sure the level is in range */
-        if(c2->pl->v1.level < minlvl || c2->pl->v1.level > maxlvl) {
-            pthread_mutex_unlock(&c2->mutex);
+    return 1;
+}
+
+/* Search the index for a ship or block wide search. */
+static void pllist_search_idx(pllist_query_t *q, struct pllist_snap *s) {
+    pllist_idx_t *idx;
+    int cl, i;
+
+    pthread_rwlock_rdlock(&pl_idx_lock);
+
+    for(cl = 0; cl < PLLIST_CLASSES && s->count < PLLIST_SNAP_MAX; ++cl) {
+        if(q->ch_class != -1 && cl != q->ch_class) {
             continue;
         }
 
-        /* Next check if the class matches the request */
-        if(ch_class != -1 && c2->pl->v1.ch_class != ch_class) {
-            pthread_mutex_unlock(&c2->mutex);
-            continue;
+        idx = &pl_idx[cl];
+
+        for(i = pllist_lower(idx, q->minlvl); i < idx->count &&
+            idx->ents[i].level <= q->maxlvl && s->count < PLLIST_SNAP_MAX;
+            ++i) {
+            if(pllist_match(q, &idx->ents[i])) {
+                s->ents[s->count++] = idx->ents[i];
+            }
         }
+    }
+
+    pthread_rwlock_unlock(&pl_idx_lock);
+}
+
+/* A lobby only has a handful of people in it, so just look at them. */
+static void pllist_search_lobby(ship_client_t *c, pllist_query_t *q,
+                                struct pllist_snap *s) {
+    lobby_t *l = c->cur_lobby;
+    ship_client_t *c2;
+    pllist_ent_t *e;
+    int i;
+
+    for(i = 0; i < l->max_clients; ++i) {
+        if((c2 = l->clients[i])) {
+            e = &s->ents[s->count];
 
-        /* Check the name filter, if given */
-        if(name && regexec(&re, c2->pl->v1.name, 0, NULL, 0)) {
+            pthread_mutex_lock(&c2->mutex);
+            pllist_client_info(c2, e);
             pthread_mutex_unlock(&c2->mutex);
-            continue;
+
+            e->c = NULL;
+            e->b = c2->cur_block;
+            e->guildcard = c2->guildcard;
+
+            if(e->level >= q->minlvl && e->level <= q->maxlvl &&
+               (q->ch_class == -1 || e->ch_class == q->ch_class) &&
+               e->ch_class >= 0 && e->ch_class < PLLIST_CLASSES &&
+               pllist_match(q, e)) {
+                ++s->count;
+            }
         }
+    }
+}
 
-        /* If we've gotten here, then the user matches */
-        ++count;
+/* Send one page of a finished search. The details that change too often to
+   keep in the search results get filled in from the client now, if they're
+   still around. */
+static int pllist_send_page(ship_client_t *c, struct pllist_snap *s,
+                            int first) {
+    ship_client_t *c2;
+    pllist_ent_t *e;
+    int i, len = 2;
+    char str[512];
+    char ip[INET6_ADDRSTRLEN];
 
-        /* If we're on the right page, add the client to the message */
-        if(count >= first) {
+    strcpy(str, "\tE");
+
+    for(i = first; i < s->count && i < first + PLLIST_PAGE; ++i) {
+        e = &s->ents[i];
+
+        if((c2 = client_dir_get(e->guildcard, e->b))) {
+            pthread_mutex_lock(&c2->mutex);
             my_ntop(&c2->ip_addr, ip);
 
             if(c2->cur_lobby) {
                 sprintf(&str[len], "%s  %s  Lv.%d  GC: %d\n"
-                        "B: %d  IP: %s  Lobby: %s\n", c2->pl->v1.name,
-                        classes[c2->pl->v1.ch_class], c2->pl->v1.level + 1,
-                        c2->guildcard, c2->cur_block->b, ip,
-                        skip_lang_code(c2->cur_lobby->name));
+                        "B: %d  IP: %s  Lobby: %s\n", e->name,
+                        classes[e->ch_class], e->level + 1, e->guildcard,
+                        e->b->b, ip, skip_lang_code(c2->cur_lobby->name));
             }
             else {
                 sprintf(&str[len], "%s  %s  Lv.%d  GC: %d\n"
-                        "B: %d  IP: %s  Lobby: ----\n", c2->pl->v1.name,
-                        classes[c2->pl->v1.ch_class], c2->pl->v1.level + 1,
-                        c2->guildcard, c2->cur_block->b, ip);
+                        "B: %d  IP: %s  Lobby: ----\n", e->name,
+                        classes[e->ch_class], e->level + 1, e->guildcard,
+                        e->b->b, ip);
             }
 
-            len = strlen(str);
+            pthread_mutex_unlock(&c2->mutex);
+            client_dir_put(c2);
         }
-
-        pthread_mutex_unlock(&c2->mutex);
-
-        if(count >= first + 4) {
-            break;
+        else {
+            sprintf(&str[len], "%s  %s  Lv.%d  GC: %d\nB: %d  %s\n",
+                    e->name, classes[e->ch_class], e->level + 1,
+                    e->guildcard, e->b->b, __(c, "Logged off"));
         }
-    }
-
-    pthread_rwlock_unlock(&b->lock);
 
-    /* Clean up the regular expression */
-    if(name) {
-        regfree(&re);
+        len = strlen(str);
     }
 
     /* If we have no results, then tell the user that */
@@ -222,93 +422,68 @@ static int pllist_block(ship_client_t *c, const char *name, int first,
     return send_message_box(c, "%s", str);
 }
 
-static int pllist_lobby(ship_client_t *c, const char *name, int first,
-                        int minlvl, int maxlvl, int ch_class) {
-    lobby_t *l = c->cur_lobby;
-    ship_client_t *c2;
-    int i, count = 0, len = 2;
-    char str[512];
-    regex_t re;
-    char ip[INET6_ADDRSTRLEN];
+static int pllist_do(ship_client_t *c, int dom, const char *name, int first,
+                     int minlvl, int maxlvl, int ch_class) {
+    struct pllist_snap *s = c->pllist_snap;
+    pllist_query_t q;
+    char key[128];
+    time_t now = time(NULL);
+    void *where = NULL;
 
-    /* Compile the regular expression if the user asked to search by name */
-    if(name) {
-        if(regcomp(&re, name, REG_EXTENDED | REG_ICASE | REG_NOSUB)) {
-            return send_txt(c, "%s", __(c, "\tE\tC7Invalid name given."));
-        }
+    if(first < 0) {
+        first = 0;
     }
 
-    strcpy(str, "\tE");
+    if(dom == DOMAIN_BLOCK)
+        where = c->cur_block;
+    else if(dom == DOMAIN_LOBBY)
+        where = c->cur_lobby;
 
-    /* Look through all the clients in this lobby for one matching the request
-       that was sent */
-    for(i = 0; i < l->max_clients && count < first + 4; ++i) {
-        if((c2 = l->clients[i])) {
-            pthread_mutex_lock(&c2->mutex);
-
-            /* Make sure the level is in range */
-            if(c2->pl->v1.level < minlvl || c2->pl->v1.level > maxlvl) {
-                pthread_mutex_unlock(&c2->mutex);
-                continue;
-            }
-
-            /* Next check if the class matches the request */
-            if(ch_class != -1 && c2->pl->v1.ch_class != ch_class) {
-                pthread_mutex_unlock(&c2->mutex);
-                continue;
-            }
+    snprintf(key, sizeof(key), "%d %p %d %d %d %s", dom, where, minlvl, maxlvl,
+             ch_class, name ? name : "");
 
-            /* Check the name filter, if given */
-            if(name && regexec(&re, c2->pl->v1.name, 0, NULL, 0)) {
-                pthread_mutex_unlock(&c2->mutex);
-                continue;
-            }
+    /* Asking for a later page of the last search just picks up where it left
+       off. The first page always gets a fresh search. */
+    if(first && s && !strcmp(s->key, key) && now - s->when < PLLIST_SNAP_TIME) {
+        return pllist_send_page(c, s, first);
+    }
 
-            /* If we've gotten here, then the user matches */
-            ++count;
+    if(pllist_query_init(&q, name)) {
+        return send_txt(c, "%s", __(c, "\tE\tC7Invalid name given."));
+    }
 
-            /* If we're on the right page, add the client to the message */
-            if(count >= first) {
-                my_ntop(&c2->ip_addr, ip);
+    if(!s) {
+        if(!(s = (struct pllist_snap *)malloc(sizeof(struct pllist_snap)))) {
+            pllist_query_free(&q);
+            return send_txt(c, "%s", __(c, "\tE\tC7Out of memory."));
+        }
 
-                if(c2->cur_lobby) {
-                    sprintf(&str[len], "%s  %s  Lv.%d  GC: %d\n"
-                            "B: %d  IP: %s  Lobby: %s\n", c2->pl->v1.name,
-                            classes[c2->pl->v1.ch_class], c2->pl->v1.level + 1,
-                            c2->guildcard, c2->cur_block->b, ip,
-                            skip_lang_code(c2->cur_lobby->name));
-                }
-                else {
-                    sprintf(&str[len], "%s  %s  Lv.%d  GC: %d\n"
-                            "B: %d  IP: %s  Lobby: ----\n", c2->pl->v1.name,
-                            classes[c2->pl->v1.ch_class], c2->pl->v1.level + 1,
-                            c2->guildcard, c2->cur_block->b, ip);
-                }
+        c->pllist_snap = s;
+    }
 
-                len = strlen(str);
-            }
+    q.dom = dom;
+    q.b = c->cur_block;
+    q.minlvl = minlvl;
+    q.maxlvl = maxlvl;
+    q.ch_class = ch_class;
 
-            pthread_mutex_unlock(&c2->mutex);
-        }
-    }
+    strcpy(s->key, key);
+    s->when = now;
+    s->count = 0;
 
-    /* Clean up the regular expression */
-    if(name) {
-        regfree(&re);
-    }
+    if(dom == DOMAIN_LOBBY)
+        pllist_search_lobby(c, &q, s);
+    else
+        pllist_search_idx(&q, s);
 
-    /* If we have no results, then tell the user that */
-    if(len == 2) {
-        strcpy(str, __(c, "\tENo matches found."));
-    }
+    pllist_query_free(&q);
 
-    /* Send the message away */
-    return send_message_box(c, "%s", str);
+    return pllist_send_page(c, s, first);
 }
 
 int send_player_list(ship_client_t *c, const char *params) {
     char *lasts = NULL, *tok, *name = NULL;
-    int dom, first = 0, minlvl = 0, maxlvl = 200, ch_class = -1;
+    int dom, first = 0, minlvl = 0, maxlvl = 200, ch_class = -1, rv;
     char *tmp = strdup(params);
 
     /* Set up for string tokenization... */
@@ -437,19 +612,10 @@ int send_player_list(ship_client_t *c, const char *params) {
         }
     }
 
+    /* Do the search (the name points into tmp, so hang on to it until
+       we're done). */
+    rv = pllist_do(c, dom, name, first, minlvl, maxlvl, ch_class);
     free(tmp);
 
-    /* Do the search */
-    switch(dom) {
-        case DOMAIN_SHIP:
-            return pllist_ship(c, name, first, minlvl, maxlvl, ch_class);
-
-        case DOMAIN_BLOCK:
-            return pllist_block(c, name, first, minlvl, maxlvl, ch_class);
-
-        case DOMAIN_LOBBY:
-            return pllist_lobby(c, name, first, minlvl, maxlvl, ch_class);
-    }
-
-    return -1;
+    return rv;
 }
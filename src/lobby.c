@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -37,8 +38,147 @@
 #include "pmtdata.h"
 #include "rtdata.h"
 
+extern size_t lobby_burst_max;
+
 static int td(ship_client_t *c, lobby_t *l, void *req);
 
+/* Lobby mutexes are recursive, since handling the packets queued during a burst
+   goes through the same code as handling them normally (which locks the lobby
+   again). */
+static void lobby_mutex_init(lobby_t *l) {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&l->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Free a lobby structure for good. */
+static void lobby_free(lobby_t *l) {
+    free(l->burst_buf);
+    free_game_enemies(l);
+    pthread_mutex_destroy(&l->mutex);
+    free(l);
+}
+
+/* Has every worker on the block gone back to waiting (or woken up again) since
+   the given lobby epoch? If so, no lookup can still be holding a lobby retired
+   in that epoch. */
+static int lobby_grace_over(block_t *b, uint64_t epoch) {
+    uint64_t e;
+    int i;
+
+    for(i = 0; i < b->num_workers; ++i) {
+        e = __atomic_load_n(&b->workers[i].epoch, __ATOMIC_SEQ_CST);
+
+        if(e && e < epoch)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Move any retired lobbies that nobody can be looking at anymore into the pool
+   if there's room and the block is still running, otherwise free them. The
+   caller must hold the block's lobby_pool_lock. */
+static void lobby_reclaim(block_t *b) {
+    lobby_t *l;
+
+    /* The list is in the order things were retired in, so stop at the first one
+       that's still too new. */
+    while((l = TAILQ_FIRST(&b->lobby_retired))) {
+        if(!lobby_grace_over(b, l->retired))
+            break;
+
+        TAILQ_REMOVE(&b->lobby_retired, l, qentry);
+
+        if(b->run && b->lobby_pool_count < LOBBY_POOL_MAX) {
+            recycle_game_enemies(l);
+            TAILQ_INSERT_HEAD(&b->lobby_pool, l, qentry);
+            ++b->lobby_pool_count;
+        }
+        else {
+            lobby_free(l);
+        }
+    }
+}
+
+/* Grab a lobby structure for a new game, from the block's pool if there's one
+   in there. Either way, everything before the mutex is cleared out and the
+   mutex is ready to use. */
+static lobby_t *lobby_alloc(block_t *b) {
+    lobby_t *l;
+
+    pthread_mutex_lock(&b->lobby_pool_lock);
+    lobby_reclaim(b);
+
+    if((l = TAILQ_FIRST(&b->lobby_pool))) {
+        TAILQ_REMOVE(&b->lobby_pool, l, qentry);
+        --b->lobby_pool_count;
+        ++b->lobby_pool_hits;
+        pthread_mutex_unlock(&b->lobby_pool_lock);
+
+        memset(l, 0, offsetof(lobby_t, mutex));
+        return l;
+    }
+
+    ++b->lobby_pool_misses;
+    pthread_mutex_unlock(&b->lobby_pool_lock);
+
+    if(!(l = (lobby_t *)malloc(sizeof(lobby_t))))
+        return NULL;
+
+    memset(l, 0, sizeof(lobby_t));
+    lobby_mutex_init(l);
+
+    return l;
+}
+
+/* Retire a game's lobby (which must be unlocked, and not in any list). Since
+   lookups by ID don't lock anything, someone might still have found it just
+   before it was taken out of the index, so it has to sit on the block's
+   retired list for a bit before it can be reused or freed. */
+static void lobby_release(lobby_t *l) {
+    block_t *b = l->block;
+
+    free(l->mtypes);
+    free(l->mids);
+    l->mtypes = l->mids = NULL;
+
+    /* Don't keep a burst buffer that grew for one slow joiner around. */
+    if(l->burst_size > LOBBY_BURST_MIN) {
+        free(l->burst_buf);
+        l->burst_buf = NULL;
+        l->burst_size = 0;
+    }
+
+    pthread_mutex_lock(&b->lobby_pool_lock);
+    l->retired = __atomic_add_fetch(&b->lobby_epoch, 1, __ATOMIC_SEQ_CST);
+    TAILQ_INSERT_TAIL(&b->lobby_retired, l, qentry);
+    lobby_reclaim(b);
+    pthread_mutex_unlock(&b->lobby_pool_lock);
+}
+
+void lobby_pool_drain(block_t *b) {
+    lobby_t *l;
+
+    pthread_mutex_lock(&b->lobby_pool_lock);
+
+    while((l = TAILQ_FIRST(&b->lobby_pool))) {
+        TAILQ_REMOVE(&b->lobby_pool, l, qentry);
+        lobby_free(l);
+    }
+
+    while((l = TAILQ_FIRST(&b->lobby_retired))) {
+        TAILQ_REMOVE(&b->lobby_retired, l, qentry);
+        lobby_free(l);
+    }
+
+    b->lobby_pool_count = 0;
+    pthread_mutex_unlock(&b->lobby_pool_lock);
+}
+
 lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
     lobby_t *l = (lobby_t *)malloc(sizeof(lobby_t));
 
@@ -69,11 +209,8 @@ lobby_t *lobby_create_default(block_t *block, uint32_t lobby_id, uint8_t ev) {
         sprintf(l->name, "BLOCK%02d-C%d", block->b, lobby_id - 15);
     }
 
-    /* Initialize the (unused) packet queue */
-    STAILQ_INIT(&l->pkt_queue);
-
     /* Initialize the lobby mutex. */
-    pthread_mutex_init(&l->mutex, NULL);
+    lobby_mutex_init(l);
 
     return l;
 }
@@ -135,8 +272,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                            uint8_t v2, int version, uint8_t section,
                            uint8_t event, uint8_t episode, ship_client_t *c,
                            uint8_t single_player) {
-    lobby_t *l = (lobby_t *)malloc(sizeof(lobby_t));
-    uint32_t id = 0x20;
+    lobby_t *l = lobby_alloc(block);
     int i;
 
     /* If we don't have a lobby, bail. */
@@ -146,16 +282,8 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         return NULL;
     }
 
-    /* Clear it. */
-    memset(l, 0, sizeof(lobby_t));
-
-    /* Select an unused ID. */
-    do {
-        ++id;
-    } while(block_get_lobby(block, id));
-
-    /* Set up the specified parameters. */
-    l->lobby_id = id;
+    /* Set up the specified parameters. The ID gets picked when the game is
+       added to the block. */
     l->type = LOBBY_TYPE_GAME;
 
     if(!single_player)
@@ -197,13 +325,9 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
     l->name[64] = 0;
     l->passwd[64] = 0;
 
-    /* Initialize the packet queue */
-    STAILQ_INIT(&l->pkt_queue);
+    /* Initialize the item queue */
     TAILQ_INIT(&l->item_queue);
 
-    /* Initialize the lobby mutex. */
-    pthread_mutex_init(&l->mutex, NULL);
-
     /* We need episode to be either 1 or 2 for the below map selection code to
        work. On PSODC and PSOPC, it'll be 0 at this point, so make it 1 (as it
        would be expected to be). */
@@ -216,7 +340,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         if(!single_player) {
             for(i = 0; i < 0x20; ++i) {
                 if(maps[episode - 1][i] != 1) {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         maps[episode - 1][i];
                 }
             }
@@ -224,7 +348,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         else {
             for(i = 0; i < 0x20; ++i) {
                 if(sp_maps[episode - 1][i] != 1) {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         sp_maps[episode - 1][i];
                 }
             }
@@ -237,7 +361,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                     l->maps[i] = c->next_maps[i];
                 }
                 else {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         maps[episode - 1][i];
                 }
             }
@@ -248,7 +372,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
                     l->maps[i] = c->next_maps[i];
                 }
                 else {
-                    l->maps[i] = mt19937_genrand_int32(&block->rng) %
+                    l->maps[i] = mt19937_genrand_int32(block_rng(block)) %
                         sp_maps[episode - 1][i];
                 }
             }
@@ -261,28 +385,32 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
     /* If its a Blue Burst lobby, set up the enemy data. */
     if(version == CLIENT_VERSION_BB && bb_load_game_enemies(l)) {
         debug(DBG_WARN, "Error setting up blue burst enemies!\n");
-        pthread_mutex_destroy(&l->mutex);
-        free(l);
+        lobby_release(l);
         return NULL;
     }
     else if(version <= CLIENT_VERSION_PC && map_have_v2_maps() && !battle &&
             !chal && v2_load_game_enemies(l)) {
         debug(DBG_WARN, "Error setting up v1/v2 enemy data!\n");
-        pthread_mutex_destroy(&l->mutex);
-        free(l);
+        lobby_release(l);
         return NULL;
     }
     else if(version == CLIENT_VERSION_GC && map_have_gc_maps() && !battle &&
             !chal && gc_load_game_enemies(l)) {
         debug(DBG_WARN, "Error setting up GC enemy data!\n");
-        pthread_mutex_destroy(&l->mutex);
-        free(l);
+        lobby_release(l);
         return NULL;
     }
 
     /* Add it to the list of lobbies, and increment the game count. */
     if(version != CLIENT_VERSION_PC || battle || chal || difficulty == 3) {
         pthread_rwlock_wrlock(&block->lobby_lock);
+
+        if(block_add_game(block, l)) {
+            pthread_rwlock_unlock(&block->lobby_lock);
+            lobby_destroy_noremove(l);
+            return NULL;
+        }
+
         TAILQ_INSERT_TAIL(&block->lobbies, l, qentry);
         ++block->num_games;
         pthread_rwlock_unlock(&block->lobby_lock);
@@ -290,7 +418,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
         ship_inc_games(block->ship);
     }
 
-    l->rand_seed = mt19937_genrand_int32(&block->rng);
+    l->rand_seed = mt19937_genrand_int32(block_rng(block));
 
     lobby_setup_drops(c, l, sylverant_crc32((uint8_t *)l->name, 16));
 
@@ -299,8 +427,7 @@ lobby_t *lobby_create_game(block_t *block, char *name, char *passwd,
 
 lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
                                uint8_t view_battle, uint8_t section) {
-    lobby_t *l = (lobby_t *)malloc(sizeof(lobby_t));
-    uint32_t id = 0x20;
+    lobby_t *l = lobby_alloc(block);
 
     /* If we don't have a lobby, bail. */
     if(!l) {
@@ -309,16 +436,8 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
         return NULL;
     }
 
-    /* Clear it. */
-    memset(l, 0, sizeof(lobby_t));
-
-    /* Select an unused ID. */
-    do {
-        ++id;
-    } while(block_get_lobby(block, id));
-
-    /* Set up the specified parameters. */
-    l->lobby_id = id;
+    /* Set up the specified parameters. The ID gets picked when the game is
+       added to the block. */
     l->type = LOBBY_TYPE_EP3_GAME;
     l->max_clients = 4;
     l->block = block;
@@ -330,7 +449,7 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
     l->section = section;
     l->min_level = 1;
     l->max_level = 200;
-    l->rand_seed = mt19937_genrand_int32(&block->rng);
+    l->rand_seed = mt19937_genrand_int32(block_rng(block));
     l->create_time = time(NULL);
     l->flags |= LOBBY_FLAG_EP3;
 
@@ -340,14 +459,15 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
     l->name[33] = 0;
     l->passwd[16] = 0;
 
-    /* Initialize the packet queue */
-    STAILQ_INIT(&l->pkt_queue);
-
-    /* Initialize the lobby mutex. */
-    pthread_mutex_init(&l->mutex, NULL);
-
     /* Add it to the list of lobbies, and increment the game count. */
     pthread_rwlock_wrlock(&block->lobby_lock);
+
+    if(block_add_game(block, l)) {
+        pthread_rwlock_unlock(&block->lobby_lock);
+        lobby_destroy_noremove(l);
+        return NULL;
+    }
+
     TAILQ_INSERT_TAIL(&block->lobbies, l, qentry);
     ++block->num_games;
     pthread_rwlock_unlock(&block->lobby_lock);
@@ -356,24 +476,21 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
     return l;
 }
 
-static void lobby_empty_pkt_queue(lobby_t *l) {
-    lobby_pkt_t *i;
-
-    while((i = STAILQ_FIRST(&l->pkt_queue))) {
-        STAILQ_REMOVE_HEAD(&l->pkt_queue, qentry);
-        free(i->pkt);
-        free(i);
-    }
+/* Throw away anything queued up from a burst. */
+static void lobby_burst_reset(lobby_t *l) {
+    l->burst_used = 0;
+    l->burst_pkts = 0;
+    memset(l->burst_pos, 0, sizeof(l->burst_pos));
 }
 
 static void lobby_destroy_locked(lobby_t *l, int remove) {
-    pthread_mutex_t m = l->mutex;
     lobby_item_t *i, *tmp;
 
     /* TAILQ_REMOVE may or may not be safe to use if the item was never actually
        inserted in a list, so don't remove it if it wasn't. */
     if(remove) {
         TAILQ_REMOVE(&l->block->lobbies, l, qentry);
+        block_remove_lobby(l->block, l);
 
         /* Decrement the game count if it got incremented for this lobby */
         if(l->type != LOBBY_TYPE_DEFAULT) {
@@ -382,7 +499,7 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
         }
     }
 
-    lobby_empty_pkt_queue(l);
+    lobby_burst_reset(l);
 
     /* Free up any items left in the lobby for Blue Burst. */
     i = TAILQ_FIRST(&l->item_queue);
@@ -392,15 +509,19 @@ static void lobby_destroy_locked(lobby_t *l, int remove) {
         i = tmp;
     }
 
-    /* Free up the enemy data */
-    if(l->map_enemies) {
-        free_game_enemies(l);
-    }
+    /* Anyone who looked the game up before it went away will see that it's
+       gone once they get the lock. */
+    if(l->type != LOBBY_TYPE_DEFAULT)
+        l->lobby_id = 0;
 
-    free(l);
+    pthread_mutex_unlock(&l->mutex);
 
-    pthread_mutex_unlock(&m);
-    pthread_mutex_destroy(&m);
+    /* Games go back in the block's pool to be reused (enemy data and all), the
+       default lobbies only go away with the block itself. */
+    if(l->type != LOBBY_TYPE_DEFAULT)
+        lobby_release(l);
+    else
+        lobby_free(l);
 }
 
 void lobby_destroy(lobby_t *l) {
@@ -470,14 +591,14 @@ static uint8_t lobby_find_max_challenge(lobby_t *l) {
 }
 
 static int td(ship_client_t *c, lobby_t *l, void *req) {
-    uint32_t r = mt19937_genrand_int32(&c->cur_block->rng);
+    uint32_t r = mt19937_genrand_int32(block_rng(c->cur_block));
     uint32_t i[4] = { 4, 0, 0, 0 };
 
     if((r & 15) != 2) {
         return 0;
     }
 
-    r =mt19937_genrand_int32(&c->cur_block->rng);
+    r =mt19937_genrand_int32(block_rng(c->cur_block));
 
     switch(l->difficulty) {
         case 0:
@@ -568,6 +689,10 @@ static int lobby_add_client_locked(ship_client_t *c, lobby_t *l) {
         c->join_time = time(NULL);
         ++l->num_clients;
 
+        if(l->type != LOBBY_TYPE_DEFAULT) {
+            block_game_list_changed(l->block);
+        }
+
         /* If this player is at a lower challenge level than the rest of the
            lobby, fix the maximum challenge level down to their level. */
         if(l->challenge && l->max_chal > clev) {
@@ -592,6 +717,10 @@ static int lobby_add_client_locked(ship_client_t *c, lobby_t *l) {
             c->join_time = time(NULL);
             ++l->num_clients;
 
+            if(l->type != LOBBY_TYPE_DEFAULT) {
+                block_game_list_changed(l->block);
+            }
+
             /* If this player is at a lower challenge level than the rest of the
                lobby, fix the maximum challenge level down to their level. */
             if(l->challenge && l->max_chal > clev) {
@@ -637,6 +766,7 @@ static int lobby_elect_leader_cross_locked(lobby_t *l) {
         l->flags &= ~LOBBY_FLAG_GC_ALLOWED;
         l->version = CLIENT_VERSION_GC;
         l->episode = 1;
+        block_game_list_changed(l->block);
 
         /* Same loop as above, but without the requirement of not on Gamecube.
            If we're here, everyone's obviously on Gamecube, if anyone's even
@@ -708,10 +838,16 @@ static int lobby_remove_client_locked(ship_client_t *c, int client_id,
         }
     }
 
-    /* Remove the client from our list, and we're done. */
+    /* Remove the client from our list, and we're done. Whoever gets their
+       slot next mustn't take over their last queued movement, either. */
     l->clients[client_id] = NULL;
+    l->burst_pos[client_id] = 0;
     --l->num_clients;
 
+    if(l->type != LOBBY_TYPE_DEFAULT) {
+        block_game_list_changed(l->block);
+    }
+
     /* Make sure the maximum challenge level available hasn't changed... */
     if(l->challenge) {
         l->max_chal = lobby_find_max_challenge(l);
@@ -721,6 +857,7 @@ static int lobby_remove_client_locked(ship_client_t *c, int client_id,
     if(c->cur_lobby == l) {
         c->cur_lobby = NULL;
         c->client_id = 0;
+        c->pos_pending = 0;
     }
 
     return l->type == LOBBY_TYPE_DEFAULT ? 0 : !l->num_clients;
@@ -776,7 +913,7 @@ int lobby_add_to_any(ship_client_t *c, lobby_t *req) {
     return !added;
 }
 
-int lobby_change_lobby(ship_client_t *c, lobby_t *req) {
+int lobby_change_lobby(ship_client_t *c, lobby_t *req, uint32_t id) {
     lobby_t *l = c->cur_lobby;
     int rv = 0;
     int old_cid = c->client_id;
@@ -807,7 +944,7 @@ int lobby_change_lobby(ship_client_t *c, lobby_t *req) {
 
         /* Send the message to the shipgate */
         shipgate_send_lobby_chg(&ship->sg, c->guildcard, l->lobby_id,
-                                l->name);
+                                c->lobby_id, l->name);
 
         return 0;
     }
@@ -819,6 +956,12 @@ int lobby_change_lobby(ship_client_t *c, lobby_t *req) {
         pthread_mutex_lock(&req->mutex);
     }
 
+    /* Make sure it's still the lobby that was asked for. */
+    if(req->lobby_id != id) {
+        rv = -2;
+        goto out;
+    }
+
     /* Don't allow HUcaseal, FOmar, or RAmarl characters in v1 games. */
     if(req->type == LOBBY_TYPE_GAME && req->version == CLIENT_VERSION_DCV1 &&
        c->pl->v1.ch_class > DCPCClassMax) {
@@ -931,6 +1074,7 @@ int lobby_change_lobby(ship_client_t *c, lobby_t *req) {
         memset(c->enemy_kills, 0, sizeof(uint32_t) * 0x60);
         send_game_join(c, c->cur_lobby);
         c->cur_lobby->flags |= LOBBY_FLAG_BURSTING;
+        c->cur_lobby->burst_start = timerwheel_time_ms();
         c->flags |= CLIENT_FLAG_BURSTING;
     }
 
@@ -946,7 +1090,7 @@ int lobby_change_lobby(ship_client_t *c, lobby_t *req) {
 
     /* Send the message to the shipgate */
     shipgate_send_lobby_chg(&ship->sg, c->guildcard, c->cur_lobby->lobby_id,
-                            c->cur_lobby->name);
+                            c->lobby_id, c->cur_lobby->name);
 
 out:
     /* We're done, unlock the locks. */
@@ -1042,9 +1186,14 @@ int lobby_send_pkt_dcnte(lobby_t *l, ship_client_t *c, void *h, void *h2,
 }
 
 int lobby_send_pkt_dc(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
-    dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)h;
+    bcast_t b;
     int i;
 
+    /* Render the packet once per version, rather than once per client. */
+    if(bcast_init(&b, h, 0, 0)) {
+        return -1;
+    }
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -1054,7 +1203,7 @@ int lobby_send_pkt_dc(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
                 continue;
             }
 
-            send_pkt_dc(l->clients[i], hdr);
+            bcast_send(l->clients[i], &b);
         }
     }
 
@@ -1062,9 +1211,14 @@ int lobby_send_pkt_dc(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
 }
 
 int lobby_send_pkt_bb(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
-    bb_pkt_hdr_t *hdr = (bb_pkt_hdr_t *)h;
+    bcast_t b;
     int i;
 
+    /* Render the packet once per version, rather than once per client. */
+    if(bcast_init(&b, h, 1, 0)) {
+        return -1;
+    }
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -1074,7 +1228,7 @@ int lobby_send_pkt_bb(lobby_t *l, ship_client_t *c, void *h, int igcheck) {
                 continue;
             }
 
-            send_pkt_bb(l->clients[i], hdr);
+            bcast_send(l->clients[i], &b);
         }
     }
 
@@ -1116,9 +1270,14 @@ int lobby_info_reply(ship_client_t *c, uint32_t lobby) {
         return send_info_reply(c, __(c, "\tEThis game is no\nlonger active."));
     }
 
-    /* Lock the lobby */
+    /* Lock the lobby, and make sure it's still the one we looked up. */
     pthread_mutex_lock(&l->mutex);
 
+    if(l->lobby_id != lobby) {
+        pthread_mutex_unlock(&l->mutex);
+        return send_info_reply(c, __(c, "\tEThis game is no\nlonger active."));
+    }
+
     /* Check if we should be on page 2 of the info or on the first page. */
     if(c->last_info_req == lobby) {
         /* Calculate any statistics we want for this */
@@ -1341,89 +1500,180 @@ void lobby_legit_check_finish_locked(lobby_t *l) {
     l->flags &= ~(LOBBY_FLAG_LEGIT_CHECK | LOBBY_FLAG_TEMP_UNAVAIL);
 }
 
+/* Handle a packet that was held back during a burst, just like it had only now
+   come in. */
+static int lobby_handle_pkt(ship_client_t *c, dc_pkt_hdr_t *p) {
+    switch(p->pkt_type) {
+        case GAME_COMMAND0_TYPE:
+            return subcmd_handle_bcast(c, (subcmd_pkt_t *)p);
+
+        case GAME_COMMAND2_TYPE:
+        case GAME_COMMANDD_TYPE:
+            return subcmd_handle_one(c, (subcmd_pkt_t *)p);
+    }
+
+    return -1;
+}
+
+int lobby_replay_pkt(ship_client_t *c, uint32_t lobby_id, dc_pkt_hdr_t *p) {
+    lobby_t *l = c->cur_lobby;
+
+    /* If they've moved on since, the packet doesn't mean anything anymore. */
+    if(!l || l->lobby_id != lobby_id)
+        return 0;
+
+    return lobby_handle_pkt(c, p);
+}
+
+/* Handle a queued packet on the worker that owns whoever sent it, since that's
+   the only thread that's allowed to touch them. */
+static int lobby_pass_pkt(lobby_t *l, lobby_pkt_t *i) {
+    block_worker_t *w = i->src->worker;
+
+    if(w && w != block_current_worker() &&
+       !block_post_pkt(w, i->src, l->lobby_id, i->pkt, i->len))
+        return 0;
+
+    return lobby_handle_pkt(i->src, (dc_pkt_hdr_t *)i->pkt);
+}
+
 /* Send out any queued packets when we get a done burst signal. You must hold
    the lobby's lock when calling this. */
 int lobby_handle_done_burst(lobby_t *l) {
     lobby_pkt_t *i;
+    uint32_t off = 0;
+    uint64_t t;
     int rv = 0;
 
-    /* Go through each packet and handle it */
-    while((i = STAILQ_FIRST(&l->pkt_queue))) {
-        STAILQ_REMOVE_HEAD(&l->pkt_queue, qentry);
-
-        /* As long as we haven't run into issues yet, continue sending the
-           queued packets */
-        if(rv == 0) {
-            switch(i->pkt->pkt_type) {
-                case GAME_COMMAND0_TYPE:
-                    if(subcmd_handle_bcast(i->src, (subcmd_pkt_t *)i->pkt)) {
-                        rv = -1;
-                    }
-                    break;
+    /* Keep track of how long the burst took and how much got queued. */
+    if(l->burst_start) {
+        t = timerwheel_time_ms() - l->burst_start;
+        l->burst_start = 0;
+        l->burst_ms_total += t;
+        ++l->bursts;
 
-                case GAME_COMMAND2_TYPE:
-                case GAME_COMMANDD_TYPE:
-                    if(subcmd_handle_one(i->src, (subcmd_pkt_t *)i->pkt)) {
-                        rv = -1;
-                    }
-                    break;
+        if(t > l->burst_ms_max)
+            l->burst_ms_max = t;
+    }
 
-                default:
-                    rv = -1;
-            }
-        }
+    if(l->burst_pkts > l->burst_max_pkts)
+        l->burst_max_pkts = l->burst_pkts;
 
-        free(i->pkt);
-        free(i);
+    if(l->burst_used > l->burst_max_bytes)
+        l->burst_max_bytes = l->burst_used;
+
+    /* Go through each packet and handle it, skipping any that were replaced by
+       a newer one or that came from someone who has left since. As long as we
+       haven't run into issues yet, continue sending the queued packets. */
+    while(off < l->burst_used && !rv) {
+        i = (lobby_pkt_t *)(l->burst_buf + off);
+        off += i->size;
+
+        if(!i->len || l->clients[i->client_id] != i->src)
+            continue;
+
+        if(lobby_pass_pkt(l, i))
+            rv = -1;
     }
 
+    lobby_burst_reset(l);
     return rv;
 }
 
+/* The burst queue is full, so whoever is bursting is taking far too long. Kick
+   them, and handle everything that was held back (and the packet that didn't
+   fit) now, so everyone else can get on with the game. */
+static int lobby_burst_overflow(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p) {
+    int i;
+
+    debug(DBG_WARN, "Burst queue full in game \"%s\", giving up on the "
+          "burst\n", l->name);
+    ++l->burst_overflows;
+
+    for(i = 0; i < l->max_clients; ++i) {
+        if(l->clients[i] && (l->clients[i]->flags & CLIENT_FLAG_BURSTING))
+            client_kick(l->clients[i]);
+    }
+
+    l->flags &= ~LOBBY_FLAG_BURSTING;
+    lobby_handle_done_burst(l);
+
+    return lobby_handle_pkt(c, p);
+}
+
 /* Enqueue a packet for later sending (due to a player bursting) */
 int lobby_enqueue_pkt(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p) {
-    lobby_pkt_t *pkt;
-    int rv = 0;
+    lobby_pkt_t *ent;
     uint16_t len = LE16(p->pkt_len);
-
-    pthread_mutex_lock(&l->mutex);
+    uint32_t need, size, *last = &l->burst_pos[c->client_id];
+    uint8_t *tmp;
+    int pos = 0;
 
     /* Sanity checks... */
-    if(!(l->flags & LOBBY_FLAG_BURSTING)) {
-        rv = -1;
-        goto out;
-    }
+    if(!(l->flags & LOBBY_FLAG_BURSTING))
+        return -1;
 
     if(p->pkt_type != GAME_COMMAND0_TYPE && p->pkt_type != GAME_COMMAND2_TYPE &&
-       p->pkt_type != GAME_COMMANDD_TYPE) {
-        rv = -2;
-        goto out;
-    }
+       p->pkt_type != GAME_COMMANDD_TYPE)
+        return -2;
 
-    /* Allocate space */
-    pkt = (lobby_pkt_t *)malloc(sizeof(lobby_pkt_t));
-    if(!pkt) {
-        rv = -3;
-        goto out;
+    if(p->pkt_type == GAME_COMMAND0_TYPE)
+        pos = is_pos_subcmd(((subcmd_pkt_t *)p)->type);
+
+    need = (sizeof(lobby_pkt_t) + len + 7) & ~7;
+
+    /* A movement packet makes the client's last queued one pointless, as long
+       as nothing else from them was queued in between. Write over the old one
+       if there's room, otherwise skip it when the queue is sent. */
+    if(pos && *last) {
+        ent = (lobby_pkt_t *)(l->burst_buf + *last - 1);
+        ++l->burst_superseded;
+
+        if(need <= ent->size) {
+            memcpy(ent->pkt, p, len);
+            ent->len = len;
+            return 0;
+        }
+
+        ent->len = 0;
+        --l->burst_pkts;
     }
 
-    pkt->pkt = (dc_pkt_hdr_t *)malloc(len);
-    if(!pkt->pkt) {
-        free(pkt);
-        rv = -3;
-        goto out;
+    /* Make room for the packet, up to the limit. */
+    if(l->burst_used + need > l->burst_size) {
+        size = l->burst_size ? l->burst_size : LOBBY_BURST_MIN;
+
+        while(size < l->burst_used + need)
+            size <<= 1;
+
+        if(lobby_burst_max && size > lobby_burst_max)
+            size = lobby_burst_max;
+
+        if(size < l->burst_used + need)
+            return lobby_burst_overflow(l, c, p);
+
+        if(!(tmp = (uint8_t *)realloc(l->burst_buf, size))) {
+            debug(DBG_WARN, "Cannot grow burst queue: %s\n", strerror(errno));
+            return lobby_burst_overflow(l, c, p);
+        }
+
+        l->burst_buf = tmp;
+        l->burst_size = size;
     }
 
-    /* Fill in the struct */
-    pkt->src = c;
-    memcpy(pkt->pkt, p, len);
+    /* Fill in the entry at the end of the queue */
+    ent = (lobby_pkt_t *)(l->burst_buf + l->burst_used);
+    ent->src = c;
+    ent->size = need;
+    ent->len = len;
+    ent->client_id = c->client_id;
+    memcpy(ent->pkt, p, len);
 
-    /* Insert into the packet queue */
-    STAILQ_INSERT_TAIL(&l->pkt_queue, pkt, qentry);
+    *last = pos ? l->burst_used + 1 : 0;
+    l->burst_used += need;
+    ++l->burst_pkts;
 
-out:
-    pthread_mutex_unlock(&l->mutex);
-    return rv;
+    return 0;
 }
 
 /* Add an item to the lobby's inventory. The caller must hold the lobby's mutex
@@ -55,14 +55,19 @@ typedef struct ship ship_t;
 
 typedef struct sylverant_quest_enemy qenemy_t;
 
+/* A packet held back while someone is bursting into a game. These are packed
+   one after another into the lobby's burst buffer, each one padded out so the
+   next starts on an 8 byte boundary. */
 typedef struct lobby_pkt {
-    STAILQ_ENTRY(lobby_pkt) qentry;
-
     ship_client_t *src;
-    dc_pkt_hdr_t *pkt;
+    uint32_t size;                  /* Space taken up in the buffer */
+    uint16_t len;                   /* Packet length, 0 if superseded */
+    uint16_t client_id;
+    uint8_t pkt[];
 } lobby_pkt_t;
 
-STAILQ_HEAD(lobby_pkt_queue, lobby_pkt);
+/* Smallest burst buffer a lobby will allocate. */
+#define LOBBY_BURST_MIN     4096
 
 typedef struct lobby_item {
     TAILQ_ENTRY(lobby_item) qentry;
@@ -75,8 +80,6 @@ TAILQ_HEAD(lobby_item_queue, lobby_item);
 struct lobby {
     TAILQ_ENTRY(lobby) qentry;
 
-    pthread_mutex_t mutex;
-
     uint32_t lobby_id;
     uint32_t type;
     uint32_t flags;
@@ -115,7 +118,27 @@ struct lobby {
 
     ship_client_t *clients[LOBBY_MAX_CLIENTS];
 
-    struct lobby_pkt_queue pkt_queue;
+    /* Packets queued up during a burst. burst_pos holds the offset (plus one)
+       of each client's last queued movement packet, as long as nothing else
+       from that client has been queued after it, so that a newer one can take
+       its place. */
+    uint32_t burst_used;
+    uint32_t burst_pkts;
+    uint32_t burst_pos[LOBBY_MAX_CLIENTS];
+    uint64_t burst_start;           /* When the burst began, in ms */
+
+    /* Burst statistics: how many bursts there have been, the most packets and
+       bytes queued in one, total and longest time spent bursting (in ms), how
+       many movement packets were replaced by newer ones while queued, and how
+       many bursts were cut short by the queue filling up. */
+    uint32_t bursts;
+    uint32_t burst_max_pkts;
+    uint32_t burst_max_bytes;
+    uint64_t burst_ms_total;
+    uint64_t burst_ms_max;
+    uint32_t burst_superseded;
+    uint32_t burst_overflows;
+
     struct lobby_item_queue item_queue;
     time_t create_time;
 
@@ -130,6 +153,28 @@ struct lobby {
     qenemy_t *mids;
 
     int (*dropfunc)(ship_client_t *c, struct lobby *l, void *req);
+
+    /* Movement subcommands replaced by a later one in the same tick, and how
+       many packets that saved sending. */
+    uint32_t pos_coalesced;
+    uint64_t pos_saved;
+
+    /* Everything from here on is left alone when a game's lobby is recycled
+       through the block's lobby pool, so it has to stay at the end. */
+    pthread_mutex_t mutex;
+
+    /* Enemy/object state left over from the last game to use this lobby, to
+       be reused by the next one (see recycle_game_enemies()). */
+    game_enemies_t *spare_enemies;
+    game_objs_t *spare_objs;
+
+    /* Buffer for packets queued during a burst (see lobby_enqueue_pkt()). */
+    uint8_t *burst_buf;
+    uint32_t burst_size;
+
+    /* The block's lobby epoch when this lobby was destroyed (see the block's
+       lobby_retired list). */
+    uint64_t retired;
 };
 
 #ifndef LOBBY_DEFINED
@@ -202,6 +247,10 @@ lobby_t *lobby_create_ep3_game(block_t *block, char *name, char *passwd,
 void lobby_destroy(lobby_t *l);
 void lobby_destroy_noremove(lobby_t *l);
 
+/* Free all the lobbies sitting in a block's pool of destroyed games (and any
+   still waiting to get in there). The block's workers must be stopped. */
+void lobby_pool_drain(block_t *b);
+
 /* Add the client to any available lobby on the current block. */
 int lobby_add_to_any(ship_client_t *c, lobby_t *req);
 
@@ -214,8 +263,10 @@ int lobby_send_pkt_bb(lobby_t *l, ship_client_t *c, void *hdr, int igcheck);
 /* Send a packet to all Episode 3 clients in a lobby. */
 int lobby_send_pkt_ep3(lobby_t *l, ship_client_t *c, void *h);
 
-/* Move the client to the requested lobby, if possible. */
-int lobby_change_lobby(ship_client_t *c, lobby_t *req);
+/* Move the client to the requested lobby, if possible. The lobby's ID is
+   checked again once it's locked, since a game's lobby can be reused for some
+   other game once it's gone. */
+int lobby_change_lobby(ship_client_t *c, lobby_t *req, uint32_t id);
 
 /* Remove a player from a lobby without changing their lobby (for instance, if
    they disconnected). */
@@ -233,10 +284,19 @@ int lobby_check_client_legit(lobby_t *l, ship_t *s, ship_client_t *c);
 /* Finish with a legit check. */
 void lobby_legit_check_finish_locked(lobby_t *l);
 
-/* Send out any queued packets when we get a done burst signal. */
+/* Send out any queued packets when we get a done burst signal. Packets from
+   clients that belong to another worker are posted over to it (see
+   block_post_pkt()). */
 int lobby_handle_done_burst(lobby_t *l);
 
-/* Enqueue a packet for later sending (due to a player bursting) */
+/* Handle a packet held back during a burst in the given game, on the sender's
+   own worker, if the sender is still in that game. */
+int lobby_replay_pkt(ship_client_t *c, uint32_t lobby_id, dc_pkt_hdr_t *p);
+
+/* Enqueue a packet for later sending (due to a player bursting). The caller
+   must hold the lobby's mutex. If this would put more than lobby_burst_max
+   bytes in the queue, the burst is given up on instead: anyone bursting is
+   kicked, and everything queued (along with this packet) is handled now. */
 int lobby_enqueue_pkt(lobby_t *l, ship_client_t *c, dc_pkt_hdr_t *p);
 
 /* Add an item to the lobby's inventory. The caller must hold the lobby's mutex
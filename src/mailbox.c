@@ -0,0 +1,76 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+#include "mailbox.h"
+
+void mailbox_init(mailbox_t *mb) {
+    mb->stub.next = NULL;
+    mb->head = mb->tail = &mb->stub;
+}
+
+void mailbox_post(mailbox_t *mb, mailbox_node_t *n) {
+    mailbox_node_t *prev;
+
+    n->next = NULL;
+
+    /* Claim the tail, then link the old tail to us. Between those two steps
+       the owner just sees the queue as ending at the old tail. */
+    prev = __atomic_exchange_n(&mb->tail, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+mailbox_node_t *mailbox_take(mailbox_t *mb) {
+    mailbox_node_t *head = mb->head, *next, *tail;
+
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    /* Skip over the stub if it's at the front. */
+    if(head == &mb->stub) {
+        if(!next) {
+            return NULL;
+        }
+
+        mb->head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(next) {
+        mb->head = next;
+        return head;
+    }
+
+    /* This is the last node, unless someone's partway through posting. */
+    tail = __atomic_load_n(&mb->tail, __ATOMIC_ACQUIRE);
+
+    if(tail != head) {
+        return NULL;
+    }
+
+    /* Put the stub back at the end so that we can hand out the last node
+       without leaving the queue with nothing in it. */
+    mailbox_post(mb, &mb->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if(next) {
+        mb->head = next;
+        return head;
+    }
+
+    return NULL;
+}
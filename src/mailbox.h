@@ -0,0 +1,46 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+/* A lock-free queue that any number of threads can post to, but only one
+   thread (the one that owns the mailbox) can take things out of. Nodes are
+   meant to be embedded at the start of whatever is being posted. The queue
+   keeps pointers to itself, so it can't be moved once it has been set up. */
+typedef struct mailbox_node {
+    struct mailbox_node *next;
+} mailbox_node_t;
+
+typedef struct mailbox {
+    mailbox_node_t *head;               /* Only touched by the owner */
+    mailbox_node_t *tail;               /* Swapped by the posting threads */
+    mailbox_node_t stub;
+} mailbox_t;
+
+void mailbox_init(mailbox_t *mb);
+
+/* Add a node to the end of the queue. Safe to call from any thread. */
+void mailbox_post(mailbox_t *mb, mailbox_node_t *n);
+
+/* Take the node at the front of the queue, or NULL if it is empty. Only the
+   owning thread may call this. If another thread is in the middle of posting,
+   this may return NULL even though the queue isn't quite empty, so the owner
+   should make sure it gets woken up again by the poster. */
+mailbox_node_t *mailbox_take(mailbox_t *mb);
+
+#endif /* !MAILBOX_H */
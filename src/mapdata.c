@@ -150,7 +150,7 @@ static const uint32_t sp_maps[3][0x20] = {
 
 static const int max_area[3] = { 0x0E, 0x0F, 0x09 };
 
-static int parse_map(map_enemy_t *en, int en_ct, game_enemies_t *game,
+static int parse_map(map_enemy_t *en, int en_ct, map_enemies_t *game,
                      int ep, int alt) {
     int i, j;
     game_enemy_t *gen;
@@ -655,14 +655,13 @@ static int parse_map(map_enemy_t *en, int en_ct, game_enemies_t *game,
 static int read_bb_map_set(int solo, int i, int j) {
     int srv;
     char fn[256];
-    int k, l, nmaps, nvars, m;
+    int k, l, nmaps, nvars;
     FILE *fp;
     long sz;
     map_enemy_t *en;
     map_object_t *obj;
-    game_object_t *gobj;
-    game_enemies_t *tmp;
-    game_objs_t *tmp2;
+    map_enemies_t *tmp;
+    map_objs_t *tmp2;
 
     if(!solo) {
         nmaps = maps[i][j << 1];
@@ -678,7 +677,7 @@ static int read_bb_map_set(int solo, int i, int j) {
     bb_parsed_objs[solo][i][j].map_count = nmaps;
     bb_parsed_objs[solo][i][j].variation_count = nvars;
 
-    if(!(tmp = (game_enemies_t *)malloc(sizeof(game_enemies_t) * nmaps *
+    if(!(tmp = (map_enemies_t *)malloc(sizeof(map_enemies_t) * nmaps *
                                         nvars))) {
         debug(DBG_ERROR, "Cannot allocate for maps: %s\n",
               strerror(errno));
@@ -687,7 +686,7 @@ static int read_bb_map_set(int solo, int i, int j) {
 
     bb_parsed_maps[solo][i][j].data = tmp;
 
-    if(!(tmp2 = (game_objs_t *)malloc(sizeof(game_objs_t) * nmaps * nvars))) {
+    if(!(tmp2 = (map_objs_t *)malloc(sizeof(map_objs_t) * nmaps * nvars))) {
         debug(DBG_ERROR, "Cannot allocate for objs: %s\n", strerror(errno));
         return 11;
     }
@@ -843,25 +842,10 @@ static int read_bb_map_set(int solo, int i, int j) {
             /* We're done with the file, so close it */
             fclose(fp);
 
-            /* Make space for the game object representation. */
-            gobj = (game_object_t *)malloc((sz / 0x44) * sizeof(game_object_t));
-            if(!gobj) {
-                debug(DBG_ERROR, "Cannot allocate game objects: %s\n",
-                      strerror(errno));
-                free(obj);
-                fclose(fp);
-                return 9;
-            }
-
-            /* Store what we'll actually use later... */
-            for(m = 0; m < sz / 0x44; ++m) {
-                gobj[m].data = obj[m];
-                gobj[m].flags = 0;
-            }
-
-            /* Save it into the struct */
+            /* Save it into the struct. Games use the objects straight out of
+               here, so there's no need to copy them anywhere else. */
             tmp2[k * nvars + l].count = sz / 0x44;
-            tmp2[k * nvars + l].objs = gobj;
+            tmp2[k * nvars + l].objs = obj;
         }
     }
 
@@ -871,14 +855,13 @@ static int read_bb_map_set(int solo, int i, int j) {
 static int read_v2_map_set(int j, int gcep) {
     int srv, ep;
     char fn[256];
-    int k, l, nmaps, nvars, i;
+    int k, l, nmaps, nvars;
     FILE *fp;
     long sz;
     map_enemy_t *en;
     map_object_t *obj;
-    game_object_t *gobj;
-    game_enemies_t *tmp;
-    game_objs_t *tmp2;
+    map_enemies_t *tmp;
+    map_objs_t *tmp2;
 
     if(!gcep) {
         nmaps = maps[0][j << 1];
@@ -904,7 +887,7 @@ static int read_v2_map_set(int j, int gcep) {
         gc_parsed_objs[gcep - 1][j].variation_count = nvars;
     }
 
-    if(!(tmp = (game_enemies_t *)malloc(sizeof(game_enemies_t) * nmaps *
+    if(!(tmp = (map_enemies_t *)malloc(sizeof(map_enemies_t) * nmaps *
                                         nvars))) {
         debug(DBG_ERROR, "Cannot allocate for maps: %s\n", strerror(errno));
         return 10;
@@ -915,7 +898,7 @@ static int read_v2_map_set(int j, int gcep) {
     else
         gc_parsed_maps[gcep - 1][j].data = tmp;
 
-    if(!(tmp2 = (game_objs_t *)malloc(sizeof(game_objs_t) * nmaps * nvars))) {
+    if(!(tmp2 = (map_objs_t *)malloc(sizeof(map_objs_t) * nmaps * nvars))) {
         debug(DBG_ERROR, "Cannot allocate for objs: %s\n", strerror(errno));
         return 11;
     }
@@ -1054,25 +1037,10 @@ static int read_v2_map_set(int j, int gcep) {
             /* We're done with the file, so close it */
             fclose(fp);
 
-            /* Make space for the game object representation. */
-            gobj = (game_object_t *)malloc((sz / 0x44) * sizeof(game_object_t));
-            if(!gobj) {
-                debug(DBG_ERROR, "Cannot allocate game objects: %s\n",
-                      strerror(errno));
-                free(obj);
-                fclose(fp);
-                return 9;
-            }
-
-            /* Store what we'll actually use later... */
-            for(i = 0; i < sz / 0x44; ++i) {
-                gobj[i].data = obj[i];
-                gobj[i].flags = 0;
-            }
-
-            /* Save it into the struct */
+            /* Save it into the struct. Games use the objects straight out of
+               here, so there's no need to copy them anywhere else. */
             tmp2[k * nvars + l].count = sz / 0x44;
-            tmp2[k * nvars + l].objs = gobj;
+            tmp2[k * nvars + l].objs = obj;
         }
     }
 
@@ -1392,20 +1360,143 @@ void gc_free_params(void) {
     }
 }
 
-int bb_load_game_enemies(lobby_t *l) {
+/* Set up the per-game state for the given number of enemies and objects, all
+   cleared out. The buffers already there are reused if they're big enough. */
+static int alloc_game_state(game_enemies_t *en, uint32_t enemies,
+                            game_objs_t *ob, uint32_t objects) {
+    uint8_t *st = en->clients_hit;
+    uint32_t *fl = ob->flags;
+
+    /* Always allocate at least a little bit, so that an empty map still has
+       state to free later on. */
+    if(!st || enemies > en->state_max) {
+        if(!(st = (uint8_t *)malloc(enemies * 3 + 1))) {
+            debug(DBG_ERROR, "Error allocating enemy state: %s\n",
+                  strerror(errno));
+            return -1;
+        }
+    }
+
+    if(!fl || objects > ob->flags_max) {
+        if(!(fl = (uint32_t *)malloc(sizeof(uint32_t) * (objects + 1)))) {
+            debug(DBG_ERROR, "Error allocating object state: %s\n",
+                  strerror(errno));
+
+            if(st != en->clients_hit)
+                free(st);
+
+            return -1;
+        }
+    }
+
+    if(st != en->clients_hit) {
+        free(en->clients_hit);
+        en->state_max = enemies;
+    }
+
+    if(fl != ob->flags) {
+        free(ob->flags);
+        ob->flags_max = objects;
+    }
+
+    memset(st, 0, enemies * 3 + 1);
+    memset(fl, 0, sizeof(uint32_t) * (objects + 1));
+
+    en->clients_hit = st;
+    en->last_client = st + enemies;
+    en->drop_done = st + enemies * 2;
+    ob->flags = fl;
+
+    return 0;
+}
+
+/* Figure out the fixups to apply to Dark Falz' data for difficulties other
+   than normal. */
+static void set_enemy_fixups(game_enemies_t *en, lobby_t *l) {
+    en->falz_fix = l->difficulty ? 1 : 0;
+}
+
+/* Set up the enemies and objects of a game from the sets picked out of the
+   parsed map data. The sets themselves aren't copied, only pointed at. */
+static int build_game_enemies(lobby_t *l, map_enemies_t *sets[0x10],
+                              map_objs_t *osets[0x10]) {
     game_enemies_t *en;
     game_objs_t *ob;
+    int i;
+
+    /* Use the sets left over from the last game in this lobby structure if
+       there are any, otherwise allocate new ones. */
+    if(l->spare_enemies && l->spare_objs) {
+        en = l->spare_enemies;
+        ob = l->spare_objs;
+        l->spare_enemies = NULL;
+        l->spare_objs = NULL;
+        en->count = ob->count = 0;
+    }
+    else {
+        if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
+            debug(DBG_ERROR, "Error allocating enemy set: %s\n",
+                  strerror(errno));
+            return -2;
+        }
+
+        if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
+            debug(DBG_ERROR, "Error allocating object set: %s\n",
+                  strerror(errno));
+            free(en);
+            return -4;
+        }
+
+        memset(en, 0, sizeof(game_enemies_t));
+        memset(ob, 0, sizeof(game_objs_t));
+    }
+
+    /* Point at each set, keeping track of where each one starts. */
+    for(i = 0; i < 0x10; ++i) {
+        if(!sets[i] || !osets[i])
+            break;
+
+        en->base[i] = en->count;
+        en->sets[i] = sets[i]->enemies;
+        en->count += sets[i]->count;
+
+        ob->base[i] = ob->count;
+        ob->sets[i] = osets[i]->objs;
+        ob->count += osets[i]->count;
+    }
+
+    en->num_sets = ob->num_sets = i;
+    en->base[i] = en->count;
+    ob->base[i] = ob->count;
+
+    if(alloc_game_state(en, en->count, ob, ob->count)) {
+        free(ob->flags);
+        free(ob);
+        free(en->clients_hit);
+        free(en);
+        return -3;
+    }
+
+    set_enemy_fixups(en, l);
+
+    /* Done! */
+    l->map_enemies = en;
+    l->map_objs = ob;
+    return 0;
+}
+
+int bb_load_game_enemies(lobby_t *l) {
     int solo = (l->flags & LOBBY_FLAG_SINGLEPLAYER) ? 1 : 0, i;
-    uint32_t enemies = 0, index, objects = 0, index2;
+    uint32_t index;
     parsed_map_t *maps;
     parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
+    map_enemies_t *sets[0x10];
+    map_objs_t *osets[0x10];
 
     /* Figure out the parameter set that will be in use first... */
     l->bb_params = battle_params[solo][l->episode - 1][l->difficulty];
 
-    /* Figure out the total number of enemies that the game will have... */
+    /* Figure out which sets of enemies the game will have... */
     for(i = 0; i < 0x20; i += 2) {
         maps = &bb_parsed_maps[solo][l->episode - 1][i >> 1];
         objs = &bb_parsed_objs[solo][l->episode - 1][i >> 1];
@@ -1425,99 +1516,22 @@ int bb_load_game_enemies(lobby_t *l) {
         }
 
         index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
         sets[i >> 1] = &maps->data[index];
         osets[i >> 1] = &objs->data[index];
     }
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
-    }
-
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
-
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
-
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
-
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
-
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
-
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
-
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
-    }
-
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
-    return 0;
+    return build_game_enemies(l, sets, osets);
 }
 
 int v2_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
     int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
+    uint32_t index;
     parsed_map_t *maps;
     parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
+    map_enemies_t *sets[0x10];
+    map_objs_t *osets[0x10];
 
-    /* Figure out the total number of enemies that the game will have... */
+    /* Figure out which sets of enemies the game will have... */
     for(i = 0; i < 0x20; i += 2) {
         maps = &v2_parsed_maps[i >> 1];
         objs = &v2_parsed_objs[i >> 1];
@@ -1537,83 +1551,22 @@ int v2_load_game_enemies(lobby_t *l) {
         }
 
         index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
         sets[i >> 1] = &maps->data[index];
         osets[i >> 1] = &objs->data[index];
     }
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
-    }
-
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
-
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
-    }
-
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
-    }
-
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
-
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
-
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
-    }
-
-    /* Fixup Dark Falz' data for difficulties other than normal... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-    }
-
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
-    return 0;
+    return build_game_enemies(l, sets, osets);
 }
 
 int gc_load_game_enemies(lobby_t *l) {
-    game_enemies_t *en;
-    game_objs_t *ob;
     int i;
-    uint32_t enemies = 0, index, objects = 0, index2;
+    uint32_t index;
     parsed_map_t *maps;
     parsed_objs_t *objs;
-    game_enemies_t *sets[0x10];
-    game_objs_t *osets[0x10];
+    map_enemies_t *sets[0x10];
+    map_objs_t *osets[0x10];
 
-    /* Figure out the total number of enemies that the game will have... */
+    /* Figure out which sets of enemies the game will have... */
     for(i = 0; i < 0x20; i += 2) {
         maps = &gc_parsed_maps[l->episode - 1][i >> 1];
         objs = &gc_parsed_objs[l->episode - 1][i >> 1];
@@ -1633,101 +1586,64 @@ int gc_load_game_enemies(lobby_t *l) {
         }
 
         index = l->maps[i] * maps->variation_count + l->maps[i + 1];
-        enemies += maps->data[index].count;
-        objects += objs->data[index].count;
         sets[i >> 1] = &maps->data[index];
         osets[i >> 1] = &objs->data[index];
     }
 
-    /* Allocate space for the enemy set and the enemies therein. */
-    if(!(en = (game_enemies_t *)malloc(sizeof(game_enemies_t)))) {
-        debug(DBG_ERROR, "Error allocating enemy set: %s\n", strerror(errno));
-        return -2;
-    }
-
-    if(!(en->enemies = (game_enemy_t *)malloc(sizeof(game_enemy_t) *
-                                              enemies))) {
-        debug(DBG_ERROR, "Error allocating enemies: %s\n", strerror(errno));
-        free(en);
-        return -3;
-    }
+    return build_game_enemies(l, sets, osets);
+}
 
-    /* Allocate space for the object set and the objects therein. */
-    if(!(ob = (game_objs_t *)malloc(sizeof(game_objs_t)))) {
-        debug(DBG_ERROR, "Error allocating object set: %s\n", strerror(errno));
-        free(en->enemies);
-        free(en);
-        return -4;
+void free_game_enemies(lobby_t *l) {
+    if(l->map_enemies) {
+        free(l->map_enemies->clients_hit);
+        free(l->map_enemies->owned);
+        free(l->map_enemies);
     }
 
-    if(!(ob->objs = (game_object_t *)malloc(sizeof(game_object_t) * objects))) {
-        debug(DBG_ERROR, "Error allocating objects: %s\n", strerror(errno));
-        free(ob);
-        free(en->enemies);
-        free(en);
-        return -5;
+    if(l->map_objs) {
+        free(l->map_objs->flags);
+        free(l->map_objs->owned);
+        free(l->map_objs);
     }
 
-    en->count = enemies;
-    ob->count = objects;
-    index = index2 = 0;
-
-    /* Copy in the enemy data. */
-    for(i = 0; i < 0x10; ++i) {
-        if(!sets[i] || !osets[i])
-            break;
-
-        memcpy(&en->enemies[index], sets[i]->enemies,
-               sizeof(game_enemy_t) * sets[i]->count);
-        index += sets[i]->count;
-
-        memcpy(&ob->objs[index2], osets[i]->objs,
-               sizeof(game_object_t) * osets[i]->count);
-        index2 += osets[i]->count;
+    if(l->spare_enemies) {
+        free(l->spare_enemies->clients_hit);
+        free(l->spare_enemies);
     }
 
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < en->count; ++i) {
-        if(en->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            en->enemies[i].bp_entry = 0x38;
-        }
-        else if(en->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    en->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    en->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    en->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    en->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
+    if(l->spare_objs) {
+        free(l->spare_objs->flags);
+        free(l->spare_objs);
     }
 
-    /* Done! */
-    l->map_enemies = en;
-    l->map_objs = ob;
-    return 0;
+    l->map_enemies = NULL;
+    l->map_objs = NULL;
+    l->spare_enemies = NULL;
+    l->spare_objs = NULL;
+    l->bb_params = NULL;
 }
 
-void free_game_enemies(lobby_t *l) {
-    if(l->map_enemies) {
-        free(l->map_enemies->enemies);
-        free(l->map_enemies);
-    }
+void recycle_game_enemies(lobby_t *l) {
+    game_enemies_t *en = l->map_enemies;
+    game_objs_t *ob = l->map_objs;
 
-    if(l->map_objs) {
-        free(l->map_objs->objs);
-        free(l->map_objs);
+    /* If there's nothing to keep (or somehow there's already something kept),
+       then just free it all. */
+    if(!en || !ob || l->spare_enemies || l->spare_objs) {
+        free_game_enemies(l);
+        return;
     }
 
+    /* Quest data is sized for the quest, so don't bother keeping it. */
+    free(en->owned);
+    free(ob->owned);
+    en->owned = NULL;
+    ob->owned = NULL;
+
+    l->spare_enemies = en;
+    l->spare_objs = ob;
     l->map_enemies = NULL;
+    l->map_objs = NULL;
     l->bb_params = NULL;
 }
 
@@ -1785,7 +1701,7 @@ int cache_quest_enemies(const char *ofn, const uint8_t *dat, uint32_t sz,
     int i, alt;
     uint32_t index, area, objects, j;
     const quest_dat_hdr_t *ptrs[2][17] = { { 0 } };
-    game_enemies_t tmp_en;
+    map_enemies_t tmp_en;
     FILE *fp;
     const quest_dat_hdr_t *hdr;
     off_t offs;
@@ -1887,8 +1803,11 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
     FILE *fp;
     size_t dlen = strlen(ship->cfg->quests_dir);
     char fn[dlen + 40];
-    void *tmp;
-    uint32_t cnt, i;
+    game_enemies_t *en = l->map_enemies;
+    game_objs_t *ob = l->map_objs;
+    game_enemy_t *enemies;
+    map_object_t *objs;
+    uint32_t cnt, ocnt, i;
     sylverant_quest_t *q;
     quest_map_elem_t *el;
 
@@ -1919,77 +1838,75 @@ int load_quest_enemies(lobby_t *l, uint32_t qid, int ver) {
         return -2;
     }
 
-    /* Reallocate the objects array. */
-    l->map_objs->count = cnt = LE32(cnt);
-    if(!(tmp = realloc(l->map_objs->objs, cnt * sizeof(game_object_t)))) {
-        debug(DBG_WARN, "Cannot reallocate objects array: %s\n",
+    /* Read the objects in from the cache file. */
+    ocnt = LE32(cnt);
+    if(!(objs = (map_object_t *)malloc(ocnt * sizeof(map_object_t) + 1))) {
+        debug(DBG_WARN, "Cannot allocate objects array: %s\n",
               strerror(errno));
         fclose(fp);
         return -3;
     }
 
-    l->map_objs->objs = (game_object_t *)tmp;
-
-    /* Read the objects in from the cache file. */
-    for(i = 0; i < cnt; ++i) {
-        if(fread(&l->map_objs->objs[i].data, 1, sizeof(map_object_t),
-                 fp) != sizeof(map_object_t)) {
-            debug(DBG_WARN, "Cannot read map cache: %s\n", strerror(errno));
-            fclose(fp);
-            return -4;
-        }
-
-        l->map_objs->objs[i].flags = 0;
+    if(fread(objs, sizeof(map_object_t), ocnt, fp) != ocnt) {
+        debug(DBG_WARN, "Cannot read map cache: %s\n", strerror(errno));
+        free(objs);
+        fclose(fp);
+        return -4;
     }
 
     if(fread(&cnt, 1, 4, fp) != 4) {
         debug(DBG_WARN, "Cannot read file \"%s\": %s\n", fn, strerror(errno));
+        free(objs);
         fclose(fp);
         return -5;
     }
 
-    /* Reallocate the enemies array. */
-    l->map_enemies->count = cnt = LE32(cnt);
-    if(!(tmp = realloc(l->map_enemies->enemies, cnt * sizeof(game_enemy_t)))) {
-        debug(DBG_WARN, "Cannot reallocate enemies array: %s\n",
+    /* Read the enemies in from the cache file. */
+    cnt = LE32(cnt);
+    if(!(enemies = (game_enemy_t *)malloc(cnt * sizeof(game_enemy_t) + 1))) {
+        debug(DBG_WARN, "Cannot allocate enemies array: %s\n",
               strerror(errno));
+        free(objs);
         fclose(fp);
         return -6;
     }
 
-    l->map_enemies->enemies = (game_enemy_t *)tmp;
-
-    /* Read the enemies in from the cache file. */
-    if(fread(l->map_enemies->enemies, sizeof(game_enemy_t), cnt, fp) != cnt) {
+    if(fread(enemies, sizeof(game_enemy_t), cnt, fp) != cnt) {
         debug(DBG_WARN, "Cannot read map cache: %s\n", strerror(errno));
+        free(enemies);
+        free(objs);
         fclose(fp);
         return -7;
     }
 
-    /* Fixup Dark Falz' data for difficulties other than normal and the special
-       Rappy data too... */
-    for(i = 0; i < cnt; ++i) {
-        if(l->map_enemies->enemies[i].bp_entry == 0x37 && l->difficulty) {
-            l->map_enemies->enemies[i].bp_entry = 0x38;
-        }
-        else if(l->map_enemies->enemies[i].rt_index == (uint8_t)-1) {
-            switch(l->event) {
-                case LOBBY_EVENT_CHRISTMAS:
-                    l->map_enemies->enemies[i].rt_index = 79;
-                    break;
-                case LOBBY_EVENT_EASTER:
-                    l->map_enemies->enemies[i].rt_index = 81;
-                    break;
-                case LOBBY_EVENT_HALLOWEEN:
-                    l->map_enemies->enemies[i].rt_index = 80;
-                    break;
-                default:
-                    l->map_enemies->enemies[i].rt_index = 51;
-                    break;
-            }
-        }
+    /* Start the game's state over for the quest's enemies and objects. */
+    if(alloc_game_state(en, cnt, ob, ocnt)) {
+        free(enemies);
+        free(objs);
+        fclose(fp);
+        return -6;
     }
 
+    /* The quest's data belongs to this game alone, so it replaces the shared
+       sets entirely. */
+    free(ob->owned);
+    ob->owned = objs;
+    ob->count = ocnt;
+    ob->num_sets = 1;
+    ob->sets[0] = objs;
+    ob->base[0] = 0;
+    ob->base[1] = ocnt;
+
+    free(en->owned);
+    en->owned = enemies;
+    en->count = cnt;
+    en->num_sets = 1;
+    en->sets[0] = enemies;
+    en->base[0] = 0;
+    en->base[1] = cnt;
+
+    set_enemy_fixups(en, l);
+
     /* Find the quest since we need to check the enemies later for drops... */
     if(!(el = quest_lookup(&ship->qmap, qid))) {
         debug(DBG_WARN, "Cannot look up quest?!\n");
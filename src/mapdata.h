@@ -107,7 +107,10 @@ typedef struct map_object {
     };
 } PACKED map_object_t;
 
-/* Enemy data as used in the game. */
+/* Enemy data as parsed from the map files. This is also the format that the
+   enemies are stored in within the quest map cache, so the layout must not
+   change. The last three fields are unused here, the game_enemies_t for each
+   game keeps its own copy of them. */
 typedef struct game_enemy {
     uint32_t bp_entry;
     uint8_t rt_index;
@@ -116,34 +119,94 @@ typedef struct game_enemy {
     uint8_t drop_done;
 } game_enemy_t;
 
-typedef struct game_enemies {
+typedef struct map_enemies {
     uint32_t count;
     game_enemy_t *enemies;
-} game_enemies_t;
+} map_enemies_t;
 
 typedef struct parsed_map {
     uint32_t map_count;
     uint32_t variation_count;
-    game_enemies_t *data;
+    map_enemies_t *data;
 } parsed_map_t;
 
-/* Object data as used in the game. */
-typedef struct game_object {
-    map_object_t data;
-    uint32_t flags;
-} game_object_t;
-
-typedef struct game_objects {
+typedef struct map_objects {
     uint32_t count;
-    game_object_t *objs;
-} game_objs_t;
+    map_object_t *objs;
+} map_objs_t;
 
 typedef struct parsed_objects {
     uint32_t map_count;
     uint32_t variation_count;
-    game_objs_t *data;
+    map_objs_t *data;
 } parsed_objs_t;
 
+/* Enemy data as used in the game. The parsed map data is shared by every game
+   and never modified after it is loaded, so a game only points at the sets it
+   is made up of. The difficulty fixups are applied when an enemy is looked
+   up, and the state that changes during the game is kept in arrays of its
+   own, indexed by enemy id. */
+typedef struct game_enemies {
+    uint32_t count;
+    uint32_t num_sets;
+    uint32_t base[0x11];
+    const game_enemy_t *sets[0x10];
+    game_enemy_t *owned;            /* Quest enemies (not shared) */
+
+    uint8_t falz_fix;
+
+    uint8_t *clients_hit;
+    uint8_t *last_client;
+    uint8_t *drop_done;
+    uint32_t state_max;             /* Enemies the state arrays can hold */
+} game_enemies_t;
+
+/* Object data as used in the game. The objects themselves are shared, the
+   same way as the enemies are. */
+typedef struct game_objects {
+    uint32_t count;
+    uint32_t num_sets;
+    uint32_t base[0x11];
+    const map_object_t *sets[0x10];
+    map_object_t *owned;            /* Quest objects (not shared) */
+
+    uint32_t *flags;
+    uint32_t flags_max;             /* Objects the flags array can hold */
+} game_objs_t;
+
+/* Find the set that an enemy/object is in. The id must be less than the count
+   of enemies/objects in the game. */
+static inline const game_enemy_t *game_enemy_get(const game_enemies_t *en,
+                                                 uint32_t mid) {
+    uint32_t i = 0;
+
+    while(mid >= en->base[i + 1])
+        ++i;
+
+    return &en->sets[i][mid - en->base[i]];
+}
+
+static inline const map_object_t *game_obj_get(const game_objs_t *ob,
+                                               uint32_t oid) {
+    uint32_t i = 0;
+
+    while(oid >= ob->base[i + 1])
+        ++i;
+
+    return &ob->sets[i][oid - ob->base[i]];
+}
+
+/* Battle parameter entry of an enemy, with Dark Falz' data fixed up for
+   difficulties other than normal. */
+static inline uint32_t game_enemy_bp(const game_enemies_t *en, uint32_t mid) {
+    uint32_t bp = game_enemy_get(en, mid)->bp_entry;
+
+    if(bp == 0x37 && en->falz_fix)
+        return 0x38;
+
+    return bp;
+}
+
 #undef PACKED
 
 #ifndef LOBBY_DEFINED
@@ -169,6 +232,11 @@ int v2_load_game_enemies(lobby_t *l);
 int gc_load_game_enemies(lobby_t *l);
 void free_game_enemies(lobby_t *l);
 
+/* Hang on to the enemy/object state of a game that is over in the lobby's
+   spare_enemies/spare_objs, so that the next game to use the lobby structure
+   can reuse the buffers (if they're big enough). */
+void recycle_game_enemies(lobby_t *l);
+
 int map_have_v2_maps(void);
 int map_have_gc_maps(void);
 int map_have_bb_maps(void);
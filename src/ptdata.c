@@ -1329,7 +1329,6 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
     int csr = 0;
     uint32_t qdrop = 0xFFFFFFFF;
 
@@ -1371,7 +1370,7 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
@@ -1379,11 +1378,10 @@ int pt_generate_v2_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
-    if(enemy->drop_done)
+    if(l->map_enemies->drop_done[mid])
         return 0;
 
-    enemy->drop_done = 1;
+    l->map_enemies->drop_done[mid] = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
     rnd = mt19937_genrand_int32(rng) % 100;
@@ -1569,8 +1567,7 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v2_entry_t *ent = &v2_ptdata[l->difficulty][section];
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -1585,18 +1582,17 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    if(l->map_objs->flags[obj_id] & 0x00000001)
         return 0;
 
-    obj = &gobj->data;
+    obj = game_obj_get(l->map_objs, obj_id);
 
     /* Figure out the area we'll be worried with */
     area = c->cur_area;
@@ -1627,7 +1623,7 @@ int pt_generate_v2_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->flags[obj_id] |= 0x00000001;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
@@ -1838,7 +1834,6 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
     int csr = 0;
 
     /* Make sure the PT index in the packet is sane */
@@ -1917,7 +1912,7 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
@@ -1925,11 +1920,10 @@ int pt_generate_gc_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
-    if(enemy->drop_done)
+    if(l->map_enemies->drop_done[mid])
         return 0;
 
-    enemy->drop_done = 1;
+    l->map_enemies->drop_done[mid] = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
     rnd = mt19937_genrand_int32(rng) % 100;
@@ -2087,8 +2081,7 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->v1.section;
     pt_v3_entry_t *ent = &gc_ptdata[l->episode - 1][l->difficulty][section];
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -2102,18 +2095,17 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    if(l->map_objs->flags[obj_id] & 0x00000001)
         return 0;
 
-    obj = &gobj->data;
+    obj = game_obj_get(l->map_objs, obj_id);
 
     /* Figure out the area we'll be worried with */
     area = c->cur_area;
@@ -2174,7 +2166,7 @@ int pt_generate_gc_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->flags[obj_id] |= 0x00000001;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
@@ -2365,7 +2357,6 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     int area, do_rare = 1;
     struct mt19937_state *rng = &c->cur_block->rng;
     uint16_t mid;
-    game_enemy_t *enemy;
     int csr = 0;
 
     /* XXXX: Handle Episode 4 */
@@ -2441,7 +2432,7 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Make sure the enemy's id is sane... */
     mid = LE16(req->req);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " requested drop for invalid "
               "enemy (%d -- max: %d, quest=%" PRIu32 ")!\n", c->guildcard, mid,
               l->map_enemies->count, l->qid);
@@ -2449,11 +2440,10 @@ int pt_generate_bb_drop(ship_client_t *c, lobby_t *l, void *r) {
     }
 
     /* Grab the map enemy to make sure it hasn't already dropped something. */
-    enemy = &l->map_enemies->enemies[mid];
-    if(enemy->drop_done)
+    if(l->map_enemies->drop_done[mid])
         return 0;
 
-    enemy->drop_done = 1;
+    l->map_enemies->drop_done[mid] = 1;
 
     /* See if the enemy is going to drop anything at all this time... */
     rnd = mt19937_genrand_int32(rng) % 100;
@@ -2611,8 +2601,7 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     int section = l->clients[l->leader_id]->pl->bb.character.section;
     pt_v3_entry_t *ent;
     uint16_t obj_id;
-    game_object_t *gobj;
-    map_object_t *obj;
+    const map_object_t *obj;
     uint32_t rnd, t1, t2;
     int area, do_rare = 1;
     uint32_t item[4];
@@ -2632,18 +2621,17 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
 
     /* Grab the object ID and make sure its sane, then grab the object itself */
     obj_id = LE16(req->req);
-    if(obj_id > l->map_objs->count) {
+    if(obj_id >= l->map_objs->count) {
         debug(DBG_WARN, "Guildard %u requested drop from invalid box\n",
               c->guildcard);
         return -1;
     }
 
     /* Don't bother if the box has already been opened */
-    gobj = &l->map_objs->objs[obj_id];
-    if(gobj->flags & 0x00000001)
+    if(l->map_objs->flags[obj_id] & 0x00000001)
         return 0;
 
-    obj = &gobj->data;
+    obj = game_obj_get(l->map_objs, obj_id);
 
     /* Figure out the area we'll be worried with */
     area = c->cur_area;
@@ -2704,7 +2692,7 @@ int pt_generate_bb_boxdrop(ship_client_t *c, lobby_t *l, void *r) {
     --area;
 
     /* Mark the box as spent now... */
-    gobj->flags |= 0x00000001;
+    l->map_objs->flags[obj_id] |= 0x00000001;
 
     /* See if we'll do a rare roll. */
     if(l->qid) {
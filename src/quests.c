@@ -31,6 +31,10 @@
 #include "ship.h"
 #include "packets.h"
 
+extern size_t quest_payload_max;
+
+quest_payload_stats_t quest_payload_stats;
+
 /* Find a quest by ID, if it exists */
 quest_map_elem_t *quest_lookup(quest_map_t *map, uint32_t qid) {
     quest_map_elem_t *i;
@@ -64,6 +68,28 @@ quest_map_elem_t *quest_add(quest_map_t *map, uint32_t qid) {
     return el;
 }
 
+/* Throw away all of a quest's payloads. */
+static void quest_payload_cleanup(quest_map_elem_t *el) {
+    quest_payload_t *p;
+    int i, j, k;
+
+    for(i = 0; i < CLIENT_VERSION_COUNT; ++i) {
+        for(j = 0; j < CLIENT_LANG_COUNT; ++j) {
+            for(k = 0; k < 2; ++k) {
+                if((p = el->payload[i][j][k])) {
+                    __atomic_sub_fetch(&quest_payload_stats.bytes,
+                                       sizeof(quest_payload_t) + p->len,
+                                       __ATOMIC_RELAXED);
+                    __atomic_sub_fetch(&quest_payload_stats.count, 1,
+                                       __ATOMIC_RELAXED);
+                    free(p);
+                    el->payload[i][j][k] = NULL;
+                }
+            }
+        }
+    }
+}
+
 /* Clean the list out */
 void quest_cleanup(quest_map_t *map) {
     quest_map_elem_t *tmp, *i;
@@ -73,6 +99,7 @@ void quest_cleanup(quest_map_t *map) {
     while(i) {
         tmp = TAILQ_NEXT(i, qentry);
 
+        quest_payload_cleanup(i);
         free(i);
         i = tmp;
     }
@@ -651,3 +678,49 @@ int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir) {
 
     return 0;
 }
+
+/* Look up the payload for a quest that has been sent before. */
+quest_payload_t *quest_payload_get(quest_map_elem_t *el, int version, int lang,
+                                   int v1) {
+    quest_payload_t *rv;
+
+    rv = __atomic_load_n(&el->payload[version][lang][!!v1], __ATOMIC_ACQUIRE);
+
+    if(rv) {
+        __atomic_add_fetch(&quest_payload_stats.hits, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_add_fetch(&quest_payload_stats.misses, 1, __ATOMIC_RELAXED);
+    }
+
+    return rv;
+}
+
+/* Hang on to a payload for next time. */
+int quest_payload_add(quest_map_elem_t *el, int version, int lang, int v1,
+                      quest_payload_t **p) {
+    quest_payload_t *old = NULL;
+    size_t sz = sizeof(quest_payload_t) + (*p)->len;
+
+    /* Make sure there's room for it first. */
+    if(__atomic_add_fetch(&quest_payload_stats.bytes, sz, __ATOMIC_RELAXED) >
+       quest_payload_max) {
+        __atomic_sub_fetch(&quest_payload_stats.bytes, sz, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&quest_payload_stats.uncached, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* Everyone sending the quest holds the quest lock for reading, so another
+       thread might have beaten us to it. If so, use theirs. */
+    if(!__atomic_compare_exchange_n(&el->payload[version][lang][!!v1], &old,
+                                    *p, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+        __atomic_sub_fetch(&quest_payload_stats.bytes, sz, __ATOMIC_RELAXED);
+        free(*p);
+        *p = old;
+        return 1;
+    }
+
+    __atomic_add_fetch(&quest_payload_stats.count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
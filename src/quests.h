@@ -33,13 +33,36 @@ struct ship;
 typedef struct ship ship_t;
 #endif
 
+/* A quest as it gets sent to the client: the packets with the files in them,
+   ready to go other than being encrypted. */
+typedef struct quest_payload {
+    size_t len;
+    uint8_t data[];
+} quest_payload_t;
+
 typedef struct quest_map_elem {
     TAILQ_ENTRY(quest_map_elem) qentry;
     uint32_t qid;
 
     sylverant_quest_t *qptr[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT];
+
+    /* Payloads that have been sent before, by the version of the client, the
+       language, and whether it was the v1-compatible version. These go away
+       with the quest map, so they're only good while the quest lock is held. */
+    quest_payload_t *payload[CLIENT_VERSION_COUNT][CLIENT_LANG_COUNT][2];
 } quest_map_elem_t;
 
+/* Stats for the quest payloads, updated atomically. */
+typedef struct quest_payload_stats {
+    int count;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t uncached;
+} quest_payload_stats_t;
+
+extern quest_payload_stats_t quest_payload_stats;
+
 TAILQ_HEAD(quest_map, quest_map_elem);
 typedef struct quest_map quest_map_t;
 
@@ -59,4 +82,15 @@ int quest_map(quest_map_t *map, sylverant_quest_list_t *list, int version,
 /* Build/rebuild the quest enemy/object data cache. */
 int quest_cache_maps(ship_t *s, quest_map_t *map, const char *dir);
 
+/* Look up the payload for a quest that has been sent before. */
+quest_payload_t *quest_payload_get(quest_map_elem_t *el, int version, int lang,
+                                   int v1);
+
+/* Hang on to a payload for next time. Returns 1 if it was kept, in which case
+   it belongs to the quest map now (and *p may be changed to one that got there
+   first), or 0 if there's no room for it, in which case the caller still has
+   to free it. */
+int quest_payload_add(quest_map_elem_t *el, int version, int lang, int v1,
+                      quest_payload_t **p);
+
 #endif /* !QUESTS_H */
@@ -0,0 +1,190 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+
+void ringbuf_init(ringbuf_t *rb, size_t max) {
+    memset(rb, 0, sizeof(ringbuf_t));
+    rb->max = max;
+}
+
+/* Adjust the shared total (if any) by the given amount. */
+static inline void ringbuf_acct(ringbuf_t *rb, size_t amt, int add) {
+    if(rb->acct && amt) {
+        if(add)
+            __atomic_add_fetch(rb->acct, amt, __ATOMIC_RELAXED);
+        else
+            __atomic_sub_fetch(rb->acct, amt, __ATOMIC_RELAXED);
+    }
+}
+
+void ringbuf_account(ringbuf_t *rb, size_t *acct) {
+    ringbuf_acct(rb, rb->len, 0);
+    rb->acct = acct;
+    ringbuf_acct(rb, rb->len, 1);
+}
+
+void ringbuf_destroy(ringbuf_t *rb) {
+    ringbuf_acct(rb, rb->len, 0);
+    free(rb->data);
+    rb->data = NULL;
+    rb->size = rb->start = rb->len = 0;
+}
+
+void ringbuf_clear(ringbuf_t *rb) {
+    ringbuf_acct(rb, rb->len, 0);
+    rb->start = rb->len = 0;
+}
+
+/* Make room for at least need bytes in total, straightening out the queued
+   data into the front of the new allocation. */
+static int ringbuf_grow(ringbuf_t *rb, size_t need) {
+    size_t nsize = rb->size ? rb->size : RINGBUF_MIN_SIZE;
+    struct iovec iov[2];
+    uint8_t *tmp;
+    int i, cnt;
+
+    while(nsize < need) {
+        nsize <<= 1;
+    }
+
+    if(rb->max && nsize > rb->max) {
+        if(need > rb->max) {
+            return -1;
+        }
+
+        nsize = rb->max;
+    }
+
+    if(!(tmp = (uint8_t *)malloc(nsize))) {
+        return -1;
+    }
+
+    cnt = ringbuf_peek(rb, iov);
+    need = 0;
+
+    for(i = 0; i < cnt; ++i) {
+        memcpy(tmp + need, iov[i].iov_base, iov[i].iov_len);
+        need += iov[i].iov_len;
+    }
+
+    free(rb->data);
+    rb->data = tmp;
+    rb->size = nsize;
+    rb->start = 0;
+
+    return 0;
+}
+
+int ringbuf_append(ringbuf_t *rb, const void *buf, size_t len) {
+    const uint8_t *src = (const uint8_t *)buf;
+    size_t end, amt;
+
+    if(rb->len + len > rb->size && ringbuf_grow(rb, rb->len + len)) {
+        return -1;
+    }
+
+    /* Copy up to the end of the allocation, then wrap around to the front for
+       anything that's left. */
+    end = rb->start + rb->len;
+
+    if(end >= rb->size) {
+        end -= rb->size;
+    }
+
+    amt = rb->size - end;
+
+    if(amt > len) {
+        amt = len;
+    }
+
+    memcpy(rb->data + end, src, amt);
+    memcpy(rb->data, src + amt, len - amt);
+    rb->len += len;
+    ringbuf_acct(rb, len, 1);
+
+    return 0;
+}
+
+int ringbuf_peek(const ringbuf_t *rb, struct iovec iov[2]) {
+    size_t first;
+
+    if(!rb->len) {
+        return 0;
+    }
+
+    first = rb->size - rb->start;
+
+    if(first >= rb->len) {
+        iov[0].iov_base = rb->data + rb->start;
+        iov[0].iov_len = rb->len;
+        return 1;
+    }
+
+    iov[0].iov_base = rb->data + rb->start;
+    iov[0].iov_len = first;
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len = rb->len - first;
+    return 2;
+}
+
+void ringbuf_consume(ringbuf_t *rb, size_t amt) {
+    if(amt >= rb->len) {
+        /* Start back at the front, so the next batch is contiguous. */
+        ringbuf_acct(rb, rb->len, 0);
+        rb->start = rb->len = 0;
+        return;
+    }
+
+    ringbuf_acct(rb, amt, 0);
+
+    rb->start += amt;
+    rb->len -= amt;
+
+    if(rb->start >= rb->size) {
+        rb->start -= rb->size;
+    }
+}
+
+int ringbuf_write(ringbuf_t *rb, int sock) {
+    struct iovec iov[2];
+    ssize_t sent;
+    int cnt;
+
+    while((cnt = ringbuf_peek(rb, iov))) {
+        sent = writev(sock, iov, cnt);
+
+        if(sent == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+
+            return -1;
+        }
+
+        ringbuf_consume(rb, (size_t)sent);
+    }
+
+    return 0;
+}
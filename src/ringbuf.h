@@ -0,0 +1,68 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Smallest amount of space a ring buffer will allocate. */
+#define RINGBUF_MIN_SIZE    4096
+
+/* A byte queue that wraps around a single allocation. The allocation grows
+   (doubling each time) as needed, up to max bytes, and is only ever freed by
+   ringbuf_destroy(), so a connection that's busy doesn't keep allocating and
+   freeing its buffer. */
+typedef struct ringbuf {
+    uint8_t *data;
+    size_t size;
+    size_t start;
+    size_t len;
+    size_t max;                     /* 0 for no limit */
+    size_t *acct;                   /* Shared total of queued bytes, or NULL */
+} ringbuf_t;
+
+void ringbuf_init(ringbuf_t *rb, size_t max);
+void ringbuf_destroy(ringbuf_t *rb);
+
+/* Keep a running total of how much is queued in this buffer (and any others
+   sharing the same counter) in acct. The counter is updated atomically, so it
+   can be shared between threads. */
+void ringbuf_account(ringbuf_t *rb, size_t *acct);
+
+/* Throw away anything queued, but keep the space around. */
+void ringbuf_clear(ringbuf_t *rb);
+
+/* Queue up data at the end of the buffer. Returns -1 if the buffer would go
+   over its limit or can't be grown. */
+int ringbuf_append(ringbuf_t *rb, const void *buf, size_t len);
+
+/* Fill in up to two iovecs describing the queued data, in order. Returns how
+   many were filled in. */
+int ringbuf_peek(const ringbuf_t *rb, struct iovec iov[2]);
+
+/* Drop amt bytes from the front of the buffer. */
+void ringbuf_consume(ringbuf_t *rb, size_t amt);
+
+/* Write as much as possible to a (non-blocking) socket with writev. Returns 0
+   if everything was written, 1 if the socket filled up first, or -1 on
+   error. */
+int ringbuf_write(ringbuf_t *rb, int sock);
+
+#endif /* !RINGBUF_H */
@@ -303,7 +303,7 @@ int rt_gc_enabled(void) {
 
 uint32_t rt_generate_v2_rare(ship_client_t *c, lobby_t *l, int rt_index,
                              int area) {
-    struct mt19937_state *rng = &c->cur_block->rng;
+    struct mt19937_state *rng = block_rng(c->cur_block);
     double rnd;
     rt_set_t *set;
     int i;
@@ -342,7 +342,7 @@ uint32_t rt_generate_v2_rare(ship_client_t *c, lobby_t *l, int rt_index,
 
 uint32_t rt_generate_gc_rare(ship_client_t *c, lobby_t *l, int rt_index,
                              int area) {
-    struct mt19937_state *rng = &c->cur_block->rng;
+    struct mt19937_state *rng = block_rng(c->cur_block);
     double rnd;
     rt_set_t *set;
     int i;
@@ -0,0 +1,104 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rxbuf.h"
+
+void rxbuf_init(rxbuf_t *rb, rxbuf_stats_t *stats) {
+    memset(rb, 0, sizeof(rxbuf_t));
+    rb->stats = stats;
+}
+
+void rxbuf_destroy(rxbuf_t *rb) {
+    free(rb->data);
+    rb->data = NULL;
+    rb->size = rb->start = rb->len = 0;
+}
+
+void rxbuf_clear(rxbuf_t *rb) {
+    rb->start = rb->len = 0;
+}
+
+uint8_t *rxbuf_space(rxbuf_t *rb, size_t need, size_t *avail) {
+    size_t nsize;
+    uint8_t *tmp;
+
+    /* Always leave room for at least one more byte. */
+    if(need <= rb->len) {
+        need = rb->len + 1;
+    }
+
+    if(need > rb->size) {
+        /* Doesn't fit at all, so get a bigger buffer, putting what we have at
+           the front of it. */
+        nsize = rb->size ? rb->size : RXBUF_MIN_SIZE;
+
+        while(nsize < need) {
+            nsize <<= 1;
+        }
+
+        if(!(tmp = (uint8_t *)malloc(nsize))) {
+            return NULL;
+        }
+
+        memcpy(tmp, rb->data + rb->start, rb->len);
+        free(rb->data);
+        rb->data = tmp;
+        rb->size = nsize;
+        rb->start = 0;
+
+        if(rb->stats) {
+            ++rb->stats->allocs;
+        }
+    }
+    else if(rb->start + need > rb->size ||
+            (rb->start && rb->size - rb->start - rb->len < rb->size / 4)) {
+        /* It'll fit, but not where it is now (or there's so little room left
+           at the end that we'd be making a lot of tiny reads). */
+        memmove(rb->data, rb->data + rb->start, rb->len);
+        rb->start = 0;
+
+        if(rb->stats) {
+            ++rb->stats->copies;
+            rb->stats->copy_bytes += rb->len;
+        }
+    }
+
+    *avail = rb->size - rb->start - rb->len;
+    return rb->data + rb->start + rb->len;
+}
+
+void rxbuf_commit(rxbuf_t *rb, size_t amt) {
+    rb->len += amt;
+
+    if(rb->stats) {
+        rb->stats->bytes += amt;
+    }
+}
+
+void rxbuf_consume(rxbuf_t *rb, size_t amt) {
+    if(amt >= rb->len) {
+        /* Start back at the front, so the next read gets all the space. */
+        rb->start = rb->len = 0;
+        return;
+    }
+
+    rb->start += amt;
+    rb->len -= amt;
+}
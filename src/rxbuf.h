@@ -0,0 +1,73 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RXBUF_H
+#define RXBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Smallest amount of space a receive buffer will allocate. */
+#define RXBUF_MIN_SIZE      4096
+
+/* Counters for how much work receiving took. Several buffers can share one set
+   of these (all the clients on a worker, for instance), as long as they're only
+   used from one thread. */
+typedef struct rxbuf_stats {
+    uint64_t bytes;                 /* Bytes received */
+    uint64_t pkts;                  /* Packets handed off (counted by caller) */
+    uint64_t copies;                /* Partial packets moved to the front */
+    uint64_t copy_bytes;
+    uint64_t allocs;                /* Buffers allocated or grown */
+} rxbuf_stats_t;
+
+/* A per-connection receive buffer. Data is received straight into the free
+   space at the end of the buffer, and complete packets are decrypted and
+   handled right where they sit. The only time anything gets moved is when a
+   partial packet is left over at the end and there isn't room after it for
+   the rest, in which case it's moved to the front. The allocation grows to fit
+   the biggest packet seen and is kept until the connection goes away. */
+typedef struct rxbuf {
+    uint8_t *data;
+    size_t size;
+    size_t start;
+    size_t len;
+    rxbuf_stats_t *stats;           /* NULL to not bother counting */
+} rxbuf_t;
+
+void rxbuf_init(rxbuf_t *rb, rxbuf_stats_t *stats);
+void rxbuf_destroy(rxbuf_t *rb);
+
+/* Throw away anything buffered, but keep the space around. */
+void rxbuf_clear(rxbuf_t *rb);
+
+/* Get a place to receive more data into, making sure that the buffered data
+   plus whatever's received can be at least need bytes long without having to
+   move. The amount of free space is stored in avail. Returns NULL if the
+   buffer can't be grown. */
+uint8_t *rxbuf_space(rxbuf_t *rb, size_t need, size_t *avail);
+
+/* Account for amt bytes received into the space from rxbuf_space(). */
+void rxbuf_commit(rxbuf_t *rb, size_t amt);
+
+/* The buffered data starts here, and is rb->len bytes long. */
+#define rxbuf_data(rb)      ((rb)->data + (rb)->start)
+
+/* Drop amt bytes from the front of the buffer. */
+void rxbuf_consume(rxbuf_t *rb, size_t amt);
+
+#endif /* !RXBUF_H */
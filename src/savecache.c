@@ -0,0 +1,536 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/queue.h>
+
+#include <sylverant/debug.h>
+
+#include "savecache.h"
+
+extern int shipgate_req_timeout;
+
+#define SAVE_BUCKETS        1024
+
+/* Send at most this many saves each time the timer goes off, so a big pile of
+   them (like after the shipgate comes back) goes out over a few seconds. */
+#define SAVE_FLUSH_BATCH    32
+
+/* Give up on a save after the shipgate has said no this many times. */
+#define SAVE_MAX_TRIES      3
+
+/* Rewrite the journal once it gets this big (and is mostly stale). */
+#define SAVE_COMPACT_SIZE   (64 * 1024 * 1024)
+
+/* Nothing we save is anywhere near this big. */
+#define SAVE_MAX_LEN        65536
+
+/* Records in the journal. A data record holds the whole character. A done
+   record says the data record with the same sequence number has been saved,
+   so it can be skipped when the journal is read back in. Everything is in the
+   host's byte order, since the file never leaves the machine. */
+#define SAVE_REC_DATA       0x45564153          /* "SAVE" */
+#define SAVE_REC_DONE       0x454E4F44          /* "DONE" */
+
+typedef struct save_rec {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t guildcard;
+    uint32_t slot;
+    uint32_t block;
+    uint32_t len;
+} save_rec_t;
+
+typedef struct save_ent {
+    TAILQ_ENTRY(save_ent) qentry;
+    struct save_ent *hnext;
+    uint32_t gc;
+    uint32_t slot;
+    uint32_t block;
+    uint32_t seq;                       /* Sequence of the data we have */
+    uint32_t sent_seq;                  /* Sequence of what was sent, or 0 */
+    int tries;
+    int len;
+    uint64_t dirty_ms;
+    uint64_t sent_ms;
+    uint8_t *data;
+} save_ent_t;
+
+TAILQ_HEAD(save_queue, save_ent);
+
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static save_ent_t *save_hash[SAVE_BUCKETS];
+static struct save_queue save_list = TAILQ_HEAD_INITIALIZER(save_list);
+static uint32_t save_seq = 0;
+static int journal_fd = -1;
+static char *journal_path = NULL;
+static tw_timer_t save_timer;
+
+save_cache_stats_t save_cache_stats;
+
+static inline int save_hash_idx(uint32_t gc, uint32_t slot) {
+    return (int)((((gc * 2654435761U) >> 8) + slot) % SAVE_BUCKETS);
+}
+
+static inline int save_connected(shipgate_conn_t *sg) {
+    return sg->sock >= 0 && sg->has_key;
+}
+
+static save_ent_t *save_find(uint32_t gc, uint32_t slot) {
+    save_ent_t *e;
+
+    for(e = save_hash[save_hash_idx(gc, slot)]; e; e = e->hnext) {
+        if(e->gc == gc && e->slot == slot) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static void save_unlink(save_ent_t *e) {
+    save_ent_t **pp = &save_hash[save_hash_idx(e->gc, e->slot)];
+
+    while(*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+
+    *pp = e->hnext;
+    TAILQ_REMOVE(&save_list, e, qentry);
+    --save_cache_stats.count;
+    save_cache_stats.bytes -= e->len;
+    free(e->data);
+    free(e);
+}
+
+/* Keep the latest data for a character, replacing anything older. */
+static save_ent_t *save_store(uint32_t gc, uint32_t slot, uint32_t block,
+                              const void *data, int len, uint32_t seq) {
+    save_ent_t *e;
+    uint8_t *tmp;
+    int h;
+
+    if((e = save_find(gc, slot))) {
+        if(e->len != len) {
+            if(!(tmp = (uint8_t *)realloc(e->data, len))) {
+                perror("realloc");
+                return NULL;
+            }
+
+            save_cache_stats.bytes += len - e->len;
+            e->data = tmp;
+            e->len = len;
+        }
+
+        ++save_cache_stats.coalesced;
+    }
+    else {
+        if(!(e = (save_ent_t *)malloc(sizeof(save_ent_t)))) {
+            perror("malloc");
+            return NULL;
+        }
+
+        if(!(e->data = (uint8_t *)malloc(len))) {
+            perror("malloc");
+            free(e);
+            return NULL;
+        }
+
+        e->gc = gc;
+        e->slot = slot;
+        e->sent_seq = 0;
+        e->tries = 0;
+        e->len = len;
+        e->dirty_ms = timerwheel_time_ms();
+        e->sent_ms = 0;
+
+        h = save_hash_idx(gc, slot);
+        e->hnext = save_hash[h];
+        save_hash[h] = e;
+        TAILQ_INSERT_TAIL(&save_list, e, qentry);
+        ++save_cache_stats.count;
+        save_cache_stats.bytes += len;
+    }
+
+    e->block = block;
+    e->seq = seq;
+    memcpy(e->data, data, len);
+
+    return e;
+}
+
+/* Append one record to a journal file. */
+static int journal_append(int fd, save_rec_t *rec, const void *data, int len) {
+    struct iovec iov[2];
+    ssize_t want = sizeof(save_rec_t) + len;
+
+    iov[0].iov_base = rec;
+    iov[0].iov_len = sizeof(save_rec_t);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    if(writev(fd, iov, len ? 2 : 1) != want) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Rewrite the journal with only what still needs to be saved. The caller must
+   hold the lock. */
+static void journal_compact(void) {
+    char *tmp;
+    int fd;
+    save_ent_t *e;
+    save_rec_t rec;
+    uint64_t bytes = 0;
+
+    if(journal_fd < 0) {
+        return;
+    }
+
+    if(!(tmp = (char *)malloc(strlen(journal_path) + 5))) {
+        perror("malloc");
+        return;
+    }
+
+    sprintf(tmp, "%s.tmp", journal_path);
+
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600)) < 0) {
+        debug(DBG_WARN, "Cannot rewrite save journal: %s\n", strerror(errno));
+        free(tmp);
+        return;
+    }
+
+    TAILQ_FOREACH(e, &save_list, qentry) {
+        rec.magic = SAVE_REC_DATA;
+        rec.seq = e->seq;
+        rec.guildcard = e->gc;
+        rec.slot = e->slot;
+        rec.block = e->block;
+        rec.len = (uint32_t)e->len;
+
+        if(journal_append(fd, &rec, e->data, e->len)) {
+            goto err;
+        }
+
+        bytes += sizeof(save_rec_t) + e->len;
+    }
+
+    if(fsync(fd) || rename(tmp, journal_path)) {
+        goto err;
+    }
+
+    close(journal_fd);
+    journal_fd = fd;
+    save_cache_stats.journal_bytes = bytes;
+    free(tmp);
+    return;
+
+err:
+    debug(DBG_WARN, "Cannot rewrite save journal: %s\n", strerror(errno));
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+}
+
+/* Write a record to the journal, if we have one. The caller must hold the
+   lock. */
+static void journal_write(uint32_t magic, save_ent_t *e, uint32_t seq) {
+    save_rec_t rec;
+    int len = magic == SAVE_REC_DATA ? e->len : 0;
+
+    if(journal_fd < 0) {
+        return;
+    }
+
+    rec.magic = magic;
+    rec.seq = seq;
+    rec.guildcard = e->gc;
+    rec.slot = e->slot;
+    rec.block = e->block;
+    rec.len = (uint32_t)len;
+
+    if(journal_append(journal_fd, &rec, e->data, len)) {
+        debug(DBG_WARN, "Cannot write to save journal: %s\n", strerror(errno));
+        return;
+    }
+
+    save_cache_stats.journal_bytes += sizeof(save_rec_t) + len;
+
+    if(save_cache_stats.journal_bytes > SAVE_COMPACT_SIZE &&
+       save_cache_stats.journal_bytes > save_cache_stats.bytes * 2) {
+        journal_compact();
+    }
+}
+
+/* Read back a journal, skipping anything that was saved already. */
+static void journal_read(int fd) {
+    save_rec_t rec;
+    save_ent_t *e;
+    uint8_t *buf;
+
+    if(!(buf = (uint8_t *)malloc(SAVE_MAX_LEN))) {
+        perror("malloc");
+        return;
+    }
+
+    /* Anything cut off at the end (from the ship going down in the middle of
+       writing it) just gets ignored. */
+    while(read(fd, &rec, sizeof(save_rec_t)) == sizeof(save_rec_t)) {
+        if(rec.magic == SAVE_REC_DATA) {
+            if(rec.len > SAVE_MAX_LEN ||
+               read(fd, buf, rec.len) != (ssize_t)rec.len) {
+                break;
+            }
+
+            save_store(rec.guildcard, rec.slot, rec.block, buf, (int)rec.len,
+                       rec.seq);
+        }
+        else if(rec.magic == SAVE_REC_DONE) {
+            if((e = save_find(rec.guildcard, rec.slot)) && e->seq == rec.seq) {
+                save_unlink(e);
+            }
+        }
+        else {
+            break;
+        }
+
+        if((int32_t)(rec.seq - save_seq) > 0) {
+            save_seq = rec.seq;
+        }
+    }
+
+    free(buf);
+}
+
+int save_cache_init(const char *journal) {
+    if(!journal) {
+        return 0;
+    }
+
+    if(!(journal_path = strdup(journal))) {
+        perror("strdup");
+        return -1;
+    }
+
+    if((journal_fd = open(journal, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0) {
+        debug(DBG_ERROR, "Cannot open save journal %s: %s\n", journal,
+              strerror(errno));
+        free(journal_path);
+        journal_path = NULL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&save_lock);
+    journal_read(journal_fd);
+
+    /* Start over fresh, with only what still has to be saved. */
+    journal_compact();
+    save_cache_stats.coalesced = 0;
+    pthread_mutex_unlock(&save_lock);
+
+    if(save_cache_stats.count) {
+        debug(DBG_LOG, "%d character(s) from the save journal still need to "
+              "be saved\n", save_cache_stats.count);
+    }
+
+    return 0;
+}
+
+void save_cache_cleanup(void) {
+    save_ent_t *e;
+
+    pthread_mutex_lock(&save_lock);
+
+    if(save_cache_stats.count && journal_fd < 0) {
+        debug(DBG_WARN, "%d character(s) were never saved by the shipgate!\n",
+              save_cache_stats.count);
+    }
+
+    while((e = TAILQ_FIRST(&save_list))) {
+        save_unlink(e);
+    }
+
+    if(journal_fd >= 0) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+
+    free(journal_path);
+    journal_path = NULL;
+    pthread_mutex_unlock(&save_lock);
+}
+
+/* Send one save to the shipgate. The caller must hold the lock. */
+static void save_send(shipgate_conn_t *sg, save_ent_t *e, uint64_t now) {
+    if(!shipgate_send_cdata(sg, e->gc, e->slot, e->data, e->len, e->block)) {
+        e->sent_seq = e->seq;
+        e->sent_ms = now;
+    }
+}
+
+int save_cache_put(shipgate_conn_t *sg, uint32_t gc, uint32_t slot,
+                   const void *data, int len, uint32_t block) {
+    save_ent_t *e;
+    uint32_t seq;
+
+    pthread_mutex_lock(&save_lock);
+
+    /* Sequence number 0 means nothing's been sent, so don't use it. */
+    if(!(seq = ++save_seq)) {
+        seq = ++save_seq;
+    }
+
+    if(!(e = save_store(gc, slot, block, data, len, seq))) {
+        pthread_mutex_unlock(&save_lock);
+        return -1;
+    }
+
+    ++save_cache_stats.puts;
+    journal_write(SAVE_REC_DATA, e, seq);
+
+    /* If an older version is on its way already, this one goes once the
+       shipgate answers that. */
+    if(!e->sent_seq && save_connected(sg)) {
+        save_send(sg, e, timerwheel_time_ms());
+    }
+
+    pthread_mutex_unlock(&save_lock);
+    return 0;
+}
+
+void save_cache_done(shipgate_conn_t *sg, uint32_t gc, uint32_t slot, int ok) {
+    save_ent_t *e;
+    uint64_t now = timerwheel_time_ms(), lag;
+
+    pthread_mutex_lock(&save_lock);
+
+    if(!(e = save_find(gc, slot)) || !e->sent_seq) {
+        pthread_mutex_unlock(&save_lock);
+        return;
+    }
+
+    if(ok && e->seq != e->sent_seq) {
+        /* What we sent was saved, but there's newer data now. Anything newer
+           came in after the last send. */
+        e->dirty_ms = e->sent_ms;
+        e->sent_seq = 0;
+        e->tries = 0;
+
+        if(save_connected(sg)) {
+            save_send(sg, e, now);
+        }
+    }
+    else if(ok || ++e->tries >= SAVE_MAX_TRIES) {
+        if(ok) {
+            lag = now - e->dirty_ms;
+            ++save_cache_stats.flushed;
+
+            if(lag > save_cache_stats.lag_max) {
+                save_cache_stats.lag_max = lag;
+            }
+        }
+        else {
+            debug(DBG_WARN, "Giving up on saving character %" PRIu32 ":%" PRIu32
+                  "\n", gc, slot);
+            ++save_cache_stats.dropped;
+        }
+
+        journal_write(SAVE_REC_DONE, e, e->seq);
+        save_unlink(e);
+
+        /* Once there's nothing left to save, there's no reason to keep around
+           any of the journal. */
+        if(!save_cache_stats.count && journal_fd >= 0 &&
+           !ftruncate(journal_fd, 0)) {
+            save_cache_stats.journal_bytes = 0;
+        }
+    }
+    else {
+        /* Try again the next time the timer goes off. */
+        e->sent_seq = 0;
+    }
+
+    pthread_mutex_unlock(&save_lock);
+}
+
+void save_cache_flush(shipgate_conn_t *sg, int resend) {
+    save_ent_t *e;
+    uint64_t now = timerwheel_time_ms();
+    uint64_t timeout = (uint64_t)shipgate_req_timeout * 1000;
+    int n = 0;
+
+    if(!save_connected(sg)) {
+        return;
+    }
+
+    pthread_mutex_lock(&save_lock);
+
+    TAILQ_FOREACH(e, &save_list, qentry) {
+        if(e->sent_seq) {
+            /* Leave it alone if the shipgate still might answer it. */
+            if(!resend && now - e->sent_ms < timeout) {
+                continue;
+            }
+
+            e->sent_seq = 0;
+            ++save_cache_stats.retries;
+        }
+
+        if(n < SAVE_FLUSH_BATCH) {
+            save_send(sg, e, now);
+            ++n;
+        }
+    }
+
+    pthread_mutex_unlock(&save_lock);
+}
+
+static void save_timer_fire(timerwheel_t *tw, tw_timer_t *t, void *d) {
+    save_cache_flush((shipgate_conn_t *)d, 0);
+    timerwheel_schedule(tw, t, tw->now_ms + 1000);
+}
+
+void save_cache_start_timer(shipgate_conn_t *sg, timerwheel_t *tw) {
+    timerwheel_timer_init(&save_timer, &save_timer_fire, sg);
+    timerwheel_schedule(tw, &save_timer, tw->now_ms + 1000);
+}
+
+uint64_t save_cache_lag(void) {
+    save_ent_t *e;
+    uint64_t now = timerwheel_time_ms(), lag = 0;
+
+    pthread_mutex_lock(&save_lock);
+
+    TAILQ_FOREACH(e, &save_list, qentry) {
+        if(now - e->dirty_ms > lag) {
+            lag = now - e->dirty_ms;
+        }
+    }
+
+    pthread_mutex_unlock(&save_lock);
+    return lag;
+}
@@ -0,0 +1,75 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SAVECACHE_H
+#define SAVECACHE_H
+
+#include <stdint.h>
+
+#include "shipgate.h"
+#include "timerwheel.h"
+
+/* Character saves headed to the shipgate go through here. Each guildcard/slot
+   only ever has its latest data kept, and it stays around until the shipgate
+   says it has been saved, so nothing is lost if the shipgate is down (or goes
+   down before it gets to it). If there's a journal file, every save is also
+   appended to that, so that a restart of the ship doesn't lose them either. */
+
+/* Statistics, all protected by the cache's lock (but fine to read without it
+   for display purposes). Lag is measured from the time a character's oldest
+   unsaved change was made. */
+typedef struct save_cache_stats {
+    int count;
+    uint64_t bytes;
+    uint64_t journal_bytes;
+    uint64_t puts;
+    uint64_t coalesced;
+    uint64_t flushed;
+    uint64_t retries;
+    uint64_t dropped;
+    uint64_t lag_max;
+} save_cache_stats_t;
+
+extern save_cache_stats_t save_cache_stats;
+
+/* Set up the cache, reading in anything that was left in the journal (if one
+   is given) from the last time the ship was running. */
+int save_cache_init(const char *journal);
+void save_cache_cleanup(void);
+
+/* Save a character. This copies the data, so the caller can do whatever it
+   likes with it afterwards. */
+int save_cache_put(shipgate_conn_t *sg, uint32_t gc, uint32_t slot,
+                   const void *data, int len, uint32_t block);
+
+/* The shipgate has answered a save, one way or another. If there's newer data
+   for the character already, that gets sent right away. */
+void save_cache_done(shipgate_conn_t *sg, uint32_t gc, uint32_t slot, int ok);
+
+/* Send saves that haven't been sent (or haven't been answered in a while) to
+   the shipgate. If resend is set, everything is sent again, since the last
+   connection went away before it was answered. */
+void save_cache_flush(shipgate_conn_t *sg, int resend);
+
+/* Start flushing periodically. This has to be called from the thread that
+   owns the timer wheel. */
+void save_cache_start_timer(shipgate_conn_t *sg, timerwheel_t *tw);
+
+/* How long the oldest unsaved change has been waiting, in milliseconds. */
+uint64_t save_cache_lag(void);
+
+#endif /* !SAVECACHE_H */
@@ -22,7 +22,6 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <arpa/inet.h>
 
 #include <sylverant/debug.h>
@@ -31,6 +30,7 @@
 #include "clients.h"
 #include "ship_packets.h"
 #include "shipgate.h"
+#include "savecache.h"
 #include "utils.h"
 #include "bans.h"
 #include "scripts.h"
@@ -113,44 +113,105 @@ static sylverant_event_t *find_current_event(ship_t *s) {
     return s->cfg->events;
 }
 
-static void *ship_thd(void *d) {
-    int i, nfds;
-    ship_t *s = (ship_t *)d;
-    struct timeval timeout;
-    fd_set readfds, writefds;
-    ship_client_t *it, *tmp;
+/* The most events we'll handle in one pass through the loop. */
+#define SHIP_MAX_EVENTS     256
+
+static const char *version_names[CLIENT_VERSION_COUNT] = {
+    "DC", "DC", "PC", "GC", "Episode 3", "Blue Burst"
+};
+
+/* Figure out which version a listening socket is for, or -1 if the socket
+   isn't one of our listening sockets. */
+static int ship_listen_version(ship_t *s, int fd) {
+    int i;
+
+    for(i = 0; i < 2; ++i) {
+        if(s->dcsock[i] == fd)
+            return CLIENT_VERSION_DCV1;
+        else if(s->pcsock[i] == fd)
+            return CLIENT_VERSION_PC;
+        else if(s->gcsock[i] == fd)
+            return CLIENT_VERSION_GC;
+        else if(s->ep3sock[i] == fd)
+            return CLIENT_VERSION_EP3;
+        else if(s->bbsock[i] == fd)
+            return CLIENT_VERSION_BB;
+    }
+
+    return -1;
+}
+
+/* Accept everything that's waiting on one of the listening sockets. */
+static void ship_accept(ship_t *s, int lsock, int version) {
     socklen_t len;
     struct sockaddr_storage addr;
     struct sockaddr *addr_p = (struct sockaddr *)&addr;
     char ipstr[INET6_ADDRSTRLEN];
-    int sock, rv;
-    ssize_t sent;
+    ship_client_t *tmp;
+    int sock;
+
+    for(;;) {
+        len = sizeof(struct sockaddr_storage);
+        if((sock = accept(lsock, addr_p, &len)) < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+
+            return;
+        }
+
+        my_ntop(&addr, ipstr);
+        debug(DBG_LOG, "%s: Accepted %s ship connection from %s\n",
+              s->cfg->name, version_names[version], ipstr);
+
+        if(!(tmp = client_create_connection(sock, version, CLIENT_TYPE_SHIP,
+                                            s->clients, s, NULL, s->evl,
+                                            &s->tw, addr_p, len))) {
+            close(sock);
+            continue;
+        }
+
+        if(s->shutdown_time) {
+            send_message_box(tmp, "%s\n\n%s\n%s",
+                             __(tmp, "\tEShip is going down for shutdown."),
+                             __(tmp, "Please try another ship."),
+                             __(tmp, "Disconnecting."));
+            tmp->flags |= CLIENT_FLAG_DISCONNECTED;
+        }
+    }
+}
+
+/* Drop the connection to the shipgate so we can attempt to reconnect. */
+static void ship_sg_close(ship_t *s) {
+    evloop_del(s->evl, s->sg.sock);
+    shipgate_disconnect(&s->sg);
+    shipgate_backoff(&s->sg);
+}
+
+static void *ship_thd(void *d) {
+    int i, nev, ver, timeout, fired;
+    ship_t *s = (ship_t *)d;
+    evloop_event_t evs[SHIP_MAX_EVENTS];
+    ship_client_t *it, *tmp;
+    char junk[32];
+    int rv;
     time_t now;
     time_t last_ban_sweep = time(NULL);
-    int numsocks = 1;
     sylverant_event_t *event, *oldevent = s->cfg->events;
 
-#ifdef SYLVERANT_ENABLE_IPV6
-    if(enable_ipv6) {
-        numsocks = 2;
-    }
-#endif
-
     /* Fire up the threads for each block. */
     for(i = 1; i <= s->cfg->blocks; ++i) {
         s->blocks[i - 1] = block_server_start(s, i, s->cfg->base_port +
                                               (i * 5));
     }
 
+    /* Start watching for requests the shipgate never answers. */
+    shipgate_start_req_timer(&s->sg, &s->tw);
+    save_cache_start_timer(&s->sg, &s->tw);
+
     /* While we're still supposed to run... do it. */
     while(s->run) {
-        /* Clear the fd_sets so we can use them again. */
-        nfds = 0;
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        timeout.tv_sec = 30;
-        timeout.tv_usec = 0;
-        now = time(NULL);
+        now = s->tw.now;
 
         /* Break out if we're shutting down now */
         if(s->shutdown_time && s->shutdown_time <= now) {
@@ -161,16 +222,17 @@ static void *ship_thd(void *d) {
         /* If we haven't swept the bans list in the last day, do it now. */
         if((last_ban_sweep + 3600 * 24) <= now) {
             ban_sweep_guildcards(s);
-            last_ban_sweep = now = time(NULL);
+            timerwheel_update_clock(&s->tw);
+            last_ban_sweep = now = s->tw.now;
         }
 
         /* If the shipgate isn't there, attempt to reconnect */
-        if(s->sg.sock == -1 && s->sg.login_attempt < now) {
+        if(s->sg.sock == -1 && s->sg.retry_ms <= s->tw.now_ms) {
             if(shipgate_reconnect(&s->sg)) {
-                s->sg.login_attempt = now + 60;
+                shipgate_backoff(&s->sg);
             }
-            else {
-                s->sg.login_attempt = 0;
+            else if(evloop_add(s->evl, s->sg.sock, EVLOOP_READ, &s->sg)) {
+                ship_sg_close(s);
             }
         }
 
@@ -193,287 +255,85 @@ static void *ship_thd(void *d) {
             oldevent = event;
         }
 
-        /* Fill the sockets into the fd_sets so we can use select below. */
-        TAILQ_FOREACH(it, s->clients, qentry) {
-            /* If we haven't heard from a client in 2 minutes, its dead.
-               Disconnect it. */
-            if(now > it->last_message + 120) {
-                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                continue;
-            }
-            /* Otherwise, if we haven't heard from them in a minute, ping it. */
-            else if(now > it->last_message + 60 && now > it->last_sent + 10) {
-                if(send_simple(it, PING_TYPE, 0)) {
-                    it->flags |= CLIENT_FLAG_DISCONNECTED;
-                    continue;
-                }
+        /* Ping or time out anyone whose timer has gone off. If that kicked
+           anyone, make sure they're cleaned up right away. Otherwise, sleep
+           until the next timer is due. */
+        fired = timerwheel_run(&s->tw);
+        timeout = fired ? 0 : timerwheel_next_timeout(&s->tw, 30000);
 
-                it->last_sent = now;
+        /* Don't sleep through the next try at reconnecting to the shipgate. */
+        if(s->sg.sock == -1) {
+            if(s->sg.retry_ms <= s->tw.now_ms) {
+                timeout = 0;
             }
-
-            FD_SET(it->sock, &readfds);
-
-            /* Only add to the write fd set if we have something to send out. */
-            if(it->sendbuf_cur) {
-                FD_SET(it->sock, &writefds);
+            else if(s->sg.retry_ms - s->tw.now_ms < (uint64_t)timeout) {
+                timeout = (int)(s->sg.retry_ms - s->tw.now_ms);
             }
-
-            nfds = nfds > it->sock ? nfds : it->sock;
-        }
-
-        /* Add the listening sockets to the read fd_set. */
-        for(i = 0; i < numsocks; ++i) {
-            FD_SET(s->dcsock[i], &readfds);
-            nfds = nfds > s->dcsock[i] ? nfds : s->dcsock[i];
-            FD_SET(s->pcsock[i], &readfds);
-            nfds = nfds > s->pcsock[i] ? nfds : s->pcsock[i];
-            FD_SET(s->gcsock[i], &readfds);
-            nfds = nfds > s->gcsock[i] ? nfds : s->gcsock[i];
-            FD_SET(s->ep3sock[i], &readfds);
-            nfds = nfds > s->ep3sock[i] ? nfds : s->ep3sock[i];
-            FD_SET(s->bbsock[i], &readfds);
-            nfds = nfds > s->bbsock[i] ? nfds : s->bbsock[i];
-        }
-
-        FD_SET(s->pipes[1], &readfds);
-        nfds = nfds > s->pipes[1] ? nfds : s->pipes[1];
-
-        /* Add the shipgate socket to the fd_sets */
-        if(s->sg.sock != -1) {
-            FD_SET(s->sg.sock, &readfds);
-
-            if(s->sg.sendbuf_cur) {
-                FD_SET(s->sg.sock, &writefds);
-            }
-
-            nfds = nfds > s->sg.sock ? nfds : s->sg.sock;
         }
 
         /* If we're supposed to shut down soon, make sure we aren't in the
-           middle of a select still when its supposed to happen. */
-        if(s->shutdown_time && now + timeout.tv_sec > s->shutdown_time) {
-            timeout.tv_sec = s->shutdown_time - now;
+           middle of a wait still when its supposed to happen. */
+        if(s->shutdown_time && now + timeout / 1000 > s->shutdown_time) {
+            timeout = (s->shutdown_time - now) * 1000;
         }
 
         /* Wait for some activity... */
-        if(select(nfds + 1, &readfds, &writefds, NULL, &timeout) > 0) {
-            /* Clear anything written to the pipe */
-            if(FD_ISSET(s->pipes[1], &readfds)) {
-                read(s->pipes[1], &len, 1);
-            }
-
-            for(i = 0; i < numsocks; ++i) {
-                if(FD_ISSET(s->dcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->dcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted DC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_DCV1,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
+        nev = evloop_wait(s->evl, evs, SHIP_MAX_EVENTS, timeout);
+        timerwheel_update_clock(&s->tw);
 
-                if(FD_ISSET(s->pcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->pcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted PC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock, CLIENT_VERSION_PC,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->gcsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->gcsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted GC ship connection from %s\n",
-                          s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock, CLIENT_VERSION_GC,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->ep3sock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->ep3sock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted Episode 3 ship connection "
-                          "from %s\n", s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_EP3,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
-                }
-
-                if(FD_ISSET(s->bbsock[i], &readfds)) {
-                    len = sizeof(struct sockaddr_storage);
-                    if((sock = accept(s->bbsock[i], addr_p, &len)) < 0) {
-                        perror("accept");
-                    }
-
-                    my_ntop(&addr, ipstr);
-                    debug(DBG_LOG, "%s: Accepted Blue Burst ship connection "
-                          "from %s\n", s->cfg->name, ipstr);
-
-                    if(!(tmp = client_create_connection(sock,
-                                                        CLIENT_VERSION_BB,
-                                                        CLIENT_TYPE_SHIP,
-                                                        s->clients, s, NULL,
-                                                        addr_p, len))) {
-                        close(sock);
-                    }
-
-                    if(s->shutdown_time) {
-                        send_message_box(tmp, "%s\n\n%s\n%s",
-                                         __(tmp, "\tEShip is going down for "
-                                            "shutdown."),
-                                         __(tmp, "Please try another ship."),
-                                         __(tmp, "Disconnecting."));
-                        tmp->flags |= CLIENT_FLAG_DISCONNECTED;
-                    }
+        for(i = 0; i < nev; ++i) {
+            /* Process the shipgate */
+            if(evs[i].data == &s->sg) {
+                if(s->sg.sock == -1) {
+                    continue;
                 }
-            }
 
-            /* Process the shipgate */
-            if(s->sg.sock != -1 && FD_ISSET(s->sg.sock, &readfds)) {
-                if((rv = shipgate_process_pkt(&s->sg))) {
+                if((evs[i].events & EVLOOP_READ) &&
+                   (rv = shipgate_process_pkt(&s->sg))) {
                     debug(DBG_WARN, "%s: Lost connection with shipgate\n",
                           s->cfg->name);
 
-                    /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
+                    ship_sg_close(s);
 
                     if(rv < -1) {
                         debug(DBG_WARN, "%s: Fatal shipgate error, bailing!\n",
                               s->cfg->name);
                         s->run = 0;
                     }
-                }
-            }
 
-            if(s->sg.sock != -1 && FD_ISSET(s->sg.sock, &writefds)) {
-                if(shipgate_send_pkts(&s->sg)) {
-                    debug(DBG_WARN, "%s: Lost connection with shipgate\n",
-                          s->cfg->name);
-
-                    /* Close the connection so we can attempt to reconnect */
-                    gnutls_bye(s->sg.session, GNUTLS_SHUT_RDWR);
-                    close(s->sg.sock);
-                    gnutls_deinit(s->sg.session);
-                    s->sg.sock = -1;
+                    continue;
                 }
             }
-
             /* Process client connections. */
-            TAILQ_FOREACH(it, s->clients, qentry) {
-                /* Check if this connection was trying to send us something. */
-                if(FD_ISSET(it->sock, &readfds)) {
-                    if(client_process_pkt(it)) {
+            else if((it = (ship_client_t *)evs[i].data)) {
+                /* Check if this connection was trying to send us something.
+                   Read until there's nothing left, since we only get told
+                   about new data. */
+                if(evs[i].events & EVLOOP_READ) {
+                    do {
+                        rv = client_process_pkt(it);
+                    } while(!rv && !(it->flags & CLIENT_FLAG_DISCONNECTED));
+
+                    if(rv < 0) {
                         it->flags |= CLIENT_FLAG_DISCONNECTED;
                         continue;
                     }
                 }
 
                 /* If we have anything to write, check if we can right now. */
-                if(FD_ISSET(it->sock, &writefds)) {
-                    if(it->sendbuf_cur) {
-                        sent = send(it->sock, it->sendbuf + it->sendbuf_start,
-                                    it->sendbuf_cur - it->sendbuf_start, 0);
-
-                        /* If we fail to send, and the error isn't EAGAIN,
-                           bail. */
-                        if(sent == -1) {
-                            if(errno != EAGAIN) {
-                                it->flags |= CLIENT_FLAG_DISCONNECTED;
-                                continue;
-                            }
-                        }
-                        else {
-                            it->sendbuf_start += sent;
-
-                            /* If we've sent everything, free the buffer. */
-                            if(it->sendbuf_start == it->sendbuf_cur) {
-                                free(it->sendbuf);
-                                it->sendbuf = NULL;
-                                it->sendbuf_cur = 0;
-                                it->sendbuf_size = 0;
-                                it->sendbuf_start = 0;
-                            }
-                        }
+                if((evs[i].events & EVLOOP_WRITE) && it->sendbuf.len) {
+                    if(client_flush(it)) {
+                        it->flags |= CLIENT_FLAG_DISCONNECTED;
                     }
                 }
             }
+            /* Clear anything written to the pipe */
+            else if(evs[i].fd == s->pipes[0]) {
+                read(s->pipes[0], junk, sizeof(junk));
+            }
+            else if((ver = ship_listen_version(s, evs[i].fd)) >= 0) {
+                ship_accept(s, evs[i].fd, ver);
+            }
         }
 
         /* Clean up any dead connections (its not safe to do a TAILQ_REMOVE in
@@ -535,6 +395,7 @@ static void *ship_thd(void *d) {
     close(s->pcsock[0]);
     close(s->dcsock[0]);
     clean_shiplist(s);
+    evloop_destroy(s->evl);
     free(s->clients);
     free(s->blocks);
     free(s);
@@ -545,59 +406,59 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
     ship_t *rv;
     int dcsock[2] = { -1, -1 }, pcsock[2] = { -1, -1 };
     int gcsock[2] = { -1, -1 }, ep3sock[2] = { -1, -1 };
-    int bbsock[2] = { -1, -1 };
+    int bbsock[2] = { -1, -1 }, i;
 
     debug(DBG_LOG, "Starting server for ship %s...\n", s->name);
 
     /* Create the sockets for listening for connections. */
-    dcsock[0] = open_sock(AF_INET, s->base_port);
+    dcsock[0] = open_sock(AF_INET, s->base_port, 0);
     if(dcsock[0] < 0) {
         return NULL;
     }
 
-    pcsock[0] = open_sock(AF_INET, s->base_port + 1);
+    pcsock[0] = open_sock(AF_INET, s->base_port + 1, 0);
     if(pcsock[0] < 0) {
         goto err_close_dc;
     }
 
-    gcsock[0] = open_sock(AF_INET, s->base_port + 2);
+    gcsock[0] = open_sock(AF_INET, s->base_port + 2, 0);
     if(gcsock[0] < 0) {
         goto err_close_pc;
     }
 
-    ep3sock[0] = open_sock(AF_INET, s->base_port + 3);
+    ep3sock[0] = open_sock(AF_INET, s->base_port + 3, 0);
     if(ep3sock[0] < 0) {
         goto err_close_gc;
     }
 
-    bbsock[0] = open_sock(AF_INET, s->base_port + 4);
+    bbsock[0] = open_sock(AF_INET, s->base_port + 4, 0);
     if(bbsock[0] < 0) {
         goto err_close_ep3;
     }
 
 #ifdef SYLVERANT_ENABLE_IPV6
     if(enable_ipv6) {
-        dcsock[1] = open_sock(AF_INET6, s->base_port);
+        dcsock[1] = open_sock(AF_INET6, s->base_port, 0);
         if(dcsock[1] < 0) {
             goto err_close_bb;
         }
 
-        pcsock[1] = open_sock(AF_INET6, s->base_port + 1);
+        pcsock[1] = open_sock(AF_INET6, s->base_port + 1, 0);
         if(pcsock[1] < 0) {
             goto err_close_dc_6;
         }
         
-        gcsock[1] = open_sock(AF_INET6, s->base_port + 2);
+        gcsock[1] = open_sock(AF_INET6, s->base_port + 2, 0);
         if(gcsock[1] < 0) {
             goto err_close_pc_6;
         }
         
-        ep3sock[1] = open_sock(AF_INET6, s->base_port + 3);
+        ep3sock[1] = open_sock(AF_INET6, s->base_port + 3, 0);
         if(ep3sock[1] < 0) {
             goto err_close_gc_6;
         }
 
-        bbsock[1] = open_sock(AF_INET6, s->base_port + 4);
+        bbsock[1] = open_sock(AF_INET6, s->base_port + 4, 0);
         if(bbsock[1] < 0) {
             goto err_close_ep3_6;
         }
@@ -637,6 +498,35 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
         goto err_blocks;
     }
 
+    /* Set up the event loop and put the pipe and listening sockets in it. */
+    if(!(rv->evl = evloop_create(evloop_backend))) {
+        debug(DBG_ERROR, "%s: Cannot create event loop!\n", s->name);
+        goto err_clients;
+    }
+
+    timerwheel_init(&rv->tw);
+    evloop_set_nonblock(rv->pipes[0]);
+
+    if(evloop_add(rv->evl, rv->pipes[0], EVLOOP_READ, NULL)) {
+        goto err_evloop;
+    }
+
+    for(i = 0; i < 2; ++i) {
+        if(dcsock[i] < 0) {
+            continue;
+        }
+
+        if(evloop_add(rv->evl, dcsock[i], EVLOOP_READ, NULL) ||
+           evloop_add(rv->evl, pcsock[i], EVLOOP_READ, NULL) ||
+           evloop_add(rv->evl, gcsock[i], EVLOOP_READ, NULL) ||
+           evloop_add(rv->evl, ep3sock[i], EVLOOP_READ, NULL) ||
+           evloop_add(rv->evl, bbsock[i], EVLOOP_READ, NULL)) {
+            debug(DBG_ERROR, "%s: Cannot watch listening sockets!\n",
+                  s->name);
+            goto err_evloop;
+        }
+    }
+
     /* Attempt to read the quest list in. */
     if(s->quests_file && s->quests_file[0]) {
         debug(DBG_WARN, "%s: Ignoring old quests configuration!\n", s->name);
@@ -706,6 +596,11 @@ ship_t *ship_server_start(sylverant_ship_t *s) {
         goto err_bans_locks;
     }
 
+    if(evloop_add(rv->evl, rv->sg.sock, EVLOOP_READ, &rv->sg)) {
+        debug(DBG_ERROR, "%s: Cannot watch shipgate socket!\n", s->name);
+        goto err_shipgate;
+    }
+
     /* Start up the thread for this ship. */
     if(pthread_create(&rv->thd, NULL, &ship_thd, rv)) {
         debug(DBG_ERROR, "%s: Cannot start ship thread!\n", s->name);
@@ -726,6 +621,9 @@ err_gms:
 err_quests:
     pthread_rwlock_destroy(&rv->qlock);
     clean_quests(rv);
+err_evloop:
+    evloop_destroy(rv->evl);
+err_clients:
     free(rv->clients);
 err_blocks:
     free(rv->blocks);
@@ -846,8 +744,8 @@ void ship_server_stop(ship_t *s) {
     /* Set the flag to kill the ship. */
     s->run = 0;
 
-    /* Send a byte to the pipe so that we actually break out of the select. */
-    write(s->pipes[0], "\xFF", 1);
+    /* Send a byte to the pipe so that we actually break out of the wait. */
+    write(s->pipes[1], "\xFF", 1);
 
     /* Wait for it to die. */
     pthread_join(s->thd, NULL);
@@ -857,9 +755,9 @@ void ship_server_shutdown(ship_t *s, time_t when) {
     if(when >= time(NULL)) {
         s->shutdown_time = when;
 
-        /* Send a byte to the pipe so that we actually break out of the select
+        /* Send a byte to the pipe so that we actually break out of the wait
            and put a probably more sane amount in the timeout there */
-        write(s->pipes[0], "\xFF", 1);
+        write(s->pipes[1], "\xFF", 1);
     }
 }
 
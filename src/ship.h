@@ -29,6 +29,8 @@
 
 #include "gm.h"
 #include "block.h"
+#include "evloop.h"
+#include "timerwheel.h"
 #include "shipgate.h"
 
 #define CLIENTS_H_COUNTS_ONLY
@@ -86,6 +88,8 @@ struct ship {
 
     time_t shutdown_time;
     int pipes[2];
+    evloop_t *evl;
+    timerwheel_t tw;
 
     uint16_t num_clients;
     uint16_t num_games;
@@ -176,17 +176,39 @@ static const char type_codes[][3] = {
 static int send_dc_lobby_arrows(lobby_t *l, ship_client_t *c);
 static int send_bb_lobby_arrows(lobby_t *l, ship_client_t *c);
 
+/* Output corking setting (from the command line). */
+extern int block_cork;
+
 /* Send a raw packet away. */
 static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
     ssize_t rv, total = 0;
-    void *tmp;
+    block_worker_t *w = block_current_worker();
+
+    /* Only count (or cork) things sent by the worker that owns the client. */
+    if(w && w != c->worker) {
+        w = NULL;
+    }
+
+    /* If we're corking output, just queue it up to go out with everything else
+       at the end of this pass through the worker's loop. */
+    if(w && block_cork) {
+        if(block_cork_send(w, c, sendbuf, len)) {
+            return -1;
+        }
+
+        return client_sendq_update(c);
+    }
 
     /* Keep trying until the whole thing's sent. */
-    if(!c->sendbuf_cur) {
+    if(!c->sendbuf.len) {
         while(total < len) {
             rv = send(c->sock, sendbuf + total, len - total, 0);
 
-            if(rv == -1 && errno != EAGAIN) {
+            if(w) {
+                ++w->sends;
+            }
+
+            if(rv == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
                 return -1;
             }
             else if(rv == -1) {
@@ -200,30 +222,18 @@ static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
     rv = len - total;
 
     if(rv) {
-        /* Move out any already transferred data. */
-        if(c->sendbuf_start) {
-            memmove(c->sendbuf, c->sendbuf + c->sendbuf_start,
-                    c->sendbuf_cur - c->sendbuf_start);
-            c->sendbuf_cur -= c->sendbuf_start;
-            c->sendbuf_start = 0;
+        /* Copy what's left of the packet into the output buffer. If that
+           would put the client over its limit, give up on it. */
+        if(ringbuf_append(&c->sendbuf, sendbuf + total, rv)) {
+            return -1;
         }
 
-        /* See if we need to reallocate the buffer. */
-        if(c->sendbuf_cur + rv > c->sendbuf_size) {
-            tmp = realloc(c->sendbuf, c->sendbuf_cur + rv);
-
-            /* If we can't allocate the space, bail. */
-            if(tmp == NULL) {
-                return -1;
-            }
-
-            c->sendbuf_size = c->sendbuf_cur + rv;
-            c->sendbuf = (unsigned char *)tmp;
+        /* Ask the event loop to tell us when we can write again. */
+        if(!c->write_armed) {
+            client_want_write(c, 1);
         }
 
-        /* Copy what's left of the packet into the output buffer. */
-        memcpy(c->sendbuf + c->sendbuf_cur, sendbuf + total, rv);
-        c->sendbuf_cur += rv;
+        return client_sendq_update(c);
     }
 
     return 0;
@@ -231,6 +241,12 @@ static int send_raw(ship_client_t *c, int len, uint8_t *sendbuf) {
 
 /* Encrypt and send a packet away. */
 int crypt_send(ship_client_t *c, int len, uint8_t *sendbuf) {
+    /* The encryption state belongs to the client's worker, so if we're on some
+       other thread, the worker has to do this part. */
+    if(c->worker && c->worker != block_current_worker()) {
+        return block_post(c->worker, c, BLOCK_MSG_SEND, sendbuf, len);
+    }
+
     /* Expand it to be a multiple of 8/4 bytes long */
     while(len & (c->hdr_size - 1)) {
         sendbuf[len++] = 0;
@@ -238,7 +254,13 @@ int crypt_send(ship_client_t *c, int len, uint8_t *sendbuf) {
 
     /* If we're logging the client, write into the log */
     if(c->logfile) {
-        fprint_packet(c->logfile, sendbuf, len, 0);
+        pthread_mutex_lock(&c->mutex);
+
+        if(c->logfile) {
+            fprint_packet(c->logfile, sendbuf, len, 0);
+        }
+
+        pthread_mutex_unlock(&c->mutex);
     }
 
     /* Encrypt the packet */
@@ -1573,81 +1595,207 @@ int send_lobby_join(ship_client_t *c, lobby_t *l) {
     return 0;
 }
 
-/* Send a prepared packet to the given client. */
-int send_pkt_dc(ship_client_t *c, dc_pkt_hdr_t *pkt) {
-    uint8_t *sendbuf = get_sendbuf();
-    int len = (int)LE16(pkt->pkt_len);
+/* Rewrite a packet with either a DC or BB style header into one of the wire
+   formats, returning the length of the result. */
+static int render_pkt(uint8_t *dst, const uint8_t *src, int is_bb, int fmt) {
+    if(!is_bb) {
+        const dc_pkt_hdr_t *pkt = (const dc_pkt_hdr_t *)src;
+        int len = (int)LE16(pkt->pkt_len);
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
+        if(fmt == BCAST_FMT_PC) {
+            pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)dst;
 
-    /* Adjust the packet for whatever version */
-    if(c->version == CLIENT_VERSION_PC) {
-        pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)sendbuf;
+            hdr->pkt_len = pkt->pkt_len;
+            hdr->flags = pkt->flags;
+            hdr->pkt_type = pkt->pkt_type;
 
-        hdr->pkt_len = pkt->pkt_len;
-        hdr->flags = pkt->flags;
-        hdr->pkt_type = pkt->pkt_type;
+            memcpy(dst + 4, src + 4, len - 4);
+        }
+        else if(fmt == BCAST_FMT_BB) {
+            bb_pkt_hdr_t *hdr = (bb_pkt_hdr_t *)dst;
 
-        memcpy(sendbuf + 4, ((uint8_t *)pkt) + 4, len - 4);
-    }
-    else if(c->version == CLIENT_VERSION_BB) {
-        bb_pkt_hdr_t *hdr = (bb_pkt_hdr_t *)sendbuf;
+            hdr->pkt_len = LE16((len + 4));
+            hdr->flags = LE32(pkt->flags);
+            hdr->pkt_type = LE16(pkt->pkt_type);
 
-        hdr->pkt_len = LE16((len + 4));
-        hdr->flags = LE32(pkt->flags);
-        hdr->pkt_type = LE16(pkt->pkt_type);
+            memcpy(dst + 8, src + 4, len - 4);
+            len += 4;
+        }
+        else {
+            memcpy(dst, src, len);
+        }
 
-        memcpy(sendbuf + 8, ((uint8_t *)pkt) + 4, len - 4);
-        len += 4;
+        return len;
     }
     else {
-        memcpy(sendbuf, pkt, len);
+        const bb_pkt_hdr_t *pkt = (const bb_pkt_hdr_t *)src;
+        int len = (int)LE16(pkt->pkt_len);
+
+        if(fmt == BCAST_FMT_BB) {
+            memcpy(dst, src, len);
+        }
+        else if(fmt == BCAST_FMT_PC) {
+            pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)dst;
+
+            hdr->pkt_len = LE16(len - 4);
+            hdr->flags = (uint8_t)pkt->flags;
+            hdr->pkt_type = (uint8_t)pkt->pkt_type;
+
+            memcpy(dst + 4, src + 8, len - 8);
+            len -= 4;
+        }
+        else {
+            dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)dst;
+
+            hdr->pkt_len = LE16(len - 4);
+            hdr->flags = (uint8_t)pkt->flags;
+            hdr->pkt_type = (uint8_t)pkt->pkt_type;
+
+            memcpy(dst + 4, src + 8, len - 8);
+            len -= 4;
+        }
+
+        return len;
     }
+}
 
-    /* Send it away */
+/* What wire format does the client speak? */
+static int client_fmt(ship_client_t *c, int nte) {
+    if(c->version == CLIENT_VERSION_PC)
+        return BCAST_FMT_PC;
+    else if(c->version == CLIENT_VERSION_BB)
+        return BCAST_FMT_BB;
+    else if(nte && (c->flags & CLIENT_FLAG_IS_DCNTE))
+        return BCAST_FMT_NTE;
+
+    return BCAST_FMT_DC;
+}
+
+/* Send a prepared packet to the given client. */
+int send_pkt_dc(ship_client_t *c, dc_pkt_hdr_t *pkt) {
+    uint8_t *sendbuf = get_sendbuf();
+    int len;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf) {
+        return -1;
+    }
+
+    /* Adjust the packet for whatever version, and send it away. */
+    len = render_pkt(sendbuf, (const uint8_t *)pkt, 0, client_fmt(c, 0));
     return crypt_send(c, len, sendbuf);
 }
 
 /* Send a prepared packet to the given client. */
 int send_pkt_bb(ship_client_t *c, bb_pkt_hdr_t *pkt) {
     uint8_t *sendbuf = get_sendbuf();
-    int len = (int)LE16(pkt->pkt_len);
+    int len;
 
     /* Verify we got the sendbuf. */
     if(!sendbuf) {
         return -1;
     }
 
-    /* Figure out what to do based on version... */
-    if(c->version == CLIENT_VERSION_BB) {
-        memcpy(sendbuf, pkt, len);
+    /* Adjust the packet for whatever version, and send it away. */
+    len = render_pkt(sendbuf, (const uint8_t *)pkt, 1, client_fmt(c, 0));
+    return crypt_send(c, len, sendbuf);
+}
+
+/* Retrieve the thread-specific buffer that broadcasts are rendered into. There
+   is room for one maximum size packet (plus a BB header) per format. */
+#define BCAST_SLOT_SIZE     (65536 + 8)
+
+static uint8_t *get_bcastbuf(void) {
+    uint8_t *buf = (uint8_t *)pthread_getspecific(bcastbuf_key);
+
+    if(!buf) {
+        buf = (uint8_t *)malloc(BCAST_SLOT_SIZE * BCAST_FMT_COUNT);
+
+        if(!buf) {
+            perror("malloc");
+            return NULL;
+        }
+
+        if(pthread_setspecific(bcastbuf_key, buf)) {
+            perror("pthread_setspecific");
+            free(buf);
+            return NULL;
+        }
     }
-    else if(c->version == CLIENT_VERSION_PC) {
-        pc_pkt_hdr_t *hdr = (pc_pkt_hdr_t *)sendbuf;
 
-        hdr->pkt_len = LE16(len - 4);
-        hdr->flags = (uint8_t)pkt->flags;
-        hdr->pkt_type = (uint8_t)pkt->pkt_type;
+    return buf;
+}
+
+int bcast_init(bcast_t *b, const void *pkt, int is_bb, int nte) {
+    int i, type, sub;
 
-        memcpy(sendbuf + 4, ((uint8_t *)pkt) + 8, len - 8);
-        len -= 4;
+    if(!(b->buf = get_bcastbuf())) {
+        return -1;
     }
-    else {
-        dc_pkt_hdr_t *hdr = (dc_pkt_hdr_t *)sendbuf;
 
-        hdr->pkt_len = LE16(len - 4);
-        hdr->flags = (uint8_t)pkt->flags;
-        hdr->pkt_type = (uint8_t)pkt->pkt_type;
+    b->pkt = (const uint8_t *)pkt;
+    b->is_bb = is_bb;
+    b->nte = nte;
+    b->low_pri = 0;
+
+    /* Position updates are superseded by the next one to come along, so they
+       can be skipped for anyone that's falling behind. */
+    if(nte) {
+        type = is_bb ? (b->pkt[2] | (b->pkt[3] << 8)) : b->pkt[0];
+        sub = is_bb ? b->pkt[8] : b->pkt[4];
 
-        memcpy(sendbuf + 4, ((uint8_t *)pkt) + 8, len - 8);
-        len -= 4;
+        if(type == GAME_COMMAND0_TYPE &&
+           (sub == SUBCMD_SET_POS_3E || sub == SUBCMD_SET_POS_3F ||
+            sub == SUBCMD_MOVE_SLOW || sub == SUBCMD_MOVE_FAST)) {
+            b->low_pri = 1;
+        }
     }
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    for(i = 0; i < BCAST_FMT_COUNT; ++i) {
+        b->len[i] = -1;
+    }
+
+    return 0;
+}
+
+int bcast_send(ship_client_t *c, bcast_t *b) {
+    int fmt = client_fmt(c, b->nte), type;
+    uint8_t *src = b->buf + fmt * BCAST_SLOT_SIZE;
+    uint8_t *sendbuf;
+
+    /* Don't add to the pile for a client that's already backed up. */
+    if(b->low_pri && client_sendq_congested(c)) {
+        __atomic_add_fetch(&c->sendq_drops, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* Render the packet for this format, if nobody else has needed it yet. */
+    if(b->len[fmt] < 0) {
+        b->len[fmt] = render_pkt(src, b->pkt, b->is_bb, fmt);
+
+        /* NTE clients need the subcommand number swapped out, assuming they
+           understand the subcommand at all. */
+        if(fmt == BCAST_FMT_NTE) {
+            if((type = subcmd_nte_type(src[4])) < 0) {
+                b->len[fmt] = 0;
+            }
+            else {
+                src[4] = (uint8_t)type;
+            }
+        }
+    }
+
+    if(!b->len[fmt]) {
+        return 0;
+    }
+
+    /* Copy it out to be encrypted and sent. */
+    if(!(sendbuf = get_sendbuf())) {
+        return -1;
+    }
+
+    memcpy(sendbuf, src, b->len[fmt]);
+    return crypt_send(c, b->len[fmt], sendbuf);
 }
 
 /* Send a packet to all clients in the lobby when a new player joins. */
@@ -4004,18 +4152,14 @@ int send_game_join(ship_client_t *c, lobby_t *l) {
     return -1;
 }
 
-/* Send a packet to a client giving them the list of games on the block. */
-static int send_dc_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+/* Render the list of games on the block for each kind of client, returning
+   the length of the packet. These expect to be called with the block's game
+   list lock held for writing (see send_game_list()). */
+static int render_dc_game_list(uint8_t *sendbuf, block_t *b, int v1) {
     dc_game_list_pkt *pkt = (dc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x20;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x20);
 
@@ -4041,14 +4185,13 @@ static int send_dc_game_list(ship_client_t *c, block_t *b) {
         }
 
         /* Don't show v2-only lobbies to v1 players */
-        if(c->version == CLIENT_VERSION_DCV1 && l->v2) {
+        if(v1 && l->v2) {
             pthread_mutex_unlock(&l->mutex);
             continue;
         }
 
         /* Don't show v1-only lobbies to v2 players */
-        if(c->version == CLIENT_VERSION_DCV2 &&
-           (l->flags & LOBBY_FLAG_V1ONLY)) {
+        if(!v1 && (l->flags & LOBBY_FLAG_V1ONLY)) {
             pthread_mutex_unlock(&l->mutex);
             continue;
         }
@@ -4106,21 +4249,14 @@ static int send_dc_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_pc_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int render_pc_game_list(uint8_t *sendbuf, block_t *b) {
     pc_game_list_pkt *pkt = (pc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x30;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x30);
 
@@ -4197,21 +4333,14 @@ static int send_pc_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_gc_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int render_gc_game_list(uint8_t *sendbuf, block_t *b, int dcpc) {
     dc_game_list_pkt *pkt = (dc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x20;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x20);
 
@@ -4244,8 +4373,7 @@ static int send_gc_game_list(ship_client_t *c, block_t *b) {
 
         /* Ignore DC/PC games if the user hasn't set the flag to show them or
            the lobby doesn't have the right flag set */
-        if(!l->episode && (!(c->flags & CLIENT_FLAG_SHOW_DCPC_ON_GC) ||
-                           !(l->flags & LOBBY_FLAG_GC_ALLOWED))) {
+        if(!l->episode && (!dcpc || !(l->flags & LOBBY_FLAG_GC_ALLOWED))) {
             pthread_mutex_unlock(&l->mutex);
             continue;
         }
@@ -4296,21 +4424,14 @@ static int send_gc_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_ep3_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int render_ep3_game_list(uint8_t *sendbuf, block_t *b) {
     dc_game_list_pkt *pkt = (dc_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x20;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x20);
 
@@ -4369,21 +4490,14 @@ static int send_ep3_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = entries - 1;
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
 }
 
-static int send_bb_game_list(ship_client_t *c, block_t *b) {
-    uint8_t *sendbuf = get_sendbuf();
+static int render_bb_game_list(uint8_t *sendbuf, block_t *b) {
     bb_game_list_pkt *pkt = (bb_game_list_pkt *)sendbuf;
     int entries = 1, len = 0x34;
     lobby_t *l;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf) {
-        return -1;
-    }
-
     /* Clear out the packet and the first entry */
     memset(pkt, 0, 0x34);
 
@@ -4441,31 +4555,133 @@ static int send_bb_game_list(ship_client_t *c, block_t *b) {
     pkt->hdr.flags = LE32(entries - 1);
     pkt->hdr.pkt_len = LE16(len);
 
-    /* Send it away */
-    return crypt_send(c, len, sendbuf);
+    return len;
+}
+
+/* Render a game list of the given kind into buf, returning its length. */
+static int render_game_list(uint8_t *buf, block_t *b, int kind) {
+    switch(kind) {
+        case GAME_LIST_DCV1:
+        case GAME_LIST_DCV2:
+            return render_dc_game_list(buf, b, kind == GAME_LIST_DCV1);
+
+        case GAME_LIST_PC:
+            return render_pc_game_list(buf, b);
+
+        case GAME_LIST_GC:
+        case GAME_LIST_GC_DCPC:
+            return render_gc_game_list(buf, b, kind == GAME_LIST_GC_DCPC);
+
+        case GAME_LIST_EP3:
+            return render_ep3_game_list(buf, b);
+
+        case GAME_LIST_BB:
+            return render_bb_game_list(buf, b);
+    }
+
+    return -1;
 }
 
 int send_game_list(ship_client_t *c, block_t *b) {
-    /* Call the appropriate function. */
+    uint8_t *sendbuf = get_sendbuf();
+    game_list_cache_t *e;
+    uint32_t gen;
+    uint8_t *tmp;
+    int kind, len = 0;
+
+    /* Verify we got the sendbuf. */
+    if(!sendbuf) {
+        return -1;
+    }
+
+    /* Figure out which list the client gets. */
     switch(c->version) {
         case CLIENT_VERSION_DCV1:
+            kind = GAME_LIST_DCV1;
+            break;
+
         case CLIENT_VERSION_DCV2:
-            return send_dc_game_list(c, b);
+            kind = GAME_LIST_DCV2;
+            break;
 
         case CLIENT_VERSION_PC:
-            return send_pc_game_list(c, b);
+            kind = GAME_LIST_PC;
+            break;
 
         case CLIENT_VERSION_GC:
-            return send_gc_game_list(c, b);
+            kind = (c->flags & CLIENT_FLAG_SHOW_DCPC_ON_GC) ?
+                GAME_LIST_GC_DCPC : GAME_LIST_GC;
+            break;
 
         case CLIENT_VERSION_EP3:
-            return send_ep3_game_list(c, b);
+            kind = GAME_LIST_EP3;
+            break;
 
         case CLIENT_VERSION_BB:
-            return send_bb_game_list(c, b);
+            kind = GAME_LIST_BB;
+            break;
+
+        default:
+            return -1;
     }
 
-    return -1;
+    e = &b->game_lists[kind];
+    __atomic_add_fetch(&b->game_list_reqs, 1, __ATOMIC_RELAXED);
+
+    /* If nothing has changed since the list was last rendered, just use that
+       copy of it. */
+    pthread_rwlock_rdlock(&b->game_list_lock);
+    gen = __atomic_load_n(&b->game_list_gen, __ATOMIC_ACQUIRE);
+
+    if(e->len && e->gen == gen) {
+        len = e->len;
+        memcpy(sendbuf, e->pkt, len);
+    }
+
+    pthread_rwlock_unlock(&b->game_list_lock);
+
+    if(len) {
+        return crypt_send(c, len, sendbuf);
+    }
+
+    /* Otherwise, render it again (unless someone beat us to it). Anything that
+       changes after we read the generation here will bump it again, so we
+       can't end up keeping a stale list around. */
+    pthread_rwlock_wrlock(&b->game_list_lock);
+    gen = __atomic_load_n(&b->game_list_gen, __ATOMIC_ACQUIRE);
+
+    if(e->len && e->gen == gen) {
+        len = e->len;
+        memcpy(sendbuf, e->pkt, len);
+    }
+    else if((len = render_game_list(sendbuf, b, kind)) > 0) {
+        __atomic_add_fetch(&b->game_list_builds, 1, __ATOMIC_RELAXED);
+
+        if(len > e->size) {
+            if((tmp = (uint8_t *)realloc(e->pkt, len))) {
+                e->pkt = tmp;
+                e->size = len;
+            }
+            else {
+                /* We can still send this one, we just can't keep it. */
+                e->len = 0;
+            }
+        }
+
+        if(len <= e->size) {
+            memcpy(e->pkt, sendbuf, len);
+            e->len = len;
+            e->gen = gen;
+        }
+    }
+
+    pthread_rwlock_unlock(&b->game_list_lock);
+
+    if(len <= 0) {
+        return -1;
+    }
+
+    return crypt_send(c, len, sendbuf);
 }
 
 /* Send the list of lobby info items to the client. */
@@ -5821,761 +6037,268 @@ int send_quest_info(lobby_t *l, uint32_t qid, int lang) {
     return 0;
 }
 
-/* Send a quest to everyone in a lobby. */
-static int send_dcv1_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                           int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
-    }
-
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-            version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
-            q->prefix);
-
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
-
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
-    }
-
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
-}
-
-static int send_dcv2_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                           int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    dc_quest_file_pkt *file = (dc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
+/* Figure out where a quest's files are (minus the extension). The
+   v1-compatible version of a quest is the v1 quest itself on Dreamcast, and
+   sits next to the full one with "v1" on the end of its name elsewhere. */
+static void quest_fn_base(char *fn, int version, sylverant_quest_t *q, int v1,
+                          int lang) {
+    if(version == CLIENT_VERSION_DCV1 || !v1 ||
+       (q->versions & SYLVERANT_QUEST_V1)) {
+        sprintf(fn, "%s/%s-%s/%s", ship->cfg->quests_dir,
+                version_codes[version], language_codes[lang], q->prefix);
     }
-
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
-    else {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
+    else if(version == CLIENT_VERSION_DCV2) {
+        sprintf(fn, "%s/%s-%s/%s", ship->cfg->quests_dir,
                 version_codes[CLIENT_VERSION_DCV1], language_codes[lang],
                 q->prefix);
     }
+    else {
+        sprintf(fn, "%s/%s-%s/%sv1", ship->cfg->quests_dir,
+                version_codes[version], language_codes[lang], q->prefix);
+    }
+}
 
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
+/* Read a whole quest file in. */
+static quest_payload_t *read_quest_file(const char *fn) {
+    FILE *fp;
+    long len;
+    quest_payload_t *rv;
 
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
+    if(!(fp = fopen(fn, "rb"))) {
+        debug(DBG_WARN, "Cannot open quest file %s: %s\n", fn,
               strerror(errno));
-        return -1;
+        return NULL;
     }
 
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
+    /* Figure out how long the file is. */
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
 
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
+    if(len < 0) {
+        debug(DBG_WARN, "Cannot size quest file %s: %s\n", fn,
               strerror(errno));
-        fclose(bin);
-        return -1;
+        fclose(fp);
+        return NULL;
     }
 
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
+    if(!(rv = (quest_payload_t *)malloc(sizeof(quest_payload_t) + len))) {
+        perror("malloc");
+        fclose(fp);
+        return NULL;
+    }
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
+    rv->len = (size_t)len;
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
+    if(fread(rv->data, 1, rv->len, fp) != rv->len) {
+        debug(DBG_WARN, "Error reading quest file %s: %s\n", fn,
               strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
+        free(rv);
+        fclose(fp);
+        return NULL;
     }
 
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(dc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
+    fclose(fp);
+    return rv;
+}
 
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x02; /* ??? */
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
+/* Fill in the file info packet for one of a quest's files. */
+static uint8_t *fill_quest_file(uint8_t *ptr, int version, sylverant_quest_t *q,
+                                const char *ext, size_t len) {
+    dc_quest_file_pkt *dc = (dc_quest_file_pkt *)ptr;
+    pc_quest_file_pkt *pc = (pc_quest_file_pkt *)ptr;
+    gc_quest_file_pkt *gc = (gc_quest_file_pkt *)ptr;
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
+    switch(version) {
+        case CLIENT_VERSION_DCV1:
+        case CLIENT_VERSION_DCV2:
+            sprintf(dc->name, "PSO/%s", q->name);
 
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
+            dc->hdr.pkt_type = QUEST_FILE_TYPE;
+            dc->hdr.flags = 0x02; /* ??? */
+            dc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            sprintf(dc->filename, "%s.%s", q->prefix, ext);
+            dc->length = LE32(((uint32_t)len));
+            break;
 
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
+        case CLIENT_VERSION_PC:
+            sprintf(pc->name, "PSO/%s", q->name);
+
+            pc->hdr.pkt_type = QUEST_FILE_TYPE;
+            pc->hdr.flags = 0x00;
+            pc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            sprintf(pc->filename, "%s.%s", q->prefix, ext);
+            pc->length = LE32(((uint32_t)len));
+            pc->flags = 0x0002;
+            break;
 
-        ++chunknum;
+        case CLIENT_VERSION_GC:
+            sprintf(gc->name, "PSO/%s", q->name);
+
+            gc->hdr.pkt_type = QUEST_FILE_TYPE;
+            gc->hdr.flags = 0x00;
+            gc->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
+            sprintf(gc->filename, "%s.%s", q->prefix, ext);
+            gc->length = LE32(((uint32_t)len));
+            gc->flags = 0x0002;
+            break;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+    return ptr + DC_QUEST_FILE_LENGTH;
 }
 
-static int send_pc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                         int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    pc_quest_file_pkt *file = (pc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
+/* Fill in a packet with one chunk of one of a quest's files. */
+static uint8_t *fill_quest_chunk(uint8_t *ptr, int version,
+                                 sylverant_quest_t *q, const char *ext,
+                                 int chunknum, quest_payload_t *file) {
+    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)ptr;
+    size_t off = (size_t)chunknum * 0x400;
+    size_t amt = file->len - off;
 
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
+    if(amt > 0x400) {
+        amt = 0x400;
     }
 
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
+    /* Fill in the header */
+    if(version == CLIENT_VERSION_PC) {
+        chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
+        chunk->hdr.pc.flags = (uint8_t)chunknum;
+        chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
     }
     else {
-        sprintf(fn_base, "%s/%s-%s/%sv1", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
-
-    sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
-
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
-    }
-
-    sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
-
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
-    }
-
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(pc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-    file->flags = 0x0002;
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(pc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-    file->flags = 0x0002;
-
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
-        }
-
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.pc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.pc.flags = (uint8_t)chunknum;
-            chunk->hdr.pc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
-        }
-
-        ++chunknum;
+        chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
+        chunk->hdr.dc.flags = (uint8_t)chunknum;
+        chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
+    /* Fill in the rest */
+    sprintf(chunk->filename, "%s.%s", q->prefix, ext);
+    memcpy(chunk->data, file->data + off, amt);
+    chunk->length = LE32(((uint32_t)amt));
 
-    return 0;
+    return ptr + DC_QUEST_CHUNK_LENGTH;
 }
 
-static int send_gc_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                         int lang) {
-    uint8_t *sendbuf = get_sendbuf();
-    gc_quest_file_pkt *file = (gc_quest_file_pkt *)sendbuf;
-    dc_quest_chunk_pkt *chunk = (dc_quest_chunk_pkt *)sendbuf;
-    FILE *bin, *dat;
-    uint32_t binlen, datlen;
-    int bindone = 0, datdone = 0, chunknum = 0;
-    char fn_base[256], filename[256];
-    size_t amt;
-    sylverant_quest_t *q = qm->qptr[c->version][lang];
-
-    /* Verify we got the sendbuf. */
-    if(!sendbuf || !q) {
-        return -1;
-    }
-
-    /* Each quest has two files: a .dat file and a .bin file, send a file packet
-       for each of them. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(fn_base, "%s/%s-%s/%s", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
-    else {
-        sprintf(fn_base, "%s/%s-%s/%sv1", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
+/* Build all the packets to send a quest that comes as a .bin and a .dat file:
+   a file packet for each of them, then the chunks of the files, interleaved. */
+static quest_payload_t *build_bindat_quest(int version, sylverant_quest_t *q,
+                                           const char *fn_base) {
+    quest_payload_t *bin = NULL, *dat = NULL, *rv = NULL;
+    char filename[256];
+    int binchunks, datchunks, chunknum;
+    size_t len;
+    uint8_t *ptr;
 
     sprintf(filename, "%s.bin", fn_base);
-    bin = fopen(filename, "rb");
 
-    if(!bin) {
-        debug(DBG_WARN, "Error opening bin file %s: %s\n", fn_base,
-              strerror(errno));
-        return -1;
+    if(!(bin = read_quest_file(filename))) {
+        goto out;
     }
 
     sprintf(filename, "%s.dat", fn_base);
-    dat = fopen(filename, "rb");
 
-    if(!dat) {
-        debug(DBG_WARN, "Error opening dat file %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        return -1;
+    if(!(dat = read_quest_file(filename))) {
+        goto out;
     }
 
-    /* Figure out how long each of the files are */
-    fseek(bin, 0, SEEK_END);
-    binlen = (uint32_t)ftell(bin);
-    fseek(bin, 0, SEEK_SET);
-
-    fseek(dat, 0, SEEK_END);
-    datlen = (uint32_t)ftell(dat);
-    fseek(dat, 0, SEEK_SET);
-
-    /* Send the file info packets */
-    /* Start with the .dat file. */
-    memset(file, 0, sizeof(gc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.dat", q->prefix);
-    file->length = LE32(datlen);
-    file->flags = 0x0002;
+    /* The files go in 1KiB chunks, and the last one is always short, even if
+       that means it's empty. */
+    binchunks = (int)(bin->len / 0x400) + 1;
+    datchunks = (int)(dat->len / 0x400) + 1;
+    len = DC_QUEST_FILE_LENGTH * 2 +
+        (size_t)(binchunks + datchunks) * DC_QUEST_CHUNK_LENGTH;
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending dat hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
+    if(!(rv = (quest_payload_t *)calloc(1, sizeof(quest_payload_t) + len))) {
+        perror("calloc");
+        goto out;
     }
 
-    /* Now the .bin file. */
-    memset(file, 0, sizeof(gc_quest_file_pkt));
-
-    sprintf(file->name, "PSO/%s", q->name);
-
-    file->hdr.pkt_type = QUEST_FILE_TYPE;
-    file->hdr.flags = 0x00;
-    file->hdr.pkt_len = LE16(DC_QUEST_FILE_LENGTH);
-    sprintf(file->filename, "%s.bin", q->prefix);
-    file->length = LE32(binlen);
-    file->flags = 0x0002;
+    rv->len = len;
+    ptr = rv->data;
 
-    if(crypt_send(c, DC_QUEST_FILE_LENGTH, sendbuf)) {
-        debug(DBG_WARN, "Error sending bin hdr %s: %s\n", fn_base,
-              strerror(errno));
-        fclose(bin);
-        fclose(dat);
-        return -2;
-    }
-
-    /* Now send the chunks of the file, interleaved. */
-    while(!bindone || !datdone) {
-        /* Start with the dat file if we've got any more to send from it */
-        if(!datdone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.dat", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, dat);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending dat file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
+    /* Start with the .dat file. */
+    ptr = fill_quest_file(ptr, version, q, "dat", dat->len);
+    ptr = fill_quest_file(ptr, version, q, "bin", bin->len);
 
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                datdone = 1;
-            }
+    for(chunknum = 0; chunknum < binchunks || chunknum < datchunks;
+        ++chunknum) {
+        if(chunknum < datchunks) {
+            ptr = fill_quest_chunk(ptr, version, q, "dat", chunknum, dat);
         }
 
-        /* Then the bin file if we've got any more to send from it */
-        if(!bindone) {
-            /* Clear the packet */
-            memset(chunk, 0, sizeof(dc_quest_chunk_pkt));
-
-            /* Fill in the header */
-            chunk->hdr.dc.pkt_type = QUEST_CHUNK_TYPE;
-            chunk->hdr.dc.flags = (uint8_t)chunknum;
-            chunk->hdr.dc.pkt_len = LE16(DC_QUEST_CHUNK_LENGTH);
-
-            /* Fill in the rest */
-            sprintf(chunk->filename, "%s.bin", q->prefix);
-            amt = fread(chunk->data, 1, 0x400, bin);
-            chunk->length = LE32(((uint32_t)amt));
-
-            /* Send it away */
-            if(crypt_send(c, DC_QUEST_CHUNK_LENGTH, sendbuf)) {
-                debug(DBG_WARN, "Error sending bin file %s: %s\n", fn_base,
-                      strerror(errno));
-                fclose(bin);
-                fclose(dat);
-                return -3;
-            }
-
-            /* Are we done with this file? */
-            if(amt != 0x400) {
-                bindone = 1;
-            }
+        if(chunknum < binchunks) {
+            ptr = fill_quest_chunk(ptr, version, q, "bin", chunknum, bin);
         }
-
-        ++chunknum;
     }
 
-    /* We're done with the files, close them */
-    fclose(bin);
-    fclose(dat);
-
-    return 0;
+out:
+    free(bin);
+    free(dat);
+    return rv;
 }
 
-static int send_qst_quest(ship_client_t *c, quest_map_elem_t *qm, int v1,
-                          int lang, int ver) {
-    char filename[256];
-    FILE *fp;
-    long len;
-    size_t read;
+/* Send a quest to one client. The packets for it are built (from the files)
+   the first time anyone gets this version of the quest, and kept around so the
+   next client just has to encrypt and send them. */
+static int send_quest_client(ship_client_t *c, quest_map_elem_t *qm,
+                             sylverant_quest_t *q, int v1, int lang, int ver) {
     uint8_t *sendbuf = get_sendbuf();
-    sylverant_quest_t *q = qm->qptr[ver][lang];
+    quest_payload_t *p;
+    char fn[256];
+    size_t off, amt;
+    int cached = 1, rv = 0;
 
     /* Make sure we got the sendbuf and the quest */
     if(!sendbuf || !q)
         return -1;
 
-    /* Figure out what file we're going to send. */
-    if(!v1 || (q->versions & SYLVERANT_QUEST_V1)) {
-        sprintf(filename, "%s/%s-%s/%s.qst", ship->cfg->quests_dir,
-                version_codes[c->version], language_codes[lang], q->prefix);
-    }
-    else {
-        switch(c->version) {
-            case CLIENT_VERSION_DCV1:
-            case CLIENT_VERSION_DCV2:
-                sprintf(filename, "%s/%s-%s/%s.qst", ship->cfg->quests_dir,
-                        version_codes[CLIENT_VERSION_DCV1],
-                        language_codes[lang], q->prefix);
-                break;
+    if(!(p = quest_payload_get(qm, c->version, lang, v1))) {
+        if(q->format == SYLVERANT_QUEST_BINDAT) {
+            /* The name of the quest comes from the client's own version of it,
+               even if the files come from the v1 version. */
+            if(!(q = qm->qptr[c->version][lang]))
+                return -1;
 
-            case CLIENT_VERSION_PC:
-            case CLIENT_VERSION_GC:
-                sprintf(filename, "%s/%s-%s/%sv1.qst", ship->cfg->quests_dir,
-                        version_codes[c->version], language_codes[lang],
-                        q->prefix);
-                break;
+            quest_fn_base(fn, ver, q, v1, lang);
+            p = build_bindat_quest(ver, q, fn);
+        }
+        else {
+            quest_fn_base(fn, c->version, q, v1, lang);
+            strcat(fn, ".qst");
+            p = read_quest_file(fn);
         }
-    }
 
-    fp = fopen(filename, "rb");
+        if(!p)
+            return -1;
 
-    if(!fp) {
-        debug(DBG_WARN, "Cannot open qst file %s: %s\n", filename,
-              strerror(errno));
-        return -1;
+        cached = quest_payload_add(qm, c->version, lang, v1, &p);
     }
 
-    /* Figure out how long the file is. */
-    fseek(fp, 0, SEEK_END);
-    len = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    /* Copy the packets (in chunks if necessary) to the sendbuf to actually
+       send away. */
+    for(off = 0; off < p->len; off += amt) {
+        amt = p->len - off;
 
-    /* Copy the file (in chunks if necessary) to the sendbuf to actually send
-       away. */
-    while(len) {
-        read = fread(sendbuf, 1, 65536, fp);
+        if(amt > 65536)
+            amt = 65536;
 
-        /* If we can't read from the file, bail. */
-        if(!read) {
-            debug(DBG_WARN, "Error reading qst file %s: %s\n", filename,
-                  strerror(errno));
-            fclose(fp);
-            return -2;
-        }
+        memcpy(sendbuf, p->data + off, amt);
 
-        /* Make sure we read up to a header-size boundary. */
-        if((read & (c->hdr_size - 1)) && !feof(fp)) {
-            long amt = (read & (c->hdr_size - 1));
-
-            fseek(fp, -amt, SEEK_CUR);
-            read -= amt;
-        }
-
-        /* Send this chunk away. */
-        if(crypt_send(c, read, sendbuf)) {
-            debug(DBG_WARN, "Error sending qst file %s: %s\n", filename,
+        if(crypt_send(c, (int)amt, sendbuf)) {
+            debug(DBG_WARN, "Error sending quest %s: %s\n", q->prefix,
                   strerror(errno));
-            fclose(fp);
-            return -3;
+            rv = -3;
+            break;
         }
-
-        len -= read;
     }
 
-    /* We're finished. */
-    fclose(fp);
-    return 0;
+    if(!cached)
+        free(p);
+
+    return rv;
 }
 
+/* Send a quest to everyone in a lobby. */
 int send_quest(lobby_t *l, uint32_t qid, int lc) {
     int i;
     int v1 = 0, rv;
@@ -6639,35 +6362,15 @@ int send_quest(lobby_t *l, uint32_t qid, int lc) {
             }
 
             if(q->format == SYLVERANT_QUEST_BINDAT) {
-                /* Call the appropriate function. */
-                switch(ver) {
-                    case CLIENT_VERSION_DCV1:
-                        rv = send_dcv1_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_DCV2:
-                        rv = send_dcv2_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_PC:
-                        rv = send_pc_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_GC:
-                        rv = send_gc_quest(c, elem, v1, lang);
-                        break;
-
-                    case CLIENT_VERSION_EP3:
-                        return -1;
-                }
-            }
-            else if(q->format == SYLVERANT_QUEST_QST) {
-                rv = send_qst_quest(c, elem, v1, lang, ver);
+                if(ver == CLIENT_VERSION_EP3)
+                    return -1;
             }
-            else {
+            else if(q->format != SYLVERANT_QUEST_QST) {
                 return -1;
             }
 
+            rv = send_quest_client(c, elem, q, v1, lang, ver);
+
             if(rv) {
                 send_message_box(c, "Error reading quest file!\nPlease report "
                                  "this problem!\nInclude your guildcard\n"
@@ -128,6 +128,35 @@ int send_lobby_join(ship_client_t *c, lobby_t *l);
 int send_pkt_dc(ship_client_t *c, dc_pkt_hdr_t *pkt);
 int send_pkt_bb(ship_client_t *c, bb_pkt_hdr_t *pkt);
 
+/* Wire formats a broadcast packet can be rendered into. */
+#define BCAST_FMT_DC        0       /* DCv1/DCv2/GC/Episode 3 */
+#define BCAST_FMT_PC        1
+#define BCAST_FMT_BB        2
+#define BCAST_FMT_NTE       3       /* DC, with NTE subcommand numbers */
+#define BCAST_FMT_COUNT     4
+
+/* A packet being sent to a bunch of clients at once. The packet is rendered
+   into each wire format the first time a recipient needs that format, and the
+   rendered copy is reused for everyone else, so each recipient only costs an
+   encryption and a send. The rendered copies live in a thread-specific buffer,
+   so only one broadcast can be in progress on a thread at a time. */
+typedef struct bcast {
+    const uint8_t *pkt;
+    int is_bb;
+    int nte;
+    int low_pri;                    /* Skipped for congested clients */
+    uint8_t *buf;
+    int len[BCAST_FMT_COUNT];
+} bcast_t;
+
+/* Set up a broadcast of pkt, which has a BB header if is_bb is set, or a DC
+   header otherwise. If nte is set, the packet is a subcommand that should be
+   translated for DC NTE recipients (and is dropped for them if it can't be). */
+int bcast_init(bcast_t *b, const void *pkt, int is_bb, int nte);
+
+/* Send the broadcast packet to one client. */
+int bcast_send(ship_client_t *c, bcast_t *b);
+
 /* Send a packet to all clients in the lobby when a new player joins. */
 int send_lobby_add_player(lobby_t *l, ship_client_t *c);
 
@@ -37,17 +37,35 @@
 #include "ship.h"
 #include "clients.h"
 #include "shipgate.h"
+#include "savecache.h"
 #include "utils.h"
 #include "scripts.h"
 #include "mapdata.h"
 #include "ptdata.h"
 #include "pmtdata.h"
 #include "rtdata.h"
+#include "evloop.h"
 
 /* The actual ship structures. */
 ship_t *ship;
 int enable_ipv6 = 1;
 int restart_on_shutdown = 0;
+int block_workers = 1;
+size_t client_sendbuf_max = 4 * 1024 * 1024;
+size_t client_sendbuf_high = 256 * 1024;
+size_t client_sendbuf_total = 0;
+int client_sendbuf_stall = 30;
+int block_cork = 0;
+int block_cork_max_ms = 0;
+int lobby_pos_tick_ms = 0;
+size_t lobby_burst_max = 256 * 1024;
+size_t shipgate_queue_max = 4 * 1024 * 1024;
+int shipgate_coalesce_ms = 0;
+int shipgate_req_timeout = 30;
+static const char *save_journal = NULL;
+size_t quest_payload_max = 32 * 1024 * 1024;
+int *block_workers_ovr = NULL;
+int block_workers_ovr_count = 0;
 uint32_t ship_ip4;
 uint8_t ship_ip6[16];
 
@@ -94,6 +112,49 @@ static void print_help(const char *bin) {
 #ifdef SYLVERANT_ENABLE_IPV6
            "--no-ipv6       Disable IPv6 support for incoming connections\n"
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+           "--no-epoll      Use select() instead of epoll for socket I/O\n"
+#endif
+#ifdef SYLVERANT_ENABLE_IO_URING
+           "--io-uring      Use io_uring for socket I/O (falls back to epoll\n"
+           "                if the kernel doesn't support it)\n"
+#endif
+           "--workers n     Run n worker threads for each block, sharing the\n"
+           "                block's ports between them (default 1)\n"
+           "--workers b:n   Run n worker threads for block b only\n"
+           "--sendbuf-max n Disconnect clients with more than n KiB of data\n"
+           "                waiting to be sent to them (default 4096)\n"
+           "--sendbuf-high n Consider clients with more than n KiB of data\n"
+           "                waiting to be sent to them to be congested, and\n"
+           "                drop position updates to them until they drain\n"
+           "                down to half that (default 256)\n"
+           "--sendbuf-total n Also consider clients congested (above half of\n"
+           "                --sendbuf-high) when more than n MiB is waiting to\n"
+           "                be sent to all clients (default: no limit)\n"
+           "--sendbuf-stall n Disconnect clients that stay congested for more\n"
+           "                than n seconds (default 30)\n"
+           "--cork          Send each block client's packets all at once at\n"
+           "                the end of each pass through the block's loop\n"
+           "--cork-max-ms n With --cork, don't hold any packet back for more\n"
+           "                than n milliseconds (default: no limit)\n"
+           "--pos-tick n    Only pass along each player's latest position\n"
+           "                every n milliseconds, rather than every movement\n"
+           "                (a multiple of 100, up to 1000, default: off)\n"
+           "--burst-queue n Hold back at most n KiB of packets in a game while\n"
+           "                someone is joining it, kicking the joiner if it\n"
+           "                takes long enough to go over that (default 256)\n"
+           "--sg-queue n    Throw away packets for the shipgate rather than\n"
+           "                queue up more than n KiB of them (default 4096)\n"
+           "--sg-delay n    Wait up to n milliseconds for more packets to\n"
+           "                send to the shipgate in the same TLS record\n"
+           "                (1-5 works well, default: only what's queued)\n"
+           "--sg-timeout n  Give up on requests to the shipgate that haven't\n"
+           "                been answered in n seconds (default 30)\n"
+           "--save-journal f Keep character saves the shipgate hasn't\n"
+           "                confirmed yet in the file f, so they survive a\n"
+           "                restart of the ship (default: memory only)\n"
+           "--quest-cache n Keep up to n KiB of quest files in memory, ready\n"
+           "                to send (default 32768, 0 to always read them)\n"
            "--check-config  Load and parse the configuration, but do not\n"
            "                actually start the ship server. This implies the\n"
            "                --nodaemon option as well.\n"
@@ -102,6 +163,51 @@ static void print_help(const char *bin) {
            "one specified will be used. The default is --verbose.\n", bin);
 }
 
+/* Parse the argument to --workers, which is either a count for every block or
+   a block:count pair to override the count for one block. */
+static int parse_workers(const char *arg) {
+    char *end;
+    long b = 0, n;
+    int *tmp;
+
+    n = strtol(arg, &end, 10);
+
+    if(*end == ':') {
+        b = n;
+        n = strtol(end + 1, &end, 10);
+
+        if(b < 1 || end == arg) {
+            return -1;
+        }
+    }
+
+    if(*end || n < 1 || n > BLOCK_MAX_WORKERS) {
+        return -1;
+    }
+
+    if(!b) {
+        block_workers = (int)n;
+        return 0;
+    }
+
+    if(b >= block_workers_ovr_count) {
+        tmp = (int *)realloc(block_workers_ovr, sizeof(int) * (b + 1));
+
+        if(!tmp) {
+            perror("realloc");
+            return -1;
+        }
+
+        memset(tmp + block_workers_ovr_count, 0,
+               sizeof(int) * (b + 1 - block_workers_ovr_count));
+        block_workers_ovr = tmp;
+        block_workers_ovr_count = (int)b + 1;
+    }
+
+    block_workers_ovr[b] = (int)n;
+    return 0;
+}
+
 /* Parse any command-line arguments passed in. */
 static void parse_command_line(int argc, char *argv[]) {
     int i;
@@ -134,6 +240,137 @@ static void parse_command_line(int argc, char *argv[]) {
         else if(!strcmp(argv[i], "--no-ipv6")) {
             enable_ipv6 = 0;
         }
+        else if(!strcmp(argv[i], "--no-epoll")) {
+            evloop_backend = EVLOOP_BACKEND_SELECT;
+        }
+#ifdef SYLVERANT_ENABLE_IO_URING
+        else if(!strcmp(argv[i], "--io-uring")) {
+            evloop_backend = EVLOOP_BACKEND_URING;
+        }
+#endif
+        else if(!strcmp(argv[i], "--workers")) {
+            if(i + 1 >= argc || parse_workers(argv[++i])) {
+                printf("Invalid argument to --workers\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(!strcmp(argv[i], "--sendbuf-max")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 64) {
+                printf("Invalid argument to --sendbuf-max\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            client_sendbuf_max = (size_t)atoi(argv[++i]) * 1024;
+        }
+        else if(!strcmp(argv[i], "--sendbuf-high")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 16) {
+                printf("Invalid argument to --sendbuf-high\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            client_sendbuf_high = (size_t)atoi(argv[++i]) * 1024;
+        }
+        else if(!strcmp(argv[i], "--sendbuf-total")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                printf("Invalid argument to --sendbuf-total\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            client_sendbuf_total = (size_t)atoi(argv[++i]) * 1024 * 1024;
+        }
+        else if(!strcmp(argv[i], "--sendbuf-stall")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                printf("Invalid argument to --sendbuf-stall\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            client_sendbuf_stall = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--cork")) {
+            block_cork = 1;
+        }
+        else if(!strcmp(argv[i], "--cork-max-ms")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                printf("Invalid argument to --cork-max-ms\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            block_cork_max_ms = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--pos-tick")) {
+            /* Positions go out on the block's timer wheel, so anything
+               finer than its ticks wouldn't mean anything. */
+            if(i + 1 >= argc || atoi(argv[i + 1]) < TIMERWHEEL_TICK_MS ||
+               atoi(argv[i + 1]) > 1000 ||
+               atoi(argv[i + 1]) % TIMERWHEEL_TICK_MS) {
+                printf("Invalid argument to --pos-tick\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            lobby_pos_tick_ms = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--burst-queue")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                printf("Invalid argument to --burst-queue\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            lobby_burst_max = (size_t)atoi(argv[++i]) * 1024;
+        }
+        else if(!strcmp(argv[i], "--sg-queue")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                printf("Invalid argument to --sg-queue\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            shipgate_queue_max = (size_t)atoi(argv[++i]) * 1024;
+        }
+        else if(!strcmp(argv[i], "--sg-delay")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 0 ||
+               atoi(argv[i + 1]) > 1000) {
+                printf("Invalid argument to --sg-delay\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            shipgate_coalesce_ms = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--sg-timeout")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                printf("Invalid argument to --sg-timeout\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            shipgate_req_timeout = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--quest-cache")) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                printf("Invalid argument to --quest-cache\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            quest_payload_max = (size_t)atoi(argv[++i]) * 1024;
+        }
+        else if(!strcmp(argv[i], "--save-journal")) {
+            if(i + 1 >= argc) {
+                printf("Invalid argument to --save-journal\n");
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+
+            save_journal = argv[++i];
+        }
         else if(!strcmp(argv[i], "--check-config")) {
             check_only = 1;
             dont_daemonize = 1;
@@ -492,6 +729,11 @@ int main(int argc, char *argv[]) {
         if(client_init(cfg)) {
             exit(EXIT_FAILURE);
         }
+
+        /* Pick up any character saves left over from last time. */
+        if(save_cache_init(save_journal)) {
+            exit(EXIT_FAILURE);
+        }
     }
 
     /* Try to read the v2 ItemPT data... */
@@ -627,9 +869,9 @@ int main(int argc, char *argv[]) {
             pthread_setspecific(sendbuf_key, NULL);
         }
 
-        if((tmp = pthread_getspecific(recvbuf_key))) {
+        if((tmp = pthread_getspecific(bcastbuf_key))) {
             free(tmp);
-            pthread_setspecific(recvbuf_key, NULL);
+            pthread_setspecific(bcastbuf_key, NULL);
         }
     }
     else {
@@ -641,6 +883,7 @@ int main(int argc, char *argv[]) {
 
     if(!check_only) {
         client_shutdown();
+        save_cache_cleanup();
         cleanup_gnutls();
     }
 
@@ -661,6 +904,7 @@ int main(int argc, char *argv[]) {
     }
 
     free(initial_path);
+    free(block_workers_ovr);
     xmlCleanupParser();
 
     return 0;
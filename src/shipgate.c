@@ -25,6 +25,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <poll.h>
 
 #include <sylverant/config.h>
 #include <sylverant/debug.h>
@@ -34,6 +35,7 @@
 #include "utils.h"
 #include "clients.h"
 #include "shipgate.h"
+#include "savecache.h"
 #include "ship_packets.h"
 
 /* TLS stuff -- from ship_server.c */
@@ -43,6 +45,56 @@ extern gnutls_priority_t tls_prio;
 extern int enable_ipv6;
 extern uint32_t ship_ip4;
 extern uint8_t ship_ip6[16];
+extern size_t shipgate_queue_max;
+extern int shipgate_coalesce_ms;
+extern int shipgate_req_timeout;
+
+/* The most we'll put in one TLS record (which is as big as they can get). */
+#define SG_BATCH_MAX    16384
+
+/* The most clients to send in one client list packet. */
+#define SG_BCLIENTS_MAX 800
+
+/* A packet waiting in the outbound queue for the writer thread. */
+typedef struct sg_msg {
+    mailbox_node_t node;
+    uint64_t enq_ms;
+    uint32_t gen;
+    int len;
+    uint8_t data[];
+} sg_msg_t;
+
+/* What the writer thread is in the middle of sending. */
+typedef struct sg_batch {
+    uint8_t buf[SG_BATCH_MAX];
+    uint8_t *data;
+    int len;
+    int off;
+    int count;
+    int sending;
+    uint32_t gen;
+    uint64_t enq_first;
+    uint64_t enq_sum;
+    sg_msg_t *big;
+    sg_msg_t *next;
+} sg_batch_t;
+
+/* How long to wait before trying to reconnect to the shipgate, in ms. This
+   starts out short (so a shipgate restart is barely noticed) and doubles each
+   time that doesn't work out, up to the max. */
+#define SG_BACKOFF_MIN      250
+#define SG_BACKOFF_MAX      60000
+
+/* One client in the roster, as it will be sent in the client list. */
+typedef struct sg_roster_ent {
+    struct sg_roster_ent *next;
+    uint32_t guildcard;
+    uint32_t block;
+    uint32_t lobby;
+    uint32_t dlobby;
+    char ch_name[32];
+    char lobby_name[32];
+} sg_roster_ent_t;
 
 static inline ssize_t sg_recv(shipgate_conn_t *c, void *buffer, size_t len) {
     return gnutls_record_recv(c->session, buffer, len);
@@ -52,14 +104,32 @@ static inline ssize_t sg_send(shipgate_conn_t *c, void *buffer, size_t len) {
     return gnutls_record_send(c->session, buffer, len);
 }
 
-/* Send a raw packet away. */
+/* Give the writer thread a poke, if nobody else has since it last looked. */
+static void sg_wake(shipgate_conn_t *c) {
+    if(!__atomic_exchange_n(&c->wake, 1, __ATOMIC_ACQ_REL)) {
+        write(c->wpipes[1], "\x00", 1);
+    }
+}
+
+/* Throw away a queued packet, whether or not it made it out. */
+static void sg_msg_free(shipgate_conn_t *c, sg_msg_t *m) {
+    __atomic_sub_fetch(&c->out_pkts, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->out_bytes, m->len, __ATOMIC_RELAXED);
+    free(m);
+}
+
+/* Send a raw packet away. Only the login reply is sent without encryption, and
+   that is sent by the ship thread before anything else can go out, so it goes
+   straight to the socket. Everything else is handed off to the writer thread,
+   so that nobody has to wait on the shipgate to send it something. */
 static int send_raw(shipgate_conn_t *c, int len, uint8_t *sendbuf, int crypt) {
     ssize_t rv, total = 0;
-    void *tmp;
+    sg_msg_t *m;
 
-    /* Keep trying until the whole thing's sent. */
-    if((!crypt || c->has_key) && c->sock >= 0 && !c->sendbuf_cur) {
-        while(total < len) {
+    if(!crypt) {
+        pthread_mutex_lock(&c->io_lock);
+
+        while(c->sock >= 0 && total < len) {
             rv = sg_send(c, sendbuf + total, len - total);
 
             if(rv == GNUTLS_E_AGAIN || rv == GNUTLS_E_INTERRUPTED) {
@@ -67,43 +137,268 @@ static int send_raw(shipgate_conn_t *c, int len, uint8_t *sendbuf, int crypt) {
                 continue;
             }
             else if(rv <= 0) {
+                pthread_mutex_unlock(&c->io_lock);
                 return -1;
             }
 
             total += rv;
         }
+
+        pthread_mutex_unlock(&c->io_lock);
+        return 0;
     }
 
-    rv = len - total;
+    /* If the shipgate has fallen this far behind, there's not much point in
+       piling more on. */
+    if(shipgate_queue_max && __atomic_load_n(&c->out_bytes, __ATOMIC_RELAXED) +
+       len > shipgate_queue_max) {
+        __atomic_add_fetch(&c->out_drops, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if(!(m = (sg_msg_t *)malloc(sizeof(sg_msg_t) + len))) {
+        perror("malloc");
+        return -1;
+    }
+
+    m->enq_ms = timerwheel_time_ms();
+    m->gen = __atomic_load_n(&c->gen, __ATOMIC_ACQUIRE);
+    m->len = len;
+    memcpy(m->data, sendbuf, len);
+
+    __atomic_add_fetch(&c->out_pkts, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->out_bytes, len, __ATOMIC_RELAXED);
+    mailbox_post(&c->outq, &m->node);
+    sg_wake(c);
+
+    return 0;
+}
+
+/* Wait until we're poked, or the socket (if there is one) is writable, for up
+   to timeout milliseconds. */
+static void sg_writer_wait(shipgate_conn_t *c, int sock, int timeout) {
+    struct pollfd fds[2];
+    char junk[32];
+    int n = 1;
+
+    fds[0].fd = c->wpipes[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
 
-    if(rv) {
-        /* Move out any already transferred data. */
-        if(c->sendbuf_start) {
-            memmove(c->sendbuf, c->sendbuf + c->sendbuf_start,
-                    c->sendbuf_cur - c->sendbuf_start);
-            c->sendbuf_cur -= c->sendbuf_start;
-            c->sendbuf_start = 0;
+    if(sock >= 0) {
+        fds[1].fd = sock;
+        fds[1].events = POLLOUT;
+        fds[1].revents = 0;
+        n = 2;
+    }
+
+    if(poll(fds, n, timeout) > 0 && (fds[0].revents & POLLIN)) {
+        while(read(c->wpipes[0], junk, sizeof(junk)) > 0) {
         }
+    }
+}
 
-        /* See if we need to reallocate the buffer. */
-        if(c->sendbuf_cur + rv > c->sendbuf_size) {
-            tmp = realloc(c->sendbuf, c->sendbuf_cur + rv);
+/* Empty out a batch, counting everything in it as sent or as dropped. */
+static void sg_batch_done(shipgate_conn_t *c, sg_batch_t *b, int sent) {
+    uint64_t now, lat;
 
-            /* If we can't allocate the space, bail. */
-            if(tmp == NULL) {
-                return -1;
+    if(sent) {
+        now = timerwheel_time_ms();
+        lat = now - b->enq_first;
+        __atomic_add_fetch(&c->out_sent, b->count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->out_records, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->out_lat_total, now * b->count - b->enq_sum,
+                           __ATOMIC_RELAXED);
+
+        if(lat > c->out_lat_max) {
+            __atomic_store_n(&c->out_lat_max, lat, __ATOMIC_RELAXED);
+        }
+    }
+    else {
+        __atomic_add_fetch(&c->out_drops, b->count, __ATOMIC_RELAXED);
+    }
+
+    if(b->big) {
+        sg_msg_free(c, b->big);
+        b->big = NULL;
+    }
+
+    b->data = b->buf;
+    b->len = b->off = b->count = 0;
+    b->sending = 0;
+}
+
+/* Is this worth sending again on a new connection? Anything that's sent fresh
+   on every login (the client list and everything that goes into it) or that's
+   already resent from elsewhere (saves) would only get in the way. */
+static int sg_msg_replayable(sg_msg_t *m) {
+    shipgate_hdr_t *hdr = (shipgate_hdr_t *)m->data;
+
+    switch(ntohs(hdr->pkt_type)) {
+        case SHDR_TYPE_BLKLOGIN:
+        case SHDR_TYPE_BLKLOGOUT:
+        case SHDR_TYPE_LOBBYCHG:
+        case SHDR_TYPE_BCLIENTS:
+        case SHDR_TYPE_CDATA:
+        case SHDR_TYPE_PING:
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Pull as many queued packets into the batch as will fit into one record. A
+   packet that's too big to ever share a record is sent from where it is. */
+static void sg_batch_fill(shipgate_conn_t *c, sg_batch_t *b) {
+    sg_msg_t *m;
+    uint32_t gen;
+
+    while(!b->big && b->len < SG_BATCH_MAX) {
+        if(!(m = b->next) && !(m = (sg_msg_t *)mailbox_take(&c->outq))) {
+            break;
+        }
+
+        b->next = NULL;
+
+        /* Anything queued up while the connection was down (or that never
+           made it out before it went down) goes out on this one instead. */
+        gen = __atomic_load_n(&c->gen, __ATOMIC_ACQUIRE);
+
+        if(m->gen != gen) {
+            if(!sg_msg_replayable(m)) {
+                __atomic_add_fetch(&c->out_drops, 1, __ATOMIC_RELAXED);
+                sg_msg_free(c, m);
+                continue;
+            }
+
+            m->gen = gen;
+            __atomic_add_fetch(&c->out_replayed, 1, __ATOMIC_RELAXED);
+        }
+
+        if(!b->count) {
+            b->gen = m->gen;
+            b->enq_first = m->enq_ms;
+            b->enq_sum = 0;
+        }
+        else if(m->gen != b->gen || b->len + m->len > SG_BATCH_MAX) {
+            /* Save it for the next one. */
+            b->next = m;
+            break;
+        }
+
+        ++b->count;
+        b->enq_sum += m->enq_ms;
+
+        if(m->len > SG_BATCH_MAX) {
+            b->big = m;
+            b->data = m->data;
+            b->len = m->len;
+            break;
+        }
+
+        memcpy(b->buf + b->len, m->data, m->len);
+        b->len += m->len;
+        sg_msg_free(c, m);
+    }
+}
+
+/* The writer thread. This is the only thing that sends anything encrypted to
+   the shipgate. Whatever is queued up when it gets around to sending goes out
+   together as one record (and, if asked, it will wait a little while for more
+   to show up first), so a burst of small packets doesn't cost a record and a
+   system call each. */
+static void *sg_writer_thd(void *d) {
+    shipgate_conn_t *c = (shipgate_conn_t *)d;
+    sg_batch_t b;
+    ssize_t rv;
+    int sock;
+    uint64_t age;
+
+    memset(&b, 0, sizeof(sg_batch_t));
+    b.data = b.buf;
+
+    while(c->writer_run) {
+        /* Clear the flag first, so that anything that happens from here on
+           will wake us up again. */
+        __atomic_store_n(&c->wake, 0, __ATOMIC_SEQ_CST);
+
+        /* Once we've tried to send the batch, GnuTLS needs to see exactly the
+           same thing again if it couldn't send it all, so only add to it
+           before that. */
+        if(!b.sending) {
+            /* Leave everything in the queue while we're not logged in, so
+               none of it gets tied to a connection that's on its way out. */
+            if(!__atomic_load_n(&c->has_key, __ATOMIC_ACQUIRE)) {
+                sg_writer_wait(c, -1, 1000);
+                continue;
+            }
+
+            sg_batch_fill(c, &b);
+
+            if(!b.count) {
+                sg_writer_wait(c, -1, 1000);
+                continue;
             }
 
-            c->sendbuf_size = c->sendbuf_cur + rv;
-            c->sendbuf = (unsigned char *)tmp;
+            if(shipgate_coalesce_ms && !b.big && !b.next &&
+               b.len < SG_BATCH_MAX) {
+                age = timerwheel_time_ms() - b.enq_first;
+
+                if(age < (uint64_t)shipgate_coalesce_ms) {
+                    sg_writer_wait(c, -1, shipgate_coalesce_ms - (int)age);
+                    continue;
+                }
+            }
+        }
+
+        pthread_mutex_lock(&c->io_lock);
+
+        if(b.gen != c->gen) {
+            pthread_mutex_unlock(&c->io_lock);
+            sg_batch_done(c, &b, 0);
+            continue;
+        }
+
+        /* Hold on to it until we're connected and logged in. */
+        if(c->sock < 0 || !c->has_key) {
+            pthread_mutex_unlock(&c->io_lock);
+            sg_writer_wait(c, -1, 1000);
+            continue;
         }
 
-        /* Copy what's left of the packet into the output buffer. */
-        memcpy(c->sendbuf + c->sendbuf_cur, sendbuf + total, rv);
-        c->sendbuf_cur += rv;
+        b.sending = 1;
+        rv = sg_send(c, b.data + b.off, b.len - b.off);
+        sock = c->sock;
+        pthread_mutex_unlock(&c->io_lock);
+
+        if(rv == GNUTLS_E_AGAIN || rv == GNUTLS_E_INTERRUPTED) {
+            sg_writer_wait(c, sock, 1000);
+            continue;
+        }
+        else if(rv < 0) {
+            /* Leave it to the ship thread to notice the connection is dead and
+               clean it up. */
+            debug(DBG_WARN, "Error sending to shipgate: %s\n",
+                  gnutls_strerror((int)rv));
+            shutdown(sock, SHUT_RDWR);
+            sg_batch_done(c, &b, 0);
+            continue;
+        }
+
+        b.off += (int)rv;
+
+        if(b.off >= b.len) {
+            sg_batch_done(c, &b, 1);
+        }
     }
 
-    return 0;
+    sg_batch_done(c, &b, 0);
+
+    if(b.next) {
+        sg_msg_free(c, b.next);
+    }
+
+    return NULL;
 }
 
 /* Encrypt a packet, and send it away. */
@@ -116,6 +411,198 @@ static int send_crypt(shipgate_conn_t *c, int len, uint8_t *sendbuf) {
     return send_raw(c, len, sendbuf, 1);
 }
 
+/* A request that is waiting on an answer from the shipgate. */
+typedef struct sg_req {
+    TAILQ_ENTRY(sg_req) qentry;
+    struct sg_req *hnext;
+    uint32_t token;
+    uint32_t gc;
+    int type;
+    uint64_t sent_ms;
+    uint64_t deadline;
+} sg_req_t;
+
+const char *shipgate_req_names[SG_REQ_TYPES] = {
+    "CREQ", "CBKUP", "CDATA", "GMLOGIN", "FRLIST", "BBOPTS"
+};
+
+static const uint64_t sg_req_hist_ms[SG_REQ_HIST - 1] = {
+    5, 10, 25, 50, 100, 250, 1000
+};
+
+static inline int sg_req_hash(uint32_t gc) {
+    return (int)(((gc * 2654435761U) >> 8) % SG_REQ_BUCKETS);
+}
+
+/* Remember that we've asked the shipgate for something. This has to be done
+   before the request is sent, since the answer could come back before the
+   sender gets another chance to run. */
+static void sg_req_start(shipgate_conn_t *c, int type, uint32_t gc) {
+    sg_req_t *r;
+    int h = sg_req_hash(gc);
+
+    if(!(r = (sg_req_t *)malloc(sizeof(sg_req_t)))) {
+        perror("malloc");
+        return;
+    }
+
+    r->gc = gc;
+    r->type = type;
+    r->sent_ms = timerwheel_time_ms();
+    r->deadline = r->sent_ms + (uint64_t)shipgate_req_timeout * 1000;
+
+    pthread_mutex_lock(&c->req_lock);
+    r->token = ++c->req_token;
+    r->hnext = c->req_hash[h];
+    c->req_hash[h] = r;
+    TAILQ_INSERT_TAIL(&c->req_queue, r, qentry);
+    ++c->req_count;
+    ++c->reqs[type].sent;
+    pthread_mutex_unlock(&c->req_lock);
+}
+
+/* Take a request out of the hash and queue. The caller must hold the lock. */
+static void sg_req_unlink(shipgate_conn_t *c, sg_req_t *r) {
+    sg_req_t **pp = &c->req_hash[sg_req_hash(r->gc)];
+
+    while(*pp != r) {
+        pp = &(*pp)->hnext;
+    }
+
+    *pp = r->hnext;
+    TAILQ_REMOVE(&c->req_queue, r, qentry);
+    --c->req_count;
+}
+
+/* Match up an answer from the shipgate with the oldest request of the same
+   type for the same guildcard. Restoring a backup is answered with character
+   data, just like a normal character request, so that answers either. */
+static void sg_req_done(shipgate_conn_t *c, int type, uint32_t gc, int failed) {
+    sg_req_t *i, *r = NULL;
+    uint64_t lat;
+    sg_req_stats_t *st;
+    int j;
+
+    pthread_mutex_lock(&c->req_lock);
+
+    for(i = c->req_hash[sg_req_hash(gc)]; i; i = i->hnext) {
+        if(i->gc == gc && (i->type == type || (type == SG_REQ_CREQ &&
+                                               !failed &&
+                                               i->type == SG_REQ_CBKUP)) &&
+           (!r || (int32_t)(i->token - r->token) < 0)) {
+            r = i;
+        }
+    }
+
+    if(!r) {
+        ++c->reqs[type].late;
+        pthread_mutex_unlock(&c->req_lock);
+        return;
+    }
+
+    sg_req_unlink(c, r);
+    st = &c->reqs[r->type];
+    lat = timerwheel_time_ms() - r->sent_ms;
+
+    if(failed) {
+        ++st->failed;
+    }
+    else {
+        ++st->done;
+    }
+
+    st->lat_total += lat;
+
+    if(lat > st->lat_max) {
+        st->lat_max = lat;
+    }
+
+    for(j = 0; j < SG_REQ_HIST - 1 && lat >= sg_req_hist_ms[j]; ++j) {
+    }
+
+    ++st->hist[j];
+    pthread_mutex_unlock(&c->req_lock);
+    free(r);
+}
+
+/* Let a client know that the shipgate never answered them. A Blue Burst client
+   that's still waiting on its character data or options can't go anywhere
+   without them, so there's no point in leaving them hanging. */
+static void sg_req_expire(sg_req_t *r) {
+    ship_client_t *c;
+
+    if(r->type == SG_REQ_CDATA || !(c = client_dir_get(r->gc, NULL))) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+
+    if(c->version == CLIENT_VERSION_BB &&
+       (r->type == SG_REQ_CREQ || r->type == SG_REQ_BBOPTS)) {
+        client_kick(c);
+    }
+    else {
+        send_txt(c, "%s", __(c, "\tE\tC7The shipgate did not respond."));
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+    client_dir_put(c);
+}
+
+/* Give up on every request that was due before the given time. */
+static void sg_req_expire_all(shipgate_conn_t *c, uint64_t now) {
+    struct sg_req_queue expired;
+    sg_req_t *r;
+
+    TAILQ_INIT(&expired);
+    pthread_mutex_lock(&c->req_lock);
+
+    while((r = TAILQ_FIRST(&c->req_queue)) && r->deadline <= now) {
+        sg_req_unlink(c, r);
+        ++c->reqs[r->type].expired;
+        TAILQ_INSERT_TAIL(&expired, r, qentry);
+    }
+
+    pthread_mutex_unlock(&c->req_lock);
+
+    /* Deal with the clients without holding the lock, since they might well be
+       in the middle of asking for something else. */
+    while((r = TAILQ_FIRST(&expired))) {
+        TAILQ_REMOVE(&expired, r, qentry);
+        sg_req_expire(r);
+        free(r);
+    }
+}
+
+static void sg_req_timer_fire(timerwheel_t *tw, tw_timer_t *t, void *d) {
+    shipgate_conn_t *c = (shipgate_conn_t *)d;
+
+    sg_req_expire_all(c, timerwheel_time_ms());
+
+    /* Every request gets the same timeout, so anything added after this will
+       be due after whatever is at the front now. Check again once a second,
+       which is plenty often enough for timeouts measured in seconds. */
+    timerwheel_schedule(tw, t, tw->now_ms + 1000);
+}
+
+void shipgate_start_req_timer(shipgate_conn_t *c, timerwheel_t *tw) {
+    timerwheel_timer_init(&c->req_timer, &sg_req_timer_fire, c);
+    timerwheel_schedule(tw, &c->req_timer, tw->now_ms + 1000);
+}
+
+/* Send a request, keeping track of it until the shipgate answers it. */
+static int send_req(shipgate_conn_t *c, int len, uint8_t *sendbuf, int type,
+                    uint32_t gc) {
+    sg_req_start(c, type, gc);
+
+    if(send_crypt(c, len, sendbuf)) {
+        sg_req_done(c, type, gc, 1);
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Send a ping packet to the server. */
 int shipgate_send_ping(shipgate_conn_t *c, int reply) {
     uint8_t *sendbuf = get_sendbuf();
@@ -139,6 +626,33 @@ int shipgate_send_ping(shipgate_conn_t *c, int reply) {
     return send_crypt(c, sizeof(shipgate_hdr_t), sendbuf);
 }
 
+/* Throw away the saved TLS session, so the next handshake starts fresh. */
+static void sg_forget_session(shipgate_conn_t *c) {
+    gnutls_free(c->resume.data);
+    c->resume.data = NULL;
+    c->resume.size = 0;
+}
+
+/* Save the TLS session, so the next connection can resume it. This has to wait
+   until we've heard something from the shipgate, since a session ticket only
+   shows up after the handshake. */
+static void sg_save_session(shipgate_conn_t *c) {
+    gnutls_datum_t d;
+    int irv;
+
+    pthread_mutex_lock(&c->io_lock);
+    irv = gnutls_session_get_data2(c->session, &d);
+    pthread_mutex_unlock(&c->io_lock);
+
+    if(irv < 0) {
+        debug(DBG_WARN, "Can't save TLS session: %s\n", gnutls_strerror(irv));
+        return;
+    }
+
+    sg_forget_session(c);
+    c->resume = d;
+}
+
 /* Attempt to connect to the shipgate. Returns < 0 on error, returns the socket
    for communciation on success. */
 static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
@@ -161,19 +675,15 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
             i = tmp;
         }
 
-        rv->has_key = 0;
-        rv->hdr_read = 0;
-        free(rv->recvbuf);
-        rv->recvbuf = NULL;
-        rv->recvbuf_cur = rv->recvbuf_size = 0;
+        rxbuf_clear(&rv->recvbuf);
 
-        free(rv->sendbuf);
-        rv->sendbuf = NULL;
-        rv->sendbuf_cur = rv->sendbuf_size = 0;
-    }
-    else {
-        /* Clear it first. */
-        memset(rv, 0, sizeof(shipgate_conn_t));
+        /* Anything still queued up was meant for the old connection, so make
+           sure the writer knows to look it over before sending it. */
+        pthread_mutex_lock(&rv->io_lock);
+        rv->has_key = 0;
+        __atomic_add_fetch(&rv->gen, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&rv->io_lock);
+        sg_wake(rv);
     }
 
     debug(DBG_LOG, "%s: Looking up shipgate (%s)...\n", s->cfg->name,
@@ -251,6 +761,19 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
     gnutls_transport_set_ptr(rv->session, (gnutls_transport_ptr_t)sock);
 #endif
 
+    /* Pick up where the last connection left off, if we can. If the shipgate
+       doesn't want to, the handshake just goes the long way. */
+    if(rv->resume.data) {
+        irv = gnutls_session_set_data(rv->session, rv->resume.data,
+                                      rv->resume.size);
+
+        if(irv < 0) {
+            debug(DBG_WARN, "Can't resume TLS session: %s\n",
+                  gnutls_strerror(irv));
+            sg_forget_session(rv);
+        }
+    }
+
     /* Do the TLS handshake */
     irv = gnutls_handshake(rv->session);
 
@@ -258,6 +781,7 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
         debug(DBG_ERROR, "TLS Handshake failed: %s\n", gnutls_strerror(irv));
         close(sock);
         gnutls_deinit(rv->session);
+        sg_forget_session(rv);
         return -3;
     }
 
@@ -292,77 +816,192 @@ static int shipgate_conn(ship_t *s, shipgate_conn_t *rv, int reconn) {
         gnutls_bye(rv->session, GNUTLS_SHUT_RDWR);
         close(sock);
         gnutls_deinit(rv->session);
+        sg_forget_session(rv);
         return -5;
     }
 
+    if(gnutls_session_is_resumed(rv->session)) {
+        debug(DBG_LOG, "%s: Resumed TLS session\n", s->cfg->name);
+        ++rv->resumed;
+    }
+
+    /* The handshake's done, so from here on, nobody should ever have to wait
+       on the socket. */
+    evloop_set_nonblock(sock);
+
     /* Save a few other things in the struct */
+    pthread_mutex_lock(&rv->io_lock);
     rv->sock = sock;
     rv->ship = s;
+    pthread_mutex_unlock(&rv->io_lock);
+    sg_wake(rv);
 
     return 0;
 }
 
 int shipgate_connect(ship_t *s, shipgate_conn_t *rv) {
-    return shipgate_conn(s, rv, 0);
+    int irv;
+
+    /* Clear it first. The outbound queue keeps taking things while we're
+       waiting to reconnect, so it can't go anywhere until we're done. */
+    memset(rv, 0, sizeof(shipgate_conn_t));
+    rv->sock = -1;
+    rxbuf_init(&rv->recvbuf, &rv->rx);
+    mailbox_init(&rv->outq);
+
+    if(pipe(rv->wpipes) == -1) {
+        debug(DBG_ERROR, "%s: Cannot create pipe!\n", s->cfg->name);
+        rxbuf_destroy(&rv->recvbuf);
+        return -1;
+    }
+
+    evloop_set_nonblock(rv->wpipes[0]);
+    evloop_set_nonblock(rv->wpipes[1]);
+    pthread_mutex_init(&rv->io_lock, NULL);
+    pthread_mutex_init(&rv->req_lock, NULL);
+    pthread_mutex_init(&rv->roster_lock, NULL);
+    TAILQ_INIT(&rv->req_queue);
+
+    if((irv = shipgate_conn(s, rv, 0))) {
+        rv->sock = -1;
+        shipgate_cleanup(rv);
+        return irv;
+    }
+
+    /* Start up the thread that does all the sending. */
+    rv->writer_run = 1;
+
+    if(pthread_create(&rv->writer, NULL, &sg_writer_thd, rv)) {
+        debug(DBG_ERROR, "%s: Cannot start shipgate writer thread!\n",
+              s->cfg->name);
+        rv->writer_run = 0;
+        shipgate_cleanup(rv);
+        return -1;
+    }
+
+    rv->writer_started = 1;
+    return 0;
 }
 
 /* Reconnect to the shipgate if we are disconnected for some reason. */
 int shipgate_reconnect(shipgate_conn_t *conn) {
-    return shipgate_conn(conn->ship, conn, 1);
+    int rv;
+
+    if((rv = shipgate_conn(conn->ship, conn, 1))) {
+        ++conn->reconn_fails;
+    }
+
+    return rv;
+}
+
+void shipgate_backoff(shipgate_conn_t *c) {
+    int delay;
+
+    if(!c->backoff_ms) {
+        c->backoff_ms = SG_BACKOFF_MIN;
+    }
+    else if(c->backoff_ms < SG_BACKOFF_MAX / 2) {
+        c->backoff_ms *= 2;
+    }
+    else {
+        c->backoff_ms = SG_BACKOFF_MAX;
+    }
+
+    /* Wait somewhere between half and all of that, so that every ship that lost
+       the shipgate at the same time doesn't come knocking at the same time. */
+    delay = c->backoff_ms / 2 +
+        (int)(mt19937_genrand_int32(&c->ship->rng) % (c->backoff_ms / 2 + 1));
+    c->retry_ms = timerwheel_time_ms() + delay;
+}
+
+/* Drop the connection to the shipgate, so we can attempt to reconnect. */
+void shipgate_disconnect(shipgate_conn_t *c) {
+    pthread_mutex_lock(&c->io_lock);
+
+    if(c->sock >= 0) {
+        gnutls_bye(c->session, GNUTLS_SHUT_RDWR);
+        close(c->sock);
+        gnutls_deinit(c->session);
+        c->sock = -1;
+    }
+
+    c->has_key = 0;
+    pthread_mutex_unlock(&c->io_lock);
+
+    if(!c->down_ms) {
+        c->down_ms = timerwheel_time_ms();
+    }
 }
 
 /* Clean up a shipgate connection. */
 void shipgate_cleanup(shipgate_conn_t *c) {
+    mailbox_node_t *n;
+    sg_req_t *r;
+    sg_roster_ent_t *e;
+    int i;
+
+    /* Stop the writer before pulling the connection out from under it. */
+    if(c->writer_started) {
+        c->writer_run = 0;
+        sg_wake(c);
+        pthread_join(c->writer, NULL);
+        c->writer_started = 0;
+    }
+
     if(c->sock > 0) {
         gnutls_bye(c->session, GNUTLS_SHUT_RDWR);
         close(c->sock);
         gnutls_deinit(c->session);
+        c->sock = -1;
+    }
+
+    /* Throw away anything that never got sent. */
+    while((n = mailbox_take(&c->outq))) {
+        sg_msg_free(c, (sg_msg_t *)n);
+    }
+
+    while((r = TAILQ_FIRST(&c->req_queue))) {
+        TAILQ_REMOVE(&c->req_queue, r, qentry);
+        free(r);
     }
 
-    free(c->recvbuf);
-    free(c->sendbuf);
+    for(i = 0; i < SG_ROSTER_BUCKETS; ++i) {
+        while((e = c->roster[i])) {
+            c->roster[i] = e->next;
+            free(e);
+        }
+    }
+
+    close(c->wpipes[0]);
+    close(c->wpipes[1]);
+    pthread_mutex_destroy(&c->io_lock);
+    pthread_mutex_destroy(&c->req_lock);
+    pthread_mutex_destroy(&c->roster_lock);
+    rxbuf_destroy(&c->recvbuf);
+    sg_forget_session(c);
 }
 
 static int handle_dc_greply(shipgate_conn_t *conn, dc_guild_reply_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_search);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
+    int rv = 0;
 
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
+    if((c = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(c->guildcard == dest) {
 #ifdef SYLVERANT_ENABLE_IPV6
-                    if(pkt->hdr.flags != 6) {
-                        send_guild_reply_sg(c, pkt);
-                    }
-                    else {
-                        send_guild_reply6_sg(c, (dc_guild_reply6_pkt *)pkt);
-                    }
+        if(pkt->hdr.flags != 6) {
+            send_guild_reply_sg(c, pkt);
+        }
+        else {
+            send_guild_reply6_sg(c, (dc_guild_reply6_pkt *)pkt);
+        }
 #else
-                    send_guild_reply_sg(c, pkt);
+        send_guild_reply_sg(c, pkt);
 #endif
 
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
-
-                if(done) {
-                    break;
-                }
-            }
-
-            pthread_rwlock_unlock(&b->lock);
-        }
+        pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
     return rv;
@@ -380,24 +1019,15 @@ static int handle_bb_greply(shipgate_conn_t *conn, bb_guild_reply_pkt *pkt,
     }
 
     b = ship->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Look for the client */
-    TAILQ_FOREACH(c, b->clients, qentry) {
+    if((c = client_dir_get(dest, b))) {
         pthread_mutex_lock(&c->mutex);
-
-        if(c->guildcard == dest) {
-            send_pkt_bb(c, (bb_pkt_hdr_t *)pkt);
-            pthread_mutex_unlock(&c->mutex);
-            pthread_rwlock_unlock(&b->lock);
-            return 0;
-        }
-
+        send_pkt_bb(c, (bb_pkt_hdr_t *)pkt);
         pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
-    pthread_rwlock_unlock(&b->lock);
-
     return 0;
 }
 
@@ -479,155 +1109,86 @@ static void handle_mail_autoreply(shipgate_conn_t *c, ship_client_t *s,
 }
 
 static int handle_dc_mail(shipgate_conn_t *conn, dc_simple_mail_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
-
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply_on) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
-
-                    /* Forward the packet there. */
-                    rv = send_simple_mail(CLIENT_VERSION_DCV1, c,
-                                          (dc_pkt_hdr_t *)pkt);
-                    done = 1;
-                }
+    int rv = 0;
 
-                pthread_mutex_unlock(&c->mutex);
+    if((c = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        /* Make sure the user hasn't blacklisted the sender. */
+        if(c->pl && !client_has_blacklisted(c, sender) &&
+           !client_has_ignored(c, sender)) {
+            /* Check if the user has an autoreply set. */
+            if(c->autoreply_on) {
+                handle_mail_autoreply(conn, c, sender);
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Forward the packet there. */
+            rv = send_simple_mail(CLIENT_VERSION_DCV1, c,
+                                  (dc_pkt_hdr_t *)pkt);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
     return rv;
 }
 
 static int handle_pc_mail(shipgate_conn_t *conn, pc_simple_mail_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
-
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
-
-                    /* Forward the packet there. */
-                    rv = send_simple_mail(CLIENT_VERSION_PC, c,
-                                          (dc_pkt_hdr_t *)pkt);
-                    done = 1;
-                }
+    int rv = 0;
 
-                pthread_mutex_unlock(&c->mutex);
+    if((c = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        /* Make sure the user hasn't blacklisted the sender. */
+        if(c->pl && !client_has_blacklisted(c, sender) &&
+           !client_has_ignored(c, sender)) {
+            /* Check if the user has an autoreply set. */
+            if(c->autoreply) {
+                handle_mail_autoreply(conn, c, sender);
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Forward the packet there. */
+            rv = send_simple_mail(CLIENT_VERSION_PC, c,
+                                  (dc_pkt_hdr_t *)pkt);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
     return rv;
 }
 
 static int handle_bb_mail(shipgate_conn_t *conn, bb_simple_mail_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = LE32(pkt->gc_dest);
     uint32_t sender = LE32(pkt->gc_sender);
-    int done = 0, rv = 0;
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* Make sure the user hasn't blacklisted the sender. */
-                    if(client_has_blacklisted(c, sender) ||
-                       client_has_ignored(c, sender)) {
-                        done = 1;
-                        pthread_mutex_unlock(&c->mutex);
-                        rv = 0;
-                        break;
-                    }
-
-                    /* Check if the user has an autoreply set. */
-                    if(c->autoreply) {
-                        handle_mail_autoreply(conn, c, sender);
-                    }
-
-                    /* Forward the packet there. */
-                    rv = send_bb_simple_mail(c, pkt);
-                    done = 1;
-                }
+    int rv = 0;
 
-                pthread_mutex_unlock(&c->mutex);
+    if((c = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        /* Make sure the user hasn't blacklisted the sender. */
+        if(c->pl && !client_has_blacklisted(c, sender) &&
+           !client_has_ignored(c, sender)) {
+            /* Check if the user has an autoreply set. */
+            if(c->autoreply) {
+                handle_mail_autoreply(conn, c, sender);
             }
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Forward the packet there. */
+            rv = send_bb_simple_mail(c, pkt);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
     return rv;
@@ -863,12 +1424,8 @@ static int handle_sstatus(shipgate_conn_t *conn, shipgate_ship_status_pkt *p) {
 }
 
 static int handle_creq(shipgate_conn_t *conn, shipgate_char_data_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->hdr.flags);
     uint16_t plen = ntohs(pkt->hdr.pkt_len);
     int clen = plen - sizeof(shipgate_char_data_pkt);
@@ -876,44 +1433,14 @@ static int handle_creq(shipgate_conn_t *conn, shipgate_char_data_pkt *pkt) {
     /* Make sure the packet looks sane */
     if(!(flags & SHDR_RESPONSE)) {
         return 0;
-    }
-
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest) {
-                    if(!c->bb_pl && c->pl) {
-                        /* We've found them, overwrite their data, and send the
-                           refresh packet. */
-                        memcpy(c->pl, pkt->data, clen);
-                        send_lobby_join(c, c->cur_lobby);
-                    }
-                    else if(c->bb_pl) {
-                        memcpy(c->bb_pl, pkt->data, clen);
-
-                        /* Clear the item ids from the inventory. */
-                        for(i = 0; i < 30; ++i) {
-                            c->bb_pl->inv.items[i].item_id = 0xFFFFFFFF;
-                        }
-                    }
-
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&c->mutex);
+    }
 
-                if(done) {
-                    break;
-                }
-            }
+    sg_req_done(conn, SG_REQ_CREQ, dest, 0);
 
-            pthread_rwlock_unlock(&b->lock);
-        }
+    /* We've found them, have their worker overwrite their data. */
+    if((c = client_dir_get(dest, NULL))) {
+        client_set_char_data(c, pkt->data, clen);
+        client_dir_put(c);
     }
 
     return 0;
@@ -933,26 +1460,21 @@ static int handle_gmlogin(shipgate_conn_t *conn,
         return 0;
     }
 
+    sg_req_done(conn, SG_REQ_GMLOGIN, gc, 0);
+
     /* Check the block number first. */
     if(block > s->cfg->blocks) {
         return 0;
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            i->privilege |= pkt->priv;
-            i->flags |= CLIENT_FLAG_LOGGED_IN;
-            i->flags &= ~CLIENT_FLAG_GC_PROTECT;
-            send_txt(i, "%s", __(i, "\tE\tC7Login Successful."));
-            break;
-        }
+    if((i = client_dir_get(gc, b))) {
+        client_gm_login(i, pkt->priv, 1);
+        client_dir_put(i);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -994,12 +1516,8 @@ static int handle_count(shipgate_conn_t *conn, shipgate_cnt_pkt *pkt) {
 }
 
 static int handle_cdata(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
 
     /* Make sure the packet looks sane */
@@ -1007,54 +1525,36 @@ static int handle_cdata(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(flags & SHDR_FAILURE) {
-                        send_txt(c, "%s", __(c, "\tE\tC7Couldn't save "
-                                                "character data."));
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7Saved character "
-                                             "data."));
-                    }
-
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
+    sg_req_done(conn, SG_REQ_CDATA, dest, flags & SHDR_FAILURE);
+    save_cache_done(conn, dest, ntohl(pkt->slot), !(flags & SHDR_FAILURE));
 
-                pthread_mutex_unlock(&c->mutex);
+    if((c = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        /* If they don't have data, act like they don't exist for right now
+           (they don't really exist right now) */
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(flags & SHDR_FAILURE) {
+                send_txt(c, "%s", __(c, "\tE\tC7Couldn't save "
+                                        "character data."));
+            }
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7Saved character "
+                                     "data."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
     return 0;
 }
 
 static int handle_ban(shipgate_conn_t *conn, shipgate_ban_err_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->req_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
 
     /* Make sure the packet looks sane */
@@ -1062,102 +1562,68 @@ static int handle_ban(shipgate_conn_t *conn, shipgate_ban_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(flags & SHDR_FAILURE) {
-                        /* If the not gm flag is set, disconnect the user. */
-                        if(ntohl(pkt->base.error_code) == ERR_BAN_NOT_GM) {
-                            c->flags |= CLIENT_FLAG_DISCONNECTED;
-                        }
-
-                        send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
-
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7User banned."));
-                    }
+    if((c = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&c->mutex);
 
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
+        /* If they don't have data, act like they don't exist for right now
+           (they don't really exist right now) */
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(flags & SHDR_FAILURE) {
+                /* If the not gm flag is set, disconnect the user. */
+                if(ntohl(pkt->base.error_code) == ERR_BAN_NOT_GM) {
+                    client_kick(c);
                 }
 
-                pthread_mutex_unlock(&c->mutex);
+                send_txt(c, "%s", __(c, "\tE\tC7Error setting ban."));
 
-                if(done) {
-                    break;
-                }
             }
-
-            pthread_rwlock_unlock(&b->lock);
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7User banned."));
+            }
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
     return 0;
 }
 
 static int handle_creq_err(shipgate_conn_t *conn, shipgate_cdata_err_pkt *pkt) {
-    int i;
-    ship_t *s = conn->ship;
-    block_t *b;
     ship_client_t *c;
     uint32_t dest = ntohl(pkt->guildcard);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
+    uint16_t type = ntohs(pkt->base.hdr.pkt_type);
 
     /* Make sure the packet looks sane */
     if(!(flags & SHDR_FAILURE) || !(flags & SHDR_RESPONSE)) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(c, b->clients, qentry) {
-                pthread_mutex_lock(&c->mutex);
-
-                if(c->guildcard == dest && c->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_CREQ_NO_DATA) {
-                        send_txt(c, "%s", __(c, "\tE\tC7No character data "
-                                             "found."));
-                    }
-                    else {
-                        send_txt(c, "%s", __(c, "\tE\tC7Couldn't request "
-                                             "character data."));
-                    }
-
-                    done = 1;
-                }
-                else if(c->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
+    sg_req_done(conn, type == SHDR_TYPE_CBKUP ? SG_REQ_CBKUP : SG_REQ_CREQ,
+                dest, 1);
 
-                pthread_mutex_unlock(&c->mutex);
+    if((c = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&c->mutex);
 
-                if(done) {
-                    break;
-                }
+        /* If they don't have data, act like they don't exist for right now
+           (they don't really exist right now) */
+        if(c->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_CREQ_NO_DATA) {
+                send_txt(c, "%s", __(c, "\tE\tC7No character data "
+                                     "found."));
+            }
+            else {
+                send_txt(c, "%s", __(c, "\tE\tC7Couldn't request "
+                                     "character data."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&c->mutex);
+        client_dir_put(c);
     }
 
     return 0;
@@ -1177,24 +1643,21 @@ static int handle_gmlogin_err(shipgate_conn_t *conn, shipgate_gm_err_pkt *pkt) {
         return 0;
     }
 
+    sg_req_done(conn, SG_REQ_GMLOGIN, gc, 1);
+
     /* Check the block number first. */
     if(block > s->cfg->blocks) {
         return 0;
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            /* XXXX: Maybe send specific error messages sometime later */
-            send_txt(i, "%s", __(i, "\tE\tC7Login failed."));
-            break;
-        }
+    if((i = client_dir_get(gc, b))) {
+        client_gm_login(i, 0, 0);
+        client_dir_put(i);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return rv;
 }
 
@@ -1203,24 +1666,22 @@ static int handle_blogin_err(shipgate_conn_t *c, shipgate_blogin_err_pkt *pkt) {
     uint32_t block = ntohl(pkt->blocknum);
     ship_t *s = c->ship;
     block_t *b;
-    ship_client_t *i;
+    ship_client_t *i, *i2;
 
     /* Grab the block first */
     if(block > s->cfg->blocks || !(b = s->blocks[block - 1])) {
         return 0;
     }
 
-    pthread_rwlock_rdlock(&b->lock);
-
     /* Find the requested client and boot them off (regardless of the error type
        for now) */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            i->flags |= CLIENT_FLAG_DISCONNECTED;
+    if((i = client_dir_get(gc, b))) {
+        for(i2 = i; i2; i2 = client_dir_next(i2, b)) {
+            client_kick(i2);
         }
-    }
 
-    pthread_rwlock_unlock(&b->lock);
+        client_dir_put(i);
+    }
 
     return 0;
 }
@@ -1229,6 +1690,8 @@ static int handle_login_reply(shipgate_conn_t *conn, shipgate_error_pkt *pkt) {
     uint32_t err = ntohl(pkt->error_code);
     uint16_t flags = ntohs(pkt->hdr.flags);
     ship_t *s = conn->ship;
+    uint64_t lat;
+    int rv;
 
     /* Make sure the packet looks sane */
     if(!(flags & SHDR_RESPONSE)) {
@@ -1266,13 +1729,33 @@ static int handle_login_reply(shipgate_conn_t *conn, shipgate_error_pkt *pkt) {
         return -9001;
     }
     else {
-        /* We have a response. Set the has key flag. */
+        /* We have a response. Set the has key flag, and let the writer know
+           it can start sending. */
         conn->has_key = 1;
+        sg_wake(conn);
         debug(DBG_LOG, "%s: Shipgate connection established\n", s->cfg->name);
+
+        sg_save_session(conn);
+        conn->backoff_ms = 0;
+
+        if(conn->down_ms) {
+            lat = timerwheel_time_ms() - conn->down_ms;
+            conn->down_ms = 0;
+            conn->reconn_last = lat;
+            ++conn->reconnects;
+
+            if(lat > conn->reconn_max) {
+                conn->reconn_max = lat;
+            }
+        }
     }
 
-    /* Send the burst of client data if we have any to send */
-    return shipgate_send_clients(conn);
+    /* Send the burst of client data if we have any to send, then anything
+       that still needs to be saved. */
+    rv = shipgate_send_clients(conn);
+    save_cache_flush(conn, 1);
+
+    return rv;
 }
 
 static int handle_friend(shipgate_conn_t *c, shipgate_friend_login_pkt *pkt) {
@@ -1308,29 +1791,19 @@ static int handle_friend(shipgate_conn_t *c, shipgate_friend_login_pkt *pkt) {
     }
 
     /* Find the user in question */
-    pthread_rwlock_rdlock(&b->lock);
-
-    TAILQ_FOREACH(cl, b->clients, qentry) {
-        if(cl->guildcard == ugc) {
-            /* The rest is easy */
-            client_send_friendmsg(cl, on, pkt->friend_name, ms->name, fbl,
-                                  pkt->friend_nick);
-            break;
-        }
+    if((cl = client_dir_get(ugc, b))) {
+        /* The rest is easy */
+        client_send_friendmsg(cl, on, pkt->friend_name, ms->name, fbl,
+                              pkt->friend_nick);
+        client_dir_put(cl);
     }
 
-    pthread_rwlock_unlock(&b->lock);
-
     return 0;
 }
 
 static int handle_addfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
-    int i;
-    ship_t *s = c->ship;
-    block_t *b;
     ship_client_t *cl;
     uint32_t dest = ntohl(pkt->user_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1339,53 +1812,32 @@ static int handle_addfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(cl, b->clients, qentry) {
-                pthread_mutex_lock(&cl->mutex);
-
-                if(cl->guildcard == dest && cl->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_NO_ERROR) {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Friend added."));
-                    }
-                    else {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't add "
-                                              "friend."));
-                    }
-
-                    done = 1;
-                }
-                else if(cl->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
+    if((cl = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&cl->mutex);
 
-                pthread_mutex_unlock(&cl->mutex);
-
-                if(done) {
-                    break;
-                }
+        /* If they don't have data, act like they don't exist for right now
+           (they don't really exist right now) */
+        if(cl->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_NO_ERROR) {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Friend added."));
+            }
+            else {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't add "
+                                      "friend."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&cl->mutex);
+        client_dir_put(cl);
     }
 
     return 0;
 }
 
 static int handle_delfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
-    int i;
-    ship_t *s = c->ship;
-    block_t *b;
     ship_client_t *cl;
     uint32_t dest = ntohl(pkt->user_gc);
-    int done = 0;
     uint16_t flags = ntohs(pkt->base.hdr.flags);
     uint32_t err = ntohl(pkt->base.error_code);
 
@@ -1394,41 +1846,24 @@ static int handle_delfriend(shipgate_conn_t *c, shipgate_friend_err_pkt *pkt) {
         return 0;
     }
 
-    for(i = 0; i < s->cfg->blocks && !done; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            TAILQ_FOREACH(cl, b->clients, qentry) {
-                pthread_mutex_lock(&cl->mutex);
-
-                if(cl->guildcard == dest && cl->pl) {
-                    /* We've found them, figure out what to tell them. */
-                    if(err == ERR_NO_ERROR) {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Friend removed."));
-                    }
-                    else {
-                        send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't remove "
-                                              "friend."));
-                    }
-
-                    done = 1;
-                }
-                else if(cl->guildcard == dest) {
-                    /* Act like they don't exist for right now (they don't
-                       really exist right now) */
-                    done = 1;
-                }
-
-                pthread_mutex_unlock(&cl->mutex);
+    if((cl = client_dir_get(dest, NULL))) {
+        pthread_mutex_lock(&cl->mutex);
 
-                if(done) {
-                    break;
-                }
+        /* If they don't have data, act like they don't exist for right now
+           (they don't really exist right now) */
+        if(cl->pl) {
+            /* We've found them, figure out what to tell them. */
+            if(err == ERR_NO_ERROR) {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Friend removed."));
+            }
+            else {
+                send_txt(cl, "%s", __(cl, "\tE\tC7Couldn't remove "
+                                      "friend."));
             }
-
-            pthread_rwlock_unlock(&b->lock);
         }
+
+        pthread_mutex_unlock(&cl->mutex);
+        client_dir_put(cl);
     }
 
     return 0;
@@ -1447,28 +1882,25 @@ static int handle_kick(shipgate_conn_t *conn, shipgate_kick_pkt *pkt) {
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            /* Found them, send the message and disconnect the client */
-            if(strlen(pkt->reason) > 0) {
-                send_message_box(i, "%s\n\n%s\n%s",
-                                 __(i, "\tEYou have been kicked by a GM."),
-                                 __(i, "Reason:"), pkt->reason);
-            }
-            else {
-                send_message_box(i, "%s",
-                                 __(i, "\tEYou have been kicked by a GM."));
-            }
-
-            i->flags |= CLIENT_FLAG_DISCONNECTED;
-            break;
+    if((i = client_dir_get(gc, b))) {
+        /* Found them, send the message and disconnect the client */
+        if(strlen(pkt->reason) > 0) {
+            send_message_box(i, "%s\n\n%s\n%s",
+                             __(i, "\tEYou have been kicked by a GM."),
+                             __(i, "Reason:"), pkt->reason);
+        }
+        else {
+            send_message_box(i, "%s",
+                             __(i, "\tEYou have been kicked by a GM."));
         }
+
+        client_kick(i);
+
+        client_dir_put(i);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1482,6 +1914,8 @@ static int handle_frlist(shipgate_conn_t *c, shipgate_friend_list_pkt *pkt) {
     char msg[1024];
     miniship_t *ms;
 
+    sg_req_done(c, SG_REQ_FRLIST, gc, 0);
+
     /* Check the block number first. */
     if(block > s->cfg->blocks) {
         return 0;
@@ -1490,62 +1924,58 @@ static int handle_frlist(shipgate_conn_t *c, shipgate_friend_list_pkt *pkt) {
     b = s->blocks[block - 1];
     total = ntohs(pkt->hdr.pkt_len) - sizeof(shipgate_friend_list_pkt);
     msg[0] = '\0';
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            pthread_mutex_lock(&i->mutex);
+    if((i = client_dir_get(gc, b))) {
+        pthread_mutex_lock(&i->mutex);
 
-            if(!total) {
-                strcpy(msg, __(i, "\tENo friends at that offset."));
-            }
+        if(!total) {
+            strcpy(msg, __(i, "\tENo friends at that offset."));
+        }
 
-            for(j = 0; total; ++j, total -= 48) {
-                ship = ntohl(pkt->entries[j].ship);
-                bl2 = ntohl(pkt->entries[j].block);
-                gc2 = ntohl(pkt->entries[j].guildcard);
+        for(j = 0; total; ++j, total -= 48) {
+            ship = ntohl(pkt->entries[j].ship);
+            bl2 = ntohl(pkt->entries[j].block);
+            gc2 = ntohl(pkt->entries[j].guildcard);
 
-                if(ship && block) {
-                    /* Grab the ship the user is on */
-                    ms = ship_find_ship(s, ship);
+            if(ship && block) {
+                /* Grab the ship the user is on */
+                ms = ship_find_ship(s, ship);
 
-                    if(!ms) {
-                        continue;
-                    }
+                if(!ms) {
+                    continue;
+                }
 
-                    /* Fill in the message */
-                    if(ms->menu_code) {
-                        sprintf(msg, "%s\tC2%s (%d)\n\tC7%02x:%c%c/%s "
-                                "BLOCK%02d\n", msg, pkt->entries[j].name, gc2,
-                                ms->ship_number, (char)(ms->menu_code),
-                                (char)(ms->menu_code >> 8), ms->name, bl2);
-                    }
-                    else {
-                        sprintf(msg, "%s\tC2%s (%d)\n\tC7%02x:%s BLOCK%02d\n",
-                                msg, pkt->entries[j].name, gc2, ms->ship_number,
-                                ms->name, bl2);
-                    }
+                /* Fill in the message */
+                if(ms->menu_code) {
+                    sprintf(msg, "%s\tC2%s (%d)\n\tC7%02x:%c%c/%s "
+                            "BLOCK%02d\n", msg, pkt->entries[j].name, gc2,
+                            ms->ship_number, (char)(ms->menu_code),
+                            (char)(ms->menu_code >> 8), ms->name, bl2);
                 }
                 else {
-                    /* Not online? Much easier to deal with! */
-                    sprintf(msg, "%s\tC4%s (%d)\n", msg, pkt->entries[j].name,
-                            gc2);
+                    sprintf(msg, "%s\tC2%s (%d)\n\tC7%02x:%s BLOCK%02d\n",
+                            msg, pkt->entries[j].name, gc2, ms->ship_number,
+                            ms->name, bl2);
                 }
             }
-
-            /* Send the message to the user */
-            if(send_message_box(i, "%s", msg)) {
-                i->flags |= CLIENT_FLAG_DISCONNECTED;
+            else {
+                /* Not online? Much easier to deal with! */
+                sprintf(msg, "%s\tC4%s (%d)\n", msg, pkt->entries[j].name,
+                        gc2);
             }
+        }
 
-            pthread_mutex_unlock(&i->mutex);
-
-            break;
+        /* Send the message to the user */
+        if(send_message_box(i, "%s", msg)) {
+            client_kick(i);
         }
+
+        pthread_mutex_unlock(&i->mutex);
+
+        client_dir_put(i);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1607,82 +2037,79 @@ static int  handle_useropt(shipgate_conn_t *c, shipgate_user_opt_pkt *pkt) {
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            pthread_mutex_lock(&i->mutex);
-
-            /* Deal with the options */
-            while(optptr < endptr && opt->option != 0) {
-                option = ntohl(opt->option);
-                length = ntohl(opt->length);
-
-                switch(ntohl(opt->option)) {
-                    case USER_OPT_QUEST_LANG:
-                        /* Make sure the length is right */
-                        if(length != 16)
-                            break;
-
-                        /* The only byte of the data that's used is the first
-                           one. It has the language code in it. */
-                        i->q_lang = opt->data[0];
+    if((i = client_dir_get(gc, b))) {
+        pthread_mutex_lock(&i->mutex);
+
+        /* Deal with the options */
+        while(optptr < endptr && opt->option != 0) {
+            option = ntohl(opt->option);
+            length = ntohl(opt->length);
+
+            switch(ntohl(opt->option)) {
+                case USER_OPT_QUEST_LANG:
+                    /* Make sure the length is right */
+                    if(length != 16)
                         break;
 
-                    case USER_OPT_ENABLE_BACKUP:
-                        /* Make sure the length is right */
-                        if(length != 16)
-                            break;
+                    /* The only byte of the data that's used is the first
+                       one. It has the language code in it. */
+                    i->q_lang = opt->data[0];
+                    break;
 
-                        /* The only byte of the data that's used is the first
-                           one. It is a boolean saying whether or not to enable
-                           the auto backup feature. */
-                        if(opt->data[0])
-                            i->flags |= CLIENT_FLAG_AUTO_BACKUP;
+                case USER_OPT_ENABLE_BACKUP:
+                    /* Make sure the length is right */
+                    if(length != 16)
                         break;
 
-                    case USER_OPT_GC_PROTECT:
-                        /* Make sure the length is right */
-                        if(length != 16)
-                            break;
-
-                        /* The only byte of the data that's used is the first
-                           one. It is a boolean saying whether or not to enable
-                           the guildcard protection feature. */
-                        if(opt->data[0]) {
-                            i->flags |= CLIENT_FLAG_GC_PROTECT;
-                            send_txt(i, __(i, "\tE\tC7Guildcard is "
-                                           "protected.\nYou will be kicked\n"
-                                           "if you do not login."));
-                            i->join_time = time(NULL);
-                        }
+                    /* The only byte of the data that's used is the first
+                       one. It is a boolean saying whether or not to enable
+                       the auto backup feature. */
+                    if(opt->data[0])
+                        i->flags |= CLIENT_FLAG_AUTO_BACKUP;
+                    break;
+
+                case USER_OPT_GC_PROTECT:
+                    /* Make sure the length is right */
+                    if(length != 16)
                         break;
 
-                    case USER_OPT_TRACK_KILLS:
-                        /* Make sure the length is right */
-                        if(length != 16)
-                            break;
+                    /* The only byte of the data that's used is the first
+                       one. It is a boolean saying whether or not to enable
+                       the guildcard protection feature. */
+                    if(opt->data[0]) {
+                        i->flags |= CLIENT_FLAG_GC_PROTECT;
+                        send_txt(i, __(i, "\tE\tC7Guildcard is "
+                                       "protected.\nYou will be kicked\n"
+                                       "if you do not login."));
+                        i->join_time = time(NULL);
+                    }
+                    break;
 
-                        /* The only byte of the data that's used is the first
-                           one. It is a boolean saying whether or not to enable
-                           kill tracking. */
-                        if(opt->data[0])
-                            i->flags |= CLIENT_FLAG_TRACK_KILLS;
+                case USER_OPT_TRACK_KILLS:
+                    /* Make sure the length is right */
+                    if(length != 16)
                         break;
-                }
 
-                /* Adjust the pointers to the next option */
-                optptr = optptr + ntohl(opt->length);
-                opt = (shipgate_user_opt_t *)optptr;
+                    /* The only byte of the data that's used is the first
+                       one. It is a boolean saying whether or not to enable
+                       kill tracking. */
+                    if(opt->data[0])
+                        i->flags |= CLIENT_FLAG_TRACK_KILLS;
+                    break;
             }
 
-            pthread_mutex_unlock(&i->mutex);
-            break;
+            /* Adjust the pointers to the next option */
+            optptr = optptr + ntohl(opt->length);
+            opt = (shipgate_user_opt_t *)optptr;
         }
+
+        pthread_mutex_unlock(&i->mutex);
+
+        client_dir_put(i);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1692,33 +2119,32 @@ static int handle_bbopts(shipgate_conn_t *c, shipgate_bb_opts_pkt *pkt) {
     ship_client_t *i;
     uint32_t gc = ntohl(pkt->guildcard), block = ntohl(pkt->block);
 
+    sg_req_done(c, SG_REQ_BBOPTS, gc, 0);
+
     /* Check the block number first. */
     if(block > s->cfg->blocks) {
         return 0;
     }
 
     b = s->blocks[block - 1];
-    pthread_rwlock_rdlock(&b->lock);
 
     /* Find the requested client. */
-    TAILQ_FOREACH(i, b->clients, qentry) {
-        if(i->guildcard == gc) {
-            pthread_mutex_lock(&i->mutex);
+    if((i = client_dir_get(gc, b))) {
+        pthread_mutex_lock(&i->mutex);
 
-            /* Copy the user's options */
-            memcpy(i->bb_opts, &pkt->opts, sizeof(sylverant_bb_db_opts_t));
+        /* Copy the user's options */
+        memcpy(i->bb_opts, &pkt->opts, sizeof(sylverant_bb_db_opts_t));
 
-            /* Move the user on now that we have everything... */
-            send_lobby_list(i);
-            send_bb_full_char(i);
-            send_simple(i, CHAR_DATA_REQUEST_TYPE, 0);
+        /* Move the user on now that we have everything... */
+        send_lobby_list(i);
+        send_bb_full_char(i);
+        send_simple(i, CHAR_DATA_REQUEST_TYPE, 0);
 
-            pthread_mutex_unlock(&i->mutex);
-            break;
-        }
+        pthread_mutex_unlock(&i->mutex);
+
+        client_dir_put(i);
     }
 
-    pthread_rwlock_unlock(&b->lock);
     return 0;
 }
 
@@ -1867,125 +2293,70 @@ static int handle_pkt(shipgate_conn_t *conn, shipgate_hdr_t *pkt) {
 /* Read data from the shipgate. */
 int shipgate_process_pkt(shipgate_conn_t *c) {
     ssize_t sz;
-    uint16_t pkt_sz;
+    size_t pkt_sz, need, avail;
     int rv = 0;
-    unsigned char *rbp;
-    uint8_t *recvbuf = get_recvbuf();
-    void *tmp;
-
-    /* If we've got anything buffered, copy it out to the main buffer to make
-       the rest of this a bit easier. */
-    if(c->recvbuf_cur) {
-        memcpy(recvbuf, c->recvbuf, c->recvbuf_cur);
-    }
-
-    /* Attempt to read, and if we don't get anything, punt. */
-    if((sz = sg_recv(c, recvbuf + c->recvbuf_cur,
-                     65536 - c->recvbuf_cur)) <= 0) {
-        if(sz == -1) {
-            perror("recv");
+    uint8_t *rbp;
+    shipgate_hdr_t *hdr;
+
+    /* GnuTLS may decrypt more than we ask it for and keep the rest buffered on
+       its own side, where the socket won't tell us about it. So, keep reading
+       until it actually tells us there's nothing left. */
+    while(rv == 0) {
+        /* Make sure there's room for the rest of the packet we're in the middle
+           of (if we've got its header already). */
+        need = 8;
+
+        if(c->recvbuf.len >= 8) {
+            hdr = (shipgate_hdr_t *)rxbuf_data(&c->recvbuf);
+            need = (ntohs(hdr->pkt_len) + 7) & ~7;
         }
 
-        return -1;
-    }
-
-    sz += c->recvbuf_cur;
-    c->recvbuf_cur = 0;
-    rbp = recvbuf;
-
-    /* As long as what we have is long enough, decrypt it. */
-    while(sz >= 8 && rv == 0) {
-        /* Copy out the packet header so we know what exactly we're looking
-           for, in terms of packet length. */
-        if(!c->hdr_read) {
-            memcpy(&c->pkt, rbp, 8);
-            c->hdr_read = 1;
+        if(!(rbp = rxbuf_space(&c->recvbuf, need, &avail))) {
+            perror("malloc");
+            return -1;
         }
 
-        /* Read the packet size to see how much we're expecting. */
-        pkt_sz = ntohs(c->pkt.pkt_len);
+        /* Attempt to read, and if we don't get anything, punt. The socket
+           doesn't block, so not having anything yet isn't an error. */
+        if((sz = sg_recv(c, rbp, avail)) <= 0) {
+            if(sz == GNUTLS_E_AGAIN || sz == GNUTLS_E_INTERRUPTED) {
+                return 0;
+            }
+            else if(sz == -1) {
+                perror("recv");
+            }
 
-        /* We'll always need a multiple of 8 bytes. */
-        if(pkt_sz & 0x07) {
-            pkt_sz = (pkt_sz & 0xFFF8) + 8;
+            return -1;
         }
 
-        /* Do we have the whole packet? */
-        if(sz >= (ssize_t)pkt_sz) {
-            /* Yes, we do, copy it out. */
-            memcpy(rbp, &c->pkt, 8);
-
-            /* Pass it on. */
-            if((rv = handle_pkt(c, (shipgate_hdr_t *)rbp))) {
-                break;
-            }
+        rxbuf_commit(&c->recvbuf, (size_t)sz);
 
-            rbp += pkt_sz;
-            sz -= pkt_sz;
-            c->hdr_read = 0;
-        }
-        else {
-            /* Nope, we're missing part, break out of the loop, and buffer
-               the remaining data. */
-            break;
-        }
-    }
+        /* Hand off every complete packet we have, right from the buffer. */
+        while(c->recvbuf.len >= 8 && rv == 0) {
+            hdr = (shipgate_hdr_t *)rxbuf_data(&c->recvbuf);
 
-    /* If we've still got something left here, buffer it for the next pass. */
-    if(sz && rv == 0) {
-        /* Reallocate the recvbuf for the client if its too small. */
-        if(c->recvbuf_size < sz) {
-            tmp = realloc(c->recvbuf, sz);
+            /* Read the packet size to see how much we're expecting. We'll
+               always need a multiple of 8 bytes. */
+            pkt_sz = (ntohs(hdr->pkt_len) + 7) & ~7;
 
-            if(!tmp) {
-                perror("realloc");
+            if(pkt_sz < 8) {
                 return -1;
             }
 
-            c->recvbuf = (unsigned char *)tmp;
-            c->recvbuf_size = sz;
-        }
+            /* Do we have the whole packet? If not, wait for the rest of it. */
+            if(c->recvbuf.len < pkt_sz) {
+                break;
+            }
 
-        memcpy(c->recvbuf, rbp, sz);
-        c->recvbuf_cur = sz;
-    }
-    else if(c->recvbuf) {
-        /* Free the buffer, if we've got nothing in it. */
-        free(c->recvbuf);
-        c->recvbuf = NULL;
-        c->recvbuf_size = 0;
+            ++c->rx.pkts;
+            rv = handle_pkt(c, hdr);
+            rxbuf_consume(&c->recvbuf, pkt_sz);
+        }
     }
 
     return rv;
 }
 
-/* Send any piled up data. */
-int shipgate_send_pkts(shipgate_conn_t *c) {
-    ssize_t amt;
-
-    /* Don't even try if there's not a connection. */
-    if(!c->has_key || c->sock < 0) {
-        return 0;
-    }
-
-    /* Send as much as we can. */
-    amt = sg_send(c, c->sendbuf, c->sendbuf_cur);
-
-    if(amt == -1) {
-        perror("send");
-        return -1;
-    }
-    else if(amt == c->sendbuf_cur) {
-        c->sendbuf_cur = 0;
-    }
-    else {
-        memmove(c->sendbuf, c->sendbuf + amt, c->sendbuf_cur - amt);
-        c->sendbuf_cur -= amt;
-    }
-
-    return 0;
-}
-
 /* Packets are below here. */
 /* Send the shipgate a character data save request. */
 int shipgate_send_cdata(shipgate_conn_t *c, uint32_t gc, uint32_t slot,
@@ -2011,7 +2382,8 @@ int shipgate_send_cdata(shipgate_conn_t *c, uint32_t gc, uint32_t slot,
     memcpy(pkt->data, cdata, len);
 
     /* Send it away. */
-    return send_crypt(c, sizeof(shipgate_char_data_pkt) + len, sendbuf);
+    return send_req(c, sizeof(shipgate_char_data_pkt) + len, sendbuf,
+                    SG_REQ_CDATA, gc);
 }
 
 /* Send the shipgate a request for character data. */
@@ -2033,7 +2405,8 @@ int shipgate_send_creq(shipgate_conn_t *c, uint32_t gc, uint32_t slot) {
     pkt->slot = htonl(slot);
 
     /* Send it away. */
-    return send_crypt(c, sizeof(shipgate_char_req_pkt), sendbuf);
+    return send_req(c, sizeof(shipgate_char_req_pkt), sendbuf, SG_REQ_CREQ,
+                    gc);
 }
 
 /* Send a newly opened ship's information to the shipgate. */
@@ -2232,7 +2605,8 @@ int shipgate_send_gmlogin(shipgate_conn_t *c, uint32_t gc, uint32_t block,
     strcpy(pkt->password, password);
 
     /* Send the packet away */
-    return send_crypt(c, sizeof(shipgate_gmlogin_req_pkt), sendbuf);
+    return send_req(c, sizeof(shipgate_gmlogin_req_pkt), sendbuf,
+                    SG_REQ_GMLOGIN, gc);
 }
 
 /* Send a ban request. */
@@ -2328,6 +2702,79 @@ int shipgate_send_friend_add(shipgate_conn_t *c, uint32_t user,
     return send_crypt(c, sizeof(shipgate_friend_add_pkt), sendbuf);
 }
 
+static inline int sg_roster_hash(uint32_t gc) {
+    return (int)(((gc * 2654435761U) >> 8) % SG_ROSTER_BUCKETS);
+}
+
+/* Add a client to the roster when they log into a block, or take them out when
+   they log off of it. The name is copied as is. */
+static void sg_roster_login(shipgate_conn_t *c, int on, uint32_t gc,
+                            uint32_t block, const char *name) {
+    sg_roster_ent_t **pp, *e, *ne = NULL;
+    int h = sg_roster_hash(gc);
+
+    if(on) {
+        if(!(ne = (sg_roster_ent_t *)malloc(sizeof(sg_roster_ent_t)))) {
+            perror("malloc");
+            return;
+        }
+
+        memset(ne, 0, sizeof(sg_roster_ent_t));
+        ne->guildcard = gc;
+        ne->block = block;
+        memcpy(ne->ch_name, name, 32);
+    }
+
+    pthread_mutex_lock(&c->roster_lock);
+
+    /* Get rid of any old entry for them on that block first. */
+    for(pp = &c->roster[h]; (e = *pp); pp = &e->next) {
+        if(e->guildcard == gc && e->block == block) {
+            *pp = e->next;
+            --c->roster_count;
+            break;
+        }
+    }
+
+    if(ne) {
+        ne->next = c->roster[h];
+        c->roster[h] = ne;
+        ++c->roster_count;
+    }
+
+    pthread_mutex_unlock(&c->roster_lock);
+    free(e);
+}
+
+/* Update the roster when a client changes lobbies. */
+static void sg_roster_lobby(shipgate_conn_t *c, uint32_t gc, uint32_t lobby,
+                            uint32_t dlobby, const char *lobby_name) {
+    sg_roster_ent_t *e;
+
+    pthread_mutex_lock(&c->roster_lock);
+
+    for(e = c->roster[sg_roster_hash(gc)]; e; e = e->next) {
+        if(e->guildcard == gc) {
+            e->lobby = lobby;
+            e->dlobby = dlobby;
+            memcpy(e->lobby_name, lobby_name, 32);
+        }
+    }
+
+    pthread_mutex_unlock(&c->roster_lock);
+}
+
+static int sg_roster_cmp(const void *a, const void *b) {
+    const sg_roster_ent_t *e1 = (const sg_roster_ent_t *)a;
+    const sg_roster_ent_t *e2 = (const sg_roster_ent_t *)b;
+
+    if(e1->block != e2->block) {
+        return e1->block < e2->block ? -1 : 1;
+    }
+
+    return 0;
+}
+
 /* Send a block login/logout */
 int shipgate_send_block_login(shipgate_conn_t *c, int on, uint32_t user,
                               uint32_t block, const char *name) {
@@ -2352,6 +2799,7 @@ int shipgate_send_block_login(shipgate_conn_t *c, int on, uint32_t user,
     pkt->guildcard = htonl(user);
     pkt->blocknum = htonl(block);
     strncpy(pkt->ch_name, name, 32);
+    sg_roster_login(c, on, user, block, pkt->ch_name);
 
     /* Send the packet away */
     return send_crypt(c, sizeof(shipgate_block_login_pkt), sendbuf);
@@ -2380,6 +2828,7 @@ int shipgate_send_block_login_bb(shipgate_conn_t *c, int on, uint32_t user,
     pkt->guildcard = htonl(user);
     pkt->blocknum = htonl(block);
     memcpy(pkt->ch_name, name, 32);
+    sg_roster_login(c, on, user, block, pkt->ch_name);
 
     /* Send the packet away */
     return send_crypt(c, sizeof(shipgate_block_login_pkt), sendbuf);
@@ -2387,7 +2836,7 @@ int shipgate_send_block_login_bb(shipgate_conn_t *c, int on, uint32_t user,
 
 /* Send a lobby change packet */
 int shipgate_send_lobby_chg(shipgate_conn_t *c, uint32_t user, uint32_t lobby,
-                            const char *lobby_name) {
+                            uint32_t dlobby, const char *lobby_name) {
     uint8_t *sendbuf = get_sendbuf();
     shipgate_lobby_change_pkt *pkt = (shipgate_lobby_change_pkt *)sendbuf;
 
@@ -2408,6 +2857,7 @@ int shipgate_send_lobby_chg(shipgate_conn_t *c, uint32_t user, uint32_t lobby,
     pkt->guildcard = htonl(user);
     pkt->lobby_id = htonl(lobby);
     strncpy(pkt->lobby_name, lobby_name, 32);
+    sg_roster_lobby(c, user, lobby, dlobby, pkt->lobby_name);
 
     /* Send the packet away */
     return send_crypt(c, sizeof(shipgate_lobby_change_pkt), sendbuf);
@@ -2417,85 +2867,73 @@ int shipgate_send_lobby_chg(shipgate_conn_t *c, uint32_t user, uint32_t lobby,
 int shipgate_send_clients(shipgate_conn_t *c) {
     uint8_t *sendbuf = get_sendbuf();
     shipgate_block_clients_pkt *pkt = (shipgate_block_clients_pkt *)sendbuf;
+    sg_roster_ent_t *ents, *e;
     uint32_t count;
     uint16_t size;
-    ship_t *s = c->ship;
-    int i;
-    block_t *b;
-    lobby_t *l;
-    ship_client_t *cl;
+    int i, j, total = 0;
 
     /* Verify we got the sendbuf. */
     if(!sendbuf) {
         return -1;
     }
 
-    /* Loop through all the blocks looking for clients, sending one packet per
-       block */
-    for(i = 0; i < s->cfg->blocks; ++i) {
-        if(s->blocks[i]) {
-            b = s->blocks[i];
-            pthread_rwlock_rdlock(&b->lock);
-
-            /* Set up this pass */
-            pkt->block = htonl(b->b);
-            size = 16;
-            count = 0;
+    /* Copy the roster out, so that nobody logging in or out has to wait on us
+       while we put together the packets. */
+    pthread_mutex_lock(&c->roster_lock);
 
-            TAILQ_FOREACH(cl, b->clients, qentry) {
-                pthread_mutex_lock(&cl->mutex);
-
-                /* Only do this if we have enough info to actually have sent
-                   the block login before */
-                if(cl->pl->v1.name[0]) {
-                    l = cl->cur_lobby;
+    if(!(ents = (sg_roster_ent_t *)malloc(sizeof(sg_roster_ent_t) *
+                                          (c->roster_count + 1)))) {
+        pthread_mutex_unlock(&c->roster_lock);
+        perror("malloc");
+        return -1;
+    }
 
-                    /* Fill in what we have */
-                    pkt->entries[count].guildcard = htonl(cl->guildcard);
-                    pkt->entries[count].dlobby = htonl(cl->lobby_id);
+    for(i = 0; i < SG_ROSTER_BUCKETS; ++i) {
+        for(e = c->roster[i]; e; e = e->next) {
+            ents[total++] = *e;
+        }
+    }
 
-                    if(cl->version != CLIENT_VERSION_BB) {
-                        strncpy(pkt->entries[count].ch_name, cl->pl->v1.name,
-                                32);
-                    }
-                    else {
-                        memcpy(pkt->entries[count].ch_name,
-                               cl->bb_pl->character.name, 32);
-                    }
+    pthread_mutex_unlock(&c->roster_lock);
 
-                    if(l) {
-                        pkt->entries[count].lobby = htonl(l->lobby_id);
-                        strncpy(pkt->entries[count].lobby_name, l->name, 32);
-                    }
-                    else {
-                        pkt->entries[count].lobby = htonl(0);
-                        memset(pkt->entries[count].lobby_name, 0, 32);
-                    }
+    qsort(ents, total, sizeof(sg_roster_ent_t), &sg_roster_cmp);
 
-                    /* Increment the counter/size */
-                    ++count;
-                    size += 80;
-                }
+    /* Send one packet per block (or more, if a block has more clients than
+       will fit in one). */
+    for(i = 0; i < total; i = j) {
+        pkt->block = htonl(ents[i].block);
+        size = 16;
+        count = 0;
 
-                pthread_mutex_unlock(&cl->mutex);
-            }
+        for(j = i; j < total && ents[j].block == ents[i].block &&
+            count < SG_BCLIENTS_MAX; ++j) {
+            pkt->entries[count].guildcard = htonl(ents[j].guildcard);
+            pkt->entries[count].lobby = htonl(ents[j].lobby);
+            pkt->entries[count].dlobby = htonl(ents[j].dlobby);
+            pkt->entries[count].reserved = 0;
+            memcpy(pkt->entries[count].ch_name, ents[j].ch_name, 32);
+            memcpy(pkt->entries[count].lobby_name, ents[j].lobby_name, 32);
 
-            pthread_rwlock_unlock(&b->lock);
+            /* Increment the counter/size */
+            ++count;
+            size += 80;
+        }
 
-            if(count) {
-                /* Fill in the header */
-                pkt->hdr.pkt_len = htons(size);
-                pkt->hdr.pkt_type = htons(SHDR_TYPE_BCLIENTS);
-                pkt->hdr.version = pkt->hdr.reserved = 0;
-                pkt->hdr.flags = 0;
-                pkt->count = htonl(count);
+        /* Fill in the header */
+        pkt->hdr.pkt_len = htons(size);
+        pkt->hdr.pkt_type = htons(SHDR_TYPE_BCLIENTS);
+        pkt->hdr.version = pkt->hdr.reserved = 0;
+        pkt->hdr.flags = 0;
+        pkt->count = htonl(count);
 
-                /* Send the packet away */
-                send_crypt(c, size, sendbuf);
-            }
-        }
+        /* Send the packet away */
+        send_crypt(c, size, sendbuf);
     }
 
+    ++c->roster_syncs;
+    c->roster_last = total;
+    free(ents);
+
     return 0;
 }
 
@@ -2552,7 +2990,8 @@ int shipgate_send_frlist_req(shipgate_conn_t *c, uint32_t gc, uint32_t block,
     pkt->start = htonl(start);
 
     /* Send the packet away */
-    return send_crypt(c, sizeof(shipgate_friend_list_req), sendbuf);
+    return send_req(c, sizeof(shipgate_friend_list_req), sendbuf,
+                    SG_REQ_FRLIST, gc);
 }
 
 /* Send a global message packet */
@@ -2650,7 +3089,8 @@ int shipgate_send_bb_opt_req(shipgate_conn_t *c, uint32_t gc, uint32_t block) {
     pkt->block = htonl(block);
 
     /* Send the packet away */
-    return send_crypt(c, sizeof(shipgate_bb_opts_req_pkt), sendbuf);
+    return send_req(c, sizeof(shipgate_bb_opts_req_pkt), sendbuf,
+                    SG_REQ_BBOPTS, gc);
 }
 
 /* Send the user's Blue Burst options to be stored */
@@ -2727,7 +3167,8 @@ int shipgate_send_cbkup_req(shipgate_conn_t *c, uint32_t gc, uint32_t block,
     pkt->name[31] = 0;
 
     /* Send it away. */
-    return send_crypt(c, sizeof(shipgate_char_bkup_pkt), sendbuf);
+    return send_req(c, sizeof(shipgate_char_bkup_pkt), sendbuf,
+                    SG_REQ_CBKUP, gc);
 }
 
 /* Send a monster kill count update */
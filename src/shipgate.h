@@ -20,6 +20,8 @@
 
 #include <time.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/queue.h>
 
 #ifdef HAVE_SSIZE_T
 #undef HAVE_SSIZE_T
@@ -31,6 +33,10 @@
 #undef HAVE_SSIZE_T
 #endif
 
+#include "rxbuf.h"
+#include "mailbox.h"
+#include "timerwheel.h"
+
 /* Forward declarations. */
 struct ship;
 struct ship_client;
@@ -68,28 +74,121 @@ typedef struct shipgate_hdr {
     uint16_t flags;
 } PACKED shipgate_hdr_t;
 
+/* Requests that we expect the shipgate to answer. The shipgate doesn't echo
+   anything back to identify which request a reply is for, so they're matched
+   up by type and guildcard (oldest first). */
+#define SG_REQ_CREQ         0
+#define SG_REQ_CBKUP        1
+#define SG_REQ_CDATA        2
+#define SG_REQ_GMLOGIN      3
+#define SG_REQ_FRLIST       4
+#define SG_REQ_BBOPTS       5
+#define SG_REQ_TYPES        6
+
+#define SG_REQ_BUCKETS      256
+#define SG_REQ_HIST         8
+
+struct sg_req;
+TAILQ_HEAD(sg_req_queue, sg_req);
+
+/* The roster of who's logged into which block (and lobby), by guildcard. */
+#define SG_ROSTER_BUCKETS   1024
+
+struct sg_roster_ent;
+
+/* Stats for each type of request. The histogram counts answered requests by
+   how long the answer took: under 5, 10, 25, 50, 100, 250 and 1000ms, then
+   everything slower than that. Late replies are ones that showed up after
+   the request had already been given up on. */
+typedef struct sg_req_stats {
+    uint64_t sent;
+    uint64_t done;
+    uint64_t failed;
+    uint64_t expired;
+    uint64_t late;
+    uint64_t lat_total;
+    uint64_t lat_max;
+    uint64_t hist[SG_REQ_HIST];
+} sg_req_stats_t;
+
 /* Shipgate connection structure. */
 struct shipgate_conn {
     int sock;
-    int hdr_read;
     int has_key;
 
-    time_t login_attempt;
     ship_t *ship;
 
     gnutls_session_t session;
 
     uint16_t key_idx;
 
-    unsigned char *recvbuf;
-    int recvbuf_cur;
-    int recvbuf_size;
-    shipgate_hdr_t pkt;
-
-    unsigned char *sendbuf;
-    int sendbuf_cur;
-    int sendbuf_size;
-    int sendbuf_start;
+    rxbuf_t recvbuf;
+    rxbuf_stats_t rx;
+
+    /* Everything headed to the shipgate goes through this queue, and is only
+       ever written to the socket by the writer thread. The io_lock keeps the
+       ship thread from tearing down the TLS session while the writer is in the
+       middle of using it. Anything queued up before the connection's gen
+       changed is sent again on the new connection, unless it's something
+       that gets sent fresh on every login anyway (like the client list). */
+    mailbox_t outq;
+    pthread_t writer;
+    pthread_mutex_t io_lock;
+    int wpipes[2];
+    int wake;
+    int writer_run;
+    int writer_started;
+    uint32_t gen;
+
+    /* Stats for the outbound queue. These are updated atomically, since every
+       block's threads can add to the queue. Latency is from the time a packet
+       is queued until the last of it is handed off to the socket. Packets
+       that are queued up together get sent in one TLS record. */
+    uint64_t out_pkts;
+    uint64_t out_bytes;
+    uint64_t out_sent;
+    uint64_t out_records;
+    uint64_t out_drops;
+    uint64_t out_replayed;
+    uint64_t out_lat_total;
+    uint64_t out_lat_max;
+
+    /* Requests waiting on an answer, hashed by guildcard and also kept in the
+       order they were sent (which is also the order they'll time out in). The
+       timer belongs to the ship thread's timer wheel. */
+    pthread_mutex_t req_lock;
+    uint32_t req_token;
+    int req_count;
+    struct sg_req *req_hash[SG_REQ_BUCKETS];
+    struct sg_req_queue req_queue;
+    tw_timer_t req_timer;
+    sg_req_stats_t reqs[SG_REQ_TYPES];
+
+    /* Every block login, logout and lobby change told to the shipgate is also
+       applied to the roster, so the whole list can be sent again when we
+       (re)connect without going through every block's clients. The stats are
+       how many times it's been sent, and how many clients were in it last
+       time. */
+    pthread_mutex_t roster_lock;
+    int roster_count;
+    struct sg_roster_ent *roster[SG_ROSTER_BUCKETS];
+    uint64_t roster_syncs;
+    int roster_last;
+
+    /* Reconnecting. The session data from the last connection lets the next
+       handshake resume it rather than doing the whole thing over, and each
+       failed attempt waits (roughly) twice as long as the last one before the
+       next. These all belong to the ship thread. The reconnect time is from
+       losing the connection until we're logged back in. */
+    gnutls_datum_t resume;
+    uint64_t retry_ms;
+    int backoff_ms;
+    uint64_t down_ms;
+    uint64_t reconnects;
+    uint64_t resumed;
+    uint64_t reconn_fails;
+    uint64_t reconn_last;
+    uint64_t reconn_max;
 };
 
 #ifndef SHIPGATE_CONN_DEFINED
@@ -536,8 +635,21 @@ void shipgate_cleanup(shipgate_conn_t *c);
 /* Read data from the shipgate. */
 int shipgate_process_pkt(shipgate_conn_t *c);
 
-/* Send any piled up data. */
-int shipgate_send_pkts(shipgate_conn_t *c);
+/* Drop the connection to the shipgate (so that it can be reconnected later).
+   Anything still queued up stays there until the next connection, and any
+   requests still waiting on an answer are left to time out as usual. */
+void shipgate_disconnect(shipgate_conn_t *c);
+
+/* Put off the next reconnect attempt, backing off a bit more each time. Call
+   this when the connection is lost or an attempt to reconnect fails. */
+void shipgate_backoff(shipgate_conn_t *c);
+
+/* Start checking for requests the shipgate hasn't answered in time. This has
+   to be called from the thread that owns the timer wheel. */
+void shipgate_start_req_timer(shipgate_conn_t *c, timerwheel_t *tw);
+
+/* Names for the types of requests, for printing the stats. */
+extern const char *shipgate_req_names[SG_REQ_TYPES];
 
 /* Send a newly opened ship's information to the shipgate. */
 int shipgate_send_ship_info(shipgate_conn_t *c, ship_t *ship);
@@ -587,11 +699,12 @@ int shipgate_send_block_login(shipgate_conn_t *c, int on, uint32_t user,
 int shipgate_send_block_login_bb(shipgate_conn_t *c, int on, uint32_t user,
                                  uint32_t block, const uint16_t *name);
 
-/* Send a lobby change packet */
+/* Send a lobby change packet. The dlobby is the last default lobby the user
+   was in, which is only kept for when the client list is sent again. */
 int shipgate_send_lobby_chg(shipgate_conn_t *c, uint32_t user, uint32_t lobby,
-                            const char *lobby_name);
+                            uint32_t dlobby, const char *lobby_name);
 
-/* Send a full client list */
+/* Send a full client list, from the roster. */
 int shipgate_send_clients(shipgate_conn_t *c);
 
 /* Send a kick packet */
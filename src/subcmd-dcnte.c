@@ -123,45 +123,48 @@ int subcmd_dcnte_handle_bcast(ship_client_t *c, subcmd_pkt_t *pkt) {
     return rv;
 }
 
-int subcmd_translate_dc_to_nte(ship_client_t *c, subcmd_pkt_t *pkt) {
-    uint8_t *sendbuf;
-    uint8_t newtype = 0xFF;
-    uint16_t len = LE16(pkt->hdr.dc.pkt_len);
-    int rv;
-
-    switch(pkt->type) {
+/* Figure out what a subcommand is called on the NTE, or -1 if the NTE doesn't
+   have it. */
+int subcmd_nte_type(uint8_t type) {
+    switch(type) {
         case SUBCMD_SET_AREA_21:
-            newtype = SUBCMD_DCNTE_SET_AREA;
-            break;
+            return SUBCMD_DCNTE_SET_AREA;
 
         case SUBCMD_FINISH_LOAD:
-            newtype = SUBCMD_DCNTE_FINISH_LOAD;
-            break;
+            return SUBCMD_DCNTE_FINISH_LOAD;
 
         case SUBCMD_SET_POS_3F:
-            newtype = SUBCMD_DCNTE_SET_POS;
-            break;
+            return SUBCMD_DCNTE_SET_POS;
 
         case SUBCMD_MOVE_SLOW:
-            newtype = SUBCMD_DCNTE_MOVE_SLOW;
-            break;
+            return SUBCMD_DCNTE_MOVE_SLOW;
 
         case SUBCMD_MOVE_FAST:
-            newtype = SUBCMD_DCNTE_MOVE_FAST;
-            break;
+            return SUBCMD_DCNTE_MOVE_FAST;
 
         case SUBCMD_TALK_DESK:
-            newtype = SUBCMD_DCNTE_TALK_DESK;
-            break;
+            return SUBCMD_DCNTE_TALK_DESK;
+    }
 
-        default:
+    return -1;
+}
+
+int subcmd_translate_dc_to_nte(ship_client_t *c, subcmd_pkt_t *pkt) {
+    uint8_t *sendbuf;
+    uint8_t newtype;
+    uint16_t len = LE16(pkt->hdr.dc.pkt_len);
+    int rv, type;
+
+    if((type = subcmd_nte_type(pkt->type)) < 0) {
 #ifdef LOG_UNKNOWN_SUBS
-            debug(DBG_WARN, "Cannot translate DC->NTE packet, dropping\n");
-            print_packet((unsigned char *)pkt, len);
+        debug(DBG_WARN, "Cannot translate DC->NTE packet, dropping\n");
+        print_packet((unsigned char *)pkt, len);
 #endif /* LOG_UNKNOWN_SUBS */
-            return 0;
+        return 0;
     }
 
+    newtype = (uint8_t)type;
+
     if(!(sendbuf = (uint8_t *)malloc(len)))
         return -1;
 
@@ -176,43 +179,20 @@ int subcmd_translate_dc_to_nte(ship_client_t *c, subcmd_pkt_t *pkt) {
 
 int subcmd_translate_bb_to_nte(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
     uint8_t *sendbuf;
-    uint8_t newtype = 0xFF;
+    uint8_t newtype;
     uint16_t len = LE16(pkt->hdr.pkt_len);
-    int rv;
-
-    switch(pkt->type) {
-        case SUBCMD_SET_AREA_21:
-            newtype = SUBCMD_DCNTE_SET_AREA;
-            break;
-
-        case SUBCMD_FINISH_LOAD:
-            newtype = SUBCMD_DCNTE_FINISH_LOAD;
-            break;
-
-        case SUBCMD_SET_POS_3F:
-            newtype = SUBCMD_DCNTE_SET_POS;
-            break;
-
-        case SUBCMD_MOVE_SLOW:
-            newtype = SUBCMD_DCNTE_MOVE_SLOW;
-            break;
+    int rv, type;
 
-        case SUBCMD_MOVE_FAST:
-            newtype = SUBCMD_DCNTE_MOVE_FAST;
-            break;
-
-        case SUBCMD_TALK_DESK:
-            newtype = SUBCMD_DCNTE_TALK_DESK;
-            break;
-
-        default:
+    if((type = subcmd_nte_type(pkt->type)) < 0) {
 #ifdef LOG_UNKNOWN_SUBS
-            debug(DBG_WARN, "Cannot translate BB->NTE packet, dropping\n");
-            print_packet((unsigned char *)pkt, len);
+        debug(DBG_WARN, "Cannot translate BB->NTE packet, dropping\n");
+        print_packet((unsigned char *)pkt, len);
 #endif /* LOG_UNKNOWN_SUBS */
-            return 0;
+        return 0;
     }
 
+    newtype = (uint8_t)type;
+
     if(!(sendbuf = (uint8_t *)malloc(len)))
         return -1;
 
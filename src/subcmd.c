@@ -31,6 +31,9 @@
 #include "items.h"
 #include "word_select.h"
 
+/* How long to hold back position updates, in ms (from the command line). */
+extern int lobby_pos_tick_ms;
+
 /* Forward declarations */
 static int subcmd_send_shop_inv(ship_client_t *c, subcmd_bb_shop_req_t *req);
 static int subcmd_send_drop_stack(ship_client_t *c, uint32_t area, float x,
@@ -667,6 +670,7 @@ static int handle_levelup(ship_client_t *c, subcmd_levelup_t *pkt) {
     c->pl->v1.dfp = pkt->dfp;
     c->pl->v1.ata = pkt->ata;
     c->pl->v1.level = pkt->level;
+    pllist_update(c);
 
     return subcmd_send_lobby_dc(c->cur_lobby, c, (subcmd_pkt_t *)pkt, 0);
 }
@@ -970,6 +974,83 @@ static int handle_bb_set_area(ship_client_t *c, subcmd_bb_set_area_t *pkt) {
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
 }
 
+/* Send the client's held back position update (if it has one) to the lobby.
+   The lobby's mutex must be held. */
+static int flush_pos(lobby_t *l, ship_client_t *c) {
+    int pending = c->pos_pending;
+
+    if(!pending) {
+        return 0;
+    }
+
+    c->pos_pending = 0;
+
+    /* The timer belongs to the client's worker, so leave it alone from
+       anywhere else. It won't find anything to send when it goes off. */
+    if(c->worker == block_current_worker()) {
+        timerwheel_cancel(c->tw, &c->pos_timer);
+    }
+
+    if(pending == 2) {
+        return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)c->pos_pkt, 0);
+    }
+
+    return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)c->pos_pkt, 0);
+}
+
+void subcmd_pos_timer(timerwheel_t *tw, tw_timer_t *t, void *d) {
+    ship_client_t *c = (ship_client_t *)d;
+    lobby_t *l = c->cur_lobby;
+
+    if(!l || !c->pos_pending) {
+        return;
+    }
+
+    pthread_mutex_lock(&l->mutex);
+    flush_pos(l, c);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+/* Send a movement subcommand to the lobby. If we're coalescing them, it is
+   held until the end of the tick instead, and replaces anything the client
+   sent earlier in the tick (saving a packet to everyone else in the lobby). */
+static int send_lobby_pos(lobby_t *l, ship_client_t *c, void *pkt, int is_bb) {
+    int len = is_bb ? LE16(((bb_pkt_hdr_t *)pkt)->pkt_len) :
+        LE16(((dc_pkt_hdr_t *)pkt)->pkt_len);
+
+    if(c->pos_pending) {
+        c->pos_pending = 0;
+        ++l->pos_coalesced;
+        l->pos_saved += l->num_clients - 1;
+    }
+
+    /* Anyone joining during a burst needs to see these right away. So does
+       anything sent from some worker other than the client's own (like when a
+       burst's queued packets are sent), since the timer belongs to that. */
+    if(!lobby_pos_tick_ms || (l->flags & LOBBY_FLAG_BURSTING) ||
+       len > (int)sizeof(c->pos_pkt) ||
+       c->worker != block_current_worker()) {
+        if(is_bb) {
+            return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
+        }
+
+        return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)pkt, 0);
+    }
+
+    memcpy(c->pos_pkt, pkt, len);
+    c->pos_pending = is_bb ? 2 : 1;
+
+    /* The wheel rounds up to its next tick, so aim just past the tick before
+       the one we want. That way each flush lands on a tick, and they go out
+       lobby_pos_tick_ms apart while the client keeps moving. */
+    if(!c->pos_timer.pending) {
+        timerwheel_schedule(c->tw, &c->pos_timer, c->tw->now_ms +
+                            lobby_pos_tick_ms - TIMERWHEEL_TICK_MS + 1);
+    }
+
+    return 0;
+}
+
 static int handle_set_pos(ship_client_t *c, subcmd_set_pos_t *pkt) {
     lobby_t *l = c->cur_lobby;
 
@@ -984,7 +1065,7 @@ static int handle_set_pos(ship_client_t *c, subcmd_set_pos_t *pkt) {
     /* Clear this, in case we're at the lobby counter */
     c->last_info_req = 0;
 
-    return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)pkt, 0);
+    return send_lobby_pos(l, c, pkt, 0);
 }
 
 static int handle_move(ship_client_t *c, subcmd_move_t *pkt) {
@@ -996,7 +1077,7 @@ static int handle_move(ship_client_t *c, subcmd_move_t *pkt) {
         c->z = pkt->z;
     }
 
-    return subcmd_send_lobby_dc(l, c, (subcmd_pkt_t *)pkt, 0);
+    return send_lobby_pos(l, c, pkt, 0);
 }
 
 static int handle_bb_set_pos(ship_client_t *c, subcmd_bb_set_pos_t *pkt) {
@@ -1010,7 +1091,7 @@ static int handle_bb_set_pos(ship_client_t *c, subcmd_bb_set_pos_t *pkt) {
         c->z = pkt->z;
     }
 
-    return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
+    return send_lobby_pos(l, c, pkt, 1);
 }
 
 static int handle_bb_move(ship_client_t *c, subcmd_bb_move_t *pkt) {
@@ -1022,7 +1103,7 @@ static int handle_bb_move(ship_client_t *c, subcmd_bb_move_t *pkt) {
         c->z = pkt->z;
     }
 
-    return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
+    return send_lobby_pos(l, c, pkt, 1);
 }
 
 static int handle_delete_inv(ship_client_t *c, subcmd_destroy_item_t *pkt) {
@@ -1720,7 +1801,8 @@ static int handle_bb_bank(ship_client_t *c, subcmd_bb_bank_open_t *req) {
     pkt->type = SUBCMD_BANK_INV;
     pkt->unused[0] = pkt->unused[1] = pkt->unused[2] = 0;
     pkt->size = LE32(size);
-    pkt->checksum = mt19937_genrand_int32(&b->rng); /* Client doesn't care */
+    /* Client doesn't care */
+    pkt->checksum = mt19937_genrand_int32(block_rng(b));
     memcpy(&pkt->item_count, &c->bb_pl->bank, sizeof(sylverant_bank_t));
 
     return crypt_send(c, (int)size, sendbuf);
@@ -2150,8 +2232,8 @@ static int handle_bb_sort_inv(ship_client_t *c, subcmd_bb_sort_inv_t *pkt) {
 static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid;
-    game_enemy_t *en;
-    uint32_t flags;
+    game_enemies_t *en;
+    uint32_t flags, bp;
 
     /* We can't get these in default lobbies without someone messing with
        something that they shouldn't be... Disconnect anyone that tries. */
@@ -2175,7 +2257,7 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n"
               "Episode: %d, Floor: %d, Map: (%d, %d)\n", c->guildcard, mid,
@@ -2191,10 +2273,10 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    en = &l->map_enemies->enemies[mid];
-    if(!(en->clients_hit & 0x80)) {
-        en->clients_hit |= (1 << c->client_id);
-        en->last_client = c->client_id;
+    en = l->map_enemies;
+    if(!(en->clients_hit[mid] & 0x80)) {
+        en->clients_hit[mid] |= (1 << c->client_id);
+        en->last_client[mid] = c->client_id;
 
         /* If the kill flag is set, mark it as dead and update the client's
            counter. */
@@ -2206,10 +2288,11 @@ static int handle_mhit(ship_client_t *c, subcmd_mhit_pkt_t *pkt) {
             flags = SWAP32(flags);
 
         if(flags & 0x00000800) {
-            en->clients_hit |= 0x80;
+            en->clients_hit[mid] |= 0x80;
 
-            if(en->bp_entry < 0x60)
-                ++c->enemy_kills[en->bp_entry];
+            bp = game_enemy_bp(en, mid);
+            if(bp < 0x60)
+                ++c->enemy_kills[bp];
         }
     }
 
@@ -2238,16 +2321,16 @@ static int handle_bb_mhit(ship_client_t *c, subcmd_bb_mhit_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " hit invalid enemy (%d -- max: "
               "%d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
     }
 
     /* Save the hit, assuming the enemy isn't already dead. */
-    if(!(l->map_enemies->enemies[mid].clients_hit & 0x80)) {
-        l->map_enemies->enemies[mid].clients_hit |= (1 << c->client_id);
-        l->map_enemies->enemies[mid].last_client = c->client_id;
+    if(!(l->map_enemies->clients_hit[mid] & 0x80)) {
+        l->map_enemies->clients_hit[mid] |= (1 << c->client_id);
+        l->map_enemies->last_client[mid] = c->client_id;
     }
 
     return subcmd_send_lobby_bb(l, c, (bb_subcmd_pkt_t *)pkt, 0);
@@ -2257,7 +2340,7 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
     lobby_t *l = c->cur_lobby;
     uint16_t mid;
     uint32_t bp, exp;
-    game_enemy_t *en;
+    game_enemies_t *en;
 
     /* We can't get these in default lobbies without someone messing with
        something that they shouldn't be... Disconnect anyone that tries. */
@@ -2277,7 +2360,7 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure the enemy is in range. */
     mid = LE16(pkt->enemy_id);
-    if(mid > l->map_enemies->count) {
+    if(mid >= l->map_enemies->count) {
         debug(DBG_WARN, "Guildcard %" PRIu32 " killed invalid enemy (%d -- "
               "max: %d)!\n", c->guildcard, mid, l->map_enemies->count);
         return -1;
@@ -2285,18 +2368,19 @@ static int handle_bb_req_exp(ship_client_t *c, subcmd_bb_req_exp_pkt_t *pkt) {
 
     /* Make sure this client actually hit the enemy and that the client didn't
        already claim their experience. */
-    en = &l->map_enemies->enemies[mid];
+    en = l->map_enemies;
 
-    if(!(en->clients_hit & (1 << c->client_id))) {
+    if(!(en->clients_hit[mid] & (1 << c->client_id))) {
         return 0;
     }
 
     /* Set that the client already got their experience and that the monster is
        indeed dead. */
-    en->clients_hit = (en->clients_hit & (~(1 << c->client_id))) | 0x80;
+    en->clients_hit[mid] = (en->clients_hit[mid] & (~(1 << c->client_id))) |
+        0x80;
 
     /* Give the client their experience! */
-    bp = en->bp_entry;
+    bp = game_enemy_bp(en, mid);
     exp = l->bb_params[bp].exp;
 
     if(!pkt->last_hitter) {
@@ -2372,6 +2456,12 @@ int subcmd_handle_one(ship_client_t *c, subcmd_pkt_t *pkt) {
 
     pthread_mutex_lock(&l->mutex);
 
+    /* Anything else the client does has to go out after the position it was
+       at when it did it. */
+    if(c->pos_pending && !is_pos_subcmd(type)) {
+        flush_pos(l, c);
+    }
+
     /* Find the destination. */
     dest = l->clients[pkt->hdr.dc.flags];
 
@@ -2470,6 +2560,12 @@ int subcmd_bb_handle_one(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
 
     pthread_mutex_lock(&l->mutex);
 
+    /* Anything else the client does has to go out after the position it was
+       at when it did it. */
+    if(c->pos_pending && !is_pos_subcmd(type)) {
+        flush_pos(l, c);
+    }
+
     /* Find the destination. */
     dest = l->clients[dnum];
 
@@ -2541,6 +2637,12 @@ int subcmd_handle_bcast(ship_client_t *c, subcmd_pkt_t *pkt) {
 
     pthread_mutex_lock(&l->mutex);
 
+    /* Anything else the client does has to go out after the position it was
+       at when it did it. */
+    if(c->pos_pending && !is_pos_subcmd(type)) {
+        flush_pos(l, c);
+    }
+
     /* If there's a burst going on in the lobby, delay most packets */
     if(l->flags & LOBBY_FLAG_BURSTING) {
         switch(type) {
@@ -2695,6 +2797,12 @@ int subcmd_bb_handle_bcast(ship_client_t *c, bb_subcmd_pkt_t *pkt) {
 
     pthread_mutex_lock(&l->mutex);
 
+    /* Anything else the client does has to go out after the position it was
+       at when it did it. */
+    if(c->pos_pending && !is_pos_subcmd(type)) {
+        flush_pos(l, c);
+    }
+
     switch(type) {
         case SUBCMD_SYMBOL_CHAT:
             rv = handle_bb_symbol_chat(c, pkt);
@@ -2821,6 +2929,9 @@ int subcmd_handle_ep3_bcast(ship_client_t *c, subcmd_pkt_t *pkt) {
 
     pthread_mutex_lock(&l->mutex);
 
+    /* Make sure the client's position goes out first. */
+    flush_pos(l, c);
+
     /* We don't do anything special with these just yet... */
     rv = lobby_send_pkt_ep3(l, c, (dc_pkt_hdr_t *)pkt);
 
@@ -2923,7 +3034,8 @@ static int subcmd_send_shop_inv(ship_client_t *c, subcmd_bb_shop_req_t *req) {
     for(i = 0; i < 0x0B; ++i) {
         shop.items[i].item_data[0] = LE32((0x03 | (i << 8)));
         shop.items[i].reserved = 0xFFFFFFFF;
-        shop.items[i].cost = LE32((mt19937_genrand_int32(&b->rng) % 255));
+        shop.items[i].cost =
+            LE32((mt19937_genrand_int32(block_rng(b)) % 255));
     }
 
     return send_pkt_bb(c, (bb_pkt_hdr_t *)&shop);
@@ -3090,8 +3202,14 @@ int subcmd_send_bb_level(ship_client_t *c) {
 
 int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                          int igcheck) {
+    bcast_t b;
     int i;
 
+    /* Render the packet once per version, rather than once per client. */
+    if(bcast_init(&b, pkt, 0, 1)) {
+        return -1;
+    }
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -3101,10 +3219,7 @@ int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                 continue;
             }
 
-            if(!(l->clients[i]->flags & CLIENT_FLAG_IS_DCNTE))
-                send_pkt_dc(l->clients[i], (dc_pkt_hdr_t *)pkt);
-            else
-                subcmd_translate_dc_to_nte(l->clients[i], pkt);
+            bcast_send(l->clients[i], &b);
         }
     }
 
@@ -3113,8 +3228,14 @@ int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
 
 int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
                          int igcheck) {
+    bcast_t b;
     int i;
 
+    /* Render the packet once per version, rather than once per client. */
+    if(bcast_init(&b, pkt, 1, 1)) {
+        return -1;
+    }
+
     /* Send the packet to every connected client. */
     for(i = 0; i < l->max_clients; ++i) {
         if(l->clients[i] && l->clients[i] != c) {
@@ -3124,10 +3245,7 @@ int subcmd_send_lobby_bb(lobby_t *l, ship_client_t *c, bb_subcmd_pkt_t *pkt,
                 continue;
             }
 
-            if(!(l->clients[i]->flags & CLIENT_FLAG_IS_DCNTE))
-                send_pkt_bb(l->clients[i], (bb_pkt_hdr_t *)pkt);
-            else
-                subcmd_translate_bb_to_nte(l->clients[i], pkt);
+            bcast_send(l->clients[i], &b);
         }
     }
 
@@ -865,6 +865,12 @@ typedef struct subcmd_mkill {
 #define SUBCMD_BANK_ACT_DONE    2
 #define SUBCMD_BANK_ACT_CLOSE   3
 
+/* Subcommands that only move the sender around, which can be coalesced. */
+static inline int is_pos_subcmd(uint8_t type) {
+    return type == SUBCMD_SET_POS_3E || type == SUBCMD_SET_POS_3F ||
+        type == SUBCMD_MOVE_SLOW || type == SUBCMD_MOVE_FAST;
+}
+
 /* Handle a 0x62/0x6D packet. */
 int subcmd_handle_one(ship_client_t *c, subcmd_pkt_t *pkt);
 int subcmd_bb_handle_one(ship_client_t *c, bb_subcmd_pkt_t *pkt);
@@ -887,6 +893,10 @@ int subcmd_send_bb_level(ship_client_t *c);
 
 int subcmd_send_pos(ship_client_t *dst, ship_client_t *src);
 
+/* Timer callback that sends a client's held back position update to its lobby
+   at the end of the tick. */
+void subcmd_pos_timer(timerwheel_t *tw, tw_timer_t *t, void *d);
+
 /* Send a broadcast subcommand to the whole lobby. */
 int subcmd_send_lobby_dc(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                          int igcheck);
@@ -896,6 +906,7 @@ int subcmd_send_lobby_dcnte(lobby_t *l, ship_client_t *c, subcmd_pkt_t *pkt,
                             int igcheck);
 
 /* Stuff dealing with the Dreamcast Network Trial edition */
+int subcmd_nte_type(uint8_t type);
 int subcmd_translate_dc_to_nte(ship_client_t *c, subcmd_pkt_t *pkt);
 int subcmd_translate_nte_to_dc(ship_client_t *c, subcmd_pkt_t *pkt);
 int subcmd_translate_bb_to_nte(ship_client_t *c, bb_subcmd_pkt_t *pkt);
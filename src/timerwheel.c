@@ -0,0 +1,227 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "timerwheel.h"
+
+uint64_t timerwheel_time_ms(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if(!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+}
+
+void timerwheel_init(timerwheel_t *tw) {
+    int i, j;
+
+    memset(tw, 0, sizeof(timerwheel_t));
+
+    for(i = 0; i < TIMERWHEEL_LEVELS; ++i) {
+        for(j = 0; j < TIMERWHEEL_SLOTS; ++j) {
+            LIST_INIT(&tw->slots[i][j]);
+        }
+    }
+
+    timerwheel_update_clock(tw);
+    tw->cur_tick = tw->now_ms / TIMERWHEEL_TICK_MS;
+}
+
+void timerwheel_update_clock(timerwheel_t *tw) {
+    tw->now = time(NULL);
+    tw->now_ms = timerwheel_time_ms();
+}
+
+void timerwheel_timer_init(tw_timer_t *t, tw_callback_t cb, void *data) {
+    memset(t, 0, sizeof(tw_timer_t));
+    t->cb = cb;
+    t->data = data;
+}
+
+/* File a timer in the right slot, based on how far away its tick is. */
+static void tw_file(timerwheel_t *tw, tw_timer_t *t) {
+    uint64_t tick = t->tick, delta;
+    int lvl, shift;
+
+    /* Anything that's already due goes in the very next slot we'll look at. */
+    if(tick < tw->cur_tick) {
+        tick = tw->cur_tick;
+    }
+
+    delta = tick - tw->cur_tick;
+
+    for(lvl = 0; lvl < TIMERWHEEL_LEVELS - 1; ++lvl) {
+        if(delta < (1ULL << ((lvl + 1) * TIMERWHEEL_BITS))) {
+            break;
+        }
+    }
+
+    /* Clamp things that are too far out for the top level. They'll get filed
+       again when that slot cascades. */
+    if(delta >= (1ULL << (TIMERWHEEL_LEVELS * TIMERWHEEL_BITS))) {
+        tick = tw->cur_tick +
+            (1ULL << (TIMERWHEEL_LEVELS * TIMERWHEEL_BITS)) - 1;
+    }
+
+    shift = lvl * TIMERWHEEL_BITS;
+    LIST_INSERT_HEAD(&tw->slots[lvl][(tick >> shift) & TIMERWHEEL_MASK], t,
+                     entry);
+}
+
+void timerwheel_schedule(timerwheel_t *tw, tw_timer_t *t, uint64_t expires) {
+    if(t->pending) {
+        LIST_REMOVE(t, entry);
+    }
+    else {
+        ++tw->count;
+    }
+
+    /* Round up, so that timers never fire before their deadline. */
+    t->expires = expires;
+    t->tick = (expires + TIMERWHEEL_TICK_MS - 1) / TIMERWHEEL_TICK_MS;
+    t->pending = 1;
+    tw_file(tw, t);
+}
+
+void timerwheel_cancel(timerwheel_t *tw, tw_timer_t *t) {
+    if(t->pending) {
+        LIST_REMOVE(t, entry);
+        t->pending = 0;
+        --tw->count;
+    }
+}
+
+/* Move everything in one slot of an upper level down to where it belongs now
+   that its time is getting close. */
+static void tw_cascade(timerwheel_t *tw, int lvl) {
+    struct tw_list *slot;
+    tw_timer_t *t;
+
+    slot = &tw->slots[lvl][(tw->cur_tick >> (lvl * TIMERWHEEL_BITS)) &
+                           TIMERWHEEL_MASK];
+
+    while((t = LIST_FIRST(slot))) {
+        LIST_REMOVE(t, entry);
+        tw_file(tw, t);
+        ++tw->cascaded;
+    }
+}
+
+int timerwheel_run(timerwheel_t *tw) {
+    uint64_t target = tw->now_ms / TIMERWHEEL_TICK_MS, lat;
+    struct tw_list due;
+    tw_timer_t *t;
+    int lvl, rv = 0;
+
+    /* Nothing to do, so don't bother walking the wheel up to the present. */
+    if(!tw->count) {
+        if(tw->cur_tick <= target) {
+            tw->cur_tick = target + 1;
+        }
+
+        return 0;
+    }
+
+    while(tw->cur_tick <= target) {
+        /* If we've gone all the way around a level, pull in the next slot from
+           the level above it (from the top down, so things can fall through
+           more than one level at once). */
+        if(!(tw->cur_tick & TIMERWHEEL_MASK)) {
+            for(lvl = 1; lvl < TIMERWHEEL_LEVELS - 1; ++lvl) {
+                if((tw->cur_tick >> (lvl * TIMERWHEEL_BITS)) & TIMERWHEEL_MASK)
+                    break;
+            }
+
+            for(; lvl > 0; --lvl) {
+                tw_cascade(tw, lvl);
+            }
+        }
+
+        /* Take the whole slot off the wheel before firing anything in it, so
+           that callbacks can safely reschedule themselves. */
+        LIST_INIT(&due);
+
+        while((t = LIST_FIRST(&tw->slots[0][tw->cur_tick & TIMERWHEEL_MASK]))) {
+            LIST_REMOVE(t, entry);
+            LIST_INSERT_HEAD(&due, t, entry);
+        }
+
+        ++tw->cur_tick;
+
+        while((t = LIST_FIRST(&due))) {
+            LIST_REMOVE(t, entry);
+            t->pending = 0;
+            --tw->count;
+
+            lat = tw->now_ms > t->expires ? tw->now_ms - t->expires : 0;
+            tw->latency_total += lat;
+
+            if(lat > tw->latency_max) {
+                tw->latency_max = lat;
+            }
+
+            ++tw->fired;
+            ++rv;
+
+            t->cb(tw, t, t->data);
+        }
+    }
+
+    return rv;
+}
+
+int timerwheel_next_timeout(timerwheel_t *tw, int max) {
+    uint64_t tick, until;
+    int i;
+
+    if(!tw->count) {
+        return max;
+    }
+
+    /* Look for the first non-empty slot on the bottom level. If we get to the
+       end of the level first, we need to wake up to cascade the next one. */
+    for(i = 0; i < TIMERWHEEL_SLOTS; ++i) {
+        tick = tw->cur_tick + i;
+
+        if(!(tick & TIMERWHEEL_MASK) ||
+           LIST_FIRST(&tw->slots[0][tick & TIMERWHEEL_MASK])) {
+            break;
+        }
+    }
+
+    tick = tw->cur_tick + i;
+    until = tick * TIMERWHEEL_TICK_MS;
+
+    if(until <= tw->now_ms) {
+        return 0;
+    }
+    else if(until - tw->now_ms > (uint64_t)max) {
+        return max;
+    }
+
+    return (int)(until - tw->now_ms);
+}
@@ -0,0 +1,100 @@
+/*
+    Sylverant Ship Server
+    Copyright (C) 2015 Lawrence Sebald
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License version 3
+    as published by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <time.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* Resolution of the wheel, in milliseconds. */
+#define TIMERWHEEL_TICK_MS      100
+
+/* The wheel has TIMERWHEEL_LEVELS levels of TIMERWHEEL_SLOTS slots each. Each
+   level's slots cover TIMERWHEEL_SLOTS times as much time as the level below,
+   so with 100ms ticks the three levels cover 6.4 seconds, about 7 minutes and
+   about 7.5 hours respectively. Anything further out than that just gets put
+   in the last slot and is re-filed when it comes around. */
+#define TIMERWHEEL_BITS         6
+#define TIMERWHEEL_SLOTS        (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_MASK         (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_LEVELS       3
+
+struct timerwheel;
+struct tw_timer;
+
+typedef void (*tw_callback_t)(struct timerwheel *tw, struct tw_timer *t,
+                              void *data);
+
+typedef struct tw_timer {
+    LIST_ENTRY(tw_timer) entry;
+    uint64_t expires;               /* Absolute time, in ms */
+    uint64_t tick;                  /* Tick the timer is filed under */
+    tw_callback_t cb;
+    void *data;
+    int pending;
+} tw_timer_t;
+
+LIST_HEAD(tw_list, tw_timer);
+
+/* A timer wheel belongs to exactly one thread. Nothing in here is locked, so
+   timers must only be scheduled, cancelled and run from the thread that owns
+   the wheel. */
+typedef struct timerwheel {
+    /* The clock, as of the last call to timerwheel_update_clock(). Anything
+       running on the owning thread can use these instead of asking the system
+       for the time itself. */
+    time_t now;
+    uint64_t now_ms;
+
+    uint64_t cur_tick;
+    int count;
+    struct tw_list slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+
+    /* Statistics. Latency is how long after its deadline a timer fired. */
+    uint64_t fired;
+    uint64_t cascaded;
+    uint64_t latency_total;
+    uint64_t latency_max;
+} timerwheel_t;
+
+void timerwheel_init(timerwheel_t *tw);
+
+/* Read the monotonic clock directly, in ms. */
+uint64_t timerwheel_time_ms(void);
+
+/* Read the system clocks into the wheel. Call once per pass of the loop. */
+void timerwheel_update_clock(timerwheel_t *tw);
+
+void timerwheel_timer_init(tw_timer_t *t, tw_callback_t cb, void *data);
+
+/* (Re)schedule a timer to fire at the given time, which is in the same units as
+   tw->now_ms. Timers scheduled in the past fire on the next run. */
+void timerwheel_schedule(timerwheel_t *tw, tw_timer_t *t, uint64_t expires);
+void timerwheel_cancel(timerwheel_t *tw, tw_timer_t *t);
+
+/* Fire every timer that is due as of the cached clock. Callbacks may schedule
+   or cancel any timer, including the one that fired. Returns the number of
+   timers fired. */
+int timerwheel_run(timerwheel_t *tw);
+
+/* How long (in ms, capped at max) the owning thread can sleep before it needs
+   to call timerwheel_run() again. */
+int timerwheel_next_timeout(timerwheel_t *tw, int max);
+
+#endif /* !TIMERWHEEL_H */
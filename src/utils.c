@@ -30,6 +30,7 @@
 #include "utils.h"
 #include "clients.h"
 #include "player.h"
+#include "evloop.h"
 
 #ifdef HAVE_LIBMINI18N
 mini18n_t langs[CLIENT_LANG_COUNT];
@@ -456,7 +457,7 @@ const void *my_ntop(struct sockaddr_storage *addr, char str[INET6_ADDRSTRLEN]) {
     return NULL;
 }
 
-int open_sock(int family, uint16_t port) {
+int open_sock(int family, uint16_t port, int reuseport) {
     int sock = -1, val;
     struct sockaddr_in addr;
     struct sockaddr_in6 addr6;
@@ -478,6 +479,24 @@ int open_sock(int family, uint16_t port) {
            anyway... */
     }
 
+    /* If the port is going to be shared between multiple listening sockets,
+       let the kernel know so that it will spread connections between them. */
+    if(reuseport) {
+#ifdef SO_REUSEPORT
+        val = 1;
+        if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(int))) {
+            perror("setsockopt SO_REUSEPORT");
+            close(sock);
+            return -1;
+        }
+#else
+        debug(DBG_ERROR, "Cannot share listening port %d on this system!\n",
+              (int)port);
+        close(sock);
+        return -1;
+#endif
+    }
+
     if(family == AF_INET) {
         memset(&addr, 0, sizeof(struct sockaddr_in));
         addr.sin_family = family;
@@ -530,6 +549,12 @@ int open_sock(int family, uint16_t port) {
         return -1;
     }
 
+    /* Everyone accepts connections until EAGAIN, so don't block in accept. */
+    if(evloop_set_nonblock(sock)) {
+        close(sock);
+        return -1;
+    }
+
     return sock;
 }
 
@@ -690,6 +715,9 @@ void update_lobby_event(void) {
         b = ship->blocks[i];
 
         if(b && b->run) {
+            /* The client lock keeps everyone around until their workers have
+               had a chance to send them the new event. */
+            pthread_rwlock_rdlock(&b->lock);
             pthread_rwlock_rdlock(&b->lobby_lock);
 
             /* ... and set the event code on each default lobby. */
@@ -703,13 +731,9 @@ void update_lobby_event(void) {
                         if(l->clients[j] != NULL) {
                             c2 = l->clients[j];
 
-                            pthread_mutex_lock(&c2->mutex);
-
                             if(c2->version > CLIENT_VERSION_PC) {
                                 send_simple(c2, LOBBY_EVENT_TYPE, event);
                             }
-
-                            pthread_mutex_unlock(&c2->mutex);
                         }
                     }
                 }
@@ -718,6 +742,7 @@ void update_lobby_event(void) {
             }
 
             pthread_rwlock_unlock(&b->lobby_lock);
+            pthread_rwlock_unlock(&b->lock);
         }
     }
 }
@@ -44,7 +44,10 @@ uint16_t *strcat16(uint16_t *d, const uint16_t *s);
 
 void *xmalloc(size_t size);
 const void *my_ntop(struct sockaddr_storage *addr, char str[INET6_ADDRSTRLEN]);
-int open_sock(int family, uint16_t port);
+/* Open a listening socket on the given port. If reuseport is non-zero, the port
+   may be shared with other sockets (for spreading out connections between
+   threads). */
+int open_sock(int family, uint16_t port, int reuseport);
 
 const char *skip_lang_code(const char *input);
 
@@ -54,6 +57,12 @@ void update_lobby_event(void);
 /* Actually implemented in list.c, not utils.c. */
 int send_player_list(ship_client_t *c, const char *params);
 
+/* Keep the index that /list searches up to date. Call pllist_update() from the
+   client's own thread whenever its player data changes in a way that matters
+   (login, level up) and pllist_remove() before it goes away. */
+void pllist_update(ship_client_t *c);
+void pllist_remove(ship_client_t *c);
+
 /* Various iconv contexts that we'll use... */
 extern iconv_t ic_utf8_to_utf16;
 extern iconv_t ic_utf16_to_utf8;